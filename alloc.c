@@ -0,0 +1,232 @@
+/**
+ * This file contains the accounted allocators, through which the lexer,
+ * the parser and the bytecode (IR) code allocate, so that a compile can
+ * report how much memory each phase allocates and how much it holds at
+ * its peak.
+ *
+ * The allocators take blocks from 'malloc()' unchanged and learn their
+ * sizes from the C library rather than a header of their own, so a block
+ * may be freed by either 'free()' or 'accounted_free()'; only the
+ * statistics are off if the two are mixed. Every thread accounts into
+ * counters of its own, to the phase it set with 'alloc_phase()', and the
+ * peak of a phase is the most memory the thread held while running it,
+ * including what earlier phases of the unit left behind. While nothing is
+ * accounted, an allocation costs one test of a global flag.
+ *
+ * Block sizes come from 'malloc_usable_size()' on glibc, musl, Android
+ * and FreeBSD and from 'malloc_size()' on macOS. C libraries without
+ * either still count allocations and bytes, but not the bytes held, so
+ * their peaks read 0.
+ *
+ * Usage:
+ *  - Start accounting with 'accounting_start()'
+ *  - Mark phases with 'alloc_phase()', restoring the returned phase after
+ *  - Collect the counters with 'accounting_stop()', after all accounting
+ *    threads finished, and print them with 'accounting_report()' or read
+ *    them with 'accounting_totals()'
+ *
+ * @file    alloc.c
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <pthread.h>
+#include "alloc.h"
+
+#if defined(__APPLE__)
+#include <malloc/malloc.h>
+#define block_size(block) malloc_size(block)
+#elif defined(__FreeBSD__)
+#include <malloc_np.h>
+#define block_size(block) malloc_usable_size(block)
+#elif defined(__linux__)
+#include <malloc.h>
+#define block_size(block) malloc_usable_size(block)
+#else
+#define block_size(block) ((void)(block), (size_t)0)
+#endif
+
+typedef struct AllocStats {
+    PhaseStats phases[PHASE_COUNT];
+    int64_t live;               // bytes held by the thread
+    struct AllocStats * next;   // next thread's counters
+} AllocStats;
+
+static const char * phase_names[PHASE_COUNT] = {
+    "other", "lex", "parse", "semantic", "codegen", "optimize", "link"
+};
+
+bool accounting = false;
+
+static struct {
+    AllocStats * threads;       // counters of all threads that allocated
+    PhaseStats totals[PHASE_COUNT];
+    pthread_mutex_t lock;       // guards 'threads'
+} stats = { NULL, { { 0, 0, 0 } }, PTHREAD_MUTEX_INITIALIZER };
+
+// Counters of the calling thread; stale after 'accounting_stop()', hence the generation
+static __thread AllocStats * thread_stats;
+static __thread int thread_generation;
+static __thread Phase thread_phase;
+static int generation;
+
+/**
+ * Starts accounting allocations, discarding earlier counters.
+ */
+void accounting_start(void) {
+    if(accounting) return;
+    memset(stats.totals, 0, sizeof(stats.totals));
+    stats.threads = NULL;
+    generation++;
+    accounting = true;
+}
+
+static AllocStats * current_stats(void) {
+    if(thread_stats && thread_generation == generation) return thread_stats;
+
+    AllocStats * counters = (AllocStats *)calloc(1, sizeof(AllocStats));
+    assert(counters);
+    pthread_mutex_lock(&stats.lock);
+    counters->next = stats.threads;
+    stats.threads = counters;
+    pthread_mutex_unlock(&stats.lock);
+
+    thread_stats = counters;
+    thread_generation = generation;
+    return counters;
+}
+
+/**
+ * Sets the phase the calling thread's allocations are accounted to.
+ *
+ * @param phase: The phase
+ * @return: The phase set before, to be restored when 'phase' ends
+ */
+Phase alloc_phase(Phase phase) {
+    Phase previous = thread_phase;
+    thread_phase = phase;
+    if(accounting) {
+        AllocStats * counters = current_stats();
+        if(counters->live > counters->phases[phase].peak) counters->phases[phase].peak = counters->live;
+    }
+    return previous;
+}
+
+/**
+ * Accounts an allocation or release to the calling thread's phase.
+ *
+ * @param change: Change of the bytes the thread holds
+ * @param size: Bytes requested, 0 for a release
+ */
+static void account(int64_t change, size_t size) {
+    AllocStats * counters = current_stats();
+    PhaseStats * phase = &counters->phases[thread_phase];
+    if(size > 0) {
+        phase->allocations++;
+        phase->bytes += size;
+    }
+    counters->live += change;
+    if(counters->live > phase->peak) phase->peak = counters->live;
+}
+
+/**
+ * Like 'malloc()', accounting the block to the calling thread's phase.
+ */
+void * accounted_malloc(size_t size) {
+    void * block = malloc(size);
+    if(accounting && block) account((int64_t)block_size(block), size ? size : 1);
+    return block;
+}
+
+/**
+ * Like 'calloc()', accounting the block to the calling thread's phase.
+ */
+void * accounted_calloc(size_t count, size_t size) {
+    void * block = calloc(count, size);
+    size_t bytes = count * size;
+    if(accounting && block) account((int64_t)block_size(block), bytes ? bytes : 1);
+    return block;
+}
+
+/**
+ * Like 'realloc()', accounting the new size to the calling thread's phase.
+ */
+void * accounted_realloc(void * block, size_t size) {
+    if(!accounting) return realloc(block, size);
+    int64_t old = block ? (int64_t)block_size(block) : 0;
+    void * resized = realloc(block, size);
+    if(resized) account((int64_t)block_size(resized) - old, size ? size : 1);
+    return resized;
+}
+
+/**
+ * Like 'strdup()', accounting the copy to the calling thread's phase.
+ */
+char * accounted_strdup(const char * string) {
+    size_t length = strlen(string) + 1;
+    char * copy = (char *)accounted_malloc(length);
+    if(copy) memcpy(copy, string, length);
+    return copy;
+}
+
+/**
+ * Like 'free()', releasing the block from the calling thread's count.
+ */
+void accounted_free(void * block) {
+    if(accounting && block) account(-(int64_t)block_size(block), 0);
+    free(block);
+}
+
+/**
+ * Stops accounting and sums up the counters of all threads. Threads must
+ * not allocate through the accounted allocators while it stops.
+ */
+void accounting_stop(void) {
+    if(!accounting) return;
+    accounting = false;
+
+    AllocStats * counters = stats.threads;
+    while(counters) {
+        for(int p = 0; p < PHASE_COUNT; p++) {
+            PhaseStats * total = &stats.totals[p];
+            total->allocations += counters->phases[p].allocations;
+            total->bytes += counters->phases[p].bytes;
+            if(counters->phases[p].peak > total->peak) total->peak = counters->phases[p].peak;
+        }
+        AllocStats * next = counters->next;
+        free(counters);
+        counters = next;
+    }
+    stats.threads = NULL;
+}
+
+/**
+ * Copies the counters collected by 'accounting_stop()'.
+ *
+ * @param totals: Receives the counters of every phase
+ */
+void accounting_totals(PhaseStats totals[PHASE_COUNT]) {
+    memcpy(totals, stats.totals, sizeof(stats.totals));
+}
+
+/**
+ * Prints the counters collected by 'accounting_stop()', one phase per line.
+ *
+ * @param out: The stream to print to
+ */
+void accounting_report(FILE * out) {
+    PhaseStats all = { 0, 0, 0 };
+    fprintf(out, "phase         allocations           bytes      peak bytes\n");
+    for(int p = 0; p < PHASE_COUNT; p++) {
+        const PhaseStats * phase = &stats.totals[p];
+        if(phase->allocations == 0 && phase->peak == 0) continue;
+        fprintf(out, "%-10s %14llu %15llu %15lld\n", phase_names[p], (unsigned long long)phase->allocations,
+                (unsigned long long)phase->bytes, (long long)phase->peak);
+        all.allocations += phase->allocations;
+        all.bytes += phase->bytes;
+        if(phase->peak > all.peak) all.peak = phase->peak;
+    }
+    fprintf(out, "%-10s %14llu %15llu %15lld\n", "total", (unsigned long long)all.allocations,
+            (unsigned long long)all.bytes, (long long)all.peak);
+}
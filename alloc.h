@@ -0,0 +1,44 @@
+#ifndef ALLOC_H
+#define ALLOC_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+/*
+ * Phases of a compile; allocations are accounted to the phase running on
+ * the allocating thread.
+ */
+typedef enum {
+    PHASE_OTHER,            // outside of the compiler's phases
+    PHASE_LEX,
+    PHASE_PARSE,
+    PHASE_SEMANTIC,
+    PHASE_CODEGEN,
+    PHASE_OPTIMIZE,
+    PHASE_LINK,
+    PHASE_COUNT
+} Phase;
+
+typedef struct {
+    uint64_t allocations;   // calls that allocated, including growing reallocations
+    uint64_t bytes;         // bytes allocated
+    int64_t peak;           // most bytes in use on one thread while the phase ran
+} PhaseStats;
+
+extern bool accounting;     // set while allocations are accounted
+
+void accounting_start(void);
+void accounting_stop(void);
+void accounting_report(FILE * out);
+void accounting_totals(PhaseStats totals[PHASE_COUNT]);
+Phase alloc_phase(Phase phase);
+
+void * accounted_malloc(size_t size);
+void * accounted_calloc(size_t count, size_t size);
+void * accounted_realloc(void * block, size_t size);
+char * accounted_strdup(const char * string);
+void accounted_free(void * block);
+
+#endif // ALLOC_H
@@ -0,0 +1,813 @@
+/**
+ * This file contains the compiler benchmark, which generates Sloth
+ * programs of given sizes, runs each through the whole pipeline and
+ * reports the throughput of every phase, the memory the compiler held at
+ * its peak and the size of the image, optionally comparing them against a
+ * baseline saved by an earlier run.
+ *
+ *   sloth --bench [--lines=N,...] [--cases=KIND,...] [--repeat=N]
+ *                 [--baseline=FILE] [--threshold=PERCENT] [--save=FILE]
+ *
+ * Every kind of program is generated at every size, from 1K up to
+ * 'BENCH_MAX_LINES' lines in files of up to 'BENCH_UNIT_LINES' lines,
+ * each kind stressing a different part of the compiler:
+ *  - realistic: many small functions with loops, branches, calls,
+ *    recursion and mixed int and float arithmetic
+ *  - nesting: functions with ifs and loops nested 'NESTING_DEPTH' deep
+ *  - wide: functions with 'WIDE_PARAMS' parameters and 'WIDE_LOCALS'
+ *    locals, close to the register limit
+ *  - expressions: statements with expressions of 'EXPRESSION_TERMS' terms
+ *
+ * The programs come from a fixed seed, so every run compiles exactly the
+ * same sources and results of different builds are comparable. Every
+ * phase is timed on its own and the fastest run counts. A case runs at
+ * least '--repeat' times and until its runs took 'BENCH_MIN_TIME'
+ * together, so small cases are timed often enough for their fastest run
+ * to be steady; an extra first run warms the caches and accounts the
+ * allocations (see alloc.c) for the peak memory. Lexing is also timed
+ * alone, since the parser lexes as it goes.
+ *
+ * With '--baseline' the results are compared case by case against a file
+ * written with '--save'. A throughput that dropped, or a peak memory or
+ * image size that grew, by more than the threshold is a regression, and
+ * the exit status is 1 if there is any. Phases that took less than
+ * 'BENCH_MIN_SECONDS' in the baseline are too short to time reliably and
+ * are not compared.
+ *
+ * The baseline is a JSON file:
+ *
+ *   {"cases": [
+ *     {"name": "realistic-1000", "lines": 1006, "bytes": 18402,
+ *      "lex_lines_per_second": 1380190, ..., "total_lines_per_second": 250464,
+ *      "peak_memory": 377904, "output_size": 12814},
+ *     ...
+ *   ]}
+ *
+ * @file    bench.c
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include "bench.h"
+#include "lexer.h"
+#include "parser.h"
+#include "semantic.h"
+#include "codegen.h"
+#include "optimize.h"
+#include "image.h"
+#include "alloc.h"
+#include "writer.h"
+
+#define BENCH_SEED          0x5eed5107u
+#define BENCH_PATH          1024    // longest path of the benchmark's directory
+#define BENCH_MIN_SECONDS   0.05    // shortest phase whose throughput is compared
+#define BENCH_MIN_TIME      0.2     // seconds the timed runs of a case take at least
+#define BENCH_MAX_RUNS      10000   // timed runs of a case at most
+#define BENCH_UNIT_LINES    100000  // lines of one source file of a case
+#define NESTING_DEPTH       64      // levels of a 'nesting' function
+#define WIDE_PARAMS         16      // parameters of a 'wide' function
+#define WIDE_LOCALS         192     // locals of a 'wide' function
+#define WIDE_STATEMENTS     800     // assignments of a 'wide' function after the declarations
+#define EXPRESSION_TERMS    256     // terms of an expression of an 'expressions' function
+#define EXPRESSION_LINE     4       // terms on one line
+
+typedef struct {
+    uint32_t state;                 // xorshift state
+    int functions;                  // functions generated so far
+    int64_t lines;                  // lines generated so far
+} Generator;
+
+typedef void (*GenerateFunction)(Generator * generator, Writer * out);
+
+static const char * phase_names[BENCH_PHASE_COUNT] = {
+    "lex", "parse", "semantic", "codegen", "optimize", "link", "write", "total"
+};
+
+static uint32_t next_random(Generator * generator, uint32_t bound) {
+    uint32_t x = generator->state;
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    generator->state = x;
+    return x % bound;
+}
+
+/**
+ * Appends a line: indentation, then the text.
+ */
+static void line(Generator * generator, Writer * out, int indent, const char * text) {
+    for(int i = 0; i < indent; i++) writer_string(out, "    ");
+    writer_string(out, text);
+    writer_char(out, '\n');
+    generator->lines++;
+}
+
+/**
+ * Appends text with '#' replaced by the given numbers in turn, which is
+ * all the formatting the generators need.
+ */
+static void format(Writer * out, const char * text, const int * numbers) {
+    for(const char * c = text; *c; c++) {
+        if(*c == '#') writer_int(out, *numbers++);
+        else writer_char(out, *c);
+    }
+}
+
+static void format_line(Generator * generator, Writer * out, int indent, const char * text, const int * numbers) {
+    for(int i = 0; i < indent; i++) writer_string(out, "    ");
+    format(out, text, numbers);
+    writer_char(out, '\n');
+    generator->lines++;
+}
+
+/**
+ * Appends a function of the 'realistic' kind. Every function is
+ * 'int r<n>(int, int)' but one in five, which is 'float r<n>(float, int)';
+ * calls only go to earlier int functions.
+ */
+static void generate_realistic(Generator * generator, Writer * out) {
+    int n = generator->functions++;
+    int c1 = 2 + (int)next_random(generator, 9);
+    int c2 = (int)next_random(generator, 100);
+    int shape = n % 5;
+    // The nearest earlier int functions, skipping the float ones
+    int p = n - 1;
+    if(p % 5 == 1) p--;
+    int q = p - 1;
+    if(q % 5 == 1) q--;
+    if(shape == 2 && q < 0) shape = 0;
+
+    if(shape == 0) {
+        int numbers[] = { n, c1, c2 % c1, c2 };
+        format_line(generator, out, 0, "int r#(int n, int m) {", numbers);
+        line(generator, out, 1, "int s = 0;");
+        line(generator, out, 1, "int i = 0;");
+        line(generator, out, 1, "while(i < n) {");
+        format_line(generator, out, 2, "if(i % # == #) {", numbers + 1);
+        format_line(generator, out, 3, "s = s + i * #;", numbers + 3);
+        line(generator, out, 2, "} else {");
+        line(generator, out, 3, "s = s - m;");
+        line(generator, out, 2, "}");
+        line(generator, out, 2, "i = i + 1;");
+        line(generator, out, 1, "}");
+        line(generator, out, 1, "return s;");
+    } else if(shape == 1) {
+        int numbers[] = { n, c1, c2 };
+        format_line(generator, out, 0, "float r#(float x, int y) {", numbers);
+        format_line(generator, out, 1, "float a = x * # + y;", numbers + 1);
+        format_line(generator, out, 1, "float b = a / #.5 - x;", numbers + 2);
+        line(generator, out, 1, "if(a > b && y != 0) {");
+        line(generator, out, 2, "return a - b;");
+        line(generator, out, 1, "}");
+        line(generator, out, 1, "return b * 0.25;");
+    } else if(shape == 2) {
+        int numbers[] = { n, p, q, c2, c1 };
+        format_line(generator, out, 0, "int r#(int a, int b) {", numbers);
+        format_line(generator, out, 1, "int x = r#(a, b + 1);", numbers + 1);
+        format_line(generator, out, 1, "int y = r#(x, a - #);", numbers + 2);
+        line(generator, out, 1, "if(!(x < y) || a == b) {");
+        format_line(generator, out, 2, "return x + y * #;", numbers + 4);
+        line(generator, out, 1, "}");
+        line(generator, out, 1, "return y - x;");
+    } else if(shape == 3) {
+        int numbers[] = { n, c1, n, n, c2 + 1 };
+        format_line(generator, out, 0, "int r#(int n, int d) {", numbers);
+        format_line(generator, out, 1, "if(n < #) {", numbers + 1);
+        line(generator, out, 2, "return n + d;");
+        line(generator, out, 1, "}");
+        format_line(generator, out, 1, "return r#(n - 1, d) + r#(n - 2, d) % #;", numbers + 2);
+    } else {
+        int numbers[] = { n, c1 };
+        format_line(generator, out, 0, "int r#(int x, int y) {", numbers);
+        line(generator, out, 1, "int t = 0;");
+        line(generator, out, 1, "while(x > 0) {");
+        line(generator, out, 2, "if(x > y) {");
+        format_line(generator, out, 3, "t = t + x / #;", numbers + 1);
+        line(generator, out, 2, "} else if(x == y) {");
+        line(generator, out, 3, "t = t * 2;");
+        line(generator, out, 2, "} else {");
+        line(generator, out, 3, "t = t - 1;");
+        line(generator, out, 2, "}");
+        line(generator, out, 2, "x = x - 1;");
+        line(generator, out, 1, "}");
+        line(generator, out, 1, "return t;");
+    }
+    line(generator, out, 0, "}");
+}
+
+/**
+ * Appends a function of the 'nesting' kind: ifs and loops alternating
+ * 'NESTING_DEPTH' levels deep.
+ */
+static void generate_nesting(Generator * generator, Writer * out) {
+    int numbers[] = { generator->functions++ };
+    format_line(generator, out, 0, "int n#(int x, int y) {", numbers);
+    line(generator, out, 1, "int t = 0;");
+    for(int depth = 1; depth <= NESTING_DEPTH; depth++) {
+        int values[] = { depth, (int)next_random(generator, 1000) };
+        format_line(generator, out, depth, depth % 2 ? "if(x > #) {" : "while(y > #) {", values);
+        format_line(generator, out, depth + 1, "t = t + #;", values + 1);
+    }
+    for(int depth = NESTING_DEPTH; depth >= 1; depth--) {
+        if(depth % 2 == 0) line(generator, out, depth + 1, "y = y - 1;");
+        line(generator, out, depth, "}");
+    }
+    line(generator, out, 1, "return t;");
+    line(generator, out, 0, "}");
+}
+
+/**
+ * Appends a function of the 'wide' kind: 'WIDE_PARAMS' parameters,
+ * 'WIDE_LOCALS' locals and 'WIDE_STATEMENTS' assignments between them.
+ */
+static void generate_wide(Generator * generator, Writer * out) {
+    int numbers[] = { generator->functions++ };
+    format(out, "int w#(", numbers);
+    for(int p = 0; p < WIDE_PARAMS; p++) {
+        int param[] = { p };
+        format(out, p ? ", int p#" : "int p#", param);
+    }
+    line(generator, out, 0, ") {");
+
+    line(generator, out, 1, "int v0 = p0 + 1;");
+    for(int v = 1; v < WIDE_LOCALS; v++) {
+        int values[] = { v, v - 1, v % WIDE_PARAMS, (int)next_random(generator, 100) };
+        format_line(generator, out, 1, "int v# = v# * p# + #;", values);
+    }
+    for(int s = 0; s < WIDE_STATEMENTS; s++) {
+        int values[] = { (int)next_random(generator, WIDE_LOCALS), (int)next_random(generator, WIDE_LOCALS),
+                         (int)next_random(generator, WIDE_LOCALS), (int)next_random(generator, WIDE_PARAMS) };
+        format_line(generator, out, 1, "v# = v# + v# - p#;", values);
+    }
+    int values[] = { WIDE_LOCALS - 1 };
+    format_line(generator, out, 1, "return v0 + v#;", values);
+    line(generator, out, 0, "}");
+}
+
+/**
+ * Appends a function of the 'expressions' kind: one declaration whose
+ * initializer has 'EXPRESSION_TERMS' terms of every precedence, spread
+ * over several lines.
+ */
+static void generate_expression(Generator * generator, Writer * out) {
+    static const char * terms[] = {
+        "a * #", "b / #", "(a - b) * #", "c % #", "(a < b) * #", "(b >= c && a != #)", "-c + #", "(a || b == #)"
+    };
+    static const char * operators[] = { " + ", " - ", " * ", " + " };
+
+    int numbers[] = { generator->functions++ };
+    format_line(generator, out, 0, "int e#(int a, int b, int c) {", numbers);
+    writer_string(out, "    int x = ");
+    for(int t = 0; t < EXPRESSION_TERMS; t++) {
+        if(t > 0) {
+            writer_string(out, operators[next_random(generator, 4)]);
+            if(t % EXPRESSION_LINE == 0) {
+                writer_string(out, "\n        ");
+                generator->lines++;
+            }
+        }
+        int value[] = { 1 + (int)next_random(generator, 50) };
+        format(out, terms[next_random(generator, 8)], value);
+    }
+    line(generator, out, 0, ";");
+    line(generator, out, 1, "return x + a;");
+    line(generator, out, 0, "}");
+}
+
+static const struct {
+    const char * name;
+    GenerateFunction generate;
+} kinds[] = {
+    { "realistic",      generate_realistic },
+    { "nesting",        generate_nesting },
+    { "wide",           generate_wide },
+    { "expressions",    generate_expression },
+};
+
+#define KIND_COUNT ((int)(sizeof(kinds) / sizeof(kinds[0])))
+
+/**
+ * Writes a source file of one kind with at least the given number of lines.
+ *
+ * @param unit: Number of the file within its case, which varies the seed
+ * @return: The number of lines written, -1 if the file cannot be written
+ */
+static int64_t generate_program(const char * filename, int kind, int64_t lines, int unit) {
+    int fd = open(filename, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666);
+    if(fd < 0) return -1;
+    Writer * out = init_writer(fd);
+    Generator generator = { BENCH_SEED + (uint32_t)unit * 0x9e3779b9u, 0, 0 };
+    while(generator.lines < lines) kinds[kind].generate(&generator, out);
+    bool ok = destroy_writer(out);
+    if(close(fd) != 0) ok = false;
+    return ok ? generator.lines : -1;
+}
+
+static double now(void) {
+    struct timespec time;
+    clock_gettime(CLOCK_MONOTONIC, &time);
+    return time.tv_sec + time.tv_nsec * 1e-9;
+}
+
+/**
+ * Returns the time since '*mark' and moves the mark to now.
+ */
+static double lap(double * mark) {
+    double time = now();
+    double elapsed = time - *mark;
+    *mark = time;
+    return elapsed;
+}
+
+/**
+ * Runs a program once through the pipeline, timing every phase.
+ *
+ * @param seconds: Receives the time of every phase
+ * @param output_size: Receives the size of the image
+ * @return: 'false' if the program did not compile, after printing why
+ */
+static bool compile_once(const char * source, const char * output, double seconds[BENCH_PHASE_COUNT], int64_t * output_size) {
+    double start = now();
+    double mark = start;
+    alloc_phase(PHASE_LEX);
+    Lexer * lexer = init(source);
+    if(!lexer) {
+        fprintf(stderr, "sloth: cannot read '%s'\n", source);
+        alloc_phase(PHASE_OTHER);
+        return false;
+    }
+    for(;;) {
+        Token * token = get_next(lexer);
+        bool end = token->type == END;
+        destroy_token(token);
+        if(end) break;
+    }
+    destroy_lexer(lexer);
+    seconds[BENCH_LEX] = lap(&mark);
+
+    Diagnostics diagnostics;
+    init_diagnostics(&diagnostics, source);
+    alloc_phase(PHASE_PARSE);
+    lexer = init(source);
+    Program * program = parse(lexer, &diagnostics);
+    destroy_lexer(lexer);
+    seconds[BENCH_PARSE] = lap(&mark);
+
+    Module * module = NULL;
+    if(diagnostics.errors == 0) {
+        alloc_phase(PHASE_SEMANTIC);
+        bool valid = analyze(program, &diagnostics);
+        seconds[BENCH_SEMANTIC] = lap(&mark);
+        alloc_phase(PHASE_CODEGEN);
+        if(valid) module = generate(program, &diagnostics);
+        seconds[BENCH_CODEGEN] = lap(&mark);
+    }
+    destroy_program(program);
+
+    if(module) {
+        mark = now();
+        alloc_phase(PHASE_OPTIMIZE);
+        optimize_module(module);
+        seconds[BENCH_OPTIMIZE] = lap(&mark);
+        alloc_phase(PHASE_LINK);
+        Image * image = link_module(module);
+        destroy_module(module);
+        seconds[BENCH_LINK] = lap(&mark);
+        alloc_phase(PHASE_OTHER);
+        if(!write_image(image, output)) diagnose(&diagnostics, 0, 0, "cannot write '%s'", output);
+        *output_size = image->size;
+        destroy_image(image);
+        seconds[BENCH_WRITE] = lap(&mark);
+    }
+    alloc_phase(PHASE_OTHER);
+    seconds[BENCH_TOTAL] = now() - start;
+
+    bool ok = module && diagnostics.errors == 0;
+    if(!ok) fwrite(diagnostics.text, 1, diagnostics.length, stderr);
+    destroy_diagnostics(&diagnostics);
+    return ok;
+}
+
+/**
+ * Returns the path of a file of a case: its source or image.
+ */
+static void case_filename(char * filename, size_t size, const char * directory, const BenchResult * result,
+                          int unit, const char * extension) {
+    snprintf(filename, size, "%s/%s-%d%s", directory, result->name, unit, extension);
+}
+
+/**
+ * Compiles every source file of a case once, adding up the times of
+ * every phase and the sizes of the images.
+ *
+ * @return: 'false' if a file did not compile
+ */
+static bool compile_case(const char * directory, const BenchResult * result, int units,
+                         double seconds[BENCH_PHASE_COUNT], int64_t * output_size) {
+    memset(seconds, 0, BENCH_PHASE_COUNT * sizeof(double));
+    *output_size = 0;
+    for(int unit = 0; unit < units; unit++) {
+        char source[BENCH_PATH + 128], output[BENCH_PATH + 128];
+        case_filename(source, sizeof(source), directory, result, unit, ".sloth");
+        case_filename(output, sizeof(output), directory, result, unit, ".slbc");
+        double unit_seconds[BENCH_PHASE_COUNT];
+        int64_t unit_size = 0;
+        if(!compile_once(source, output, unit_seconds, &unit_size)) return false;
+        for(int phase = 0; phase < BENCH_PHASE_COUNT; phase++) seconds[phase] += unit_seconds[phase];
+        *output_size += unit_size;
+    }
+    return true;
+}
+
+/**
+ * Generates and benchmarks one case. A program of more than
+ * 'BENCH_UNIT_LINES' lines is split into files of that size, compiled one
+ * after another, as a module holds at most 65535 functions.
+ *
+ * @param directory: Directory for the sources and images
+ * @param kind: Kind of program
+ * @param lines: Lines to generate
+ * @param repeat: Timed runs at least
+ * @param result: Receives the result
+ * @return: 'false' if the case failed, after printing why
+ */
+static bool run_case(const char * directory, int kind, int64_t lines, int repeat, BenchResult * result) {
+    memset(result, 0, sizeof(*result));
+    snprintf(result->name, sizeof(result->name), "%s-%lld", kinds[kind].name, (long long)lines);
+
+    int units = (int)((lines + BENCH_UNIT_LINES - 1) / BENCH_UNIT_LINES);
+    bool ok = true;
+    for(int unit = 0; ok && unit < units; unit++) {
+        char source[BENCH_PATH + 128];
+        case_filename(source, sizeof(source), directory, result, unit, ".sloth");
+        int64_t unit_lines = lines - (int64_t)unit * BENCH_UNIT_LINES;
+        int64_t generated = generate_program(source, kind, unit_lines < BENCH_UNIT_LINES ? unit_lines : BENCH_UNIT_LINES, unit);
+        int fd = generated >= 0 ? open(source, O_RDONLY | O_CLOEXEC) : -1;
+        if(fd < 0) {
+            fprintf(stderr, "sloth: cannot write '%s'\n", source);
+            ok = false;
+            units = unit + 1;
+            break;
+        }
+        result->lines += generated;
+        result->bytes += lseek(fd, 0, SEEK_END);
+        close(fd);
+    }
+
+    // The first run warms up and accounts the allocations, which slows it down
+    double best[BENCH_PHASE_COUNT], seconds[BENCH_PHASE_COUNT];
+    PhaseStats totals[PHASE_COUNT];
+    if(ok) {
+        accounting_start();
+        ok = compile_case(directory, result, units, seconds, &result->output_size);
+        accounting_stop();
+        accounting_totals(totals);
+        for(int p = 0; p < PHASE_COUNT; p++) {
+            if(totals[p].peak > result->peak_memory) result->peak_memory = totals[p].peak;
+        }
+    }
+
+    double elapsed = 0;
+    for(int run = 0; ok && run < BENCH_MAX_RUNS && (run < repeat || elapsed < BENCH_MIN_TIME); run++) {
+        ok = compile_case(directory, result, units, seconds, &result->output_size);
+        for(int phase = 0; phase < BENCH_PHASE_COUNT; phase++) {
+            if(run == 0 || seconds[phase] < best[phase]) best[phase] = seconds[phase];
+        }
+        elapsed += seconds[BENCH_TOTAL];
+    }
+
+    for(int unit = 0; unit < units; unit++) {
+        char filename[BENCH_PATH + 128];
+        case_filename(filename, sizeof(filename), directory, result, unit, ".sloth");
+        unlink(filename);
+        case_filename(filename, sizeof(filename), directory, result, unit, ".slbc");
+        unlink(filename);
+    }
+    if(!ok) return false;
+
+    for(int phase = 0; phase < BENCH_PHASE_COUNT; phase++) {
+        double time = best[phase] > 1e-9 ? best[phase] : 1e-9;
+        result->throughput[phase] = (int64_t)(result->lines / time);
+    }
+    return true;
+}
+
+static void print_header(void) {
+    printf("%-22s %9s", "case", "lines");
+    for(int phase = 0; phase < BENCH_PHASE_COUNT; phase++) printf(" %9s", phase_names[phase]);
+    printf(" %10s %10s\n", "peak KiB", "image KiB");
+}
+
+static void print_result(const BenchResult * result) {
+    printf("%-22s %9lld", result->name, (long long)result->lines);
+    for(int phase = 0; phase < BENCH_PHASE_COUNT; phase++) {
+        printf(" %8.0fK", result->throughput[phase] / 1000.0);
+    }
+    printf(" %10lld %10lld\n", (long long)(result->peak_memory >> 10), (long long)(result->output_size >> 10));
+}
+
+/**
+ * Writes the results as a baseline for later runs.
+ *
+ * @return: 'false' if the file cannot be written
+ */
+static bool save_results(const char * filename, const BenchResult * results, int count) {
+    FILE * out = fopen(filename, "w");
+    if(!out) return false;
+    fprintf(out, "{\"cases\": [\n");
+    for(int i = 0; i < count; i++) {
+        const BenchResult * result = &results[i];
+        fprintf(out, "  {\"name\": \"%s\", \"lines\": %lld, \"bytes\": %lld", result->name,
+                (long long)result->lines, (long long)result->bytes);
+        for(int phase = 0; phase < BENCH_PHASE_COUNT; phase++) {
+            fprintf(out, ", \"%s_lines_per_second\": %lld", phase_names[phase], (long long)result->throughput[phase]);
+        }
+        fprintf(out, ", \"peak_memory\": %lld, \"output_size\": %lld}%s\n", (long long)result->peak_memory,
+                (long long)result->output_size, i + 1 < count ? "," : "");
+    }
+    fprintf(out, "]}\n");
+    return fclose(out) == 0;
+}
+
+static const char * skip_space(const char * c) {
+    while(*c == ' ' || *c == '\t' || *c == '\n' || *c == '\r') c++;
+    return c;
+}
+
+/**
+ * Reads a JSON string without escapes, which is all the baseline holds.
+ *
+ * @return: The character after the string, NULL if there is none
+ */
+static const char * read_string(const char * c, char * string, size_t size) {
+    if(*c != '"') return NULL;
+    const char * end = strchr(c + 1, '"');
+    if(!end || (size_t)(end - c - 1) >= size) return NULL;
+    memcpy(string, c + 1, end - c - 1);
+    string[end - c - 1] = '\0';
+    return end + 1;
+}
+
+/**
+ * Sets the field of a result a baseline key names; unknown keys are
+ * ignored, so baselines of older builds can be read.
+ */
+static void set_field(BenchResult * result, const char * key, int64_t value) {
+    if(strcmp(key, "lines") == 0) result->lines = value;
+    else if(strcmp(key, "bytes") == 0) result->bytes = value;
+    else if(strcmp(key, "peak_memory") == 0) result->peak_memory = value;
+    else if(strcmp(key, "output_size") == 0) result->output_size = value;
+    for(int phase = 0; phase < BENCH_PHASE_COUNT; phase++) {
+        size_t length = strlen(phase_names[phase]);
+        if(strncmp(key, phase_names[phase], length) == 0 && strcmp(key + length, "_lines_per_second") == 0) {
+            result->throughput[phase] = value;
+        }
+    }
+}
+
+/**
+ * Reads a baseline written by 'save_results()'.
+ *
+ * @param results: Receives the results, at most 'BENCH_MAX_CASES'
+ * @return: The number of results, -1 if the file cannot be read
+ */
+static int load_results(const char * filename, BenchResult * results) {
+    FILE * in = fopen(filename, "r");
+    if(!in) return -1;
+    fseek(in, 0, SEEK_END);
+    long size = ftell(in);
+    rewind(in);
+    char * text = (char *)malloc(size + 1);
+    assert(text);
+    size_t length = fread(text, 1, size, in);
+    text[length] = '\0';
+    fclose(in);
+
+    int count = 0;
+    const char * c = strstr(text, "\"cases\"");
+    c = c ? strchr(c, '[') : NULL;
+    while(c && count < BENCH_MAX_CASES && (c = strchr(c, '{')) != NULL) {
+        BenchResult * result = &results[count++];
+        memset(result, 0, sizeof(*result));
+        c = skip_space(c + 1);
+        while(c && *c == '"') {
+            char key[64], value[64];
+            c = read_string(c, key, sizeof(key));
+            c = c ? skip_space(c) : NULL;
+            if(!c || *c != ':') {
+                c = NULL;
+                break;
+            }
+            c = skip_space(c + 1);
+            if(*c == '"') {
+                c = read_string(c, value, sizeof(value));
+                if(c && strcmp(key, "name") == 0) strcpy(result->name, value);
+            } else {
+                char * end;
+                set_field(result, key, strtoll(c, &end, 10));
+                c = end == c ? NULL : end;
+            }
+            c = c ? skip_space(c) : NULL;
+            if(c && *c == ',') c = skip_space(c + 1);
+        }
+        if(!c || *c != '}') {
+            free(text);
+            return -1;
+        }
+    }
+    free(text);
+    return count;
+}
+
+/**
+ * Prints how a metric changed against the baseline.
+ *
+ * @param higher_is_better: 'true' for throughputs, 'false' for sizes
+ * @return: 'true' if the metric regressed beyond the threshold
+ */
+static bool compare_metric(const char * name, const char * metric, int64_t baseline, int64_t current,
+                           bool higher_is_better, double threshold) {
+    if(baseline <= 0) return false;
+    double change = 100.0 * (current - baseline) / baseline;
+    bool regressed = higher_is_better ? change < -threshold : change > threshold;
+    if(regressed) {
+        printf("  %-22s %-24s %12lld -> %12lld  %+6.1f%%  regression\n", name, metric, (long long)baseline,
+               (long long)current, change);
+    }
+    return regressed;
+}
+
+/**
+ * Compares results against a baseline, printing every regression.
+ *
+ * @return: The number of regressions
+ */
+static int compare_results(const BenchResult * results, int count, const BenchResult * baseline, int baseline_count,
+                           double threshold) {
+    int regressions = 0;
+    for(int i = 0; i < count; i++) {
+        const BenchResult * result = &results[i];
+        const BenchResult * old = NULL;
+        for(int b = 0; b < baseline_count && !old; b++) {
+            if(strcmp(baseline[b].name, result->name) == 0) old = &baseline[b];
+        }
+        if(!old) {
+            printf("  %-22s not in the baseline\n", result->name);
+            continue;
+        }
+        for(int phase = 0; phase < BENCH_PHASE_COUNT; phase++) {
+            if(old->throughput[phase] <= 0 || (double)old->lines / old->throughput[phase] < BENCH_MIN_SECONDS) continue;
+            char metric[64];
+            snprintf(metric, sizeof(metric), "%s lines/s", phase_names[phase]);
+            regressions += compare_metric(result->name, metric, old->throughput[phase], result->throughput[phase],
+                                          true, threshold);
+        }
+        regressions += compare_metric(result->name, "peak memory", old->peak_memory, result->peak_memory, false, threshold);
+        regressions += compare_metric(result->name, "image size", old->output_size, result->output_size, false, threshold);
+    }
+    return regressions;
+}
+
+/**
+ * Reads a comma separated list of sizes.
+ *
+ * @return: The number of sizes, -1 if the list is invalid
+ */
+static int read_sizes(const char * list, int64_t * sizes, int capacity) {
+    int count = 0;
+    while(*list) {
+        char * end;
+        long long lines = strtoll(list, &end, 10);
+        if(end == list || lines < 1 || lines > BENCH_MAX_LINES || count == capacity) return -1;
+        sizes[count++] = lines;
+        list = *end == ',' ? end + 1 : end;
+        if(*end != ',' && *end != '\0') return -1;
+    }
+    return count;
+}
+
+/**
+ * Reads a comma separated list of kinds of programs.
+ *
+ * @param selected: Receives for every kind whether it is listed
+ * @return: 'false' if the list names an unknown kind
+ */
+static bool read_kinds(const char * list, bool selected[KIND_COUNT]) {
+    memset(selected, 0, KIND_COUNT * sizeof(bool));
+    while(*list) {
+        size_t length = strcspn(list, ",");
+        int kind = 0;
+        while(kind < KIND_COUNT && (strlen(kinds[kind].name) != length || strncmp(kinds[kind].name, list, length) != 0)) kind++;
+        if(kind == KIND_COUNT) return false;
+        selected[kind] = true;
+        list += length + (list[length] == ',');
+    }
+    return true;
+}
+
+static void usage(void) {
+    fprintf(stderr, "usage: sloth --bench [--lines=N,...] [--cases=KIND,...] [--repeat=N]\n"
+                    "                     [--baseline=FILE] [--threshold=PERCENT] [--save=FILE]\n"
+                    "kinds: realistic, nesting, wide, expressions; at most %d lines\n", BENCH_MAX_LINES);
+}
+
+/**
+ * Runs the benchmark.
+ *
+ * @param argc: Number of arguments, without the program name and '--bench'
+ * @param argv: The arguments
+ * @return: The exit status of the process: 1 if a case failed or regressed
+ */
+int run_bench(int argc, char ** argv) {
+    int64_t sizes[BENCH_MAX_CASES];
+    int size_count = read_sizes(BENCH_DEFAULT_LINES, sizes, BENCH_MAX_CASES);
+    bool selected[KIND_COUNT];
+    read_kinds("realistic,nesting,wide,expressions", selected);
+    int repeat = BENCH_DEFAULT_REPEAT;
+    double threshold = BENCH_DEFAULT_THRESHOLD;
+    const char * baseline_file = NULL;
+    const char * save_file = NULL;
+
+    for(int i = 0; i < argc; i++) {
+        const char * value = strchr(argv[i], '=');
+        value = value ? value + 1 : "";
+        char * end;
+        if(strncmp(argv[i], "--lines=", 8) == 0) {
+            size_count = read_sizes(value, sizes, BENCH_MAX_CASES);
+            if(size_count <= 0) return usage(), 1;
+        } else if(strncmp(argv[i], "--cases=", 8) == 0) {
+            if(!read_kinds(value, selected)) return usage(), 1;
+        } else if(strncmp(argv[i], "--repeat=", 9) == 0) {
+            repeat = (int)strtol(value, &end, 10);
+            if(*value == '\0' || *end != '\0' || repeat < 1 || repeat > 1000) return usage(), 1;
+        } else if(strncmp(argv[i], "--threshold=", 12) == 0) {
+            threshold = strtod(value, &end);
+            if(*value == '\0' || *end != '\0' || threshold < 0) return usage(), 1;
+        } else if(strncmp(argv[i], "--baseline=", 11) == 0 && *value) {
+            baseline_file = value;
+        } else if(strncmp(argv[i], "--save=", 7) == 0 && *value) {
+            save_file = value;
+        } else {
+            usage();
+            return 1;
+        }
+    }
+
+    BenchResult * baseline = NULL;
+    int baseline_count = 0;
+    if(baseline_file) {
+        baseline = (BenchResult *)malloc(BENCH_MAX_CASES * sizeof(BenchResult));
+        assert(baseline);
+        baseline_count = load_results(baseline_file, baseline);
+        if(baseline_count < 0) {
+            fprintf(stderr, "sloth: cannot read the baseline '%s'\n", baseline_file);
+            free(baseline);
+            return 1;
+        }
+    }
+
+    const char * temporary = getenv("TMPDIR");
+    char directory[BENCH_PATH];
+    int length = snprintf(directory, sizeof(directory), "%s/sloth-bench-XXXXXX", temporary && *temporary ? temporary : "/tmp");
+    if(length >= (int)sizeof(directory) || !mkdtemp(directory)) {
+        perror("sloth: cannot create a directory for the benchmark");
+        free(baseline);
+        return 1;
+    }
+
+    BenchResult * results = (BenchResult *)malloc(BENCH_MAX_CASES * sizeof(BenchResult));
+    assert(results);
+    int count = 0;
+    bool ok = true;
+    print_header();
+    for(int kind = 0; kind < KIND_COUNT; kind++) {
+        for(int s = 0; selected[kind] && s < size_count && count < BENCH_MAX_CASES; s++) {
+            if(!run_case(directory, kind, sizes[s], repeat, &results[count])) {
+                fprintf(stderr, "sloth: case %s-%lld failed\n", kinds[kind].name, (long long)sizes[s]);
+                ok = false;
+                continue;
+            }
+            print_result(&results[count++]);
+            fflush(stdout);
+        }
+    }
+    rmdir(directory);
+
+    if(save_file && !save_results(save_file, results, count)) {
+        fprintf(stderr, "sloth: cannot write '%s'\n", save_file);
+        ok = false;
+    }
+    if(baseline) {
+        printf("\nagainst %s, threshold %.1f%%:\n", baseline_file, threshold);
+        int regressions = compare_results(results, count, baseline, baseline_count, threshold);
+        printf("%d regression%s\n", regressions, regressions == 1 ? "" : "s");
+        if(regressions > 0) ok = false;
+        free(baseline);
+    }
+    free(results);
+    return ok ? 0 : 1;
+}
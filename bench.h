@@ -0,0 +1,39 @@
+#ifndef BENCH_H
+#define BENCH_H
+
+#include <stdint.h>
+
+#define BENCH_MAX_LINES         10000000    // largest program a case may generate
+#define BENCH_DEFAULT_LINES     "1000,100000"
+#define BENCH_DEFAULT_REPEAT    5           // timed runs of every case at least, the fastest counts
+#define BENCH_DEFAULT_THRESHOLD 10          // percent a metric may get worse before it regresses
+#define BENCH_MAX_CASES         256
+
+/*
+ * Phases timed by the benchmark, in pipeline order; 'BENCH_TOTAL' is the
+ * whole pipeline.
+ */
+typedef enum {
+    BENCH_LEX,
+    BENCH_PARSE,            // includes lexing the tokens it reads
+    BENCH_SEMANTIC,
+    BENCH_CODEGEN,
+    BENCH_OPTIMIZE,
+    BENCH_LINK,
+    BENCH_WRITE,
+    BENCH_TOTAL,
+    BENCH_PHASE_COUNT
+} BenchPhase;
+
+typedef struct {
+    char name[64];                          // kind and size, e.g. "realistic-1000"
+    int64_t lines;                          // lines of the generated source
+    int64_t bytes;                          // size of the generated source
+    int64_t throughput[BENCH_PHASE_COUNT];  // lines per second of every phase
+    int64_t peak_memory;                    // most bytes the compiler held
+    int64_t output_size;                    // bytes of the image
+} BenchResult;
+
+int run_bench(int argc, char ** argv);
+
+#endif // BENCH_H
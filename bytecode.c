@@ -0,0 +1,419 @@
+/**
+ * This file contains the in-memory representation of compiled Sloth code:
+ * modules holding a constant pool and a function table, and functions
+ * holding typed register files and register-based instructions. The code
+ * generator builds modules through these functions and the virtual
+ * machine executes them.
+ *
+ * Usage:
+ *  - Create a module with 'init_module()'
+ *  - Add functions with 'module_add_function()', their parameters and
+ *    registers with 'function_add_param()' and 'function_add_register()'
+ *  - Append instructions with 'function_emit()'
+ *  - Free resources with 'destroy_module()'
+ *
+ * @file    bytecode.c
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include "bytecode.h"
+#include "alloc.h"
+
+#define INITIAL_CAPACITY 16
+
+static const char * const opcode_names[] = {
+#define OPCODE_NAME(name, format) #name,
+    OPCODE_LIST(OPCODE_NAME)
+#undef OPCODE_NAME
+};
+
+static const InstructionFormat opcode_formats[] = {
+#define OPCODE_FORMAT(name, format) FORMAT_##format,
+    OPCODE_LIST(OPCODE_FORMAT)
+#undef OPCODE_FORMAT
+};
+
+/**
+ * Initializes an empty module.
+ *
+ * @return: A pointer to the new 'Module' structure
+ */
+Module * init_module(void) {
+    Module * module = (Module *)accounted_calloc(1, sizeof(Module));
+    assert(module);
+    return module;
+}
+
+/**
+ * Destroys the given module, its functions and its constant pool.
+ *
+ * @param module: A pointer to the module
+ */
+void destroy_module(Module * module) {
+    for(int i = 0; i < module->function_count; i++) {
+        Function * function = module->functions[i];
+        accounted_free(function->name);
+        accounted_free(function->types);
+        accounted_free(function->code);
+        accounted_free(function);
+    }
+    for(int i = 0; i < module->constant_count; i++) {
+        if(module->constants[i].type == CONSTANT_STRING) {
+            accounted_free((char *)module->constants[i].value.s);
+        }
+    }
+    accounted_free(module->functions);
+    accounted_free(module->constants);
+    accounted_free(module->constant_table);
+    accounted_free(module);
+}
+
+/**
+ * Adds an empty function to the module's function table.
+ *
+ * @param module: A pointer to the module
+ * @param name: The function name
+ * @param return_type: The type of the returned value
+ * @return: The index of the function, used as operand of 'CALL', or -1 if
+ *          the module has as many functions as 'CALL' can address
+ */
+int module_add_function(Module * module, const char * name, ValueType return_type) {
+    if(module->function_count > MAX_BX) return -1;
+    if(module->function_count == module->function_capacity) {
+        module->function_capacity = module->function_capacity ? module->function_capacity * 2 : INITIAL_CAPACITY;
+        module->functions = (Function **)accounted_realloc(module->functions, module->function_capacity * sizeof(Function *));
+        assert(module->functions);
+    }
+
+    Function * function = (Function *)accounted_calloc(1, sizeof(Function));
+    assert(function);
+    function->name = accounted_strdup(name);
+    function->return_type = return_type;
+
+    module->functions[module->function_count] = function;
+    return module->function_count++;
+}
+
+/**
+ * Looks up a function by name.
+ *
+ * @param module: A pointer to the module
+ * @param name: The function name
+ * @return: The index of the function, or -1 if there is none
+ */
+int module_find_function(const Module * module, const char * name) {
+    for(int i = 0; i < module->function_count; i++) {
+        if(strcmp(module->functions[i]->name, name) == 0) return i;
+    }
+    return -1;
+}
+
+/**
+ * Hashes a constant by type and value; strings by their contents.
+ *
+ * @param constant: The constant
+ * @return: The hash value
+ */
+static uint64_t hash_constant(const Constant * constant) {
+    uint64_t hash;
+
+    if(constant->type == CONSTANT_STRING) {
+        hash = 14695981039346656037ull;
+        for(const char * c = constant->value.s; *c; c++) {
+            hash = (hash ^ (uint8_t)*c) * 1099511628211ull;
+        }
+    } else {
+        hash = (uint64_t)constant->value.i * 0x9e3779b97f4a7c15ull;
+        hash ^= hash >> 32;
+    }
+    return hash ^ constant->type;
+}
+
+/**
+ * Checks if two constants are the same. Floats are compared by their bits,
+ * so '0.0' and '-0.0' stay distinct and every NaN matches itself.
+ *
+ * @param a: The first constant
+ * @param b: The second constant
+ * @return: 'true' if the constants are interchangeable
+ */
+static bool constants_equal(const Constant * a, const Constant * b) {
+    if(a->type != b->type) return false;
+    if(a->type == CONSTANT_STRING) return strcmp(a->value.s, b->value.s) == 0;
+    return a->value.i == b->value.i;
+}
+
+/**
+ * Rebuilds the hash table of the constant pool with the given size.
+ *
+ * @param module: A pointer to the module
+ * @param size: Number of slots, a power of two
+ */
+static void rehash_constants(Module * module, int size) {
+    accounted_free(module->constant_table);
+    module->constant_table = (int *)accounted_calloc(size, sizeof(int));
+    assert(module->constant_table);
+    module->constant_table_size = size;
+
+    for(int k = 0; k < module->constant_count; k++) {
+        uint64_t slot = hash_constant(&module->constants[k]) & (size - 1);
+        while(module->constant_table[slot]) slot = (slot + 1) & (size - 1);
+        module->constant_table[slot] = k + 1;
+    }
+}
+
+/**
+ * Adds a constant to the module's constant pool, unless an equal constant
+ * is already there. All functions of a module share the pool, so every
+ * literal is stored once however often it appears. String constants are
+ * copied.
+ *
+ * @param module: A pointer to the module
+ * @param constant: The constant to add
+ * @return: The index of the constant, used as operand of 'LOADK', or -1 if
+ *          the pool has as many constants as 'LOADK' can address
+ */
+int module_add_constant(Module * module, Constant constant) {
+    if(2 * (module->constant_count + 1) > module->constant_table_size) {
+        rehash_constants(module, module->constant_table_size ? module->constant_table_size * 2 : 2 * INITIAL_CAPACITY);
+    }
+
+    int mask = module->constant_table_size - 1;
+    uint64_t slot = hash_constant(&constant) & mask;
+    while(module->constant_table[slot]) {
+        int k = module->constant_table[slot] - 1;
+        if(constants_equal(&module->constants[k], &constant)) return k;
+        slot = (slot + 1) & mask;
+    }
+    if(module->constant_count > MAX_BX) return -1;
+
+    if(module->constant_count == module->constant_capacity) {
+        module->constant_capacity = module->constant_capacity ? module->constant_capacity * 2 : INITIAL_CAPACITY;
+        module->constants = (Constant *)accounted_realloc(module->constants, module->constant_capacity * sizeof(Constant));
+        assert(module->constants);
+    }
+
+    if(constant.type == CONSTANT_STRING) constant.value.s = accounted_strdup(constant.value.s);
+    module->constants[module->constant_count] = constant;
+    module->constant_table[slot] = module->constant_count + 1;
+    return module->constant_count++;
+}
+
+/**
+ * Adds the value of a literal token returned by 'get_next()' to the
+ * constant pool. Numbers containing a '.' or an exponent are floats;
+ * integers out of the range of 'int64_t' are rejected by semantic
+ * analysis before.
+ *
+ * @param module: A pointer to the module
+ * @param token: A 'NUMBER' or 'STRING' token
+ * @return: The index of the constant, or -1 if the pool is full
+ */
+int module_add_literal(Module * module, const Token * token) {
+    Constant constant;
+
+    if(token->type == STRING) {
+        constant.type = CONSTANT_STRING;
+        constant.value.s = token->token;
+    } else if(strpbrk(token->token, ".eE")) {
+        constant.type = CONSTANT_FLOAT;
+        constant.value.f = strtod(token->token, NULL);
+    } else {
+        constant.type = CONSTANT_INT;
+        constant.value.i = strtoll(token->token, NULL, 10);
+    }
+    return module_add_constant(module, constant);
+}
+
+/**
+ * Removes constants that no 'LOADK' refers to any more, e.g. after the
+ * optimizer turned small integers into immediates, and renumbers the
+ * remaining ones.
+ *
+ * @param module: A pointer to the module
+ */
+void module_remove_unused_constants(Module * module) {
+    int * map = (int *)accounted_calloc(module->constant_count ? module->constant_count : 1, sizeof(int));
+    assert(map);
+
+    for(int i = 0; i < module->function_count; i++) {
+        const Function * function = module->functions[i];
+        for(int pc = 0; pc < function->code_length; pc++) {
+            if(OP(function->code[pc]) == OP_LOADK) map[ARG_BX(function->code[pc])] = 1;
+        }
+    }
+
+    int count = 0;
+    for(int k = 0; k < module->constant_count; k++) {
+        if(map[k]) {
+            module->constants[count] = module->constants[k];
+            map[k] = count++;
+        } else if(module->constants[k].type == CONSTANT_STRING) {
+            accounted_free((char *)module->constants[k].value.s);
+        }
+    }
+
+    for(int i = 0; i < module->function_count; i++) {
+        Function * function = module->functions[i];
+        for(int pc = 0; pc < function->code_length; pc++) {
+            uint32_t instruction = function->code[pc];
+            if(OP(instruction) == OP_LOADK) {
+                function->code[pc] = ENCODE_ABX(OP_LOADK, ARG_A(instruction), map[ARG_BX(instruction)]);
+            }
+        }
+    }
+
+    accounted_free(map);
+    module->constant_count = count;
+    rehash_constants(module, module->constant_table_size ? module->constant_table_size : 2 * INITIAL_CAPACITY);
+}
+
+/**
+ * Adds a parameter to the function. Parameters occupy the first registers
+ * of the frame, so they must be added before any other register.
+ *
+ * @param function: A pointer to the function
+ * @param type: The type of the parameter
+ * @return: The register holding the parameter
+ */
+int function_add_param(Function * function, ValueType type) {
+    assert(function->param_count == function->register_count);
+    function->param_count++;
+    return function_add_register(function, type);
+}
+
+/**
+ * Adds a register of the given type to the function's frame.
+ *
+ * @param function: A pointer to the function
+ * @param type: The type of values held by the register
+ * @return: The index of the register
+ */
+int function_add_register(Function * function, ValueType type) {
+    assert(function->register_count < MAX_REGISTERS);
+    function->types = (uint8_t *)accounted_realloc(function->types, function->register_count + 1);
+    assert(function->types);
+    function->types[function->register_count] = (uint8_t)type;
+    return function->register_count++;
+}
+
+/**
+ * Appends an instruction to the function's code.
+ *
+ * @param function: A pointer to the function
+ * @param instruction: The encoded instruction
+ * @return: The index of the instruction
+ */
+int function_emit(Function * function, uint32_t instruction) {
+    if(function->code_length == function->code_capacity) {
+        function->code_capacity = function->code_capacity ? function->code_capacity * 2 : INITIAL_CAPACITY;
+        function->code = (uint32_t *)accounted_realloc(function->code, function->code_capacity * sizeof(uint32_t));
+        assert(function->code);
+    }
+    function->code[function->code_length] = instruction;
+    return function->code_length++;
+}
+
+/**
+ * Sets the target of an already emitted jump instruction.
+ *
+ * @param function: A pointer to the function
+ * @param pc: The index of the jump instruction
+ * @param target: The index of the instruction to jump to
+ */
+void function_patch_jump(Function * function, int pc, int target) {
+    uint32_t instruction = function->code[pc];
+    int offset = target - (pc + 1);
+
+    if(opcode_format(OP(instruction)) == FORMAT_SJ) {
+        assert(offset >= -MAX_SJ && offset <= MAX_SJ);
+        function->code[pc] = ENCODE_SJ(OP(instruction), offset);
+    } else {
+        assert(offset >= -MAX_SBX && offset <= MAX_SBX);
+        function->code[pc] = ENCODE_ABX(OP(instruction), ARG_A(instruction), offset);
+    }
+}
+
+/**
+ * Returns the mnemonic of an opcode.
+ *
+ * @param op: The opcode
+ * @return: The name of the opcode
+ */
+const char * opcode_name(Opcode op) {
+    return op < OPCODE_COUNT ? opcode_names[op] : "???";
+}
+
+/**
+ * Returns the instruction format of an opcode.
+ *
+ * @param op: The opcode
+ * @return: The format used to decode the operands
+ */
+InstructionFormat opcode_format(Opcode op) {
+    assert(op < OPCODE_COUNT);
+    return opcode_formats[op];
+}
+
+/**
+ * Prints the mnemonic and operands of one instruction, without a newline.
+ * Jumps are annotated with the index of their target.
+ *
+ * @param out: The output stream
+ * @param instruction: The instruction
+ * @param pc: The index of the instruction in its function
+ */
+void disassemble_instruction(FILE * out, uint32_t instruction, int pc) {
+    Opcode op = OP(instruction);
+
+    fprintf(out, "  %4d  %-6s", pc, opcode_name(op));
+    switch(opcode_format(op)) {
+        case FORMAT_ABC:
+            fprintf(out, " %d %d %d", ARG_A(instruction), ARG_B(instruction),
+                    op == OP_ADDI ? ARG_SC(instruction) : ARG_C(instruction));
+            break;
+        case FORMAT_ABX:
+            fprintf(out, " %d %d", ARG_A(instruction), ARG_BX(instruction));
+            break;
+        case FORMAT_ASBX:
+            if(op == OP_LOADI) {
+                fprintf(out, " %d %d", ARG_A(instruction), ARG_SBX(instruction));
+                break;
+            }
+            fprintf(out, " %d %d\t; -> %d", ARG_A(instruction), ARG_SBX(instruction),
+                    pc + 1 + ARG_SBX(instruction));
+            break;
+        case FORMAT_SJ:
+            fprintf(out, " %d\t; -> %d", ARG_SJ(instruction), pc + 1 + ARG_SJ(instruction));
+            break;
+    }
+}
+
+/**
+ * Prints a human readable listing of a function's code.
+ *
+ * @param out: The output stream
+ * @param module: The module containing the function
+ * @param function: The function to print
+ */
+void disassemble_function(FILE * out, const Module * module, const Function * function) {
+    fprintf(out, "function %s (%d params, %d registers)\n",
+            function->name, function->param_count, function->register_count);
+
+    for(int pc = 0; pc < function->code_length; pc++) {
+        uint32_t instruction = function->code[pc];
+
+        disassemble_instruction(out, instruction, pc);
+        if(OP(instruction) == OP_CALL) {
+            fprintf(out, "\t; %s", module->functions[ARG_BX(instruction)]->name);
+        } else if(OP(instruction) == OP_LOADK) {
+            const Constant * k = &module->constants[ARG_BX(instruction)];
+            if(k->type == CONSTANT_INT) fprintf(out, "\t; %lld", (long long)k->value.i);
+            else if(k->type == CONSTANT_FLOAT) fprintf(out, "\t; %g", k->value.f);
+            else fprintf(out, "\t; \"%s\"", k->value.s);
+        }
+        fputc('\n', out);
+    }
+}
@@ -0,0 +1,182 @@
+#ifndef BYTECODE_H
+#define BYTECODE_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include "lexer.h"
+
+/*
+ * Instructions are 32 bits wide and address the registers of the current
+ * frame directly (three-address code). Formats:
+ *
+ *   ABC:  op:8 | A:8 | B:8 | C:8  (sC when C is a signed immediate)
+ *   ABx:  op:8 | A:8 | Bx:16      (unsigned, constant or function index)
+ *   AsBx: op:8 | A:8 | sBx:16     (signed jump offset or immediate)
+ *   sJ:   op:8 | sJ:24            (signed jump offset)
+ *
+ * Jump offsets are relative to the instruction following the jump.
+ */
+#define OP(i)       ((Opcode)((i) & 0xff))
+#define ARG_A(i)    ((int)(((i) >> 8) & 0xff))
+#define ARG_B(i)    ((int)(((i) >> 16) & 0xff))
+#define ARG_C(i)    ((int)(((i) >> 24) & 0xff))
+#define ARG_SC(i)   ((int)(int8_t)((i) >> 24))
+#define ARG_BX(i)   ((int)(((i) >> 16) & 0xffff))
+#define ARG_SBX(i)  ((int)(int16_t)((i) >> 16))
+#define ARG_SJ(i)   ((int)((int32_t)(i) >> 8))
+
+#define ENCODE_ABC(op, a, b, c) \
+    ((uint32_t)(op) | ((uint32_t)(a) << 8) | ((uint32_t)(b) << 16) | ((uint32_t)(c) << 24))
+#define ENCODE_ABX(op, a, bx) \
+    ((uint32_t)(op) | ((uint32_t)(a) << 8) | ((uint32_t)(uint16_t)(bx) << 16))
+#define ENCODE_SJ(op, sj) \
+    ((uint32_t)(op) | ((uint32_t)(sj) << 8))
+
+#define MAX_REGISTERS 256
+#define MAX_BX        UINT16_MAX
+#define MAX_SBX       INT16_MAX
+#define MAX_SJ        ((1 << 23) - 1)
+
+/*
+ * X-macro list of all opcodes: name and instruction format. The '_I' and
+ * '_F' variants operate on 'int' and 'float' registers; the language is
+ * statically typed, so the interpreter never checks types at run time.
+ *
+ * 'LOADI', 'ADDI' and the 'Jxx' compare-and-branch superinstructions are
+ * never emitted by the code generator, they are introduced by the
+ * optimizer (see optimize.c). A 'Jxx' is always followed by a 'JMP' whose
+ * offset it takes when the comparison equals C, and skips otherwise.
+ */
+#define OPCODE_LIST(X) \
+    X(MOVE,  ABC)   /* R[A] = R[B]                       */ \
+    X(LOADK, ABX)   /* R[A] = K[Bx]                      */ \
+    X(LOADI, ASBX)  /* R[A] = sBx                        */ \
+    X(ADD_I, ABC)   /* R[A] = R[B] + R[C]                */ \
+    X(ADDI,  ABC)   /* R[A] = R[B] + sC                  */ \
+    X(SUB_I, ABC)   /* R[A] = R[B] - R[C]                */ \
+    X(MUL_I, ABC)   /* R[A] = R[B] * R[C]                */ \
+    X(DIV_I, ABC)   /* R[A] = R[B] / R[C]                */ \
+    X(MOD_I, ABC)   /* R[A] = R[B] % R[C]                */ \
+    X(NEG_I, ABC)   /* R[A] = -R[B]                      */ \
+    X(ADD_F, ABC)   /* R[A] = R[B] + R[C]                */ \
+    X(SUB_F, ABC)   /* R[A] = R[B] - R[C]                */ \
+    X(MUL_F, ABC)   /* R[A] = R[B] * R[C]                */ \
+    X(DIV_F, ABC)   /* R[A] = R[B] / R[C]                */ \
+    X(NEG_F, ABC)   /* R[A] = -R[B]                      */ \
+    X(EQ_I,  ABC)   /* R[A] = R[B] == R[C]               */ \
+    X(NE_I,  ABC)   /* R[A] = R[B] != R[C]               */ \
+    X(LT_I,  ABC)   /* R[A] = R[B] < R[C]                */ \
+    X(LE_I,  ABC)   /* R[A] = R[B] <= R[C]               */ \
+    X(EQ_F,  ABC)   /* R[A] = R[B] == R[C]               */ \
+    X(NE_F,  ABC)   /* R[A] = R[B] != R[C]               */ \
+    X(LT_F,  ABC)   /* R[A] = R[B] < R[C]                */ \
+    X(LE_F,  ABC)   /* R[A] = R[B] <= R[C]               */ \
+    X(NOT,   ABC)   /* R[A] = !R[B]                      */ \
+    X(I2F,   ABC)   /* R[A] = (float)R[B]                */ \
+    X(F2I,   ABC)   /* R[A] = (int)R[B]                  */ \
+    X(JMP,   SJ)    /* pc += sJ                          */ \
+    X(JMPT,  ASBX)  /* if R[A] then pc += sBx            */ \
+    X(JMPF,  ASBX)  /* if !R[A] then pc += sBx           */ \
+    X(JEQ_I, ABC)   /* if (R[A] == R[B]) == C then JMP   */ \
+    X(JLT_I, ABC)   /* if (R[A] < R[B]) == C then JMP    */ \
+    X(JLE_I, ABC)   /* if (R[A] <= R[B]) == C then JMP   */ \
+    X(JEQ_F, ABC)   /* if (R[A] == R[B]) == C then JMP   */ \
+    X(JLT_F, ABC)   /* if (R[A] < R[B]) == C then JMP    */ \
+    X(JLE_F, ABC)   /* if (R[A] <= R[B]) == C then JMP   */ \
+    X(CALL,  ABX)   /* R[A] = F[Bx](R[A], R[A+1], ...)   */ \
+    X(RET,   ABC)   /* return R[A]                       */
+
+typedef enum {
+#define OPCODE_ENUM(name, format) OP_##name,
+    OPCODE_LIST(OPCODE_ENUM)
+#undef OPCODE_ENUM
+    OPCODE_COUNT
+} Opcode;
+
+typedef enum {
+    FORMAT_ABC,
+    FORMAT_ABX,
+    FORMAT_ASBX,
+    FORMAT_SJ
+} InstructionFormat;
+
+typedef enum {
+    TYPE_INT,   // 64-bit signed integer
+    TYPE_FLOAT  // 64-bit floating point
+} ValueType;
+
+typedef union {
+    int64_t i;      // 'int' value
+    double f;       // 'float' value
+    const char * s; // string constant
+} Value;
+
+/**
+ * Converts a 'float' to an 'int' as 'F2I' does in every backend: truncated
+ * toward zero, saturated to the range of 'int64_t', and 0 for NaN. A plain
+ * C cast is undefined for values out of range.
+ *
+ * @param x: The value to convert
+ * @return: The converted value
+ */
+static inline int64_t float_to_int(double x) {
+    if(x != x) return 0;
+    if(x >= 9223372036854775808.0) return INT64_MAX;
+    if(x <= -9223372036854775808.0) return INT64_MIN;
+    return (int64_t)x;
+}
+
+typedef enum {
+    CONSTANT_INT,
+    CONSTANT_FLOAT,
+    CONSTANT_STRING
+} ConstantType;
+
+typedef struct {
+    ConstantType type;  // type of the constant
+    Value value;        // the value, strings are owned by the module
+} Constant;
+
+typedef struct {
+    char * name;            // function name
+    int param_count;        // parameters, passed in R[0] .. R[param_count - 1]
+    ValueType return_type;  // type of the returned value
+    bool result_param;      // R[0] is a hidden parameter for the result, see codegen.c
+    uint8_t * types;        // 'ValueType' of every register
+    int register_count;     // registers in the frame
+    uint32_t * code;        // instructions
+    int code_length;        // number of instructions
+    int code_capacity;      // allocated instructions
+} Function;
+
+typedef struct {
+    Constant * constants;   // constant pool shared by all functions
+    int constant_count;
+    int constant_capacity;
+    int * constant_table;   // hash table of constant indices + 1, 0 is empty
+    int constant_table_size;
+    Function ** functions;  // function table, indexed by CALL
+    int function_count;
+    int function_capacity;
+} Module;
+
+Module * init_module(void);
+void destroy_module(Module * module);
+int module_add_function(Module * module, const char * name, ValueType return_type);
+int module_find_function(const Module * module, const char * name);
+int module_add_constant(Module * module, Constant constant);
+int module_add_literal(Module * module, const Token * token);
+void module_remove_unused_constants(Module * module);
+
+int function_add_param(Function * function, ValueType type);
+int function_add_register(Function * function, ValueType type);
+int function_emit(Function * function, uint32_t instruction);
+void function_patch_jump(Function * function, int pc, int target);
+
+const char * opcode_name(Opcode op);
+InstructionFormat opcode_format(Opcode op);
+void disassemble_instruction(FILE * out, uint32_t instruction, int pc);
+void disassemble_function(FILE * out, const Module * module, const Function * function);
+
+#endif // BYTECODE_H
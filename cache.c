@@ -0,0 +1,313 @@
+/**
+ * This file contains the function cache, which keeps the optimized code
+ * of every function a long-lived compiler (see server.c) optimized, so
+ * that functions which did not change are not optimized again when other
+ * functions of their file did.
+ *
+ * The cache is content addressed: a function is looked up by its
+ * generated code in a normalized form that does not depend on the rest
+ * of its module. Constant pool indices are replaced by the constants'
+ * values and function indices by the callees' names and signatures,
+ * since both are numbered across the whole module. The normalized code,
+ * together with the register types, is everything the optimizer reads,
+ * so equal keys are guaranteed to produce equal code; keys are compared
+ * in full, the hash only selects the bucket. The optimized code is stored
+ * in the same normalized form and renumbered for the module it is used in.
+ *
+ * Usage:
+ *  - Create a cache with 'init_function_cache()'
+ *  - Optimize modules through it with 'optimize_module_cached()', which
+ *    may be called from several threads at once
+ *  - Free resources with 'destroy_function_cache()'
+ *
+ * @file    cache.c
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <pthread.h>
+#include "cache.h"
+#include "optimize.h"
+#include "alloc.h"
+
+typedef struct {
+    uint8_t * data;
+    size_t length;
+    size_t capacity;
+} Buffer;
+
+typedef struct FunctionEntry {
+    uint64_t hash;
+    uint8_t * key;              // normalized generated code
+    size_t key_length;
+    uint32_t * code;            // optimized code, 'LOADK' and 'CALL' refer to
+    int code_length;            // 'constants' and 'callees'
+    uint8_t * types;            // register types of the optimized function
+    int register_count;
+    Constant * constants;       // constants of the optimized code, strings owned
+    int constant_count;
+    char ** callees;            // names of the called functions
+    int callee_count;
+    struct FunctionEntry * next;
+} FunctionEntry;
+
+struct FunctionCache {
+    FunctionEntry * buckets[FUNCTION_CACHE_BUCKETS];
+    size_t size;                // bytes held by the entries
+    pthread_mutex_t lock;
+};
+
+static void append(Buffer * buffer, const void * data, size_t length) {
+    if(buffer->length + length > buffer->capacity) {
+        buffer->capacity = (buffer->length + length) * 2;
+        buffer->data = (uint8_t *)realloc(buffer->data, buffer->capacity);
+        assert(buffer->data);
+    }
+    memcpy(buffer->data + buffer->length, data, length);
+    buffer->length += length;
+}
+
+static void append_u32(Buffer * buffer, uint32_t value) {
+    append(buffer, &value, sizeof(value));
+}
+
+static void append_constant(Buffer * buffer, const Constant * constant) {
+    append_u32(buffer, constant->type);
+    if(constant->type == CONSTANT_STRING) {
+        uint32_t length = (uint32_t)strlen(constant->value.s);
+        append_u32(buffer, length);
+        append(buffer, constant->value.s, length);
+    } else {
+        append(buffer, &constant->value.i, sizeof(constant->value.i));
+    }
+}
+
+/**
+ * Builds the key of a function: its signature, register types and code,
+ * with constants and callees spelled out.
+ *
+ * @param module: The module of the function
+ * @param function: The generated function
+ * @param key: Receives the key
+ */
+static void normalize(const Module * module, const Function * function, Buffer * key) {
+    append_u32(key, function->return_type);
+    append_u32(key, function->param_count);
+    append_u32(key, function->register_count);
+    append(key, function->types, function->register_count);
+    append_u32(key, function->code_length);
+
+    for(int pc = 0; pc < function->code_length; pc++) {
+        uint32_t instruction = function->code[pc];
+        Opcode op = OP(instruction);
+        if(op == OP_LOADK) {
+            append_u32(key, ENCODE_ABX(op, ARG_A(instruction), 0));
+            append_constant(key, &module->constants[ARG_BX(instruction)]);
+        } else if(op == OP_CALL) {
+            const Function * callee = module->functions[ARG_BX(instruction)];
+            uint32_t length = (uint32_t)strlen(callee->name);
+            append_u32(key, ENCODE_ABX(op, ARG_A(instruction), 0));
+            append_u32(key, callee->param_count);
+            append_u32(key, callee->return_type);
+            append_u32(key, length);
+            append(key, callee->name, length);
+        } else {
+            append_u32(key, instruction);
+        }
+    }
+}
+
+static uint64_t hash_key(const Buffer * key) {
+    uint64_t hash = 14695981039346656037u;  // FNV-1a
+    for(size_t i = 0; i < key->length; i++) hash = (hash ^ key->data[i]) * 1099511628211u;
+    return hash;
+}
+
+/**
+ * Returns the index of a constant in the table of an entry, adding it if
+ * it is missing.
+ */
+static int find_or_add_constant(FunctionEntry * entry, const Constant * constant) {
+    for(int i = 0; i < entry->constant_count; i++) {
+        const Constant * k = &entry->constants[i];
+        if(k->type != constant->type) continue;
+        if(k->type == CONSTANT_STRING ? strcmp(k->value.s, constant->value.s) == 0 : k->value.i == constant->value.i) return i;
+    }
+    entry->constants = (Constant *)realloc(entry->constants, (entry->constant_count + 1) * sizeof(Constant));
+    assert(entry->constants);
+    Constant copy = *constant;
+    if(copy.type == CONSTANT_STRING) copy.value.s = strdup(copy.value.s);
+    entry->constants[entry->constant_count] = copy;
+    return entry->constant_count++;
+}
+
+static int find_or_add_callee(FunctionEntry * entry, const char * name) {
+    for(int i = 0; i < entry->callee_count; i++) {
+        if(strcmp(entry->callees[i], name) == 0) return i;
+    }
+    entry->callees = (char **)realloc(entry->callees, (entry->callee_count + 1) * sizeof(char *));
+    assert(entry->callees);
+    entry->callees[entry->callee_count] = strdup(name);
+    return entry->callee_count++;
+}
+
+/**
+ * Creates an entry holding the optimized code of a function.
+ *
+ * @param module: The module of the function
+ * @param function: The optimized function
+ * @param key: The key of the function before optimization, taken over
+ * @return: A pointer to the new entry
+ */
+static FunctionEntry * new_entry(const Module * module, const Function * function, Buffer * key) {
+    FunctionEntry * entry = (FunctionEntry *)calloc(1, sizeof(FunctionEntry));
+    assert(entry);
+    entry->hash = hash_key(key);
+    entry->key = key->data;
+    entry->key_length = key->length;
+    key->data = NULL;
+    key->length = key->capacity = 0;
+
+    entry->code_length = function->code_length;
+    entry->code = (uint32_t *)malloc((function->code_length + 1) * sizeof(uint32_t));
+    entry->register_count = function->register_count;
+    entry->types = (uint8_t *)malloc(function->register_count + 1);
+    assert(entry->code && entry->types);
+    memcpy(entry->types, function->types, function->register_count);
+
+    for(int pc = 0; pc < function->code_length; pc++) {
+        uint32_t instruction = function->code[pc];
+        if(OP(instruction) == OP_LOADK) {
+            int k = find_or_add_constant(entry, &module->constants[ARG_BX(instruction)]);
+            instruction = ENCODE_ABX(OP_LOADK, ARG_A(instruction), k);
+        } else if(OP(instruction) == OP_CALL) {
+            int callee = find_or_add_callee(entry, module->functions[ARG_BX(instruction)]->name);
+            instruction = ENCODE_ABX(OP_CALL, ARG_A(instruction), callee);
+        }
+        entry->code[pc] = instruction;
+    }
+    return entry;
+}
+
+static size_t entry_size(const FunctionEntry * entry) {
+    return sizeof(FunctionEntry) + entry->key_length + entry->code_length * sizeof(uint32_t)
+        + entry->register_count + entry->constant_count * sizeof(Constant) + entry->callee_count * sizeof(char *);
+}
+
+static void destroy_entry(FunctionEntry * entry) {
+    for(int i = 0; i < entry->constant_count; i++) {
+        if(entry->constants[i].type == CONSTANT_STRING) free((char *)entry->constants[i].value.s);
+    }
+    for(int i = 0; i < entry->callee_count; i++) free(entry->callees[i]);
+    free(entry->constants);
+    free(entry->callees);
+    free(entry->key);
+    free(entry->code);
+    free(entry->types);
+    free(entry);
+}
+
+static void clear(FunctionCache * cache) {
+    for(int b = 0; b < FUNCTION_CACHE_BUCKETS; b++) {
+        FunctionEntry * entry = cache->buckets[b];
+        while(entry) {
+            FunctionEntry * next = entry->next;
+            destroy_entry(entry);
+            entry = next;
+        }
+        cache->buckets[b] = NULL;
+    }
+    cache->size = 0;
+}
+
+/**
+ * Initializes an empty function cache.
+ *
+ * @return: A pointer to the new 'FunctionCache' structure
+ */
+FunctionCache * init_function_cache(void) {
+    FunctionCache * cache = (FunctionCache *)calloc(1, sizeof(FunctionCache));
+    assert(cache);
+    pthread_mutex_init(&cache->lock, NULL);
+    return cache;
+}
+
+/**
+ * Frees a function cache and everything cached.
+ *
+ * @param cache: A pointer to the cache
+ */
+void destroy_function_cache(FunctionCache * cache) {
+    clear(cache);
+    pthread_mutex_destroy(&cache->lock);
+    free(cache);
+}
+
+/**
+ * Replaces the code of a function by a cached optimized version, if there
+ * is one.
+ *
+ * @return: 'true' if the function was found
+ */
+static bool lookup(FunctionCache * cache, Module * module, Function * function, const Buffer * key, uint64_t hash) {
+    bool found = false;
+    pthread_mutex_lock(&cache->lock);
+    for(FunctionEntry * entry = cache->buckets[hash % FUNCTION_CACHE_BUCKETS]; entry; entry = entry->next) {
+        if(entry->hash != hash || entry->key_length != key->length || memcmp(entry->key, key->data, key->length) != 0) continue;
+
+        function->code_length = 0;
+        for(int pc = 0; pc < entry->code_length; pc++) {
+            uint32_t instruction = entry->code[pc];
+            if(OP(instruction) == OP_LOADK) {
+                int k = module_add_constant(module, entry->constants[ARG_BX(instruction)]);
+                instruction = ENCODE_ABX(OP_LOADK, ARG_A(instruction), k);
+            } else if(OP(instruction) == OP_CALL) {
+                int callee = module_find_function(module, entry->callees[ARG_BX(instruction)]);
+                instruction = ENCODE_ABX(OP_CALL, ARG_A(instruction), callee);
+            }
+            function_emit(function, instruction);
+        }
+        function->types = (uint8_t *)accounted_realloc(function->types, entry->register_count + 1);
+        assert(function->types);
+        memcpy(function->types, entry->types, entry->register_count);
+        function->register_count = entry->register_count;
+        found = true;
+        break;
+    }
+    pthread_mutex_unlock(&cache->lock);
+    return found;
+}
+
+static void store(FunctionCache * cache, FunctionEntry * entry) {
+    pthread_mutex_lock(&cache->lock);
+    if(cache->size + entry_size(entry) > FUNCTION_CACHE_MAX_SIZE) clear(cache);
+    FunctionEntry ** bucket = &cache->buckets[entry->hash % FUNCTION_CACHE_BUCKETS];
+    entry->next = *bucket;
+    *bucket = entry;
+    cache->size += entry_size(entry);
+    pthread_mutex_unlock(&cache->lock);
+}
+
+/**
+ * Optimizes every function of a module like 'optimize_module()', taking
+ * the code of functions optimized before from the cache.
+ *
+ * @param module: The module to optimize
+ * @param cache: The cache, shared with other threads
+ */
+void optimize_module_cached(Module * module, FunctionCache * cache) {
+    Buffer key = { NULL, 0, 0 };
+    for(int i = 0; i < module->function_count; i++) {
+        Function * function = module->functions[i];
+        key.length = 0;
+        normalize(module, function, &key);
+        uint64_t hash = hash_key(&key);
+        if(lookup(cache, module, function, &key, hash)) continue;
+
+        optimize_function(module, function);
+        store(cache, new_entry(module, function, &key));
+    }
+    free(key.data);
+    module_remove_unused_constants(module);
+}
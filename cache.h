@@ -0,0 +1,16 @@
+#ifndef CACHE_H
+#define CACHE_H
+
+#include <stddef.h>
+#include "bytecode.h"
+
+#define FUNCTION_CACHE_BUCKETS  65536
+#define FUNCTION_CACHE_MAX_SIZE (256 << 20)     // bytes cached before the cache starts over
+
+typedef struct FunctionCache FunctionCache;
+
+FunctionCache * init_function_cache(void);
+void destroy_function_cache(FunctionCache * cache);
+void optimize_module_cached(Module * module, FunctionCache * cache);
+
+#endif // CACHE_H
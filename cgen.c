@@ -0,0 +1,312 @@
+/**
+ * This file contains the C backend which translates optimized bytecode
+ * into portable C source.
+ *
+ * Every Sloth function becomes one C function and every register a local
+ * variable of its static type ('int64_t' or 'double'), so the host
+ * compiler sees plain scalar code it can allocate to machine registers and
+ * optimize as a whole. Jumps become 'goto's to labels placed only on jump
+ * targets, which keeps loops recognizable to the C optimizer.
+ *
+ * The emitted code is plain C11 depending on no library, and preserves
+ * the virtual machine's semantics: integer arithmetic wraps, division by
+ * -1 negates, conversions to 'int' saturate, division by zero stores an
+ * error in 'sloth_error' and returns, and callers return as soon as a
+ * callee failed. Functions take their source parameters only: the hidden
+ * result parameter of the bytecode (see codegen.c) is a local variable.
+ *
+ * Usage:
+ *  - Optimize the module with 'optimize_module()'
+ *  - Write the translation unit with 'cgen_module()'
+ *  - Compile it with e.g. 'cc -O2 -c', then call 'sloth_<name>()'
+ *
+ * @file    cgen.c
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <math.h>
+#include "cgen.h"
+
+/**
+ * Returns the target of a jump instruction.
+ *
+ * @param code: The function's code
+ * @param pc: The index of the jump
+ * @return: The index of the target, or -1 if the instruction is no jump
+ */
+static int jump_target(const uint32_t * code, int pc) {
+    switch(OP(code[pc])) {
+        case OP_JMP:  return pc + 1 + ARG_SJ(code[pc]);
+        case OP_JMPT: return pc + 1 + ARG_SBX(code[pc]);
+        case OP_JMPF: return pc + 1 + ARG_SBX(code[pc]);
+        default:      return -1;
+    }
+}
+
+/**
+ * Returns the C type of a register or return type.
+ *
+ * @param type: The 'ValueType'
+ * @return: The name of the C type
+ */
+static const char * c_type(int type) {
+    return type == TYPE_FLOAT ? "double" : "int64_t";
+}
+
+/**
+ * Prints a string as a C string literal.
+ *
+ * @param out: The output stream
+ * @param s: The string
+ */
+static void emit_string(FILE * out, const char * s) {
+    fputc('"', out);
+    for(; *s; s++) {
+        unsigned char c = (unsigned char)*s;
+        if(c == '"' || c == '\\') fprintf(out, "\\%c", c);
+        else if(c == '\n') fputs("\\n", out);
+        else if(c == '\t') fputs("\\t", out);
+        else if(c < 0x20 || c >= 0x7f) fprintf(out, "\\%03o", c);
+        else fputc(c, out);
+    }
+    fputc('"', out);
+}
+
+/**
+ * Prints the value of a constant as a C expression. Floats are printed in
+ * hexadecimal so that they are reproduced exactly.
+ *
+ * @param out: The output stream
+ * @param index: Index of the constant
+ * @param k: The constant
+ */
+static void emit_constant(FILE * out, int index, const Constant * k) {
+    switch(k->type) {
+        case CONSTANT_INT:
+            if(k->value.i == INT64_MIN) fputs("INT64_MIN", out);
+            else fprintf(out, "INT64_C(%lld)", (long long)k->value.i);
+            break;
+        case CONSTANT_FLOAT:
+            if(isnan(k->value.f)) fputs("NAN", out);
+            else if(isinf(k->value.f)) fputs(k->value.f < 0 ? "-INFINITY" : "INFINITY", out);
+            else fprintf(out, "%a", k->value.f);
+            break;
+        case CONSTANT_STRING:
+            fprintf(out, "(int64_t)(intptr_t)k%d", index);
+            break;
+    }
+}
+
+/**
+ * Returns the first register of a function holding a source parameter.
+ */
+static int first_param(const Function * function) {
+    return function->result_param ? 1 : 0;
+}
+
+/**
+ * Prints the prototype of a function, with its source parameters.
+ *
+ * @param out: The output stream
+ * @param function: The function
+ */
+static void emit_prototype(FILE * out, const Function * function) {
+    fprintf(out, "%s " CGEN_PREFIX "%s(", c_type(function->return_type), function->name);
+    int first = first_param(function);
+    for(int p = first; p < function->param_count; p++) {
+        fprintf(out, "%s%s r%d", p > first ? ", " : "", c_type(function->types[p]), p);
+    }
+    fputs(function->param_count > first ? ")" : "void)", out);
+}
+
+/**
+ * Prints the condition tested by a compare-and-branch instruction.
+ *
+ * @param out: The output stream
+ * @param instruction: The 'Jxx' instruction
+ */
+static void emit_branch(FILE * out, uint32_t instruction) {
+    const char * op = "==";
+    switch(OP(instruction)) {
+        case OP_JLT_I: case OP_JLT_F: op = "<"; break;
+        case OP_JLE_I: case OP_JLE_F: op = "<="; break;
+        default: break;
+    }
+    fprintf(out, "if((r%d %s r%d) == %d) ", ARG_A(instruction), op, ARG_B(instruction), ARG_C(instruction));
+}
+
+/**
+ * Marks the registers an instruction reads or writes.
+ *
+ * @param used: One flag per register
+ * @param instruction: The instruction
+ */
+static void mark_used(bool * used, uint32_t instruction) {
+    switch(OP(instruction)) {
+        case OP_JMP:
+            break;
+        case OP_LOADK: case OP_LOADI: case OP_JMPT: case OP_JMPF: case OP_CALL: case OP_RET:
+            used[ARG_A(instruction)] = true;
+            break;
+        case OP_MOVE: case OP_ADDI: case OP_NEG_I: case OP_NEG_F: case OP_NOT: case OP_I2F: case OP_F2I:
+        case OP_JEQ_I: case OP_JLT_I: case OP_JLE_I: case OP_JEQ_F: case OP_JLT_F: case OP_JLE_F:
+            used[ARG_A(instruction)] = used[ARG_B(instruction)] = true;
+            break;
+        default:
+            used[ARG_A(instruction)] = used[ARG_B(instruction)] = used[ARG_C(instruction)] = true;
+            break;
+    }
+}
+
+/**
+ * Prints one C function.
+ *
+ * @param out: The output stream
+ * @param module: The module containing the function
+ * @param function: The function
+ */
+static void emit_function(FILE * out, const Module * module, const Function * function) {
+    const uint32_t * code = function->code;
+    int length = function->code_length;
+
+    bool * targets = (bool *)calloc(length + 1, sizeof(bool));
+    bool used[MAX_REGISTERS] = { false };
+    assert(targets);
+    for(int pc = 0; pc < length; pc++) {
+        int target = jump_target(code, pc);
+        if(target >= 0) targets[target] = true;
+        mark_used(used, code[pc]);
+    }
+
+    emit_prototype(out, function);
+    fputs(" {\n", out);
+    for(int r = 0; r < function->register_count; r++) {
+        bool param = r >= first_param(function) && r < function->param_count;
+        if(!used[r] || param) continue;
+        fprintf(out, "    %s r%d = 0;\n", c_type(function->types[r]), r);
+    }
+
+    for(int pc = 0; pc < length; pc++) {
+        uint32_t i = code[pc];
+        int a = ARG_A(i), b = ARG_B(i), c = ARG_C(i);
+
+        if(targets[pc]) fprintf(out, "L%d:\n", pc);
+        fputs("    ", out);
+        switch(OP(i)) {
+            case OP_MOVE:  fprintf(out, "r%d = r%d;", a, b); break;
+            case OP_LOADK:
+                fprintf(out, "r%d = ", a);
+                emit_constant(out, ARG_BX(i), &module->constants[ARG_BX(i)]);
+                fputc(';', out);
+                break;
+            case OP_LOADI: fprintf(out, "r%d = %d;", a, ARG_SBX(i)); break;
+
+            case OP_ADD_I: fprintf(out, "r%d = (int64_t)((uint64_t)r%d + (uint64_t)r%d);", a, b, c); break;
+            case OP_ADDI:  fprintf(out, "r%d = (int64_t)((uint64_t)r%d + (uint64_t)%d);", a, b, ARG_SC(i)); break;
+            case OP_SUB_I: fprintf(out, "r%d = (int64_t)((uint64_t)r%d - (uint64_t)r%d);", a, b, c); break;
+            case OP_MUL_I: fprintf(out, "r%d = (int64_t)((uint64_t)r%d * (uint64_t)r%d);", a, b, c); break;
+            case OP_DIV_I: case OP_MOD_I:
+                fprintf(out, "if(r%d == 0) { sloth_error = \"division by zero\"; return 0; }\n", c);
+                if(OP(i) == OP_DIV_I) fprintf(out, "    r%d = r%d == -1 ? (int64_t)(0 - (uint64_t)r%d) : r%d / r%d;", a, c, b, b, c);
+                else fprintf(out, "    r%d = r%d == -1 ? 0 : r%d %% r%d;", a, c, b, c);
+                break;
+            case OP_NEG_I: fprintf(out, "r%d = (int64_t)(0 - (uint64_t)r%d);", a, b); break;
+
+            case OP_ADD_F: fprintf(out, "r%d = r%d + r%d;", a, b, c); break;
+            case OP_SUB_F: fprintf(out, "r%d = r%d - r%d;", a, b, c); break;
+            case OP_MUL_F: fprintf(out, "r%d = r%d * r%d;", a, b, c); break;
+            case OP_DIV_F: fprintf(out, "r%d = r%d / r%d;", a, b, c); break;
+            case OP_NEG_F: fprintf(out, "r%d = -r%d;", a, b); break;
+
+            case OP_EQ_I: case OP_EQ_F: fprintf(out, "r%d = r%d == r%d;", a, b, c); break;
+            case OP_NE_I: case OP_NE_F: fprintf(out, "r%d = r%d != r%d;", a, b, c); break;
+            case OP_LT_I: case OP_LT_F: fprintf(out, "r%d = r%d < r%d;", a, b, c); break;
+            case OP_LE_I: case OP_LE_F: fprintf(out, "r%d = r%d <= r%d;", a, b, c); break;
+            case OP_NOT:   fprintf(out, "r%d = !r%d;", a, b); break;
+
+            case OP_I2F: fprintf(out, "r%d = (double)r%d;", a, b); break;
+            case OP_F2I: fprintf(out, "r%d = " CGEN_PREFIX "float_to_int(r%d);", a, b); break;
+
+            case OP_JMP:  fprintf(out, "goto L%d;", jump_target(code, pc)); break;
+            case OP_JMPT: fprintf(out, "if(r%d) goto L%d;", a, jump_target(code, pc)); break;
+            case OP_JMPF: fprintf(out, "if(!r%d) goto L%d;", a, jump_target(code, pc)); break;
+
+            case OP_JEQ_I: case OP_JLT_I: case OP_JLE_I:
+            case OP_JEQ_F: case OP_JLT_F: case OP_JLE_F: {
+                int target = jump_target(code, pc + 1);
+                emit_branch(out, i);
+                fprintf(out, "goto L%d;", target);
+                pc++;
+                if(targets[pc]) fprintf(out, "\n    if(0) { L%d: goto L%d; }", pc, target);
+                break;
+            }
+
+            case OP_CALL: {
+                const Function * callee = module->functions[ARG_BX(i)];
+                fprintf(out, "r%d = " CGEN_PREFIX "%s(", a, callee->name);
+                int first = first_param(callee);
+                for(int p = first; p < callee->param_count; p++) fprintf(out, "%sr%d", p > first ? ", " : "", a + p);
+                fputs(");\n    if(sloth_error) return 0;", out);
+                break;
+            }
+            case OP_RET: fprintf(out, "return r%d;", a); break;
+
+            default:
+                fprintf(out, "/* invalid opcode %d */", OP(i));
+                break;
+        }
+        fputc('\n', out);
+    }
+
+    if(targets[length]) fprintf(out, "L%d:\n", length);
+    if(length == 0 || targets[length] || (OP(code[length - 1]) != OP_RET && OP(code[length - 1]) != OP_JMP)) {
+        fputs("    return 0;\n", out);
+    }
+    fputs("}\n\n", out);
+    free(targets);
+}
+
+/**
+ * Translates a module into one C translation unit. Functions keep their
+ * names with the prefix 'sloth_', and 'sloth_error' holds the message of
+ * a run-time error of the last call on the calling thread.
+ *
+ * @param out: The output stream
+ * @param module: The module, preferably optimized
+ * @return: 'true' if the source was written successfully
+ */
+bool cgen_module(FILE * out, const Module * module) {
+    fputs("/* Generated by Sloth, do not edit. */\n", out);
+    fputs("#include <stdint.h>\n#include <math.h>\n\n", out);
+    fputs("_Thread_local const char * sloth_error;\n\n", out);
+    fputs("static inline int64_t " CGEN_PREFIX "float_to_int(double x) {\n"
+          "    if(x != x) return 0;\n"
+          "    if(x >= 9223372036854775808.0) return INT64_MAX;\n"
+          "    if(x <= -9223372036854775808.0) return INT64_MIN;\n"
+          "    return (int64_t)x;\n"
+          "}\n\n", out);
+
+    bool strings = false;
+    for(int k = 0; k < module->constant_count; k++) {
+        if(module->constants[k].type != CONSTANT_STRING) continue;
+        fprintf(out, "static const char k%d[] = ", k);
+        emit_string(out, module->constants[k].value.s);
+        fputs(";\n", out);
+        strings = true;
+    }
+    if(strings) fputc('\n', out);
+
+    for(int f = 0; f < module->function_count; f++) {
+        emit_prototype(out, module->functions[f]);
+        fputs(";\n", out);
+    }
+    fputc('\n', out);
+
+    for(int f = 0; f < module->function_count; f++) {
+        emit_function(out, module, module->functions[f]);
+    }
+
+    return !ferror(out);
+}
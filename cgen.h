@@ -0,0 +1,12 @@
+#ifndef CGEN_H
+#define CGEN_H
+
+#include <stdio.h>
+#include <stdbool.h>
+#include "bytecode.h"
+
+#define CGEN_PREFIX "sloth_"   // prepended to the names of emitted functions
+
+bool cgen_module(FILE * out, const Module * module);
+
+#endif // CGEN_H
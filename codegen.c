@@ -0,0 +1,444 @@
+/**
+ * This file contains the code generator, which translates an analyzed
+ * program into a bytecode module.
+ *
+ * Every variable lives in a register of its own for the whole function.
+ * Intermediate values use temporary registers from a pool per type which
+ * is reused by every statement, so the frame grows with the most complex
+ * statement rather than with the length of the function.
+ *
+ * 'CALL A Bx' passes R[A], R[A+1], ... and returns into R[A], so R[A] must
+ * have the type of both the first parameter and the result. A function
+ * whose first parameter has another type than its result therefore
+ * receives a hidden leading parameter of the result type, which callers
+ * leave unset, and is marked with 'result_param' so that the backends and
+ * the run mode can tell it from a source parameter. The arguments of every callee go to a block of consecutive
+ * registers reserved for it on first use.
+ *
+ * Usage:
+ *  - Generate the module of a program with 'generate()', after the
+ *    program has passed semantic analysis
+ *
+ * @file    codegen.c
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include "codegen.h"
+#include "alloc.h"
+
+typedef struct {
+    const Program * program;
+    Module * module;
+    Diagnostics * diagnostics;
+    const AstFunction * source;     // function being generated
+    Function * function;
+    bool failed;                    // an error has been reported for the function
+    int * variables;                // register of every variable slot
+    int * call_blocks;              // first argument register of every callee, -1 if not reserved
+    int temporaries[2][MAX_REGISTERS];  // temporary registers by 'ValueType'
+    int temporary_count[2];         // temporaries allocated so far
+    int temporary_used[2];          // temporaries holding live values
+} Generator;
+
+/**
+ * Returns whether a function receives a hidden parameter for its result.
+ */
+static bool has_result_param(const AstFunction * function) {
+    return function->param_count > 0 && function->params[0]->type != function->return_type;
+}
+
+/**
+ * Reports an error that stops the generation of the current function.
+ * Only the first such error of a function is reported.
+ */
+static void fail(Generator * generator, const char * message) {
+    if(!generator->failed) {
+        diagnose(generator->diagnostics, generator->source->line, generator->source->column,
+                 "function '%s' %s", generator->source->name, message);
+    }
+    generator->failed = true;
+}
+
+/**
+ * Adds a register to the frame, reporting frames exceeding
+ * 'MAX_REGISTERS' instead of overflowing.
+ */
+static int new_register(Generator * generator, ValueType type) {
+    if(generator->function->register_count == MAX_REGISTERS) {
+        fail(generator, "needs too many registers");
+        return 0;
+    }
+    return function_add_register(generator->function, type);
+}
+
+/**
+ * Returns an unused temporary register.
+ */
+static int temporary(Generator * generator, ValueType type) {
+    int used = generator->temporary_used[type];
+    if(used == generator->temporary_count[type]) {
+        if(used == MAX_REGISTERS) {
+            fail(generator, "needs too many registers");
+            return 0;
+        }
+        generator->temporaries[type][generator->temporary_count[type]++] = new_register(generator, type);
+    }
+    return generator->temporaries[type][generator->temporary_used[type]++];
+}
+
+static int emit(Generator * generator, uint32_t instruction) {
+    return function_emit(generator->function, instruction);
+}
+
+static int emit_jump(Generator * generator, Opcode op, int a) {
+    return emit(generator, op == OP_JMP ? ENCODE_SJ(op, 0) : ENCODE_ABX(op, a, 0));
+}
+
+/**
+ * Sets the target of a jump, reporting offsets out of range instead of
+ * overflowing.
+ */
+static void patch_jump(Generator * generator, int pc, int target) {
+    int offset = target - (pc + 1);
+    int limit = OP(generator->function->code[pc]) == OP_JMP ? MAX_SJ : MAX_SBX;
+    if(offset < -limit || offset > limit) {
+        fail(generator, "is too large for a jump");
+        return;
+    }
+    function_patch_jump(generator->function, pc, target);
+}
+
+static int here(const Generator * generator) {
+    return generator->function->code_length;
+}
+
+/**
+ * Loads a constant into a register.
+ */
+static void emit_constant(Generator * generator, int target, Constant constant) {
+    int index = module_add_constant(generator->module, constant);
+    if(index < 0) {
+        fail(generator, "uses too many constants");
+        return;
+    }
+    emit(generator, ENCODE_ABX(OP_LOADK, target, index));
+}
+
+static int destination(Generator * generator, int target, ValueType type) {
+    return target >= 0 ? target : temporary(generator, type);
+}
+
+static bool contains_call(const AstNode * node) {
+    if(!node) return false;
+    if(node->kind == AST_CALL) return true;
+    return contains_call(node->left) || contains_call(node->right);
+}
+
+static int emit_expression(Generator * generator, const AstNode * node, int target);
+
+/**
+ * Reserves the argument block of a callee.
+ *
+ * @return: The register receiving the result and first argument
+ */
+static int call_block(Generator * generator, int callee) {
+    if(generator->call_blocks[callee] >= 0) return generator->call_blocks[callee];
+
+    const AstFunction * function = &generator->program->functions[callee];
+    int base = new_register(generator, has_result_param(function) || function->param_count == 0
+                                           ? function->return_type : function->params[0]->type);
+    for(int p = has_result_param(function) ? 0 : 1; p < function->param_count; p++) {
+        new_register(generator, function->params[p]->type);
+    }
+    generator->call_blocks[callee] = base;
+    return base;
+}
+
+static int emit_call(Generator * generator, const AstNode * node, int target) {
+    const AstFunction * callee = &generator->program->functions[node->symbol];
+    int base = call_block(generator, node->symbol);
+    int first = base + (has_result_param(callee) ? 1 : 0);
+    int used[2] = { generator->temporary_used[TYPE_INT], generator->temporary_used[TYPE_FLOAT] };
+
+    // Arguments containing calls would overwrite the block, so they are
+    // evaluated first; the others are evaluated right into the block
+    int * values = (int *)accounted_malloc((node->child_count + 1) * sizeof(int));
+    assert(values);
+    for(int i = 0; i < node->child_count; i++) {
+        if(contains_call(node->children[i])) values[i] = emit_expression(generator, node->children[i], -1);
+    }
+    for(int i = 0; i < node->child_count; i++) {
+        if(contains_call(node->children[i])) {
+            emit(generator, ENCODE_ABC(OP_MOVE, first + i, values[i], 0));
+        } else {
+            emit_expression(generator, node->children[i], first + i);
+        }
+    }
+    accounted_free(values);
+
+    emit(generator, ENCODE_ABX(OP_CALL, base, node->symbol));
+    generator->temporary_used[TYPE_INT] = used[TYPE_INT];
+    generator->temporary_used[TYPE_FLOAT] = used[TYPE_FLOAT];
+
+    // The block is reused by the next call, so the result is copied out
+    int result = destination(generator, target, node->type);
+    emit(generator, ENCODE_ABC(OP_MOVE, result, base, 0));
+    return result;
+}
+
+/**
+ * Emits '&&' and '||', which evaluate their right operand only when the
+ * left one does not decide the result, and yield 0 or 1.
+ */
+static int emit_logical(Generator * generator, const AstNode * node, int target) {
+    // The operands must not write the target, which they may read
+    int result = temporary(generator, TYPE_INT);
+    int used[2] = { generator->temporary_used[TYPE_INT], generator->temporary_used[TYPE_FLOAT] };
+
+    emit_expression(generator, node->left, result);
+    int skip = emit_jump(generator, strcmp(node->text, "&&") == 0 ? OP_JMPF : OP_JMPT, result);
+    emit_expression(generator, node->right, result);
+    patch_jump(generator, skip, here(generator));
+    emit(generator, ENCODE_ABC(OP_NOT, result, result, 0));
+    emit(generator, ENCODE_ABC(OP_NOT, result, result, 0));
+
+    generator->temporary_used[TYPE_INT] = used[TYPE_INT];
+    generator->temporary_used[TYPE_FLOAT] = used[TYPE_FLOAT];
+    if(target < 0) return result;
+    emit(generator, ENCODE_ABC(OP_MOVE, target, result, 0));
+    return target;
+}
+
+static int emit_binary(Generator * generator, const AstNode * node, int target) {
+    const char * op = node->text;
+    if(strcmp(op, "&&") == 0 || strcmp(op, "||") == 0) return emit_logical(generator, node, target);
+
+    int used[2] = { generator->temporary_used[TYPE_INT], generator->temporary_used[TYPE_FLOAT] };
+    int left = emit_expression(generator, node->left, -1);
+    int right = emit_expression(generator, node->right, -1);
+    // The operands are read before the result is written, so the result
+    // may take the place of an operand
+    generator->temporary_used[TYPE_INT] = used[TYPE_INT];
+    generator->temporary_used[TYPE_FLOAT] = used[TYPE_FLOAT];
+
+    bool is_float = node->left->type == TYPE_FLOAT;
+    Opcode opcode;
+    if(strcmp(op, "+") == 0) opcode = is_float ? OP_ADD_F : OP_ADD_I;
+    else if(strcmp(op, "-") == 0) opcode = is_float ? OP_SUB_F : OP_SUB_I;
+    else if(strcmp(op, "*") == 0) opcode = is_float ? OP_MUL_F : OP_MUL_I;
+    else if(strcmp(op, "/") == 0) opcode = is_float ? OP_DIV_F : OP_DIV_I;
+    else if(strcmp(op, "%") == 0) opcode = OP_MOD_I;
+    else if(strcmp(op, "==") == 0) opcode = is_float ? OP_EQ_F : OP_EQ_I;
+    else if(strcmp(op, "!=") == 0) opcode = is_float ? OP_NE_F : OP_NE_I;
+    else if(strcmp(op, "<") == 0 || strcmp(op, ">") == 0) opcode = is_float ? OP_LT_F : OP_LT_I;
+    else opcode = is_float ? OP_LE_F : OP_LE_I;
+
+    // 'a > b' is 'b < a'
+    if(op[0] == '>') {
+        int swap = left;
+        left = right;
+        right = swap;
+    }
+
+    int result = destination(generator, target, node->type);
+    emit(generator, ENCODE_ABC(opcode, result, left, right));
+    return result;
+}
+
+/**
+ * Emits the code computing an expression.
+ *
+ * @param generator: The generator
+ * @param node: The expression
+ * @param target: The register to compute it into, or -1 for any register
+ * @return: The register holding the value
+ */
+static int emit_expression(Generator * generator, const AstNode * node, int target) {
+    switch(node->kind) {
+        case AST_NUMBER: {
+            Token token = { NUMBER, node->text, node->line, node->column };
+            int result = destination(generator, target, node->type);
+            int index = module_add_literal(generator->module, &token);
+            if(index < 0) fail(generator, "uses too many constants");
+            else emit(generator, ENCODE_ABX(OP_LOADK, result, index));
+            return result;
+        }
+        case AST_VARIABLE: {
+            int variable = generator->variables[node->symbol];
+            if(target < 0 || target == variable) return variable;
+            emit(generator, ENCODE_ABC(OP_MOVE, target, variable, 0));
+            return target;
+        }
+        case AST_UNARY:
+        case AST_CONVERT: {
+            int used[2] = { generator->temporary_used[TYPE_INT], generator->temporary_used[TYPE_FLOAT] };
+            int operand = emit_expression(generator, node->left, -1);
+            generator->temporary_used[TYPE_INT] = used[TYPE_INT];
+            generator->temporary_used[TYPE_FLOAT] = used[TYPE_FLOAT];
+
+            Opcode opcode;
+            if(node->kind == AST_CONVERT) opcode = node->type == TYPE_FLOAT ? OP_I2F : OP_F2I;
+            else if(strcmp(node->text, "!") == 0) opcode = OP_NOT;
+            else opcode = node->type == TYPE_FLOAT ? OP_NEG_F : OP_NEG_I;
+
+            int result = destination(generator, target, node->type);
+            emit(generator, ENCODE_ABC(opcode, result, operand, 0));
+            return result;
+        }
+        case AST_BINARY:
+            return emit_binary(generator, node, target);
+        case AST_CALL:
+            return emit_call(generator, node, target);
+        default:
+            assert(false);
+            return 0;
+    }
+}
+
+static void emit_statement(Generator * generator, const AstNode * node);
+
+/**
+ * Emits an 'if' statement and the 'else if' chain following it.
+ */
+static void emit_if(Generator * generator, const AstNode * node) {
+    int condition = emit_expression(generator, node->left, -1);
+    int skip_then = emit_jump(generator, OP_JMPF, condition);
+    emit_statement(generator, node->right);
+    if(!node->third) {
+        patch_jump(generator, skip_then, here(generator));
+        return;
+    }
+
+    int skip_else = emit_jump(generator, OP_JMP, 0);
+    patch_jump(generator, skip_then, here(generator));
+    emit_statement(generator, node->third);
+    patch_jump(generator, skip_else, here(generator));
+}
+
+/**
+ * Emits the code of a statement.
+ *
+ * @param generator: The generator
+ * @param node: The statement
+ */
+static void emit_statement(Generator * generator, const AstNode * node) {
+    // Temporaries never outlive the statement computing them
+    generator->temporary_used[TYPE_INT] = 0;
+    generator->temporary_used[TYPE_FLOAT] = 0;
+
+    switch(node->kind) {
+        case AST_DECLARATION: {
+            int variable = generator->variables[node->symbol];
+            if(node->left) {
+                emit_expression(generator, node->left, variable);
+            } else {
+                // Uninitialized variables start at zero, also when a loop declares them again
+                Constant zero = { node->type == TYPE_FLOAT ? CONSTANT_FLOAT : CONSTANT_INT, { 0 } };
+                emit_constant(generator, variable, zero);
+            }
+            break;
+        }
+        case AST_ASSIGNMENT:
+            emit_expression(generator, node->left, generator->variables[node->symbol]);
+            break;
+        case AST_IF:
+            emit_if(generator, node);
+            break;
+        case AST_WHILE: {
+            int top = here(generator);
+            int condition = emit_expression(generator, node->left, -1);
+            int exit = emit_jump(generator, OP_JMPF, condition);
+            emit_statement(generator, node->right);
+            patch_jump(generator, emit_jump(generator, OP_JMP, 0), top);
+            patch_jump(generator, exit, here(generator));
+            break;
+        }
+        case AST_RETURN:
+            emit(generator, ENCODE_ABC(OP_RET, emit_expression(generator, node->left, -1), 0, 0));
+            break;
+        case AST_EXPRESSION:
+            emit_expression(generator, node->left, -1);
+            break;
+        case AST_BLOCK:
+            for(int i = 0; i < node->child_count && !generator->failed; i++) emit_statement(generator, node->children[i]);
+            break;
+        default:
+            assert(false);
+    }
+}
+
+/**
+ * Generates the code of one function.
+ */
+static void generate_function(Generator * generator, int index) {
+    const AstFunction * source = &generator->program->functions[index];
+    generator->source = source;
+    generator->function = generator->module->functions[index];
+    generator->failed = false;
+    generator->temporary_count[TYPE_INT] = generator->temporary_count[TYPE_FLOAT] = 0;
+    for(int f = 0; f < generator->program->function_count; f++) generator->call_blocks[f] = -1;
+
+    generator->variables = (int *)accounted_malloc((source->slot_count + 1) * sizeof(int));
+    assert(generator->variables);
+    if(has_result_param(source)) {
+        function_add_param(generator->function, source->return_type);
+        generator->function->result_param = true;
+    }
+    for(int p = 0; p < source->param_count; p++) {
+        generator->variables[p] = function_add_param(generator->function, source->slot_types[p]);
+    }
+    for(int s = source->param_count; s < source->slot_count; s++) {
+        generator->variables[s] = new_register(generator, source->slot_types[s]);
+    }
+
+    emit_statement(generator, source->body);
+
+    // Falling off the end returns zero
+    generator->temporary_used[TYPE_INT] = generator->temporary_used[TYPE_FLOAT] = 0;
+    int zero = temporary(generator, source->return_type);
+    Constant constant = { source->return_type == TYPE_FLOAT ? CONSTANT_FLOAT : CONSTANT_INT, { 0 } };
+    emit_constant(generator, zero, constant);
+    emit(generator, ENCODE_ABC(OP_RET, zero, 0, 0));
+
+    accounted_free(generator->variables);
+}
+
+/**
+ * Generates the bytecode module of a program.
+ *
+ * @param program: The program, which must have passed semantic analysis
+ * @param diagnostics: Receives functions exceeding the limits of the bytecode
+ * @return: A pointer to the new module, or NULL after an error
+ */
+Module * generate(const Program * program, Diagnostics * diagnostics) {
+    int errors = diagnostics->errors;
+    Generator generator;
+    memset(&generator, 0, sizeof(generator));
+    generator.program = program;
+    generator.diagnostics = diagnostics;
+    generator.module = init_module();
+    generator.call_blocks = (int *)accounted_malloc((program->function_count + 1) * sizeof(int));
+    assert(generator.call_blocks);
+
+    // Calls refer to functions by index, so all of them are added first
+    for(int f = 0; f < program->function_count; f++) {
+        const AstFunction * function = &program->functions[f];
+        if(module_add_function(generator.module, function->name, function->return_type) < 0) {
+            diagnose(diagnostics, function->line, function->column,
+                     "too many functions, a program may define at most %d", MAX_BX + 1);
+            break;
+        }
+    }
+    if(diagnostics->errors == errors) {
+        for(int f = 0; f < program->function_count; f++) generate_function(&generator, f);
+    }
+
+    accounted_free(generator.call_blocks);
+    if(diagnostics->errors != errors) {
+        destroy_module(generator.module);
+        return NULL;
+    }
+    return generator.module;
+}
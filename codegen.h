@@ -0,0 +1,10 @@
+#ifndef CODEGEN_H
+#define CODEGEN_H
+
+#include "bytecode.h"
+#include "parser.h"
+#include "diagnostic.h"
+
+Module * generate(const Program * program, Diagnostics * diagnostics);
+
+#endif // CODEGEN_H
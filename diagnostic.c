@@ -0,0 +1,89 @@
+/**
+ * This file contains the collection of error messages shared by the
+ * stages of the compiler. Every message names the file, line and column
+ * it refers to, in the usual 'file:line:column: error: message' form.
+ *
+ * Usage:
+ *  - Initialize the messages of a unit with 'init_diagnostics()'
+ *  - Report errors with 'diagnose()'
+ *  - Free resources with 'destroy_diagnostics()'
+ *
+ * @file    diagnostic.c
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <assert.h>
+#include "diagnostic.h"
+
+/**
+ * Initializes an empty list of messages.
+ *
+ * @param diagnostics: A pointer to the messages
+ * @param filename: The source file they refer to
+ */
+void init_diagnostics(Diagnostics * diagnostics, const char * filename) {
+    diagnostics->filename = filename;
+    diagnostics->text = NULL;
+    diagnostics->length = 0;
+    diagnostics->capacity = 0;
+    diagnostics->errors = 0;
+}
+
+/**
+ * Frees the text of the messages.
+ *
+ * @param diagnostics: A pointer to the messages
+ */
+void destroy_diagnostics(Diagnostics * diagnostics) {
+    free(diagnostics->text);
+    diagnostics->text = NULL;
+    diagnostics->length = diagnostics->capacity = 0;
+}
+
+/**
+ * Appends formatted text, growing the buffer as needed.
+ */
+static void append(Diagnostics * diagnostics, const char * format, va_list args) {
+    va_list copy;
+    va_copy(copy, args);
+    int needed = vsnprintf(NULL, 0, format, copy);
+    va_end(copy);
+    if(needed < 0) return;
+
+    if(diagnostics->length + needed + 1 > diagnostics->capacity) {
+        diagnostics->capacity = (diagnostics->length + needed + 1) * 2;
+        diagnostics->text = (char *)realloc(diagnostics->text, diagnostics->capacity);
+        assert(diagnostics->text);
+    }
+    vsnprintf(diagnostics->text + diagnostics->length, needed + 1, format, args);
+    diagnostics->length += needed;
+}
+
+static void append_text(Diagnostics * diagnostics, const char * format, ...) {
+    va_list args;
+    va_start(args, format);
+    append(diagnostics, format, args);
+    va_end(args);
+}
+
+/**
+ * Reports an error.
+ *
+ * @param diagnostics: A pointer to the messages
+ * @param line: Line of the error, 0 if it concerns the whole file
+ * @param column: Column of the error
+ * @param format: 'printf' style message
+ */
+void diagnose(Diagnostics * diagnostics, int line, int column, const char * format, ...) {
+    if(line > 0) append_text(diagnostics, "%s:%d:%d: error: ", diagnostics->filename, line, column + 1);
+    else append_text(diagnostics, "%s: error: ", diagnostics->filename);
+
+    va_list args;
+    va_start(args, format);
+    append(diagnostics, format, args);
+    va_end(args);
+
+    append_text(diagnostics, "\n");
+    diagnostics->errors++;
+}
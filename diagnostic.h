@@ -0,0 +1,24 @@
+#ifndef DIAGNOSTIC_H
+#define DIAGNOSTIC_H
+
+#include <stddef.h>
+
+/*
+ * Error messages of one compilation unit. They are collected as text
+ * rather than printed, so that a driver compiling many units at once can
+ * print every unit's messages in one piece and in input order.
+ */
+typedef struct {
+    const char * filename;  // source file the messages refer to
+    char * text;            // the messages, one per line
+    size_t length;
+    size_t capacity;
+    int errors;             // number of errors reported
+} Diagnostics;
+
+void init_diagnostics(Diagnostics * diagnostics, const char * filename);
+void destroy_diagnostics(Diagnostics * diagnostics);
+void diagnose(Diagnostics * diagnostics, int line, int column, const char * format, ...)
+    __attribute__((format(printf, 4, 5)));
+
+#endif // DIAGNOSTIC_H
@@ -0,0 +1,585 @@
+/**
+ * This file contains the compiler driver, which compiles any number of
+ * source files into bytecode images.
+ *
+ * Every file is a unit of its own that goes through the whole pipeline:
+ * lexing, parsing, semantic analysis, code generation, optimization and
+ * linking, and is written next to the source as 'file.slbc', or with
+ * '--emit=c' or '--emit=llvm' translated after optimization into C source
+ * 'file.c' or LLVM IR 'file.ll' instead (see cgen.c and llvmgen.c), which
+ * bypasses the unit cache. The units are compiled concurrently by worker
+ * threads (by default one per processor)
+ * which take the next unit off a shared queue whenever they finish one, so
+ * a few large files do not leave the other workers idle.
+ *
+ * Each unit collects its error messages on its own; they are reported unit
+ * by unit in the order of the command line as soon as every earlier unit
+ * has finished, so the output is the same for any number of workers and
+ * messages of different files never interleave.
+ *
+ * A long-lived process (see server.c) may also pass a unit cache, which
+ * keeps the image and messages of every unit it compiled, keyed by the
+ * contents of the source, so that neither the file's path nor its
+ * timestamps matter. A unit whose source has the contents of a cached one
+ * is not compiled again; its cached image is written and its cached
+ * messages reported under its own file name instead, and the functions of
+ * a unit that did change are only optimized if they changed themselves
+ * (see cache.c). Once the cache holds 'UNIT_CACHE_MAX_SIZE' bytes it
+ * starts over, like the function cache. Such a process compiles on behalf
+ * of clients, which pass their working
+ * directory and sources as open file descriptors, so sources are read
+ * and images written where the client has them without being copied.
+ *
+ * With '--profile-use=FILE' every unit is optimized with the execution
+ * counts of a profile written by 'sloth --run --profile-generate=FILE'
+ * (see run.c), which the caller reads into 'options->feedback'. Such
+ * units bypass the unit cache, whose results were optimized without it.
+ *
+ * Usage:
+ *  - Read the command line with 'init_driver_options()'
+ *  - Compile the files with 'compile_files()'
+ *  - Free the options with 'destroy_driver_options()'
+ *
+ * @file    driver.c
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <pthread.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include "driver.h"
+#include "lexer.h"
+#include "parser.h"
+#include "semantic.h"
+#include "codegen.h"
+#include "optimize.h"
+#include "cache.h"
+#include "image.h"
+#include "cgen.h"
+#include "llvmgen.h"
+#include "trace.h"
+#include "alloc.h"
+
+#define IMAGE_EXTENSION     ".slbc"
+#define C_EXTENSION         ".c"
+#define LLVM_EXTENSION      ".ll"
+#define UNIT_CACHE_BUCKETS  4096
+#define UNIT_CACHE_MAX_SIZE (256 << 20)     // bytes cached before the cache starts over
+
+typedef struct CacheEntry {
+    uint64_t hash;              // hash of the source
+    char * source;              // contents of the source, compared in full
+    size_t source_length;
+    bool optimize;              // compiled with the optimizer
+    Image * image;              // linked image, NULL if the unit had errors
+    char * messages;            // messages of the unit, each line without the file name it starts with
+    size_t length;
+    int errors;
+    struct CacheEntry * next;   // next entry in the bucket
+} CacheEntry;
+
+struct UnitCache {
+    CacheEntry * buckets[UNIT_CACHE_BUCKETS];
+    size_t size;                // bytes held by the entries
+    FunctionCache * functions;  // optimized functions of all units
+    pthread_mutex_t lock;
+};
+
+typedef struct {
+    const DriverOptions * options;
+    UnitCache * cache;
+    Unit * units;
+    int next;                   // next unit to compile, guarded by 'lock'
+    int workers;                // workers started, guarded by 'lock'
+    pthread_mutex_t lock;
+    pthread_cond_t finished;    // signaled whenever a unit is done
+} Driver;
+
+/**
+ * Reads the command line of the compiler:
+ *
+ *   [-j N] [-O0] [--emit=c|llvm] [--trace=FILE] [--mem-stats] [--profile-use=FILE] file...
+ *
+ * @param options: Receives the options
+ * @param argc: Number of arguments, without the program name
+ * @param argv: The arguments
+ * @return: 'false' if the command line is invalid
+ */
+bool init_driver_options(DriverOptions * options, int argc, char ** argv) {
+    options->jobs = (int)sysconf(_SC_NPROCESSORS_ONLN);
+    options->optimize = true;
+    options->file_count = 0;
+    options->files = (char **)malloc((argc + 1) * sizeof(char *));
+    assert(options->files);
+    options->directory = AT_FDCWD;
+    options->sources = NULL;
+    options->trace = NULL;
+    options->mem_stats = false;
+    options->profile_use = NULL;
+    options->feedback = NULL;
+    options->emit = EMIT_IMAGE;
+
+    for(int i = 0; i < argc; i++) {
+        if(strncmp(argv[i], "-j", 2) == 0) {
+            const char * count = argv[i][2] ? argv[i] + 2 : (i + 1 < argc ? argv[++i] : "");
+            char * end;
+            long jobs = strtol(count, &end, 10);
+            if(*count == '\0' || *end != '\0' || jobs < 1 || jobs > 1024) return false;
+            options->jobs = (int)jobs;
+        } else if(strcmp(argv[i], "-O0") == 0) {
+            options->optimize = false;
+        } else if(strcmp(argv[i], "--emit=c") == 0) {
+            options->emit = EMIT_C;
+        } else if(strcmp(argv[i], "--emit=llvm") == 0) {
+            options->emit = EMIT_LLVM;
+        } else if(strncmp(argv[i], "--trace=", 8) == 0 && argv[i][8]) {
+            options->trace = argv[i] + 8;
+        } else if(strcmp(argv[i], "--mem-stats") == 0) {
+            options->mem_stats = true;
+        } else if(strncmp(argv[i], "--profile-use=", 14) == 0 && argv[i][14]) {
+            options->profile_use = argv[i] + 14;
+        } else if(argv[i][0] == '-') {
+            return false;
+        } else {
+            options->files[options->file_count++] = argv[i];
+        }
+    }
+    if(options->jobs < 1) options->jobs = 1;
+    return options->file_count > 0;
+}
+
+/**
+ * Frees the options read by 'init_driver_options()'.
+ *
+ * @param options: The options
+ */
+void destroy_driver_options(DriverOptions * options) {
+    free(options->files);
+    options->files = NULL;
+}
+
+/**
+ * Initializes an empty unit cache.
+ *
+ * @return: A pointer to the new 'UnitCache' structure
+ */
+UnitCache * init_unit_cache(void) {
+    UnitCache * cache = (UnitCache *)calloc(1, sizeof(UnitCache));
+    assert(cache);
+    cache->functions = init_function_cache();
+    pthread_mutex_init(&cache->lock, NULL);
+    return cache;
+}
+
+static size_t entry_size(const CacheEntry * entry) {
+    return sizeof(CacheEntry) + entry->source_length + entry->length + (entry->image ? entry->image->size : 0);
+}
+
+static void destroy_entry(CacheEntry * entry) {
+    free(entry->source);
+    if(entry->image) destroy_image(entry->image);
+    free(entry->messages);
+    free(entry);
+}
+
+/**
+ * Drops every cached unit. The caller holds the lock.
+ */
+static void clear_units(UnitCache * cache) {
+    for(int b = 0; b < UNIT_CACHE_BUCKETS; b++) {
+        CacheEntry * entry = cache->buckets[b];
+        while(entry) {
+            CacheEntry * next = entry->next;
+            destroy_entry(entry);
+            entry = next;
+        }
+        cache->buckets[b] = NULL;
+    }
+    cache->size = 0;
+}
+
+/**
+ * Frees a unit cache and everything cached.
+ *
+ * @param cache: A pointer to the cache
+ */
+void destroy_unit_cache(UnitCache * cache) {
+    clear_units(cache);
+    destroy_function_cache(cache->functions);
+    pthread_mutex_destroy(&cache->lock);
+    free(cache);
+}
+
+/**
+ * Hashes the contents of a source, which select its bucket.
+ */
+static uint64_t hash_source(const char * source, size_t length) {
+    uint64_t hash = 14695981039346656037u;  // FNV-1a
+    for(size_t i = 0; i < length; i++) hash = (hash ^ (unsigned char)source[i]) * 1099511628211u;
+    return hash;
+}
+
+static bool same_source(const CacheEntry * entry, uint64_t hash, const Lexer * lexer, bool optimize) {
+    return entry->hash == hash && entry->optimize == optimize && entry->source_length == lexer->length
+        && memcmp(entry->source, lexer->source, lexer->length) == 0;
+}
+
+/**
+ * Returns the output file name of a source file: its extension replaced
+ * by the given one.
+ *
+ * @param filename: The source file
+ * @param extension: The extension of the output, e.g. 'IMAGE_EXTENSION'
+ * @return: The output file name, to be freed by the caller
+ */
+static char * output_filename(const char * filename, const char * extension) {
+    const char * slash = strrchr(filename, '/');
+    const char * dot = strrchr(filename, '.');
+    size_t stem = dot && (!slash || dot > slash) ? (size_t)(dot - filename) : strlen(filename);
+
+    char * output = (char *)malloc(stem + strlen(extension) + 1);
+    assert(output);
+    memcpy(output, filename, stem);
+    strcpy(output + stem, extension);
+    return output;
+}
+
+static void write_output(Unit * unit, int directory, const Image * image) {
+    char * output = output_filename(unit->filename, IMAGE_EXTENSION);
+    if(!write_image_at(image, directory, output)) diagnose(&unit->diagnostics, 0, 0, "cannot write '%s'", output);
+    free(output);
+}
+
+/**
+ * Writes a module as C source or LLVM IR next to the unit's source.
+ *
+ * @param unit: The unit, receives an error if the file cannot be written
+ * @param directory: Directory the unit's file name is relative to
+ * @param module: The optimized module
+ * @param emit: 'EMIT_C' or 'EMIT_LLVM'
+ */
+static void write_source(Unit * unit, int directory, const Module * module, EmitKind emit) {
+    char * output = output_filename(unit->filename, emit == EMIT_C ? C_EXTENSION : LLVM_EXTENSION);
+    int fd = openat(directory, output, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666);
+    FILE * out = fd >= 0 ? fdopen(fd, "w") : NULL;
+    bool ok = out && (emit == EMIT_C ? cgen_module(out, module) : llvmgen_module(out, module));
+    if(out) ok = fclose(out) == 0 && ok;
+    else if(fd >= 0) close(fd);
+    if(!ok) diagnose(&unit->diagnostics, 0, 0, "cannot write '%s'", output);
+    free(output);
+}
+
+/**
+ * Completes a unit from the cache if a unit with the same source was
+ * cached, under any file name.
+ *
+ * @param lexer: The lexer holding the unit's source
+ * @param hash: Hash of the source
+ * @return: 'true' if the unit was found
+ */
+static bool cache_lookup(UnitCache * cache, Unit * unit, const Lexer * lexer, uint64_t hash, const DriverOptions * options) {
+    Image * image = NULL;
+    bool found = false;
+
+    pthread_mutex_lock(&cache->lock);
+    for(CacheEntry * entry = cache->buckets[hash % UNIT_CACHE_BUCKETS]; entry; entry = entry->next) {
+        if(!same_source(entry, hash, lexer, options->optimize)) continue;
+
+        // Every line gets the unit's own file name back
+        Diagnostics * diagnostics = &unit->diagnostics;
+        size_t name = strlen(unit->filename);
+        size_t lines = 0;
+        for(size_t i = 0; i < entry->length; i++) lines += entry->messages[i] == '\n';
+        diagnostics->capacity = entry->length + lines * name;
+        diagnostics->text = diagnostics->capacity ? (char *)malloc(diagnostics->capacity) : NULL;
+        assert(diagnostics->text || !diagnostics->capacity);
+        diagnostics->length = 0;
+        for(size_t start = 0; start < entry->length; ) {
+            const char * end = memchr(entry->messages + start, '\n', entry->length - start);
+            size_t line = end ? (size_t)(end - entry->messages) + 1 - start : entry->length - start;
+            memcpy(diagnostics->text + diagnostics->length, unit->filename, name);
+            memcpy(diagnostics->text + diagnostics->length + name, entry->messages + start, line);
+            diagnostics->length += name + line;
+            start += line;
+        }
+        diagnostics->errors = entry->errors;
+
+        // Another request may replace the entry while the image is written
+        if(entry->image) {
+            image = (Image *)malloc(entry->image->size);
+            assert(image);
+            memcpy(image, entry->image, entry->image->size);
+        }
+        found = true;
+        break;
+    }
+    pthread_mutex_unlock(&cache->lock);
+
+    if(image) {
+        write_output(unit, options->directory, image);
+        free(image);
+    }
+    return found;
+}
+
+/**
+ * Caches the result of a compiled unit, replacing an older one. Messages
+ * are cached without the file name starting every line, so the result
+ * serves the same source under any name.
+ *
+ * @param lexer: The lexer holding the unit's source
+ * @param hash: Hash of the source
+ * @param length: Length of the unit's messages from compiling, without
+ *                those from writing the image
+ * @param errors: Errors among those messages
+ * @param image: The unit's image, owned by the cache from now on
+ */
+static void cache_store(UnitCache * cache, const Unit * unit, const Lexer * lexer, uint64_t hash, bool optimize,
+                        size_t length, int errors, Image * image) {
+    CacheEntry * entry = (CacheEntry *)malloc(sizeof(CacheEntry));
+    assert(entry);
+    entry->hash = hash;
+    entry->source_length = lexer->length;
+    entry->source = (char *)malloc(lexer->length + 1);
+    assert(entry->source);
+    memcpy(entry->source, lexer->source, lexer->length);
+    entry->optimize = optimize;
+    entry->image = image;
+    entry->messages = length ? (char *)malloc(length) : NULL;
+    assert(entry->messages || !length);
+    entry->length = 0;
+    entry->errors = errors;
+    size_t name = strlen(unit->filename);
+    const char * text = unit->diagnostics.text;
+    for(size_t start = 0; start < length; ) {
+        const char * end = memchr(text + start, '\n', length - start);
+        size_t line = end ? (size_t)(end - text) + 1 - start : length - start;
+        size_t skip = line > name && memcmp(text + start, unit->filename, name) == 0 ? name : 0;
+        memcpy(entry->messages + entry->length, text + start + skip, line - skip);
+        entry->length += line - skip;
+        start += line;
+    }
+
+    pthread_mutex_lock(&cache->lock);
+    CacheEntry ** link = &cache->buckets[hash % UNIT_CACHE_BUCKETS];
+    while(*link) {
+        CacheEntry * old = *link;
+        if(same_source(old, hash, lexer, optimize)) {
+            *link = old->next;
+            cache->size -= entry_size(old);
+            destroy_entry(old);
+            break;
+        }
+        link = &old->next;
+    }
+    if(cache->size + entry_size(entry) > UNIT_CACHE_MAX_SIZE) clear_units(cache);
+    CacheEntry ** bucket = &cache->buckets[hash % UNIT_CACHE_BUCKETS];
+    entry->next = *bucket;
+    *bucket = entry;
+    cache->size += entry_size(entry);
+    pthread_mutex_unlock(&cache->lock);
+}
+
+/**
+ * Runs one unit through the whole pipeline and writes its image.
+ *
+ * @param unit: The unit, receives its messages
+ * @param options: The options of the compile
+ * @param cache: Results of earlier compilations, may be NULL
+ */
+static void compile_unit(Unit * unit, const DriverOptions * options, UnitCache * cache) {
+    Diagnostics * diagnostics = &unit->diagnostics;
+    // Opening a FIFO by name must not block until a writer appears
+    int fd = unit->source >= 0 ? unit->source
+                               : openat(options->directory, unit->filename, O_RDONLY | O_NONBLOCK | O_CLOEXEC);
+    if(fd < 0) {
+        diagnose(diagnostics, 0, 0, "cannot open file");
+        return;
+    }
+
+    // Only regular files are compiled, since reading a pipe or device of a
+    // client could block a worker of the server forever
+    struct stat source;
+    if(fstat(fd, &source) != 0 || !S_ISREG(source.st_mode)) {
+        diagnose(diagnostics, 0, 0, "not a regular file");
+        if(unit->source < 0) close(fd);
+        return;
+    }
+    trace_begin("lex init", NULL);
+    alloc_phase(PHASE_LEX);
+    Lexer * lexer = init_fd(fd, options->sources == NULL);
+    trace_end("lex init");
+    if(unit->source < 0) close(fd);
+    if(!lexer) {
+        diagnose(diagnostics, 0, 0, "cannot read file");
+        alloc_phase(PHASE_OTHER);
+        return;
+    }
+
+    // The cache is keyed by exactly the source that is compiled, which the
+    // lexer keeps until the result is stored
+    bool cacheable = cache && !options->feedback && options->emit == EMIT_IMAGE;
+    uint64_t hash = 0;
+    if(cacheable) {
+        trace_begin("cache lookup", NULL);
+        hash = hash_source(lexer->source, lexer->length);
+        bool cached = cache_lookup(cache, unit, lexer, hash, options);
+        trace_end("cache lookup");
+        if(cached) {
+            destroy_lexer(lexer);
+            alloc_phase(PHASE_OTHER);
+            return;
+        }
+    }
+
+    trace_begin("parse", NULL);
+    alloc_phase(PHASE_PARSE);
+    Program * program = parse(lexer, diagnostics);
+    if(!cacheable) destroy_lexer(lexer);
+    trace_end("parse");
+    Module * module = NULL;
+    if(diagnostics->errors == 0) {
+        trace_begin("semantic", NULL);
+        alloc_phase(PHASE_SEMANTIC);
+        bool valid = analyze(program, diagnostics);
+        trace_end("semantic");
+        if(valid) {
+            trace_begin("codegen", NULL);
+            alloc_phase(PHASE_CODEGEN);
+            module = generate(program, diagnostics);
+            trace_end("codegen");
+        }
+    }
+    destroy_program(program);
+
+    Image * image = NULL;
+    if(module) {
+        trace_begin("optimize", NULL);
+        alloc_phase(PHASE_OPTIMIZE);
+        if(options->optimize && options->feedback) optimize_module_with_feedback(module, options->feedback);
+        else if(options->optimize && cache) optimize_module_cached(module, cache->functions);
+        else if(options->optimize) optimize_module(module);
+        trace_end("optimize");
+    }
+    if(module && options->emit != EMIT_IMAGE) {
+        trace_begin("write", NULL);
+        write_source(unit, options->directory, module, options->emit);
+        destroy_module(module);
+        trace_end("write");
+    } else if(module) {
+        trace_begin("link", NULL);
+        alloc_phase(PHASE_LINK);
+        image = link_module(module);
+        destroy_module(module);
+        trace_end("link");
+    }
+
+    // Failing to write the image is not part of the cached result
+    size_t compiled_length = diagnostics->length;
+    int compiled_errors = diagnostics->errors;
+    if(image) {
+        trace_begin("write", NULL);
+        write_output(unit, options->directory, image);
+        trace_end("write");
+    }
+    alloc_phase(PHASE_OTHER);
+
+    if(cacheable) {
+        cache_store(cache, unit, lexer, hash, options->optimize, compiled_length, compiled_errors, image);
+        destroy_lexer(lexer);
+    } else if(image) {
+        destroy_image(image);
+    }
+}
+
+/**
+ * Body of a worker thread: compiles units off the shared queue until none
+ * is left.
+ *
+ * @param arg: A pointer to the driver
+ * @return: NULL
+ */
+static void * worker_thread(void * arg) {
+    Driver * driver = (Driver *)arg;
+    char name[32];
+    pthread_mutex_lock(&driver->lock);
+    snprintf(name, sizeof(name), "worker %d", ++driver->workers);
+    pthread_mutex_unlock(&driver->lock);
+    trace_thread_name(name);
+    for(;;) {
+        pthread_mutex_lock(&driver->lock);
+        int index = driver->next < driver->options->file_count ? driver->next++ : -1;
+        pthread_mutex_unlock(&driver->lock);
+        if(index < 0) return NULL;
+
+        trace_begin("unit", driver->units[index].filename);
+        compile_unit(&driver->units[index], driver->options, driver->cache);
+        trace_end("unit");
+
+        pthread_mutex_lock(&driver->lock);
+        driver->units[index].done = true;
+        pthread_cond_broadcast(&driver->finished);
+        pthread_mutex_unlock(&driver->lock);
+    }
+}
+
+/**
+ * Compiles the source files of the options concurrently, on fewer workers
+ * than asked if threads cannot be created.
+ *
+ * @param options: The files and options
+ * @param cache: Results of earlier compilations, may be NULL
+ * @param report: Receives every unit in order once it is done
+ * @param context: Passed to 'report'
+ * @return: 'true' if every unit compiled without errors
+ */
+bool compile_files(const DriverOptions * options, UnitCache * cache, UnitReport report, void * context) {
+    int count = options->file_count;
+    Driver driver;
+    memset(&driver, 0, sizeof(driver));
+    driver.options = options;
+    driver.cache = cache;
+    driver.units = (Unit *)calloc(count, sizeof(Unit));
+    assert(driver.units);
+
+    for(int i = 0; i < count; i++) {
+        Unit * unit = &driver.units[i];
+        unit->filename = options->files[i];
+        unit->source = options->sources ? options->sources[i] : -1;
+        init_diagnostics(&unit->diagnostics, unit->filename);
+    }
+
+    int jobs = options->jobs < count ? options->jobs : count;
+    pthread_mutex_init(&driver.lock, NULL);
+    pthread_cond_init(&driver.finished, NULL);
+    pthread_t * workers = (pthread_t *)malloc(jobs * sizeof(pthread_t));
+    assert(workers);
+    int started = 0;
+    while(started < jobs && pthread_create(&workers[started], NULL, worker_thread, &driver) == 0) started++;
+
+    // Without any worker, e.g. when out of threads, the units are compiled here
+    if(started == 0) worker_thread(&driver);
+
+    // Report every unit in order as soon as it is complete
+    bool ok = true;
+    for(int i = 0; i < count; i++) {
+        Unit * unit = &driver.units[i];
+        pthread_mutex_lock(&driver.lock);
+        while(!unit->done) pthread_cond_wait(&driver.finished, &driver.lock);
+        pthread_mutex_unlock(&driver.lock);
+
+        report(unit, context);
+        if(unit->diagnostics.errors > 0) ok = false;
+        destroy_diagnostics(&unit->diagnostics);
+    }
+
+    for(int w = 0; w < started; w++) pthread_join(workers[w], NULL);
+    free(workers);
+    pthread_cond_destroy(&driver.finished);
+    pthread_mutex_destroy(&driver.lock);
+    free(driver.units);
+    return ok;
+}
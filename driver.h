@@ -0,0 +1,50 @@
+#ifndef DRIVER_H
+#define DRIVER_H
+
+#include <stdbool.h>
+#include "diagnostic.h"
+#include "feedback.h"
+
+typedef struct {
+    const char * filename;      // source file as named by the user
+    int source;                 // the opened source file, -1 to open it by name
+    Diagnostics diagnostics;    // messages of the unit
+    bool done;                  // compiled, guarded by the driver's lock
+} Unit;
+
+typedef enum {
+    EMIT_IMAGE,                 // bytecode image, 'file.slbc'
+    EMIT_C,                     // C source, 'file.c' (see cgen.c)
+    EMIT_LLVM                   // LLVM IR, 'file.ll' (see llvmgen.c)
+} EmitKind;
+
+typedef struct {
+    int jobs;                   // worker threads
+    bool optimize;              // run the bytecode optimizer
+    char ** files;              // source files
+    int file_count;
+    int directory;              // directory the file names are relative to, 'AT_FDCWD' by default
+    int * sources;              // opened source of every file or -1, NULL to open all by name
+    const char * trace;         // file to write a trace of the compile to, NULL if none
+    bool mem_stats;             // report the memory allocated by every phase
+    const char * profile_use;   // profile to optimize with, NULL if none
+    const Feedback * feedback;  // the profile once read by the caller, NULL if none
+    EmitKind emit;              // output written for every unit
+} DriverOptions;
+
+typedef struct UnitCache UnitCache;
+
+/*
+ * Called on the thread running 'compile_files()' for every unit in order,
+ * once it and all units before it are done.
+ */
+typedef void (*UnitReport)(const Unit * unit, void * context);
+
+bool init_driver_options(DriverOptions * options, int argc, char ** argv);
+void destroy_driver_options(DriverOptions * options);
+bool compile_files(const DriverOptions * options, UnitCache * cache, UnitReport report, void * context);
+
+UnitCache * init_unit_cache(void);
+void destroy_unit_cache(UnitCache * cache);
+
+#endif // DRIVER_H
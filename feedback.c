@@ -0,0 +1,252 @@
+/**
+ * This file contains the execution profiles used for profile guided
+ * optimization.
+ *
+ * A machine given a 'Feedback' counts, per instruction, how often every
+ * jump and call was executed and how often every jump was taken, and how
+ * often each function was called. The counts are stored in a text file
+ * keyed by function name and a checksum of the function's code, so a
+ * profile written by one run can be read by the next compilation of the
+ * same program and is ignored for functions whose code has changed since.
+ *
+ * The optimizer uses the counts to inline hot call sites and unroll loops
+ * that run many iterations (see 'optimize_module_with_feedback()'); the
+ * native backend uses them to lay out the hot path of branches as
+ * straight line code (see layout.c).
+ *
+ * A profile is collected with 'sloth --run --profile-generate=FILE' and
+ * used with 'sloth --profile-use=FILE' (see run.c and driver.c).
+ *
+ * Usage:
+ *  - Collect counts for an image with 'init_feedback()' and 'vm->feedback'
+ *  - Store them with 'write_feedback()', accumulating several runs with
+ *    'feedback_merge()'
+ *  - Load them with 'read_feedback()' and look up functions with
+ *    'feedback_find()'
+ *  - Free resources with 'destroy_feedback()'
+ *
+ * @file    feedback.c
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include "feedback.h"
+
+#define MAX_NAME 256
+
+/**
+ * Computes the FNV-1a checksum of a function's code, which identifies the
+ * code a profile was collected for.
+ *
+ * @param code: The instructions
+ * @param length: Number of instructions
+ * @return: The checksum
+ */
+uint32_t code_checksum(const uint32_t * code, int length) {
+    uint32_t hash = 2166136261u;
+    for(int pc = 0; pc < length; pc++) {
+        for(int byte = 0; byte < 4; byte++) {
+            hash ^= (code[pc] >> (byte * 8)) & 0xff;
+            hash *= 16777619u;
+        }
+    }
+    return hash;
+}
+
+/**
+ * Initializes empty counts for every function of an image. All counts
+ * share one allocation laid out like the image's code section, so the
+ * machine indexes them with its code offset directly: 'counters[offset]'
+ * holds the executions and 'counters[code_length + offset]' the taken
+ * jumps of the instruction at that offset.
+ *
+ * @param image: The image to profile
+ * @return: A pointer to the new 'Feedback' structure
+ */
+Feedback * init_feedback(const Image * image) {
+    Feedback * feedback = (Feedback *)malloc(sizeof(Feedback));
+    assert(feedback);
+
+    feedback->function_count = (int)image->function_count;
+    feedback->functions = (FeedbackFunction *)calloc(feedback->function_count ? feedback->function_count : 1,
+                                                     sizeof(FeedbackFunction));
+    feedback->counters = (uint64_t *)calloc(2 * (size_t)image->code_length + 1, sizeof(uint64_t));
+    assert(feedback->functions && feedback->counters);
+
+    const ImageFunction * functions = image_functions(image);
+    const uint32_t * code = image_code(image);
+    for(int i = 0; i < feedback->function_count; i++) {
+        FeedbackFunction * f = &feedback->functions[i];
+        f->name = strdup(image_string(image, functions[i].name));
+        f->code_length = (int)functions[i].code_length;
+        f->checksum = code_checksum(code + functions[i].code, f->code_length);
+        f->counts = feedback->counters + functions[i].code;
+        f->taken = feedback->counters + image->code_length + functions[i].code;
+    }
+
+    return feedback;
+}
+
+/**
+ * Appends a function with zeroed counts to a profile being read.
+ *
+ * @param feedback: A pointer to the profile
+ * @param name: Name of the function
+ * @param checksum: Checksum of its code
+ * @param code_length: Number of instructions
+ * @return: A pointer to the new function
+ */
+static FeedbackFunction * add_function(Feedback * feedback, const char * name, uint32_t checksum, int code_length) {
+    int count = feedback->function_count++;
+    feedback->functions = (FeedbackFunction *)realloc(feedback->functions, feedback->function_count * sizeof(FeedbackFunction));
+    assert(feedback->functions);
+
+    FeedbackFunction * f = &feedback->functions[count];
+    f->name = strdup(name);
+    f->checksum = checksum;
+    f->code_length = code_length;
+    f->calls = 0;
+    f->counts = (uint64_t *)calloc(2 * (size_t)code_length + 1, sizeof(uint64_t));
+    assert(f->counts);
+    f->taken = f->counts + code_length;
+    return f;
+}
+
+/**
+ * Reads a profile written by 'write_feedback()'.
+ *
+ * @param filename: Path of the file
+ * @return: A pointer to the new 'Feedback' structure, or NULL if the file
+ * cannot be read or is malformed
+ */
+Feedback * read_feedback(const char * filename) {
+    FILE * file = fopen(filename, "r");
+    if(!file) return NULL;
+
+    Feedback * feedback = (Feedback *)malloc(sizeof(Feedback));
+    assert(feedback);
+    feedback->functions = NULL;
+    feedback->function_count = 0;
+    feedback->counters = NULL;
+
+    char word[MAX_NAME];
+    int version = 0;
+    bool ok = fscanf(file, "%255s %d", word, &version) == 2
+        && strcmp(word, FEEDBACK_MAGIC) == 0 && version == FEEDBACK_VERSION;
+
+    FeedbackFunction * current = NULL;
+    while(ok && fscanf(file, "%255s", word) == 1) {
+        if(strcmp(word, "function") == 0) {
+            char name[MAX_NAME];
+            unsigned int checksum;
+            int code_length;
+            unsigned long long calls;
+            ok = fscanf(file, "%255s %x %d %llu", name, &checksum, &code_length, &calls) == 4 && code_length >= 0;
+            if(!ok) break;
+            current = add_function(feedback, name, checksum, code_length);
+            current->calls = calls;
+        } else {
+            char * end;
+            long pc = strtol(word, &end, 10);
+            unsigned long long count, taken;
+            ok = current && *end == '\0' && pc >= 0 && pc < current->code_length
+                && fscanf(file, "%llu %llu", &count, &taken) == 2;
+            if(!ok) break;
+            current->counts[pc] = count;
+            current->taken[pc] = taken;
+        }
+    }
+
+    fclose(file);
+    if(!ok) {
+        destroy_feedback(feedback);
+        return NULL;
+    }
+    return feedback;
+}
+
+/**
+ * Writes a profile as text. Only instructions that were executed are
+ * listed.
+ *
+ * @param feedback: A pointer to the profile
+ * @param filename: Path of the file
+ * @return: 'true' on success
+ */
+bool write_feedback(const Feedback * feedback, const char * filename) {
+    FILE * file = fopen(filename, "w");
+    if(!file) return false;
+
+    fprintf(file, "%s %d\n", FEEDBACK_MAGIC, FEEDBACK_VERSION);
+    for(int i = 0; i < feedback->function_count; i++) {
+        const FeedbackFunction * f = &feedback->functions[i];
+        fprintf(file, "function %s %08x %d %llu\n", f->name, f->checksum, f->code_length, (unsigned long long)f->calls);
+        for(int pc = 0; pc < f->code_length; pc++) {
+            if(f->counts[pc] == 0 && f->taken[pc] == 0) continue;
+            fprintf(file, "%d %llu %llu\n", pc, (unsigned long long)f->counts[pc], (unsigned long long)f->taken[pc]);
+        }
+    }
+
+    bool ok = !ferror(file);
+    return fclose(file) == 0 && ok;
+}
+
+/**
+ * Destroys a profile and frees all resources associated with it.
+ *
+ * @param feedback: A pointer to the profile
+ */
+void destroy_feedback(Feedback * feedback) {
+    for(int i = 0; i < feedback->function_count; i++) {
+        free(feedback->functions[i].name);
+        if(!feedback->counters) free(feedback->functions[i].counts);
+    }
+    free(feedback->counters);
+    free(feedback->functions);
+    free(feedback);
+}
+
+/**
+ * Adds the counts of another profile, e.g. of a different run or of
+ * another machine that ran the same image. Functions are matched by name
+ * and checksum; functions missing from 'feedback' are ignored.
+ *
+ * @param feedback: The profile receiving the counts
+ * @param other: The profile to add
+ */
+void feedback_merge(Feedback * feedback, const Feedback * other) {
+    for(int i = 0; i < other->function_count; i++) {
+        const FeedbackFunction * from = &other->functions[i];
+        for(int j = 0; j < feedback->function_count; j++) {
+            FeedbackFunction * to = &feedback->functions[j];
+            if(to->checksum != from->checksum || to->code_length != from->code_length) continue;
+            if(strcmp(to->name, from->name) != 0) continue;
+
+            to->calls += from->calls;
+            for(int pc = 0; pc < to->code_length; pc++) {
+                to->counts[pc] += from->counts[pc];
+                to->taken[pc] += from->taken[pc];
+            }
+            break;
+        }
+    }
+}
+
+/**
+ * Finds the counts of a function, provided they were collected for
+ * exactly the code the function has now.
+ *
+ * @param feedback: A pointer to the profile
+ * @param function: The function
+ * @return: The counts, or NULL if the profile holds none for the code
+ */
+const FeedbackFunction * feedback_find(const Feedback * feedback, const Function * function) {
+    for(int i = 0; i < feedback->function_count; i++) {
+        const FeedbackFunction * f = &feedback->functions[i];
+        if(f->code_length == function->code_length && strcmp(f->name, function->name) == 0) {
+            return f->checksum == code_checksum(function->code, function->code_length) ? f : NULL;
+        }
+    }
+    return NULL;
+}
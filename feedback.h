@@ -0,0 +1,40 @@
+#ifndef FEEDBACK_H
+#define FEEDBACK_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "bytecode.h"
+#include "image.h"
+
+#define FEEDBACK_MAGIC   "sloth-feedback"
+#define FEEDBACK_VERSION 1
+
+typedef struct {
+    char * name;            // function name
+    uint32_t checksum;      // of the code the counts belong to
+    int code_length;        // instructions counted
+    uint64_t calls;         // interpreted calls of the function
+    uint64_t * counts;      // executions of every jump and call instruction
+    uint64_t * taken;       // taken jumps per instruction
+} FeedbackFunction;
+
+/*
+ * Execution counts of a program, collected by the virtual machine and fed
+ * back into the optimizer. Counts are indexed by instruction; for a
+ * compare-and-branch the counts are kept on the compare, not on its 'JMP'.
+ */
+typedef struct {
+    FeedbackFunction * functions;
+    int function_count;
+    uint64_t * counters;    // storage of all counts when collected for an image
+} Feedback;
+
+Feedback * init_feedback(const Image * image);
+Feedback * read_feedback(const char * filename);
+bool write_feedback(const Feedback * feedback, const char * filename);
+void destroy_feedback(Feedback * feedback);
+void feedback_merge(Feedback * feedback, const Feedback * other);
+const FeedbackFunction * feedback_find(const Feedback * feedback, const Function * function);
+uint32_t code_checksum(const uint32_t * code, int length);
+
+#endif // FEEDBACK_H
@@ -0,0 +1,412 @@
+/**
+ * This file contains the linker which turns a compiled module into a
+ * position independent image, and the loader which maps image files into
+ * memory.
+ *
+ * The image is the format executed by the virtual machine: the loader only
+ * maps the file and checks it, there is nothing to parse or relocate. The
+ * check covers the header, the sections, every function and every operand
+ * of every instruction, as the machine trusts the code it runs: a file
+ * whose code would read or jump outside its function, its frame or the
+ * image is rejected instead of crashing the process that mapped it.
+ *
+ * Usage:
+ *  - Link a module with 'link_module()' or map a file with 'map_image()'
+ *  - Store a linked image with 'write_image()'
+ *  - Free resources with 'destroy_image()'
+ *
+ * @file    image.c
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <errno.h>
+#include <limits.h>
+#include <stdatomic.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "image.h"
+
+#define ALIGN(n) (((n) + 7u) & ~7u)
+
+/**
+ * Allocates zeroed, page aligned memory for an image. Linked images are
+ * mapped like loaded ones so that 'destroy_image()' treats both the same.
+ *
+ * @param size: Size of the image in bytes
+ * @return: A pointer to the memory
+ */
+static void * allocate_image(size_t size) {
+    void * memory = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    assert(memory != MAP_FAILED);
+    return memory;
+}
+
+/**
+ * Links a module into an image. The module is not modified and may be
+ * destroyed afterwards.
+ *
+ * @param module: The module to link
+ * @return: A pointer to the new image
+ */
+Image * link_module(const Module * module) {
+    uint32_t code_length = 0;
+    uint32_t strings_size = 0;
+
+    for(int i = 0; i < module->function_count; i++) {
+        const Function * function = module->functions[i];
+        code_length += function->code_length;
+        strings_size += strlen(function->name) + 1 + function->register_count;
+    }
+    for(int k = 0; k < module->constant_count; k++) {
+        if(module->constants[k].type == CONSTANT_STRING) {
+            strings_size += strlen(module->constants[k].value.s) + 1;
+        }
+    }
+
+    uint32_t constants = ALIGN(sizeof(Image));
+    uint32_t functions = ALIGN(constants + module->constant_count * sizeof(Value));
+    uint32_t code = ALIGN(functions + module->function_count * sizeof(ImageFunction));
+    uint32_t constant_types = code + code_length * sizeof(uint32_t);
+    uint32_t strings = constant_types + module->constant_count;
+    uint32_t size = strings + strings_size;
+
+    Image * image = (Image *)allocate_image(size);
+    memcpy(image->magic, IMAGE_MAGIC, 4);
+    image->version = IMAGE_VERSION;
+    image->size = size;
+    image->constant_count = module->constant_count;
+    image->function_count = module->function_count;
+    image->code_length = code_length;
+    image->constants = constants;
+    image->functions = functions;
+    image->code = code;
+    image->constant_types = constant_types;
+    image->strings = strings;
+    image->strings_size = strings_size;
+
+    char * base = (char *)image;
+    char * text = base + strings;
+    uint32_t text_length = 0;
+
+    Value * values = (Value *)(base + constants);
+    uint8_t * types = (uint8_t *)(base + constant_types);
+    for(int k = 0; k < module->constant_count; k++) {
+        const Constant * constant = &module->constants[k];
+        types[k] = (uint8_t)constant->type;
+        if(constant->type == CONSTANT_STRING) {
+            size_t length = strlen(constant->value.s) + 1;
+            memcpy(text + text_length, constant->value.s, length);
+            values[k].i = text_length;
+            text_length += length;
+        } else {
+            values[k] = constant->value;
+        }
+    }
+
+    ImageFunction * table = (ImageFunction *)(base + functions);
+    uint32_t * instructions = (uint32_t *)(base + code);
+    uint32_t pc = 0;
+    for(int i = 0; i < module->function_count; i++) {
+        const Function * function = module->functions[i];
+        ImageFunction * entry = &table[i];
+
+        size_t length = strlen(function->name) + 1;
+        memcpy(text + text_length, function->name, length);
+        entry->name = text_length;
+        text_length += length;
+
+        memcpy(text + text_length, function->types, function->register_count);
+        entry->types = text_length;
+        text_length += function->register_count;
+
+        memcpy(instructions + pc, function->code, function->code_length * sizeof(uint32_t));
+        entry->code = pc;
+        entry->code_length = function->code_length;
+        pc += function->code_length;
+
+        entry->param_count = (uint16_t)function->param_count;
+        entry->register_count = (uint16_t)function->register_count;
+        entry->return_type = (uint8_t)function->return_type;
+        entry->flags = function->result_param ? FUNCTION_RESULT_PARAM : 0;
+    }
+
+    return image;
+}
+
+/**
+ * Checks that a section lies inside the image.
+ *
+ * @param image: The image
+ * @param offset: Offset of the section
+ * @param size: Size of the section in bytes
+ * @return: 'true' if the section is in range
+ */
+static bool in_range(const Image * image, uint64_t offset, uint64_t size) {
+    return offset <= image->size && size <= image->size - offset;
+}
+
+/**
+ * Checks that a string of the string section ends inside it.
+ *
+ * @param image: The image
+ * @param offset: Offset of the string in the string section
+ * @return: 'true' if the string is in range
+ */
+static bool valid_string(const Image * image, uint64_t offset) {
+    return offset < image->strings_size && memchr(image_string(image, offset), '\0', image->strings_size - offset);
+}
+
+/**
+ * Checks that a jump from an instruction lands inside its function.
+ *
+ * @param function: The function
+ * @param pc: Index of the jump in the function
+ * @param offset: Offset of the jump, relative to the next instruction
+ * @return: 'true' if the target is in range
+ */
+static bool valid_jump(const ImageFunction * function, uint32_t pc, int offset) {
+    int64_t target = (int64_t)pc + 1 + offset;
+    return target >= 0 && target < function->code_length;
+}
+
+/**
+ * Checks the operands of one instruction: registers inside the frame,
+ * constants and functions inside their tables and jumps inside the
+ * function. A compare-and-branch must be followed by its 'JMP'.
+ *
+ * @param image: The image
+ * @param function: The function holding the instruction
+ * @param pc: Index of the instruction in the function
+ * @return: 'true' if the instruction is valid
+ */
+static bool valid_instruction(const Image * image, const ImageFunction * function, uint32_t pc) {
+    const uint32_t * code = image_code(image) + function->code;
+    uint32_t i = code[pc];
+    int registers = function->register_count;
+    if(OP(i) >= OPCODE_COUNT) return false;
+    if(OP(i) == OP_JMP) return valid_jump(function, pc, ARG_SJ(i));
+    if(ARG_A(i) >= registers) return false;
+
+    switch(OP(i)) {
+        case OP_LOADK:
+            return (uint32_t)ARG_BX(i) < image->constant_count;
+        case OP_LOADI: case OP_RET:
+            return true;
+        case OP_MOVE: case OP_ADDI: case OP_NEG_I: case OP_NEG_F: case OP_NOT: case OP_I2F: case OP_F2I:
+            return ARG_B(i) < registers;
+        case OP_JMPT: case OP_JMPF:
+            return valid_jump(function, pc, ARG_SBX(i));
+        case OP_JEQ_I: case OP_JLT_I: case OP_JLE_I: case OP_JEQ_F: case OP_JLT_F: case OP_JLE_F:
+            return ARG_B(i) < registers && ARG_C(i) <= 1 && pc + 1 < function->code_length
+                && OP(code[pc + 1]) == OP_JMP;
+        case OP_CALL: {
+            if((uint32_t)ARG_BX(i) >= image->function_count) return false;
+            const ImageFunction * callee = &image_functions(image)[ARG_BX(i)];
+            return ARG_A(i) + callee->param_count <= registers;
+        }
+        default:
+            return ARG_B(i) < registers && ARG_C(i) < registers;
+    }
+}
+
+/**
+ * Checks a function of the function table and all of its code. The last
+ * instruction must return or jump, so execution never runs off its end.
+ *
+ * @param image: The image
+ * @param function: The function
+ * @return: 'true' if the function is valid
+ */
+static bool valid_function(const Image * image, const ImageFunction * function) {
+    if(function->code_length == 0 || function->code > image->code_length
+       || function->code_length > image->code_length - function->code) return false;
+    if(!valid_string(image, function->name) || function->types > image->strings_size
+       || function->register_count > image->strings_size - function->types) return false;
+    if(function->param_count > function->register_count || function->register_count > MAX_REGISTERS) return false;
+    if(function->return_type > TYPE_FLOAT || (function->flags & ~FUNCTION_RESULT_PARAM)) return false;
+    if((function->flags & FUNCTION_RESULT_PARAM) && function->param_count == 0) return false;
+
+    const uint8_t * types = (const uint8_t *)image_string(image, function->types);
+    for(int r = 0; r < function->register_count; r++) {
+        if(types[r] > TYPE_FLOAT) return false;
+    }
+    for(uint32_t pc = 0; pc < function->code_length; pc++) {
+        if(!valid_instruction(image, function, pc)) return false;
+    }
+    Opcode last = OP(image_code(image)[function->code + function->code_length - 1]);
+    return last == OP_RET || last == OP_JMP;
+}
+
+/**
+ * Checks every constant and function of an image whose header and
+ * sections are in range.
+ *
+ * @param image: The image
+ * @return: 'true' if the contents are valid
+ */
+static bool valid_contents(const Image * image) {
+    const Value * constants = image_constants(image);
+    const uint8_t * types = image_constant_types(image);
+    for(uint32_t k = 0; k < image->constant_count; k++) {
+        if(types[k] > CONSTANT_STRING) return false;
+        if(types[k] == CONSTANT_STRING && !valid_string(image, (uint64_t)constants[k].i)) return false;
+    }
+    const ImageFunction * functions = image_functions(image);
+    for(uint32_t f = 0; f < image->function_count; f++) {
+        if(!valid_function(image, &functions[f])) return false;
+    }
+    return true;
+}
+
+/**
+ * Maps an image file into memory. The header, the function table and the
+ * code are checked before the image is returned, so nothing the machine
+ * executes can reach outside the image.
+ *
+ * @param filename: The image file
+ * @return: A pointer to the mapped image, or NULL if the file cannot be
+ * read or is not a valid image
+ */
+Image * map_image(const char * filename) {
+    int fd = open(filename, O_RDONLY);
+    if(fd < 0) return NULL;
+
+    struct stat st;
+    if(fstat(fd, &st) != 0 || st.st_size < (off_t)sizeof(Image) || st.st_size > UINT32_MAX) {
+        close(fd);
+        return NULL;
+    }
+
+    Image * image = (Image *)mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if(image == MAP_FAILED) return NULL;
+
+    bool valid = memcmp(image->magic, IMAGE_MAGIC, 4) == 0
+        && image->version == IMAGE_VERSION
+        && image->size == (uint64_t)st.st_size
+        && image->constants % 8 == 0 && image->functions % 8 == 0 && image->code % 4 == 0
+        && in_range(image, image->constants, (uint64_t)image->constant_count * sizeof(Value))
+        && in_range(image, image->functions, (uint64_t)image->function_count * sizeof(ImageFunction))
+        && in_range(image, image->code, (uint64_t)image->code_length * sizeof(uint32_t))
+        && in_range(image, image->constant_types, image->constant_count)
+        && in_range(image, image->strings, image->strings_size)
+        && valid_contents(image);
+    if(!valid) {
+        munmap(image, st.st_size);
+        return NULL;
+    }
+
+    return image;
+}
+
+/**
+ * Writes an image to a file.
+ *
+ * @param image: The image
+ * @param filename: The file to create
+ * @return: 'true' on success, 'false' otherwise
+ */
+bool write_image(const Image * image, const char * filename) {
+    return write_image_at(image, AT_FDCWD, filename);
+}
+
+/**
+ * Writes an image to a file relative to a directory. The image goes to
+ * the file straight from memory, without a stream buffer in between.
+ *
+ * The image is written to a temporary file next to the target, synced and
+ * renamed over the target, so that processes which mapped the old image
+ * keep reading it unchanged and an interrupted write leaves the old image
+ * or none, never a torn one.
+ *
+ * @param image: The image
+ * @param directory: Descriptor of the directory, or 'AT_FDCWD'
+ * @param filename: The file to create
+ * @return: 'true' on success, 'false' otherwise
+ */
+bool write_image_at(const Image * image, int directory, const char * filename) {
+    static atomic_uint writes;
+    char temporary[PATH_MAX];
+    int length = snprintf(temporary, sizeof(temporary), "%s.%d.%u.tmp", filename, (int)getpid(),
+                          atomic_fetch_add(&writes, 1));
+    if(length < 0 || (size_t)length >= sizeof(temporary)) return false;
+    int fd = openat(directory, temporary, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0666);
+    if(fd < 0) return false;
+
+    const char * data = (const char *)image;
+    size_t rest = image->size;
+    while(rest > 0) {
+        ssize_t written = write(fd, data, rest);
+        if(written < 0 && errno == EINTR) continue;
+        if(written <= 0) break;
+        data += written;
+        rest -= (size_t)written;
+    }
+    bool ok = rest == 0 && fsync(fd) == 0;
+    ok = close(fd) == 0 && ok;
+    ok = ok && renameat(directory, temporary, directory, filename) == 0;
+    if(!ok) unlinkat(directory, temporary, 0);
+    return ok;
+}
+
+/**
+ * Destroys a linked or mapped image.
+ *
+ * @param image: A pointer to the image
+ */
+void destroy_image(Image * image) {
+    munmap(image, image->size);
+}
+
+/**
+ * Looks up a function by name.
+ *
+ * @param image: The image
+ * @param name: The function name
+ * @return: The index of the function, or -1 if there is none
+ */
+int image_find_function(const Image * image, const char * name) {
+    const ImageFunction * functions = image_functions(image);
+    for(uint32_t i = 0; i < image->function_count; i++) {
+        if(strcmp(image_string(image, functions[i].name), name) == 0) return (int)i;
+    }
+    return -1;
+}
+
+/**
+ * Prints a human readable listing of every function in an image.
+ *
+ * @param out: The output stream
+ * @param image: The image
+ */
+void disassemble_image(FILE * out, const Image * image) {
+    const Value * constants = image_constants(image);
+    const uint8_t * types = image_constant_types(image);
+    const ImageFunction * functions = image_functions(image);
+    const uint32_t * code = image_code(image);
+
+    for(uint32_t i = 0; i < image->function_count; i++) {
+        const ImageFunction * function = &functions[i];
+        fprintf(out, "function %s (%d params, %d registers)\n",
+                image_string(image, function->name), function->param_count, function->register_count);
+
+        for(uint32_t pc = 0; pc < function->code_length; pc++) {
+            uint32_t instruction = code[function->code + pc];
+
+            disassemble_instruction(out, instruction, pc);
+            if(OP(instruction) == OP_CALL) {
+                fprintf(out, "\t; %s", image_string(image, functions[ARG_BX(instruction)].name));
+            } else if(OP(instruction) == OP_LOADK) {
+                int k = ARG_BX(instruction);
+                if(types[k] == CONSTANT_INT) fprintf(out, "\t; %lld", (long long)constants[k].i);
+                else if(types[k] == CONSTANT_FLOAT) fprintf(out, "\t; %g", constants[k].f);
+                else fprintf(out, "\t; \"%s\"", image_string(image, constants[k].i));
+            }
+            fputc('\n', out);
+        }
+    }
+}
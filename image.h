@@ -0,0 +1,81 @@
+#ifndef IMAGE_H
+#define IMAGE_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "bytecode.h"
+
+#define IMAGE_MAGIC   "SLBC"
+#define IMAGE_VERSION 2
+
+#define FUNCTION_RESULT_PARAM 0x01  // R[0] is a hidden parameter for the result
+
+/*
+ * A linked module, laid out exactly as it is stored on disk. Every
+ * reference inside the image is an offset from its first byte, so a file
+ * can be mapped into memory and executed as is: loading costs one 'mmap'
+ * and one pass checking the tables and the code, with nothing to parse or
+ * relocate.
+ *
+ *   header | constant values | function table | code | constant types | strings
+ *
+ * Sections holding 8 byte values are 8 byte aligned. String constants hold
+ * the offset of their text in the string section instead of a pointer.
+ */
+typedef struct {
+    char magic[4];              // "SLBC"
+    uint16_t version;           // 'IMAGE_VERSION'
+    uint16_t reserved;
+    uint32_t size;              // total size of the image in bytes
+    uint32_t constant_count;    // entries in the constant pool
+    uint32_t function_count;    // entries in the function table
+    uint32_t code_length;       // instructions in the code section
+    uint32_t constants;         // offset of the 'Value' array
+    uint32_t functions;         // offset of the 'ImageFunction' array
+    uint32_t code;              // offset of the instructions
+    uint32_t constant_types;    // offset of one 'ConstantType' byte per constant
+    uint32_t strings;           // offset of the string section
+    uint32_t strings_size;      // size of the string section in bytes
+} Image;
+
+typedef struct {
+    uint32_t name;              // offset of the name in the string section
+    uint32_t types;             // offset of the register types in the string section
+    uint32_t code;              // index of the first instruction in the code section
+    uint32_t code_length;       // number of instructions
+    uint16_t param_count;       // parameters, passed in R[0] .. R[param_count - 1]
+    uint16_t register_count;    // registers in the frame
+    uint8_t return_type;        // 'ValueType' of the returned value
+    uint8_t flags;              // 'FUNCTION_*' bits
+    uint8_t reserved[2];
+} ImageFunction;
+
+Image * link_module(const Module * module);
+Image * map_image(const char * filename);
+bool write_image(const Image * image, const char * filename);
+bool write_image_at(const Image * image, int directory, const char * filename);
+void destroy_image(Image * image);
+int image_find_function(const Image * image, const char * name);
+void disassemble_image(FILE * out, const Image * image);
+
+static inline const Value * image_constants(const Image * image) {
+    return (const Value *)((const char *)image + image->constants);
+}
+
+static inline const uint8_t * image_constant_types(const Image * image) {
+    return (const uint8_t *)image + image->constant_types;
+}
+
+static inline const ImageFunction * image_functions(const Image * image) {
+    return (const ImageFunction *)((const char *)image + image->functions);
+}
+
+static inline const uint32_t * image_code(const Image * image) {
+    return (const uint32_t *)((const char *)image + image->code);
+}
+
+static inline const char * image_string(const Image * image, uint32_t offset) {
+    return (const char *)image + image->strings + offset;
+}
+
+#endif // IMAGE_H
@@ -0,0 +1,347 @@
+/**
+ * This file contains the block placement pass of the native backend. It
+ * orders the basic blocks of a machine function so that the likely
+ * successor of every block falls through and code that rarely runs moves
+ * to the end of the function, which keeps the hot path dense in the
+ * instruction cache and turns most taken jumps into straight-line code.
+ *
+ * Every edge between two blocks is weighted by the probability of taking
+ * it and by the loop depth of its source. The probability of a 'JCC' is
+ * its 'likely' hint, which instruction selection sets from execution
+ * counts or to 0 for error paths. Without a hint it is guessed: loop back
+ * edges are taken, while loop exits and paths that return are not.
+ *
+ * Blocks are then chained along the heaviest edges first, as described by
+ * Pettis and Hansen, and the chains are placed one after another, each
+ * following the placed chain it is most likely entered from. The entry
+ * block stays first; chains that are never entered, such as the error
+ * returns, go last. A loop whose test jumps out is rotated this way, so
+ * that its body falls into the test and only the conditional back edge
+ * remains. Finally branches are inverted and jumps added or dropped to
+ * match the new order.
+ *
+ * Usage:
+ *  - Call 'layout_blocks()' on a function before the peephole optimizer
+ *
+ * @file    layout.c
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <assert.h>
+#include "layout.h"
+
+#define LIKELY   (LIKELY_SCALE * 7 / 8)     // guessed probability of a likely branch
+#define UNLIKELY (LIKELY_SCALE / 8)         // guessed probability of an unlikely branch
+#define MAX_LOOP_WEIGHT 6                   // loop depth up to which edges get heavier
+
+typedef struct {
+    int first;          // index of the first instruction
+    int end;            // index after the last instruction
+    int label;          // label at the start of the block, -1 if none
+    bool new_label;     // 'label' has been allocated by the pass
+    int taken;          // block a jump at the end goes to, -1 if none
+    int next;           // block reached by falling through, -1 if none
+    int likely;         // probability of 'taken' if both successors exist
+    int depth;          // number of loops around the block
+    int chain;          // chain containing the block
+    int successor;      // following block in the chain, -1 if last
+} Block;
+
+typedef struct {
+    int from;
+    int to;
+    uint64_t weight;
+} Edge;
+
+typedef struct {
+    int head;           // first block
+    int tail;           // last block
+    bool placed;        // already in the final order
+} Chain;
+
+static bool is_jump(const MachineInstr * instr) {
+    return instr->op == M_JMP || instr->op == M_JCC || instr->op == M_RET;
+}
+
+static bool returns(const Block * block, const MachineFunction * function) {
+    return function->code[block->end - 1].op == M_RET;
+}
+
+/**
+ * Splits a function into basic blocks. A block begins at a run of labels
+ * and after every jump or return.
+ *
+ * @param function: The function
+ * @param count: Receives the number of blocks
+ * @return: The blocks, or NULL if control leaves the code or a jump has
+ *          no label
+ */
+static Block * find_blocks(const MachineFunction * function, int * count) {
+    Block * blocks = (Block *)malloc((function->length + 1) * sizeof(Block));
+    int * owner = (int *)malloc((function->label_count + 1) * sizeof(int));
+    assert(blocks && owner);
+    for(int label = 0; label <= function->label_count; label++) owner[label] = -1;
+
+    int n = 0;
+    for(int i = 0; i < function->length; i++) {
+        const MachineInstr * instr = &function->code[i];
+        bool leader = i == 0 || is_jump(&function->code[i - 1])
+                      || (instr->op == M_LABEL && function->code[i - 1].op != M_LABEL);
+        if(leader) {
+            if(n > 0) blocks[n - 1].end = i;
+            blocks[n].first = i;
+            blocks[n].label = instr->op == M_LABEL ? (int)instr->dst.imm : -1;
+            blocks[n].new_label = false;
+            blocks[n].depth = 0;
+            n++;
+        }
+        if(instr->op == M_LABEL) owner[instr->dst.imm] = n - 1;
+    }
+    if(n > 0) blocks[n - 1].end = function->length;
+
+    bool valid = n > 0;
+    for(int b = 0; b < n && valid; b++) {
+        const MachineInstr * last = &function->code[blocks[b].end - 1];
+        blocks[b].taken = -1;
+        blocks[b].next = b + 1 < n ? b + 1 : -1;
+        blocks[b].likely = LIKELY_SCALE;
+        if(last->op == M_JMP || last->op == M_JCC) {
+            if(last->dst.kind == OPERAND_LABEL) blocks[b].taken = owner[last->dst.imm];
+            if(blocks[b].taken < 0) valid = false;
+            if(last->op == M_JMP) blocks[b].next = -1;
+            else blocks[b].likely = last->likely;
+        } else if(last->op == M_RET) {
+            blocks[b].next = -1;
+        }
+        if(blocks[b].next < 0 && last->op != M_JMP && last->op != M_RET) valid = false;
+    }
+    free(owner);
+
+    if(!valid) {
+        free(blocks);
+        return NULL;
+    }
+    *count = n;
+    return blocks;
+}
+
+/**
+ * Estimates loop depths from the original order: the blocks between the
+ * target of a backwards jump and the jump itself form a loop.
+ */
+static void find_loops(Block * blocks, int count) {
+    for(int b = 0; b < count; b++) {
+        if(blocks[b].taken >= 0 && blocks[b].taken <= b) {
+            for(int inner = blocks[b].taken; inner <= b; inner++) blocks[inner].depth++;
+        }
+    }
+}
+
+/**
+ * Guesses the probability of a conditional jump without a hint.
+ *
+ * @param blocks: The blocks
+ * @param b: The block ending with the jump
+ * @param function: The function
+ * @return: The probability in 1/'LIKELY_SCALE'
+ */
+static int guess_likely(const Block * blocks, int b, const MachineFunction * function) {
+    const Block * taken = &blocks[blocks[b].taken];
+    const Block * next = &blocks[blocks[b].next];
+
+    if(blocks[b].taken <= b) return LIKELY;
+    if(taken->depth < blocks[b].depth) return UNLIKELY;
+    if(next->depth < blocks[b].depth) return LIKELY;
+    if(returns(taken, function) && !returns(next, function)) return UNLIKELY;
+    if(returns(next, function) && !returns(taken, function)) return LIKELY;
+    return LIKELY_SCALE / 2;
+}
+
+/**
+ * Orders edges by weight, keeping the original fall through first on ties.
+ */
+static int compare_edges(const void * x, const void * y) {
+    const Edge * a = (const Edge *)x, * b = (const Edge *)y;
+    if(a->weight != b->weight) return a->weight > b->weight ? -1 : 1;
+    bool a_falls = a->to == a->from + 1, b_falls = b->to == b->from + 1;
+    if(a_falls != b_falls) return a_falls ? -1 : 1;
+    return a->from - b->from;
+}
+
+/**
+ * Collects the weighted edges of all blocks.
+ *
+ * @param blocks: The blocks
+ * @param count: Number of blocks
+ * @param function: The function
+ * @param edges: Receives at most two edges per block
+ * @return: The number of edges
+ */
+static int find_edges(Block * blocks, int count, const MachineFunction * function, Edge * edges) {
+    int n = 0;
+    for(int b = 0; b < count; b++) {
+        Block * block = &blocks[b];
+        int depth = block->depth < MAX_LOOP_WEIGHT ? block->depth : MAX_LOOP_WEIGHT;
+        uint64_t frequency = 1ull << (3 * depth);
+
+        if(block->taken >= 0 && block->next >= 0 && block->likely == LIKELY_UNKNOWN) {
+            block->likely = guess_likely(blocks, b, function);
+        }
+        int likely = block->next >= 0 ? block->likely : LIKELY_SCALE;
+        if(block->taken >= 0) edges[n++] = (Edge){ b, block->taken, frequency * likely };
+        if(block->next >= 0) {
+            int falls = block->taken >= 0 ? LIKELY_SCALE - likely : LIKELY_SCALE;
+            edges[n++] = (Edge){ b, block->next, frequency * falls };
+        }
+    }
+    qsort(edges, n, sizeof(Edge), compare_edges);
+    return n;
+}
+
+/**
+ * Links blocks into chains along the heaviest edges. An edge joins two
+ * chains if it leaves the tail of one and enters the head of the other;
+ * nothing may be placed before the entry block.
+ *
+ * @return: The chains, one per block; merged chains are left empty
+ */
+static Chain * build_chains(Block * blocks, int count, const Edge * edges, int edge_count) {
+    Chain * chains = (Chain *)malloc(count * sizeof(Chain));
+    assert(chains);
+    for(int b = 0; b < count; b++) {
+        chains[b] = (Chain){ b, b, false };
+        blocks[b].chain = b;
+        blocks[b].successor = -1;
+    }
+
+    for(int e = 0; e < edge_count; e++) {
+        int from = edges[e].from, to = edges[e].to;
+        Chain * first = &chains[blocks[from].chain], * second = &chains[blocks[to].chain];
+        if(edges[e].weight == 0 || to == 0 || first == second) continue;
+        if(first->tail != from || second->head != to) continue;
+
+        blocks[from].successor = to;
+        for(int b = to; b >= 0; b = blocks[b].successor) blocks[b].chain = blocks[from].chain;
+        first->tail = second->tail;
+        second->head = -1;
+    }
+    return chains;
+}
+
+/**
+ * Places the chains: the entry chain first, then repeatedly the chain most
+ * likely entered from the code placed so far, and the chains never
+ * entered last, in their original order.
+ *
+ * @param order: Receives the blocks in their final order
+ */
+static void place_chains(const Block * blocks, int count, Chain * chains, const Edge * edges, int edge_count,
+                         int * order) {
+    int placed = 0;
+    int chain = blocks[0].chain;
+    while(chain >= 0) {
+        chains[chain].placed = true;
+        for(int b = chains[chain].head; b >= 0; b = blocks[b].successor) order[placed++] = b;
+
+        // Edges are sorted, so the first one leaving the placed code is the heaviest
+        chain = -1;
+        for(int e = 0; e < edge_count && chain < 0; e++) {
+            if(edges[e].weight == 0) break;
+            const Chain * to = &chains[blocks[edges[e].to].chain];
+            if(chains[blocks[edges[e].from].chain].placed && !to->placed) chain = blocks[edges[e].to].chain;
+        }
+        for(int b = 0; b < count && chain < 0; b++) {
+            if(chains[b].head >= 0 && !chains[b].placed) chain = b;
+        }
+    }
+    assert(placed == count);
+}
+
+/**
+ * Returns the label of a block, allocating one if it has none.
+ */
+static int block_label(MachineFunction * function, Block * block) {
+    if(block->label < 0) {
+        block->label = machine_new_label(function);
+        block->new_label = true;
+    }
+    return block->label;
+}
+
+/**
+ * Rewrites the function in the new order, fixing up the end of every
+ * block whose successor no longer follows it.
+ */
+static void emit_blocks(MachineFunction * function, Block * blocks, int count, const int * order) {
+    // Labels are allocated first, as a block may be jumped to from an earlier one
+    for(int k = 0; k < count; k++) {
+        Block * block = &blocks[order[k]];
+        int following = k + 1 < count ? order[k + 1] : -1;
+        if(block->next >= 0 && block->next != following) block_label(function, &blocks[block->next]);
+    }
+
+    int capacity = function->length + 2 * count;
+    MachineInstr * code = (MachineInstr *)malloc(capacity * sizeof(MachineInstr));
+    assert(code);
+    int length = 0;
+
+    for(int k = 0; k < count; k++) {
+        Block * block = &blocks[order[k]];
+        int following = k + 1 < count ? order[k + 1] : -1;
+        if(block->new_label) {
+            code[length] = (MachineInstr){ M_LABEL, 0, LIKELY_UNKNOWN, label_operand(block->label), no_operand() };
+            length++;
+        }
+        for(int i = block->first; i < block->end; i++) code[length++] = function->code[i];
+
+        MachineInstr * last = &code[length - 1];
+        if(last->op == M_JMP && block->taken == following) {
+            length--;
+        } else if(last->op == M_JCC && block->next != following) {
+            if(block->taken == following) {
+                last->cond = (uint8_t)NEGATE(last->cond);
+                last->dst = label_operand(blocks[block->next].label);
+                last->likely = (uint16_t)(LIKELY_SCALE - block->likely);
+            } else {
+                code[length++] = (MachineInstr){ M_JMP, 0, LIKELY_UNKNOWN,
+                                                 label_operand(blocks[block->next].label), no_operand() };
+            }
+        } else if(last->op != M_JMP && last->op != M_JCC && block->next >= 0 && block->next != following) {
+            code[length++] = (MachineInstr){ M_JMP, 0, LIKELY_UNKNOWN,
+                                             label_operand(blocks[block->next].label), no_operand() };
+        }
+    }
+
+    free(function->code);
+    function->code = code;
+    function->length = length;
+    function->capacity = capacity;
+}
+
+/**
+ * Reorders the basic blocks of a function for the likely path. Functions
+ * whose control flow cannot be followed are left unchanged.
+ *
+ * @param function: The function
+ */
+void layout_blocks(MachineFunction * function) {
+    int count;
+    Block * blocks = find_blocks(function, &count);
+    if(!blocks) return;
+
+    find_loops(blocks, count);
+    Edge * edges = (Edge *)malloc(2 * count * sizeof(Edge));
+    assert(edges);
+    int edge_count = find_edges(blocks, count, function, edges);
+
+    Chain * chains = build_chains(blocks, count, edges, edge_count);
+    int * order = (int *)malloc(count * sizeof(int));
+    assert(order);
+    place_chains(blocks, count, chains, edges, edge_count, order);
+    emit_blocks(function, blocks, count, order);
+
+    free(order);
+    free(chains);
+    free(edges);
+    free(blocks);
+}
@@ -0,0 +1,8 @@
+#ifndef LAYOUT_H
+#define LAYOUT_H
+
+#include "machine.h"
+
+void layout_blocks(MachineFunction * function);
+
+#endif // LAYOUT_H
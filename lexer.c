@@ -7,14 +7,22 @@
  * The lexer supports:
  * - Keywords (e.g., 'if', 'else', etc.)
  * - Identifiers (variable names, function names)
- * - Numeric constants (integers)
- * - Operators ('+', '-', '*', '/', etc.)
- * - Disregarding whitespace
+ * - Numeric constants (integers, and floats with a fraction or exponent)
+ * - String literals
+ * - Operators ('+', '-', '*', '/', '==', '&&', etc.)
+ * - Separators ('(', ')', '{', '}', ',' and ';')
+ * - Disregarding whitespace and '//' comments
  * - Error handling for invalid tokens
  * 
+ * The whole input is mapped into memory rather than read through a
+ * stream, so a large source is lexed in place without being copied. A
+ * source passed as a file descriptor by a client of the compile server is
+ * read into a buffer of the lexer instead: the client could truncate a
+ * mapped file while it is lexed, which would kill the server with SIGBUS.
+ * 
  * Usage:
- *  - Initializes the lexer with 'init_lexer()'
- *  - Usage 'get_next_token()' to extract tokens 
+ *  - Initializes the lexer with 'init()', or 'init_fd()' for an open file
+ *  - Usage 'get_next()' to extract tokens 
  *  - Free resources with 'destroy_lexer()' and 'destroy_token()'
  * 
  * @file    lexer.c
@@ -25,7 +33,12 @@
 #include <string.h>
 #include <assert.h>
 #include <ctype.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include "lexer.h"
+#include "alloc.h"
 
 #define BUFFER 256
 
@@ -35,20 +48,74 @@
  * counters.
  * 
  * @param filename: The source file to be analyzed
- * @return: A pointer to the new 'Lexer' structure
+ * @return: A pointer to the new 'Lexer' structure, or NULL if the file
+ *          cannot be opened
  */
 Lexer * init(const char * filename) {
-    Lexer * lexer = (Lexer *)malloc(sizeof(Lexer));
+    int fd = open(filename, O_RDONLY);
+    if(fd < 0) return NULL;
+
+    Lexer * lexer = init_fd(fd, true);
+    close(fd);
+    return lexer;
+}
+
+/**
+ * Initializes the lexical analyzer for an open source file. Regular files
+ * are mapped if allowed, anything else is read completely.
+ * 
+ * @param fd: The source file, which the caller may close afterwards
+ * @param map: Map a regular file; 'false' for files that others may
+ *             truncate while they are lexed
+ * @return: A pointer to the new 'Lexer' structure, or NULL if the file
+ *          cannot be read
+ */
+Lexer * init_fd(int fd, bool map) {
+    struct stat st;
+    if(fstat(fd, &st) != 0) return NULL;
+
+    Lexer * lexer = (Lexer *)accounted_malloc(sizeof(Lexer));
     assert(lexer);
+    lexer->source = NULL;
+    lexer->length = 0;
+    lexer->mapped = false;
+
+    if(map && S_ISREG(st.st_mode) && st.st_size > 0) {
+        void * source = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if(source != MAP_FAILED) {
+            lexer->source = (const char *)source;
+            lexer->length = st.st_size;
+            lexer->mapped = true;
+        }
+    }
 
-    lexer->input = fopen(filename, "r");
-    assert(lexer->input);
+    if(!lexer->mapped) {
+        size_t capacity = S_ISREG(st.st_mode) && st.st_size >= BUFFER ? (size_t)st.st_size + 1 : BUFFER;
+        char * source = (char *)accounted_malloc(capacity);
+        assert(source);
+        for(;;) {
+            if(lexer->length == capacity) {
+                capacity *= 2;
+                source = (char *)accounted_realloc(source, capacity);
+                assert(source);
+            }
+            ssize_t count = read(fd, source + lexer->length, capacity - lexer->length);
+            if(count == 0) break;
+            if(count < 0) {
+                accounted_free(source);
+                accounted_free(lexer);
+                return NULL;
+            }
+            lexer->length += count;
+        }
+        lexer->source = source;
+    }
 
+    lexer->position = 0;
     lexer->current_line = 1;
     lexer->current_column = 0;
-    lexer->end_of_file = false;
-
-    lexer->current_char = fgetc(lexer->input);
+    lexer->current_char = lexer->length > 0 ? (unsigned char)lexer->source[0] : EOF;
+    lexer->end_of_file = lexer->current_char == EOF;
     return lexer;
 }
 
@@ -59,10 +126,12 @@ Lexer * init(const char * filename) {
  * @param lexer: A pointer to the lexer
  */
 void destroy_lexer(Lexer * lexer) {
-    if(lexer->input) {
-        fclose(lexer->input);
+    if(lexer->mapped) {
+        munmap((void *)lexer->source, lexer->length);
+    } else {
+        accounted_free((void *)lexer->source);
     }
-    free(lexer);
+    accounted_free(lexer);
 }
 
 /**
@@ -79,23 +148,59 @@ static void advance(Lexer * lexer) {
         lexer->current_column++;
     }
 
-    lexer->current_char = fgetc(lexer->input);
-    if(lexer->current_char = END) {
+    if(lexer->position < lexer->length) lexer->position++;
+    lexer->current_char = lexer->position < lexer->length ? (unsigned char)lexer->source[lexer->position] : EOF;
+    if(lexer->current_char == EOF) {
         lexer->end_of_file = true;
     }
 }
 
 /**
- * Skips whitespace in the file
+ * Returns the character after the current one without consuming it.
+ * 
+ * @param lexer: A pointer to the lexer
+ * @return: The next character, or EOF
+ */
+static int peek(Lexer * lexer) {
+    return lexer->position + 1 < lexer->length ? (unsigned char)lexer->source[lexer->position + 1] : EOF;
+}
+
+/**
+ * Skips whitespace and '//' comments in the file
  * 
  * @param lexer: A pointer to the lexer
  */
 static void skip(Lexer * lexer) {
-    while(isspace(lexer->current_char) && !lexer->end_of_file) {
-        advance(lexer);
+    while(!lexer->end_of_file) {
+        if(isspace(lexer->current_char)) {
+            advance(lexer);
+        } else if(lexer->current_char == '/' && peek(lexer) == '/') {
+            while(!lexer->end_of_file && lexer->current_char != '\n') advance(lexer);
+        } else {
+            break;
+        }
     }
 }
 
+/**
+ * Allocates a token.
+ * 
+ * @param type: The type of the token
+ * @param text: The text of the token, copied
+ * @param line: Line of the first character
+ * @param column: Column of the first character
+ * @return: A pointer to the new 'Token' structure
+ */
+static Token * make_token(TokenType type, const char * text, int line, int column) {
+    Token * token = (Token *)accounted_malloc(sizeof(Token));
+    assert(token);
+    token->type = type;
+    token->token = accounted_strdup(text);
+    token->line = line;
+    token->column = column;
+    return token;
+}
+
 /**
  * Check if a character is valid in an identifier.
  * An identifier can contain letters, digits, and underscores.
@@ -120,88 +225,84 @@ static bool is_valid_identifier_char(char c) {
 Token * get_next(Lexer * lexer) {
     skip(lexer);
 
-    if(lexer->end_of_file) {
-        Token * token = (Token *)malloc(sizeof(Token));
-        token->type = END;
-        token->token = strdup("EOF");
-        token->line = lexer->current_line;
-        token->column = lexer->current_column;
-        return token;
-    }
+    int line = lexer->current_line;
+    int start = lexer->current_column;
+    if(lexer->end_of_file) return make_token(END, "EOF", line, start);
 
-    if(isalpha(lexer->current_char) || lexer->current_char == '_') {
-        int start = lexer->current_column;
-        char buf[BUFFER];
-        int index = 0;
+    char buf[BUFFER];
+    int index = 0;
 
+    if(isalpha(lexer->current_char) || lexer->current_char == '_') {
         while(is_valid_identifier_char(lexer->current_char)) {
-            if(index < sizeof(buf) - 1) {
-                buf[index++] = lexer->current_char;
+            if(index < BUFFER - 1) {
+                buf[index++] = (char)lexer->current_char;
             }
             advance(lexer);
         }
         buf[index] = '\0';
 
-        Token * token = (Token *)malloc(sizeof(Token));
-        token->token = strdup(buf);
-        token->line = lexer->current_line;
-        token->column = start;
-
-        if(is_keyword(buf)) token->type = KEYWORD;
-        else token->type = IDENTIFIER;
-
-        return token;
+        return make_token(is_keyword(buf) ? KEYWORD : IDENTIFIER, buf, line, start);
     }
 
     if(isdigit(lexer->current_char)) {
-        int start = lexer->current_column;
-        char buf[BUFFER];
-        int index = 0;
-
-        while(isdigit(lexer->current_char)) {
-            if(index < sizeof(buf) - 1) buf[index++] = lexer->current_char;
+        // Digits, an optional fraction and an optional exponent
+        bool fraction = false, exponent = false;
+        while(isdigit(lexer->current_char)
+              || (lexer->current_char == '.' && !fraction && !exponent)
+              || ((lexer->current_char == 'e' || lexer->current_char == 'E') && !exponent)) {
+            if(lexer->current_char == '.') fraction = true;
+            if(lexer->current_char == 'e' || lexer->current_char == 'E') {
+                exponent = true;
+                if(index < BUFFER - 1) buf[index++] = (char)lexer->current_char;
+                advance(lexer);
+                if(lexer->current_char != '+' && lexer->current_char != '-') continue;
+            }
+            if(index < BUFFER - 1) buf[index++] = (char)lexer->current_char;
             advance(lexer);
         }
         buf[index] = '\0';
 
-        Token * token = (Token *)malloc(sizeof(Token));
-        token->token = strdup(buf);
-        token->line = lexer->current_line;
-        token->column = start;
+        return make_token(NUMBER, buf, line, start);
+    }
 
-        if(is_keyword(buf)) token->type = KEYWORD;
-        else token->type = IDENTIFIER;
+    if(lexer->current_char == '"') {
+        advance(lexer);
+        while(!lexer->end_of_file && lexer->current_char != '"' && lexer->current_char != '\n') {
+            int c = lexer->current_char;
+            if(c == '\\') {
+                advance(lexer);
+                c = lexer->current_char == 'n' ? '\n' : lexer->current_char == 't' ? '\t' : lexer->current_char;
+            }
+            if(index < BUFFER - 1) buf[index++] = (char)c;
+            advance(lexer);
+        }
+        buf[index] = '\0';
+        if(lexer->current_char != '"') return make_token(INVALID, "\"", line, start);
 
-        return token;
+        advance(lexer);
+        return make_token(STRING, buf, line, start);
     }
 
-    if(is_operator(lexer->current_char)) {
-        char op = lexer->current_char;
-        int start = lexer->current_column;
-
+    if(is_operator((char)lexer->current_char)) {
+        buf[index++] = (char)lexer->current_char;
         advance(lexer);
 
-        Token * token = (Token *)malloc(sizeof(Token));
-        token->type = OPERATOR;
-        token->token = (char *)malloc(2);
-        token->token[0] = op;
-        token->token[1] = '\0';
-        token->line = lexer->current_line;
-        token->column = start;
+        // Two character operators: '==', '!=', '<=', '>=', '&&' and '||'
+        int c = lexer->current_char;
+        if((c == '=' && strchr("=!<>", buf[0])) || (c == '&' && buf[0] == '&') || (c == '|' && buf[0] == '|')) {
+            buf[index++] = (char)c;
+            advance(lexer);
+        }
+        buf[index] = '\0';
 
-        return token;
+        return make_token(OPERATOR, buf, line, start);
     }
 
-    Token * token = (Token *)malloc(sizeof(Token));
-        token->type = INVALID;
-        token->token = (char *)malloc(2);
-        token->token[0] = lexer->current_char;
-        token->token[1] = '\0';
-        token->line = lexer->current_line;
-        token->column = lexer->current_column;
-
-        advance(lexer);
-        return token;
+    buf[0] = (char)lexer->current_char;
+    buf[1] = '\0';
+    advance(lexer);
+    bool separator = buf[0] != '\0' && strchr("(){},;", buf[0]);
+    return make_token(separator ? SEPARATOR : INVALID, buf, line, start);
 }
 
 /**
@@ -211,8 +312,8 @@ Token * get_next(Lexer * lexer) {
  * @param token: A pointer to the token to be destroyed
  */
 void destroy_token(Token * token) {
-    if(token->token) free(token->token);
-    free(token);
+    if(token->token) accounted_free(token->token);
+    accounted_free(token);
 }
 
 /**
@@ -252,7 +353,7 @@ bool is_letter(char c) {
  * @return: 'true' if the character is an operator, 'false' otherwise
  */
 bool is_operator(char c) {
-    return strchr("+-*/=<>!&|", c) != NULL;
+    return c != '\0' && strchr("+-*/%=<>!&|", c) != NULL;
 }
 
 /**
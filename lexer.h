@@ -23,14 +23,18 @@ typedef struct {
 } Token;
 
 typedef struct {
-    FILE * input;       // input file
+    const char * source;    // contents of the input file
+    size_t length;          // size of the input in bytes
+    size_t position;        // offset of the current character
+    bool mapped;            // 'source' is mapped rather than allocated
     int current_line;   // current line in the input file
     int current_column; // current column in the input file
-    char current_char;  // current character being processed
+    int current_char;   // current character being processed, EOF at the end
     bool end_of_file;   // end of file indicator
 } Lexer;
 
 Lexer * init(const char * filename);
+Lexer * init_fd(int fd, bool map);
 void destroy_lexer(Lexer * lexer);
 Token * get_next(Lexer * lexer);
 void destroy_token(Token * token);
@@ -0,0 +1,422 @@
+/**
+ * This file contains the LLVM backend which translates optimized bytecode
+ * into textual LLVM IR ('.ll'), to be compiled by 'llc' or 'clang'.
+ *
+ * Sloth's registers are mutable, so every register becomes an 'alloca'
+ * of its static type ('i64' or 'double') in the entry block, read with
+ * 'load' and written with 'store'. LLVM's 'mem2reg' pass, which runs
+ * first in every optimization pipeline, promotes them to SSA values and
+ * inserts the phi nodes, so no SSA construction is done here. Basic blocks
+ * start at jump targets and behind jumps, calls and divisions.
+ *
+ * The semantics match the virtual machine and the C backend: integer
+ * arithmetic wraps, division by -1 negates, conversions to 'int' saturate
+ * ('llvm.fptosi.sat', LLVM 12 or later), division by zero stores a message
+ * in '@sloth_error' and returns, and callers return as soon as a callee
+ * failed. Functions take their source parameters only: the hidden result
+ * parameter of the bytecode (see codegen.c) is an 'alloca' like any other
+ * register.
+ *
+ * Usage:
+ *  - Optimize the module with 'optimize_module()'
+ *  - Write the IR with 'llvmgen_module()'
+ *  - Compile it with e.g. 'clang -O2 -c' or 'llc -O2 -filetype=obj
+ *    -relocation-model=pic'; the IR uses opaque pointers, so LLVM 14
+ *    needs '-opaque-pointers'
+ *
+ * @file    llvmgen.c
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include "llvmgen.h"
+
+#define DIVISION_BY_ZERO "division by zero"
+
+/**
+ * Returns the target of a jump instruction.
+ *
+ * @param code: The function's code
+ * @param pc: The index of the jump
+ * @return: The index of the target, or -1 if the instruction is no jump
+ */
+static int jump_target(const uint32_t * code, int pc) {
+    switch(OP(code[pc])) {
+        case OP_JMP:  return pc + 1 + ARG_SJ(code[pc]);
+        case OP_JMPT: return pc + 1 + ARG_SBX(code[pc]);
+        case OP_JMPF: return pc + 1 + ARG_SBX(code[pc]);
+        default:      return -1;
+    }
+}
+
+/**
+ * Returns the LLVM type of a register or return type.
+ *
+ * @param type: The 'ValueType'
+ * @return: The name of the LLVM type
+ */
+static const char * ll_type(int type) {
+    return type == TYPE_FLOAT ? "double" : "i64";
+}
+
+/*
+ * State of the function being translated.
+ */
+typedef struct {
+    FILE * out;
+    const Module * module;
+    const Function * function;
+    int temp;
+} Emitter;
+
+/**
+ * Loads a register into a new temporary.
+ *
+ * @param e: The emitter
+ * @param r: The register
+ * @return: Number of the temporary
+ */
+static int load(Emitter * e, int r) {
+    const char * type = ll_type(e->function->types[r]);
+    fprintf(e->out, "  %%t%d = load %s, ptr %%r%d\n", e->temp, type, r);
+    return e->temp++;
+}
+
+/**
+ * Stores a temporary into a register.
+ *
+ * @param e: The emitter
+ * @param r: The register
+ * @param t: Number of the temporary
+ */
+static void store(Emitter * e, int r, int t) {
+    fprintf(e->out, "  store %s %%t%d, ptr %%r%d\n", ll_type(e->function->types[r]), t, r);
+}
+
+/**
+ * Computes 'R[A] = R[B] op R[C]' with a binary LLVM instruction.
+ *
+ * @param e: The emitter
+ * @param op: The LLVM instruction
+ * @param instruction: The bytecode instruction
+ */
+static void binary(Emitter * e, const char * op, uint32_t instruction) {
+    int b = load(e, ARG_B(instruction)), c = load(e, ARG_C(instruction));
+    fprintf(e->out, "  %%t%d = %s %s %%t%d, %%t%d\n", e->temp, op,
+            ll_type(e->function->types[ARG_B(instruction)]), b, c);
+    store(e, ARG_A(instruction), e->temp++);
+}
+
+/**
+ * Compares two registers into an 'i1' temporary.
+ *
+ * @param e: The emitter
+ * @param predicate: The 'icmp' or 'fcmp' instruction with its predicate
+ * @param x: The left register
+ * @param y: The right register
+ * @return: Number of the temporary
+ */
+static int compare(Emitter * e, const char * predicate, int x, int y) {
+    int a = load(e, x), b = load(e, y);
+    fprintf(e->out, "  %%t%d = %s %s %%t%d, %%t%d\n", e->temp, predicate, ll_type(e->function->types[x]), a, b);
+    return e->temp++;
+}
+
+/**
+ * Returns the comparison instruction and predicate of a compare or
+ * compare-and-branch opcode.
+ *
+ * @param op: The opcode
+ * @return: e.g. "icmp slt"
+ */
+static const char * predicate(Opcode op) {
+    switch(op) {
+        case OP_EQ_I: case OP_JEQ_I: return "icmp eq";
+        case OP_NE_I:                return "icmp ne";
+        case OP_LT_I: case OP_JLT_I: return "icmp slt";
+        case OP_LE_I: case OP_JLE_I: return "icmp sle";
+        case OP_EQ_F: case OP_JEQ_F: return "fcmp oeq";
+        case OP_NE_F:                return "fcmp une";
+        case OP_LT_F: case OP_JLT_F: return "fcmp olt";
+        case OP_LE_F: case OP_JLE_F: return "fcmp ole";
+        default:                     return NULL;
+    }
+}
+
+/**
+ * Returns the first register of a function holding a source parameter.
+ */
+static int first_param(const Function * function) {
+    return function->result_param ? 1 : 0;
+}
+
+/**
+ * Prints the signature of a function, with its source parameters.
+ *
+ * @param out: The output stream
+ * @param function: The function
+ */
+static void emit_signature(FILE * out, const Function * function) {
+    fprintf(out, "define %s @" LLVMGEN_PREFIX "%s(", ll_type(function->return_type), function->name);
+    int first = first_param(function);
+    for(int p = first; p < function->param_count; p++) {
+        fprintf(out, "%s%s %%p%d", p > first ? ", " : "", ll_type(function->types[p]), p);
+    }
+    fputc(')', out);
+}
+
+/**
+ * Prints one LLVM function.
+ *
+ * @param out: The output stream
+ * @param module: The module containing the function
+ * @param function: The function
+ */
+static void emit_function(FILE * out, const Module * module, const Function * function) {
+    const uint32_t * code = function->code;
+    int length = function->code_length;
+    const char * zero = function->return_type == TYPE_FLOAT ? "0.0" : "0";
+    Emitter e = { out, module, function, 0 };
+
+    bool * leaders = (bool *)calloc(length + 1, sizeof(bool));
+    assert(leaders);
+    leaders[0] = true;
+    for(int pc = 0; pc < length; pc++) {
+        int target = jump_target(code, pc);
+        if(target >= 0) leaders[target] = true;
+        switch(OP(code[pc])) {
+            case OP_JMP: case OP_JMPT: case OP_JMPF: case OP_RET:
+                leaders[pc + 1] = true;
+                break;
+            default:
+                break;
+        }
+    }
+
+    emit_signature(out, function);
+    fputs(" {\nentry:\n", out);
+    for(int r = 0; r < function->register_count; r++) {
+        fprintf(out, "  %%r%d = alloca %s\n", r, ll_type(function->types[r]));
+    }
+    for(int p = first_param(function); p < function->param_count; p++) {
+        fprintf(out, "  store %s %%p%d, ptr %%r%d\n", ll_type(function->types[p]), p, p);
+    }
+    fputs("  br label %L0\n", out);
+
+    bool open = false;
+    for(int pc = 0; pc < length; pc++) {
+        uint32_t i = code[pc];
+        int a = ARG_A(i), b = ARG_B(i);
+
+        if(leaders[pc]) {
+            if(open) fprintf(out, "  br label %%L%d\n", pc);
+            fprintf(out, "L%d:\n", pc);
+        }
+        open = true;
+
+        switch(OP(i)) {
+            case OP_MOVE: store(&e, a, load(&e, b)); break;
+            case OP_LOADK: {
+                const Constant * k = &module->constants[ARG_BX(i)];
+                if(k->type == CONSTANT_INT) {
+                    fprintf(out, "  store i64 %lld, ptr %%r%d\n", (long long)k->value.i, a);
+                } else if(k->type == CONSTANT_FLOAT) {
+                    uint64_t bits;
+                    memcpy(&bits, &k->value.f, sizeof(bits));
+                    fprintf(out, "  store double 0x%016llX, ptr %%r%d\n", (unsigned long long)bits, a);
+                } else {
+                    fprintf(out, "  store i64 ptrtoint (ptr @k%d to i64), ptr %%r%d\n", ARG_BX(i), a);
+                }
+                break;
+            }
+            case OP_LOADI: fprintf(out, "  store i64 %d, ptr %%r%d\n", ARG_SBX(i), a); break;
+
+            case OP_ADD_I: binary(&e, "add", i); break;
+            case OP_SUB_I: binary(&e, "sub", i); break;
+            case OP_MUL_I: binary(&e, "mul", i); break;
+            case OP_ADDI: {
+                int t = load(&e, b);
+                fprintf(out, "  %%t%d = add i64 %%t%d, %d\n", e.temp, t, ARG_SC(i));
+                store(&e, a, e.temp++);
+                break;
+            }
+            case OP_DIV_I: case OP_MOD_I: {
+                int c = load(&e, ARG_C(i));
+                fprintf(out, "  %%t%d = icmp eq i64 %%t%d, 0\n", e.temp, c);
+                fprintf(out, "  br i1 %%t%d, label %%fail.zero, label %%D%d\n", e.temp++, pc);
+                fprintf(out, "D%d:\n", pc);
+                int x = load(&e, b);
+
+                // 'sdiv' and 'srem' are undefined for INT64_MIN / -1: divide by 1
+                // instead, which leaves x and the remainder 0, and negate x
+                int minus = e.temp++, divisor = e.temp++;
+                fprintf(out, "  %%t%d = icmp eq i64 %%t%d, -1\n", minus, c);
+                fprintf(out, "  %%t%d = select i1 %%t%d, i64 1, i64 %%t%d\n", divisor, minus, c);
+                fprintf(out, "  %%t%d = %s i64 %%t%d, %%t%d\n", e.temp, OP(i) == OP_DIV_I ? "sdiv" : "srem", x, divisor);
+                if(OP(i) == OP_DIV_I) {
+                    fprintf(out, "  %%t%d = sub i64 0, %%t%d\n", e.temp + 1, x);
+                    fprintf(out, "  %%t%d = select i1 %%t%d, i64 %%t%d, i64 %%t%d\n", e.temp + 2, minus, e.temp + 1, e.temp);
+                    e.temp += 2;
+                }
+                store(&e, a, e.temp++);
+                break;
+            }
+            case OP_NEG_I: {
+                int t = load(&e, b);
+                fprintf(out, "  %%t%d = sub i64 0, %%t%d\n", e.temp, t);
+                store(&e, a, e.temp++);
+                break;
+            }
+
+            case OP_ADD_F: binary(&e, "fadd", i); break;
+            case OP_SUB_F: binary(&e, "fsub", i); break;
+            case OP_MUL_F: binary(&e, "fmul", i); break;
+            case OP_DIV_F: binary(&e, "fdiv", i); break;
+            case OP_NEG_F: {
+                int t = load(&e, b);
+                fprintf(out, "  %%t%d = fneg double %%t%d\n", e.temp, t);
+                store(&e, a, e.temp++);
+                break;
+            }
+
+            case OP_EQ_I: case OP_NE_I: case OP_LT_I: case OP_LE_I:
+            case OP_EQ_F: case OP_NE_F: case OP_LT_F: case OP_LE_F: {
+                int t = compare(&e, predicate(OP(i)), b, ARG_C(i));
+                fprintf(out, "  %%t%d = zext i1 %%t%d to i64\n", e.temp, t);
+                store(&e, a, e.temp++);
+                break;
+            }
+            case OP_NOT: {
+                int t = load(&e, b);
+                fprintf(out, "  %%t%d = icmp eq i64 %%t%d, 0\n", e.temp, t);
+                fprintf(out, "  %%t%d = zext i1 %%t%d to i64\n", e.temp + 1, e.temp);
+                e.temp += 2;
+                store(&e, a, e.temp - 1);
+                break;
+            }
+
+            case OP_I2F: {
+                int t = load(&e, b);
+                fprintf(out, "  %%t%d = sitofp i64 %%t%d to double\n", e.temp, t);
+                store(&e, a, e.temp++);
+                break;
+            }
+            case OP_F2I: {
+                int t = load(&e, b);
+                fprintf(out, "  %%t%d = call i64 @llvm.fptosi.sat.i64.f64(double %%t%d)\n", e.temp, t);
+                store(&e, a, e.temp++);
+                break;
+            }
+
+            case OP_JMP:
+                fprintf(out, "  br label %%L%d\n", jump_target(code, pc));
+                open = false;
+                break;
+            case OP_JMPT: case OP_JMPF: {
+                int t = load(&e, a);
+                fprintf(out, "  %%t%d = icmp ne i64 %%t%d, 0\n", e.temp, t);
+                int target = jump_target(code, pc);
+                if(OP(i) == OP_JMPT) fprintf(out, "  br i1 %%t%d, label %%L%d, label %%L%d\n", e.temp++, target, pc + 1);
+                else fprintf(out, "  br i1 %%t%d, label %%L%d, label %%L%d\n", e.temp++, pc + 1, target);
+                open = false;
+                break;
+            }
+
+            case OP_JEQ_I: case OP_JLT_I: case OP_JLE_I:
+            case OP_JEQ_F: case OP_JLT_F: case OP_JLE_F: {
+                int t = compare(&e, predicate(OP(i)), a, b);
+                int target = jump_target(code, pc + 1);
+                if(ARG_C(i)) fprintf(out, "  br i1 %%t%d, label %%L%d, label %%L%d\n", t, target, pc + 2);
+                else fprintf(out, "  br i1 %%t%d, label %%L%d, label %%L%d\n", t, pc + 2, target);
+                pc++;
+                if(leaders[pc]) fprintf(out, "L%d:\n  br label %%L%d\n", pc, target);
+                if(pc + 1 <= length) leaders[pc + 1] = true;
+                open = false;
+                break;
+            }
+
+            case OP_CALL: {
+                const Function * callee = module->functions[ARG_BX(i)];
+                int skip = first_param(callee);
+                int first = e.temp - skip;
+                for(int p = skip; p < callee->param_count; p++) load(&e, a + p);
+                fprintf(out, "  %%t%d = call %s @" LLVMGEN_PREFIX "%s(", e.temp, ll_type(callee->return_type), callee->name);
+                for(int p = skip; p < callee->param_count; p++) {
+                    fprintf(out, "%s%s %%t%d", p > skip ? ", " : "", ll_type(callee->types[p]), first + p);
+                }
+                fputs(")\n", out);
+                store(&e, a, e.temp++);
+                fprintf(out, "  %%t%d = load ptr, ptr @sloth_error\n", e.temp);
+                fprintf(out, "  %%t%d = icmp ne ptr %%t%d, null\n", e.temp + 1, e.temp);
+                fprintf(out, "  br i1 %%t%d, label %%fail, label %%C%d\n", e.temp + 1, pc);
+                fprintf(out, "C%d:\n", pc);
+                e.temp += 2;
+                break;
+            }
+            case OP_RET:
+                fprintf(out, "  ret %s %%t%d\n", ll_type(function->return_type), load(&e, a));
+                open = false;
+                break;
+
+            default:
+                fprintf(out, "  ; invalid opcode %d\n", OP(i));
+                break;
+        }
+    }
+
+    if(open || leaders[length]) {
+        if(open) fprintf(out, "  br label %%L%d\n", length);
+        fprintf(out, "L%d:\n  ret %s %s\n", length, ll_type(function->return_type), zero);
+    }
+    fprintf(out, "fail.zero:\n  store ptr @division_by_zero, ptr @sloth_error\n  br label %%fail\n");
+    fprintf(out, "fail:\n  ret %s %s\n}\n\n", ll_type(function->return_type), zero);
+    free(leaders);
+}
+
+/**
+ * Prints a string as an LLVM character array constant.
+ *
+ * @param out: The output stream
+ * @param name: Name of the global
+ * @param s: The string
+ */
+static void emit_string(FILE * out, const char * name, const char * s) {
+    fprintf(out, "@%s = private unnamed_addr constant [%zu x i8] c\"", name, strlen(s) + 1);
+    for(; *s; s++) {
+        unsigned char c = (unsigned char)*s;
+        if(c < 0x20 || c >= 0x7f || c == '"' || c == '\\') fprintf(out, "\\%02X", c);
+        else fputc(c, out);
+    }
+    fputs("\\00\"\n", out);
+}
+
+/**
+ * Translates a module into one LLVM IR module. Functions keep their names
+ * with the prefix 'sloth_'; '@sloth_error' is thread local and holds the
+ * message of a run-time error of the last call.
+ *
+ * @param out: The output stream
+ * @param module: The module, preferably optimized
+ * @return: 'true' if the IR was written successfully
+ */
+bool llvmgen_module(FILE * out, const Module * module) {
+    fputs("; Generated by Sloth, do not edit.\n\n", out);
+    fputs("@sloth_error = thread_local global ptr null\n", out);
+    emit_string(out, "division_by_zero", DIVISION_BY_ZERO);
+
+    char name[32];
+    for(int k = 0; k < module->constant_count; k++) {
+        if(module->constants[k].type != CONSTANT_STRING) continue;
+        snprintf(name, sizeof(name), "k%d", k);
+        emit_string(out, name, module->constants[k].value.s);
+    }
+    fputc('\n', out);
+
+    for(int f = 0; f < module->function_count; f++) {
+        emit_function(out, module, module->functions[f]);
+    }
+    fputs("declare i64 @llvm.fptosi.sat.i64.f64(double)\n", out);
+
+    return !ferror(out);
+}
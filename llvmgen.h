@@ -0,0 +1,12 @@
+#ifndef LLVMGEN_H
+#define LLVMGEN_H
+
+#include <stdio.h>
+#include <stdbool.h>
+#include "bytecode.h"
+
+#define LLVMGEN_PREFIX "sloth_"    // prepended to the names of emitted functions
+
+bool llvmgen_module(FILE * out, const Module * module);
+
+#endif // LLVMGEN_H
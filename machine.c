@@ -0,0 +1,649 @@
+/**
+ * This file contains the machine level representation used by the native
+ * backend: x86-64 instructions with explicit registers and memory
+ * operands, the queries the peephole optimizer needs about them, and the
+ * encoder which turns them into executable bytes.
+ *
+ * Only the instructions the backend selects are supported, each in the
+ * operand combinations listed in 'MACHINE_OP_LIST'. Jumps always use 32
+ * bit displacements, so every instruction has its final size as soon as
+ * it is encoded and labels are resolved in a single pass.
+ *
+ * Usage:
+ *  - Build a function with 'init_machine_function()' and 'machine_emit()'
+ *  - Write a listing with 'machine_write()' or 'machine_print()', or encode
+ *    it with 'machine_encode()'
+ *  - Free resources with 'destroy_machine_function()'
+ *
+ * @file    machine.c
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include "machine.h"
+
+#define INITIAL_CAPACITY 64
+
+static const char * const op_names[] = {
+#define MACHINE_OP_NAME(name, mnemonic) mnemonic,
+    MACHINE_OP_LIST(MACHINE_OP_NAME)
+#undef MACHINE_OP_NAME
+};
+
+static const char * const condition_names[] = {
+    "o", "no", "b", "ae", "e", "ne", "be", "a", "s", "ns", "p", "np", "l", "ge", "le", "g"
+};
+
+/**
+ * Initializes an empty machine function.
+ *
+ * @param name: Name of the function, copied
+ * @return: A pointer to the new 'MachineFunction' structure
+ */
+MachineFunction * init_machine_function(const char * name) {
+    MachineFunction * function = (MachineFunction *)calloc(1, sizeof(MachineFunction));
+    assert(function);
+    function->name = strdup(name);
+    return function;
+}
+
+/**
+ * Destroys a machine function and frees all resources associated with it.
+ *
+ * @param function: A pointer to the function
+ */
+void destroy_machine_function(MachineFunction * function) {
+    free(function->name);
+    free(function->code);
+    free(function);
+}
+
+/**
+ * Allocates a new label. Labels are placed with a 'LABEL' instruction.
+ *
+ * @param function: A pointer to the function
+ * @return: The number of the label
+ */
+int machine_new_label(MachineFunction * function) {
+    return function->label_count++;
+}
+
+/**
+ * Appends an instruction.
+ *
+ * @param function: A pointer to the function
+ * @param op: The instruction
+ * @param dst: The destination or only operand
+ * @param src: The source operand
+ * @return: Index of the instruction
+ */
+int machine_emit(MachineFunction * function, MachineOp op, Operand dst, Operand src) {
+    if(function->length == function->capacity) {
+        function->capacity = function->capacity ? function->capacity * 2 : INITIAL_CAPACITY;
+        function->code = (MachineInstr *)realloc(function->code, function->capacity * sizeof(MachineInstr));
+        assert(function->code);
+    }
+
+    MachineInstr * instr = &function->code[function->length];
+    instr->op = (uint8_t)op;
+    instr->cond = 0;
+    instr->likely = LIKELY_UNKNOWN;
+    instr->dst = dst;
+    instr->src = src;
+    return function->length++;
+}
+
+/**
+ * Appends a conditional instruction, 'JCC' or 'SETCC'.
+ *
+ * @param function: A pointer to the function
+ * @param op: The instruction
+ * @param cond: The condition
+ * @param dst: The label or register
+ * @return: Index of the instruction
+ */
+int machine_emit_cc(MachineFunction * function, MachineOp op, Condition cond, Operand dst) {
+    int index = machine_emit(function, op, dst, no_operand());
+    function->code[index].cond = (uint8_t)cond;
+    return index;
+}
+
+/**
+ * Removes the instructions that passes replaced by 'NOP'.
+ *
+ * @param function: A pointer to the function
+ */
+void machine_remove_nops(MachineFunction * function) {
+    int length = 0;
+    for(int i = 0; i < function->length; i++) {
+        if(function->code[i].op != M_NOP) function->code[length++] = function->code[i];
+    }
+    function->length = length;
+}
+
+/**
+ * Compares two operands.
+ *
+ * @param a: The first operand
+ * @param b: The second operand
+ * @return: 'true' if both denote the same register, memory or value
+ */
+bool operands_equal(const Operand * a, const Operand * b) {
+    if(a->kind != b->kind) return false;
+    switch(a->kind) {
+        case OPERAND_REG:   return a->reg == b->reg;
+        case OPERAND_MEM:   return a->reg == b->reg && a->index == b->index
+                                && (a->index == NO_REG || a->scale == b->scale) && a->disp == b->disp;
+        case OPERAND_IMM:
+        case OPERAND_LABEL: return a->imm == b->imm;
+        default:            return true;
+    }
+}
+
+/**
+ * Checks if an operand reads a register: a register operand, or the base
+ * or index of a memory operand.
+ *
+ * @param operand: The operand
+ * @param reg: The register
+ * @return: 'true' if the register is read
+ */
+static bool operand_uses(const Operand * operand, int reg) {
+    if(operand->kind == OPERAND_REG) return operand->reg == reg;
+    if(operand->kind == OPERAND_MEM) return operand->reg == reg || operand->index == reg;
+    return false;
+}
+
+/**
+ * Checks if an instruction reads a register, including implicit operands.
+ *
+ * @param instr: The instruction
+ * @param reg: The register
+ * @return: 'true' if the register is read
+ */
+bool machine_reads(const MachineInstr * instr, int reg) {
+    bool address = instr->dst.kind == OPERAND_MEM && operand_uses(&instr->dst, reg);
+
+    switch(instr->op) {
+        case M_MOV: case M_LEA: case M_MOVZX: case M_MOVSD:
+        case M_CVTSI2SD: case M_CVTTSD2SI: case M_MOVQ:
+            return address || operand_uses(&instr->src, reg);
+        case M_NEG: case M_SETCC: case M_PUSH:
+            return operand_uses(&instr->dst, reg);
+        case M_CQO:
+            return reg == RAX;
+        case M_IDIV:
+            return reg == RAX || reg == RDX || operand_uses(&instr->dst, reg);
+        case M_CALL:
+            return operand_uses(&instr->dst, reg) || reg == RDI || reg == RSI || reg == RDX
+                || reg == RCX || reg == R8 || reg == R9;
+        case M_RET:
+            return reg == RAX;
+        case M_POP:
+            return address;
+        case M_JMP: case M_JCC: case M_LABEL: case M_NOP:
+            return false;
+        case M_XOR:
+            if(operands_equal(&instr->dst, &instr->src)) return false;
+            return operand_uses(&instr->dst, reg) || operand_uses(&instr->src, reg);
+        default:
+            return operand_uses(&instr->dst, reg) || operand_uses(&instr->src, reg);
+    }
+}
+
+/**
+ * Checks if an instruction writes a register, including implicit operands
+ * and the registers a call clobbers.
+ *
+ * @param instr: The instruction
+ * @param reg: The register
+ * @return: 'true' if the register is written
+ */
+bool machine_writes(const MachineInstr * instr, int reg) {
+    switch(instr->op) {
+        case M_CMP: case M_TEST: case M_UCOMISD: case M_PUSH:
+        case M_JMP: case M_JCC: case M_LABEL: case M_NOP: case M_RET:
+            return false;
+        case M_CQO:
+            return reg == RDX;
+        case M_IDIV:
+            return reg == RAX || reg == RDX;
+        case M_CALL:
+            return reg == RAX || reg == RCX || reg == RDX || reg == RSI || reg == RDI
+                || (reg >= R8 && reg <= R11) || IS_XMM(reg);
+        default:
+            return instr->dst.kind == OPERAND_REG && instr->dst.reg == reg;
+    }
+}
+
+/**
+ * Checks if an instruction reads the flags.
+ *
+ * @param instr: The instruction
+ * @return: 'true' for conditional instructions
+ */
+bool machine_reads_flags(const MachineInstr * instr) {
+    return instr->op == M_JCC || instr->op == M_SETCC;
+}
+
+/**
+ * Checks if an instruction overwrites the flags.
+ *
+ * @param instr: The instruction
+ * @return: 'true' if the flags are set or clobbered
+ */
+bool machine_writes_flags(const MachineInstr * instr) {
+    switch(instr->op) {
+        case M_ADD: case M_SUB: case M_AND: case M_OR: case M_XOR: case M_CMP:
+        case M_TEST: case M_IMUL: case M_NEG: case M_IDIV: case M_UCOMISD: case M_CALL:
+            return true;
+        default:
+            return false;
+    }
+}
+
+/*
+ * Growing byte buffer receiving encoded instructions.
+ */
+typedef struct {
+    uint8_t * bytes;
+    size_t length;
+    size_t capacity;
+} Buffer;
+
+static void put(Buffer * buffer, uint8_t byte) {
+    if(buffer->length == buffer->capacity) {
+        buffer->capacity = buffer->capacity ? buffer->capacity * 2 : 256;
+        buffer->bytes = (uint8_t *)realloc(buffer->bytes, buffer->capacity);
+        assert(buffer->bytes);
+    }
+    buffer->bytes[buffer->length++] = byte;
+}
+
+static void put32(Buffer * buffer, int32_t value) {
+    for(int i = 0; i < 4; i++) put(buffer, (uint8_t)((uint32_t)value >> (i * 8)));
+}
+
+static void put64(Buffer * buffer, int64_t value) {
+    for(int i = 0; i < 8; i++) put(buffer, (uint8_t)((uint64_t)value >> (i * 8)));
+}
+
+/**
+ * Returns the 4 bit hardware number of a register.
+ *
+ * @param reg: The register
+ * @return: The number used in ModRM, SIB and REX
+ */
+static int hw(int reg) {
+    return IS_XMM(reg) ? reg - XMM0 : reg;
+}
+
+static bool fits8(int64_t value) {
+    return value >= INT8_MIN && value <= INT8_MAX;
+}
+
+static bool fits32(int64_t value) {
+    return value >= INT32_MIN && value <= INT32_MAX;
+}
+
+/**
+ * Encodes the prefixes and opcode of an instruction with a ModRM byte,
+ * followed by the ModRM, SIB and displacement bytes.
+ *
+ * @param buffer: The output
+ * @param prefix: Mandatory prefix (0x66 or 0xf2), or 0
+ * @param wide: Sets REX.W for 64 bit operands
+ * @param byte: The r/m operand is a byte register
+ * @param opcode: Opcode bytes
+ * @param opcode_length: Number of opcode bytes
+ * @param reg: Register or opcode extension in the ModRM reg field
+ * @param rm: The register or memory operand
+ */
+static void encode(Buffer * buffer, int prefix, bool wide, bool byte,
+                   const uint8_t * opcode, int opcode_length, int reg, const Operand * rm) {
+    int r = hw(reg);
+    bool memory = rm->kind == OPERAND_MEM;
+    int base = hw(rm->reg);
+    int index = memory && rm->index != NO_REG ? hw(rm->index) : -1;
+
+    if(prefix) put(buffer, (uint8_t)prefix);
+    int rex = (wide ? 8 : 0) | (r >= 8 ? 4 : 0) | (index >= 8 ? 2 : 0) | (base >= 8 ? 1 : 0);
+    if(rex || (byte && !memory && base >= 4)) put(buffer, (uint8_t)(0x40 | rex));
+    for(int i = 0; i < opcode_length; i++) put(buffer, opcode[i]);
+
+    if(!memory) {
+        put(buffer, (uint8_t)(0xc0 | (r & 7) << 3 | (base & 7)));
+        return;
+    }
+
+    int mod = rm->disp == 0 && (base & 7) != 5 ? 0 : fits8(rm->disp) ? 1 : 2;
+    if(index < 0 && (base & 7) != 4) {
+        put(buffer, (uint8_t)(mod << 6 | (r & 7) << 3 | (base & 7)));
+    } else {
+        int scale = rm->scale == 8 ? 3 : rm->scale == 4 ? 2 : rm->scale == 2 ? 1 : 0;
+        put(buffer, (uint8_t)(mod << 6 | (r & 7) << 3 | 4));
+        put(buffer, (uint8_t)(scale << 6 | ((index < 0 ? 4 : index) & 7) << 3 | (base & 7)));
+    }
+    if(mod == 1) put(buffer, (uint8_t)rm->disp);
+    else if(mod == 2) put32(buffer, rm->disp);
+}
+
+/**
+ * Encodes an instruction with a single opcode byte.
+ */
+static void encode1(Buffer * buffer, bool wide, uint8_t opcode, int reg, const Operand * rm) {
+    encode(buffer, 0, wide, false, &opcode, 1, reg, rm);
+}
+
+/**
+ * Encodes an instruction with the two byte opcode '0f xx'.
+ */
+static void encode2(Buffer * buffer, int prefix, bool wide, uint8_t opcode, int reg, const Operand * rm) {
+    uint8_t bytes[2] = { 0x0f, opcode };
+    encode(buffer, prefix, wide, false, bytes, 2, reg, rm);
+}
+
+/**
+ * Encodes a two operand integer instruction of the classic ALU group.
+ *
+ * @param buffer: The output
+ * @param instr: The instruction
+ * @param extension: Opcode extension of the immediate forms
+ */
+static void encode_alu(Buffer * buffer, const MachineInstr * instr, int extension) {
+    const Operand * dst = &instr->dst, * src = &instr->src;
+    uint8_t base = (uint8_t)(extension << 3);
+
+    if(src->kind == OPERAND_IMM) {
+        if(fits8(src->imm)) {
+            encode1(buffer, true, 0x83, extension, dst);
+            put(buffer, (uint8_t)src->imm);
+        } else {
+            encode1(buffer, true, 0x81, extension, dst);
+            put32(buffer, (int32_t)src->imm);
+        }
+    } else if(dst->kind == OPERAND_MEM) {
+        encode1(buffer, true, base | 0x01, src->reg, dst);
+    } else if(instr->op == M_XOR && src->kind == OPERAND_REG && src->reg == dst->reg) {
+        encode1(buffer, false, 0x33, dst->reg, src);
+    } else {
+        encode1(buffer, true, base | 0x03, dst->reg, src);
+    }
+}
+
+/**
+ * Encodes one instruction. Label operands are encoded as zero and
+ * recorded for patching.
+ *
+ * @param buffer: The output
+ * @param instr: The instruction
+ * @param fixups: Receives the offset of the displacement of a jump
+ */
+static void encode_instruction(Buffer * buffer, const MachineInstr * instr, size_t * fixup) {
+    const Operand * dst = &instr->dst, * src = &instr->src;
+    *fixup = 0;
+
+    switch(instr->op) {
+        case M_MOV:
+            if(src->kind == OPERAND_IMM) {
+                if(dst->kind == OPERAND_REG && src->imm >= 0 && src->imm <= UINT32_MAX) {
+                    if(hw(dst->reg) >= 8) put(buffer, 0x41);
+                    put(buffer, (uint8_t)(0xb8 + (hw(dst->reg) & 7)));
+                    put32(buffer, (int32_t)(uint32_t)src->imm);
+                } else if(fits32(src->imm)) {
+                    encode1(buffer, true, 0xc7, 0, dst);
+                    put32(buffer, (int32_t)src->imm);
+                } else {
+                    put(buffer, (uint8_t)(0x48 | (hw(dst->reg) >= 8 ? 1 : 0)));
+                    put(buffer, (uint8_t)(0xb8 + (hw(dst->reg) & 7)));
+                    put64(buffer, src->imm);
+                }
+            } else if(dst->kind == OPERAND_MEM) {
+                encode1(buffer, true, 0x89, src->reg, dst);
+            } else {
+                encode1(buffer, true, 0x8b, dst->reg, src);
+            }
+            break;
+        case M_LEA:  encode1(buffer, true, 0x8d, dst->reg, src); break;
+        case M_ADD:  encode_alu(buffer, instr, 0); break;
+        case M_OR:   encode_alu(buffer, instr, 1); break;
+        case M_AND:  encode_alu(buffer, instr, 4); break;
+        case M_SUB:  encode_alu(buffer, instr, 5); break;
+        case M_XOR:  encode_alu(buffer, instr, 6); break;
+        case M_CMP:  encode_alu(buffer, instr, 7); break;
+        case M_TEST:
+            if(src->kind == OPERAND_IMM) {
+                encode1(buffer, true, 0xf7, 0, dst);
+                put32(buffer, (int32_t)src->imm);
+            } else {
+                encode1(buffer, true, 0x85, src->reg, dst);
+            }
+            break;
+        case M_IMUL:
+            if(src->kind == OPERAND_IMM) {
+                encode1(buffer, true, fits8(src->imm) ? 0x6b : 0x69, dst->reg, dst);
+                if(fits8(src->imm)) put(buffer, (uint8_t)src->imm);
+                else put32(buffer, (int32_t)src->imm);
+            } else {
+                encode2(buffer, 0, true, 0xaf, dst->reg, src);
+            }
+            break;
+        case M_NEG:  encode1(buffer, true, 0xf7, 3, dst); break;
+        case M_CQO:  put(buffer, 0x48); put(buffer, 0x99); break;
+        case M_IDIV: encode1(buffer, true, 0xf7, 7, dst); break;
+        case M_SETCC: {
+            uint8_t opcode[2] = { 0x0f, (uint8_t)(0x90 + instr->cond) };
+            encode(buffer, 0, false, true, opcode, 2, 0, dst);
+            break;
+        }
+        case M_MOVZX: {
+            uint8_t opcode[2] = { 0x0f, 0xb6 };
+            encode(buffer, 0, true, true, opcode, 2, dst->reg, src);
+            break;
+        }
+        case M_JMP:
+            put(buffer, 0xe9);
+            *fixup = buffer->length;
+            put32(buffer, 0);
+            break;
+        case M_JCC:
+            put(buffer, 0x0f);
+            put(buffer, (uint8_t)(0x80 + instr->cond));
+            *fixup = buffer->length;
+            put32(buffer, 0);
+            break;
+        case M_CALL: encode1(buffer, false, 0xff, 2, dst); break;
+        case M_RET:  put(buffer, 0xc3); break;
+        case M_PUSH:
+            if(hw(dst->reg) >= 8) put(buffer, 0x41);
+            put(buffer, (uint8_t)(0x50 + (hw(dst->reg) & 7)));
+            break;
+        case M_POP:
+            if(hw(dst->reg) >= 8) put(buffer, 0x41);
+            put(buffer, (uint8_t)(0x58 + (hw(dst->reg) & 7)));
+            break;
+        case M_MOVSD:
+            if(dst->kind == OPERAND_MEM) encode2(buffer, 0xf2, false, 0x11, src->reg, dst);
+            else encode2(buffer, 0xf2, false, 0x10, dst->reg, src);
+            break;
+        case M_ADDSD:     encode2(buffer, 0xf2, false, 0x58, dst->reg, src); break;
+        case M_MULSD:     encode2(buffer, 0xf2, false, 0x59, dst->reg, src); break;
+        case M_SUBSD:     encode2(buffer, 0xf2, false, 0x5c, dst->reg, src); break;
+        case M_DIVSD:     encode2(buffer, 0xf2, false, 0x5e, dst->reg, src); break;
+        case M_UCOMISD:   encode2(buffer, 0x66, false, 0x2e, dst->reg, src); break;
+        case M_XORPD:     encode2(buffer, 0x66, false, 0x57, dst->reg, src); break;
+        case M_CVTSI2SD:  encode2(buffer, 0xf2, true, 0x2a, dst->reg, src); break;
+        case M_CVTTSD2SI: encode2(buffer, 0xf2, true, 0x2c, dst->reg, src); break;
+        case M_MOVQ:
+            if(IS_XMM(dst->reg)) encode2(buffer, 0x66, true, 0x6e, dst->reg, src);
+            else encode2(buffer, 0x66, true, 0x7e, src->reg, dst);
+            break;
+        default:
+            break;
+    }
+}
+
+/**
+ * Encodes a function into machine code and resolves its labels.
+ *
+ * @param function: A pointer to the function
+ * @param size: Receives the size of the code in bytes
+ * @return: The code, allocated with 'malloc()'
+ */
+uint8_t * machine_encode(const MachineFunction * function, size_t * size) {
+    Buffer buffer = { NULL, 0, 0 };
+    size_t * labels = (size_t *)malloc((function->label_count + 1) * sizeof(size_t));
+    size_t * fixups = (size_t *)malloc((function->length + 1) * sizeof(size_t));
+    assert(labels && fixups);
+
+    for(int i = 0; i < function->length; i++) {
+        const MachineInstr * instr = &function->code[i];
+        if(instr->op == M_LABEL) labels[instr->dst.imm] = buffer.length;
+        encode_instruction(&buffer, instr, &fixups[i]);
+    }
+
+    for(int i = 0; i < function->length; i++) {
+        if(!fixups[i]) continue;
+        int32_t offset = (int32_t)(labels[function->code[i].dst.imm] - (fixups[i] + 4));
+        memcpy(buffer.bytes + fixups[i], &offset, sizeof(offset));
+    }
+
+    free(fixups);
+    free(labels);
+    *size = buffer.length;
+    return buffer.bytes;
+}
+
+/**
+ * Returns the mnemonic of a machine instruction, without the condition
+ * of 'JCC' and 'SETCC'.
+ *
+ * @param op: The instruction
+ * @return: The mnemonic
+ */
+const char * machine_op_name(MachineOp op) {
+    return op < MACHINE_OP_COUNT ? op_names[op] : "?";
+}
+
+/**
+ * Returns the assembler name of a register.
+ *
+ * @param reg: The register
+ * @param size: Operand size in bytes, 1, 4 or 8; ignored for SSE registers
+ * @return: The name
+ */
+const char * machine_register_name(int reg, int size) {
+    static const char * const names64[] = {
+        "rax", "rcx", "rdx", "rbx", "rsp", "rbp", "rsi", "rdi",
+        "r8", "r9", "r10", "r11", "r12", "r13", "r14", "r15"
+    };
+    static const char * const names32[] = {
+        "eax", "ecx", "edx", "ebx", "esp", "ebp", "esi", "edi",
+        "r8d", "r9d", "r10d", "r11d", "r12d", "r13d", "r14d", "r15d"
+    };
+    static const char * const names8[] = {
+        "al", "cl", "dl", "bl", "spl", "bpl", "sil", "dil",
+        "r8b", "r9b", "r10b", "r11b", "r12b", "r13b", "r14b", "r15b"
+    };
+    static const char * const xmm[] = {
+        "xmm0", "xmm1", "xmm2", "xmm3", "xmm4", "xmm5", "xmm6", "xmm7",
+        "xmm8", "xmm9", "xmm10", "xmm11", "xmm12", "xmm13", "xmm14", "xmm15"
+    };
+
+    if(IS_XMM(reg)) return xmm[reg - XMM0];
+    if(reg < 0 || reg > R15) return "?";
+    return size == 1 ? names8[reg] : size == 4 ? names32[reg] : names64[reg];
+}
+
+/**
+ * Writes an operand in Intel syntax.
+ *
+ * @param out: The writer
+ * @param operand: The operand
+ * @param size: Size of a register operand in bytes
+ */
+static void write_operand(Writer * out, const Operand * operand, int size) {
+    switch(operand->kind) {
+        case OPERAND_REG:
+            writer_string(out, machine_register_name(operand->reg, size));
+            break;
+        case OPERAND_MEM:
+            writer_string(out, size == 1 ? "byte ptr [" : "qword ptr [");
+            writer_string(out, machine_register_name(operand->reg, 8));
+            if(operand->index != NO_REG) {
+                writer_string(out, " + ");
+                writer_string(out, machine_register_name(operand->index, 8));
+                writer_char(out, '*');
+                writer_char(out, (char)('0' + operand->scale));
+            }
+            if(operand->disp) {
+                writer_string(out, operand->disp < 0 ? " - " : " + ");
+                writer_int(out, operand->disp < 0 ? -(int64_t)operand->disp : operand->disp);
+            }
+            writer_char(out, ']');
+            break;
+        case OPERAND_IMM:
+            writer_int(out, operand->imm);
+            break;
+        case OPERAND_LABEL:
+            writer_string(out, ".L");
+            writer_int(out, operand->imm);
+            break;
+        default:
+            break;
+    }
+}
+
+/**
+ * Writes a human readable listing of a machine function in Intel syntax.
+ *
+ * @param out: The writer
+ * @param function: The function to write
+ */
+void machine_write(Writer * out, const MachineFunction * function) {
+    writer_string(out, function->name);
+    writer_string(out, ":\n");
+    for(int i = 0; i < function->length; i++) {
+        const MachineInstr * instr = &function->code[i];
+        if(instr->op == M_NOP) continue;
+        if(instr->op == M_LABEL) {
+            writer_string(out, ".L");
+            writer_int(out, instr->dst.imm);
+            writer_string(out, ":\n");
+            continue;
+        }
+
+        writer_string(out, "    ");
+        writer_string(out, op_names[instr->op]);
+        if(instr->op == M_JCC || instr->op == M_SETCC) writer_string(out, condition_names[instr->cond]);
+
+        bool zeroing = instr->op == M_XOR && operands_equal(&instr->dst, &instr->src);
+        int dst_size = instr->op == M_SETCC ? 1 : zeroing ? 4 : 8;
+        int src_size = instr->op == M_MOVZX ? 1 : zeroing ? 4 : 8;
+        if(instr->dst.kind != OPERAND_NONE) {
+            writer_char(out, ' ');
+            write_operand(out, &instr->dst, dst_size);
+        }
+        if(instr->src.kind != OPERAND_NONE) {
+            writer_string(out, ", ");
+            write_operand(out, &instr->src, src_size);
+        }
+        writer_char(out, '\n');
+    }
+}
+
+/**
+ * Prints a human readable listing of a machine function to a stream.
+ * Listings of many functions should share one writer with
+ * 'machine_write()' instead.
+ *
+ * @param out: The output stream
+ * @param function: The function to print
+ */
+void machine_print(FILE * out, const MachineFunction * function) {
+    fflush(out);
+    Writer * writer = init_writer(fileno(out));
+    machine_write(writer, function);
+    destroy_writer(writer);
+}
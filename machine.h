@@ -0,0 +1,167 @@
+#ifndef MACHINE_H
+#define MACHINE_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include "writer.h"
+
+/*
+ * x86-64 registers in hardware encoding order; the SSE registers follow
+ * the general purpose ones.
+ */
+typedef enum {
+    RAX, RCX, RDX, RBX, RSP, RBP, RSI, RDI,
+    R8, R9, R10, R11, R12, R13, R14, R15,
+    XMM0, XMM1, XMM2, XMM3, XMM4, XMM5, XMM6, XMM7,
+    XMM8, XMM9, XMM10, XMM11, XMM12, XMM13, XMM14, XMM15,
+    MACHINE_REGISTER_COUNT,
+    NO_REG = 0xff
+} MachineRegister;
+
+#define IS_XMM(r) ((r) >= XMM0 && (r) <= XMM15)
+
+/*
+ * Condition codes in hardware encoding order, so that flipping the lowest
+ * bit negates a condition.
+ */
+typedef enum {
+    CC_O, CC_NO, CC_B, CC_AE, CC_E, CC_NE, CC_BE, CC_A,
+    CC_S, CC_NS, CC_P, CC_NP, CC_L, CC_GE, CC_LE, CC_G
+} Condition;
+
+#define NEGATE(cc) ((Condition)((cc) ^ 1))
+
+typedef enum {
+    OPERAND_NONE,
+    OPERAND_REG,    // register
+    OPERAND_MEM,    // [reg + index * scale + disp]
+    OPERAND_IMM,    // immediate
+    OPERAND_LABEL   // jump target
+} OperandKind;
+
+typedef struct {
+    uint8_t kind;   // 'OperandKind'
+    uint8_t reg;    // register, or base register of a memory operand
+    uint8_t index;  // index register of a memory operand, 'NO_REG' if none
+    uint8_t scale;  // 1, 2, 4 or 8
+    int32_t disp;   // displacement of a memory operand
+    int64_t imm;    // immediate, or label number
+} Operand;
+
+/*
+ * X-macro list of the machine instructions the backend selects: name and
+ * mnemonic. Instructions take Intel operand order, destination first.
+ * 'IMUL' with an immediate multiplies the destination in place; 'CQO' and
+ * 'IDIV' implicitly use RAX and RDX; 'SETCC' writes the low byte of its
+ * register. 'LABEL' and 'NOP' emit no code.
+ */
+#define MACHINE_OP_LIST(X) \
+    X(MOV,       "mov")         \
+    X(LEA,       "lea")         \
+    X(ADD,       "add")         \
+    X(SUB,       "sub")         \
+    X(AND,       "and")         \
+    X(OR,        "or")          \
+    X(XOR,       "xor")         \
+    X(CMP,       "cmp")         \
+    X(TEST,      "test")        \
+    X(IMUL,      "imul")        \
+    X(NEG,       "neg")         \
+    X(CQO,       "cqo")         \
+    X(IDIV,      "idiv")        \
+    X(SETCC,     "set")         \
+    X(MOVZX,     "movzx")       \
+    X(JMP,       "jmp")         \
+    X(JCC,       "j")           \
+    X(CALL,      "call")        \
+    X(RET,       "ret")         \
+    X(PUSH,      "push")        \
+    X(POP,       "pop")         \
+    X(MOVSD,     "movsd")       \
+    X(ADDSD,     "addsd")       \
+    X(SUBSD,     "subsd")       \
+    X(MULSD,     "mulsd")       \
+    X(DIVSD,     "divsd")       \
+    X(UCOMISD,   "ucomisd")     \
+    X(XORPD,     "xorpd")       \
+    X(CVTSI2SD,  "cvtsi2sd")    \
+    X(CVTTSD2SI, "cvttsd2si")   \
+    X(MOVQ,      "movq")        \
+    X(LABEL,     "")            \
+    X(NOP,       "")
+
+typedef enum {
+#define MACHINE_OP_ENUM(name, mnemonic) M_##name,
+    MACHINE_OP_LIST(MACHINE_OP_ENUM)
+#undef MACHINE_OP_ENUM
+    MACHINE_OP_COUNT
+} MachineOp;
+
+#define LIKELY_SCALE   1024     // branch probability 1
+#define LIKELY_UNKNOWN 0xffff   // branch probability not known
+
+typedef struct {
+    uint8_t op;         // 'MachineOp'
+    uint8_t cond;       // 'Condition' of 'JCC' and 'SETCC'
+    uint16_t likely;    // probability that a 'JCC' is taken, in 1/'LIKELY_SCALE'
+    Operand dst;        // destination, or the only operand
+    Operand src;        // source
+} MachineInstr;
+
+typedef struct {
+    char * name;            // function name, for listings
+    MachineInstr * code;    // instructions
+    int length;             // number of instructions
+    int capacity;           // allocated instructions
+    int label_count;        // labels allocated by 'machine_new_label()'
+} MachineFunction;
+
+static inline Operand reg_operand(int reg) {
+    Operand o = { OPERAND_REG, (uint8_t)reg, NO_REG, 1, 0, 0 };
+    return o;
+}
+
+static inline Operand mem_operand(int base, int32_t disp) {
+    Operand o = { OPERAND_MEM, (uint8_t)base, NO_REG, 1, disp, 0 };
+    return o;
+}
+
+static inline Operand index_operand(int base, int index, int scale, int32_t disp) {
+    Operand o = { OPERAND_MEM, (uint8_t)base, (uint8_t)index, (uint8_t)scale, disp, 0 };
+    return o;
+}
+
+static inline Operand imm_operand(int64_t imm) {
+    Operand o = { OPERAND_IMM, NO_REG, NO_REG, 1, 0, imm };
+    return o;
+}
+
+static inline Operand label_operand(int label) {
+    Operand o = { OPERAND_LABEL, NO_REG, NO_REG, 1, 0, label };
+    return o;
+}
+
+static inline Operand no_operand(void) {
+    Operand o = { OPERAND_NONE, NO_REG, NO_REG, 1, 0, 0 };
+    return o;
+}
+
+MachineFunction * init_machine_function(const char * name);
+void destroy_machine_function(MachineFunction * function);
+int machine_new_label(MachineFunction * function);
+int machine_emit(MachineFunction * function, MachineOp op, Operand dst, Operand src);
+int machine_emit_cc(MachineFunction * function, MachineOp op, Condition cond, Operand dst);
+void machine_remove_nops(MachineFunction * function);
+bool operands_equal(const Operand * a, const Operand * b);
+bool machine_reads(const MachineInstr * instr, int reg);
+bool machine_writes(const MachineInstr * instr, int reg);
+bool machine_reads_flags(const MachineInstr * instr);
+bool machine_writes_flags(const MachineInstr * instr);
+uint8_t * machine_encode(const MachineFunction * function, size_t * size);
+const char * machine_op_name(MachineOp op);
+const char * machine_register_name(int reg, int size);
+void machine_write(Writer * out, const MachineFunction * function);
+void machine_print(FILE * out, const MachineFunction * function);
+
+#endif // MACHINE_H
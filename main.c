@@ -0,0 +1,104 @@
+/**
+ * This file contains the entry point of the compiler.
+ *
+ *   sloth [-j N] [-O0] [--emit=c|llvm] [--trace=FILE] [--mem-stats] [--profile-use=FILE] file.sloth...
+ *   sloth --server SOCKET [--trace=FILE]
+ *   sloth --connect SOCKET [-j N] [-O0] file.sloth...
+ *   sloth --bench [options]
+ *   sloth --run [--native[=all]] [--profile[=FILE]] [--profile-generate=FILE]
+ *               IMAGE FUNCTION [ARG...]
+ *
+ * The first form compiles the files in this process (see driver.c). The
+ * second starts a compile server listening on SOCKET, and the third has
+ * that server compile the files instead (see server.c); both print the
+ * same messages and exit with the same status. The fourth generates
+ * programs of many kinds and sizes and measures how fast the compiler
+ * gets through them (see bench.c). The last calls a function of a
+ * compiled image and prints its result, interpreted or as native code
+ * (see run.c).
+ *
+ * Usage:
+ *  - '-j N' compiles with N workers
+ *  - '-O0' skips the bytecode optimizer
+ *  - '--emit=c' and '--emit=llvm' write C source 'file.c' or LLVM IR
+ *    'file.ll' instead of the image (see cgen.c and llvmgen.c)
+ *  - '--trace=FILE' writes a timeline of the compiler's phases on every
+ *    thread to FILE, which Perfetto (ui.perfetto.dev) displays
+ *  - '--mem-stats' prints the allocations, bytes allocated and peak bytes
+ *    in use of every phase (see alloc.c)
+ *  - '--profile-use=FILE' optimizes with the execution counts collected by
+ *    '--run --profile-generate=FILE' (see feedback.c)
+ *  - The exit status is 1 if any unit failed to compile
+ *
+ * @file    main.c
+ */
+#include <stdio.h>
+#include <string.h>
+#include "driver.h"
+#include "server.h"
+#include "bench.h"
+#include "run.h"
+#include "trace.h"
+#include "alloc.h"
+
+static void usage(void) {
+    fprintf(stderr, "usage: sloth [-j N] [-O0] [--emit=c|llvm] [--trace=FILE] [--mem-stats]\n"
+                    "             [--profile-use=FILE] file...\n"
+                    "       sloth --server SOCKET [--trace=FILE]\n"
+                    "       sloth --connect SOCKET [-j N] [-O0] file...\n"
+                    "       sloth --bench [--lines=N,...] [--baseline=FILE] [--threshold=PERCENT] ...\n"
+                    "       sloth --run [--native[=all]] [--profile[=FILE]] [--profile-generate=FILE]\n"
+                    "                   IMAGE FUNCTION [ARG...]\n");
+}
+
+static void print_report(const Unit * unit, void * context) {
+    (void)context;
+    if(unit->diagnostics.length > 0) fwrite(unit->diagnostics.text, 1, unit->diagnostics.length, stderr);
+}
+
+int main(int argc, char ** argv) {
+    if((argc == 3 || argc == 4) && strcmp(argv[1], "--server") == 0) {
+        if(argc == 4 && (strncmp(argv[3], "--trace=", 8) != 0 || !argv[3][8])) {
+            usage();
+            return 1;
+        }
+        return run_server(argv[2], argc == 4 ? argv[3] + 8 : NULL);
+    }
+    if(argc >= 3 && strcmp(argv[1], "--connect") == 0) return run_client(argv[2], argc - 3, argv + 3);
+    if(argc >= 2 && strcmp(argv[1], "--bench") == 0) return run_bench(argc - 2, argv + 2);
+    if(argc >= 2 && strcmp(argv[1], "--run") == 0) return run_program(argc - 2, argv + 2);
+
+    DriverOptions options;
+    if(!init_driver_options(&options, argc - 1, argv + 1)) {
+        destroy_driver_options(&options);
+        usage();
+        return 1;
+    }
+    Feedback * feedback = NULL;
+    if(options.profile_use) {
+        feedback = read_feedback(options.profile_use);
+        if(!feedback) {
+            fprintf(stderr, "sloth: cannot read the profile '%s'\n", options.profile_use);
+            destroy_driver_options(&options);
+            return 1;
+        }
+        options.feedback = feedback;
+    }
+    if(options.trace) {
+        trace_start(options.trace);
+        trace_thread_name("main");
+    }
+    if(options.mem_stats) accounting_start();
+    bool ok = compile_files(&options, NULL, print_report, NULL);
+    if(options.mem_stats) {
+        accounting_stop();
+        accounting_report(stderr);
+    }
+    if(options.trace && !trace_stop()) {
+        fprintf(stderr, "sloth: cannot write '%s'\n", options.trace);
+        ok = false;
+    }
+    if(feedback) destroy_feedback(feedback);
+    destroy_driver_options(&options);
+    return ok ? 0 : 1;
+}
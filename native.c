@@ -0,0 +1,1288 @@
+/**
+ * This file contains the native backend of the optimizing tier, which
+ * compiles the bytecode of one function of a linked image into x86-64
+ * machine code.
+ *
+ * Compilation runs in five steps. The integer registers used most often,
+ * weighted by loop nesting, are allocated to callee saved machine
+ * registers, and in leaf functions the float registers to XMM2 to XMM15;
+ * all other registers stay in the function's register file on the
+ * virtual machine's stack. Integer temporaries written and read once
+ * within a basic block are folded into expression trees, which are tiled
+ * with a table of x86-64 patterns, so 'a + b * 4' becomes one 'lea' and a
+ * compare feeding a conditional jump becomes 'cmp' and 'jcc'. Float, call
+ * and division instructions are lowered through the scratch registers by
+ * fixed templates. The basic blocks are then reordered so that likely
+ * branches fall through, using execution counts when the context carries
+ * them, and the peephole optimizer cleans up the moves the selection
+ * leaves behind before the code is encoded.
+ *
+ * Compiled functions use the 'NativeFunction' convention. RBX holds the
+ * virtual machine and R12 the register file; calls go through
+ * 'vm_native_call()', after which R12 is recomputed because the stack may
+ * have moved. Leaf functions, which make no calls, keep both in RDI and
+ * RSI where they arrive and need no stack frame at all. Only the callee
+ * saved registers a function actually uses are saved. Run-time errors set
+ * 'vm->error' and return 0.
+ *
+ * Usage:
+ *  - Install 'native_compile()' and 'native_release()' with
+ *    'vm_set_compiler()', passing a 'NativeContext' as context
+ *  - Use 'native_lower()' to inspect the selected instructions
+ *
+ * @file    native.c
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stddef.h>
+#include <assert.h>
+#include <sys/mman.h>
+#include "native.h"
+#include "layout.h"
+#include "peephole.h"
+#include "vm.h"
+
+#define VM_STACK  ((int32_t)offsetof(Vm, stack))
+#define VM_ERROR  ((int32_t)offsetof(Vm, error))
+
+#define FRAME_OFFSET mem_operand(RSP, 0)   // offset of the register file on the stack
+
+#define MAX_TREE_DEPTH 6      // instructions folded into one tree, from root to leaf
+#define MAX_TREE_NODES 256    // nodes of a tree of 'MAX_TREE_DEPTH'
+
+// Scratch registers are never live at labels and jump targets
+#define SCRATCH ((1ull << RAX) | (1ull << RCX) | (1ull << RDX) | (1ull << RSI) | (1ull << RDI) \
+                 | (1ull << R8) | (1ull << R9) | (1ull << R10) | (1ull << R11) | (1ull << XMM0) | (1ull << XMM1))
+
+static const int allocatable[NATIVE_ALLOCATABLE] = { R13, R14, R15, RBP };
+static const int float_allocatable[NATIVE_FLOAT_ALLOCATABLE] = {
+    XMM2, XMM3, XMM4, XMM5, XMM6, XMM7, XMM8, XMM9, XMM10, XMM11, XMM12, XMM13, XMM14, XMM15
+};
+static const int saved[] = { RBP, RBX, R12, R13, R14, R15 };
+
+#define SAVED_COUNT ((int)(sizeof(saved) / sizeof(saved[0])))
+
+static const int scratch[] = { RAX, RCX, RDX, RSI, RDI, R8, R9, R10, R11 };
+
+static const char division_by_zero[] = "division by zero";
+
+typedef enum {
+    NODE_REG,       // leaf: a register not computed by the tree
+    NODE_CONST,     // leaf: an integer constant
+    NODE_ADD,
+    NODE_SUB,
+    NODE_MUL,
+    NODE_NEG,
+    NODE_COMPARE    // 0 or 1 by 'cond'
+} NodeKind;
+
+typedef struct Node {
+    uint8_t kind;           // 'NodeKind'
+    uint8_t cond;           // 'Condition' of a compare
+    int reg;                // register of a leaf
+    int64_t value;          // value of a constant
+    struct Node * kids[2];  // operands
+} Node;
+
+typedef struct {
+    const Image * image;
+    const ImageFunction * function;
+    const uint32_t * code;          // the function's instructions
+    const uint8_t * types;          // 'ValueType' of every register
+    const FeedbackFunction * profile;   // execution counts of the function, NULL if unknown
+    uint8_t map[MAX_REGISTERS];     // machine register of each register, 'NO_REG' if in memory
+    bool leaf;                      // the function makes no calls
+    int vm;                         // machine register holding the virtual machine
+    int file;                       // machine register holding the register file
+    int saved[SAVED_COUNT];         // callee saved registers the function uses
+    int saved_count;
+    MachineFunction * out;
+    int fail;                       // label returning 0 after a failed call
+    int divide;                     // label reporting a division by zero
+
+    int definition[MAX_REGISTERS];  // instruction writing each register, -1 if none
+    bool * folded;                  // instructions folded into the tree of a later one
+    Node nodes[MAX_TREE_NODES];     // the tree being selected
+    int node_count;
+    uint32_t busy;                  // scratch registers in use, one bit per 'scratch' entry
+    uint32_t reserved;              // scratch registers the function keeps for itself
+} Lowering;
+
+/*
+ * Operands of an 'lea' bound by a pattern: base + index * scale + disp.
+ */
+typedef struct {
+    const Node * base;
+    const Node * index;     // NULL if none
+    int scale;
+    int64_t disp;
+} Address;
+
+/*
+ * A tile: the kind of node it covers, a matcher checking the shape of the
+ * tree below and binding operands, and the emitter of its instructions,
+ * which returns the scratch register holding the result.
+ */
+typedef struct {
+    uint8_t kind;
+    bool (*match)(const Node * node, Address * address);
+    int (*emit)(Lowering * l, const Node * node, const Address * address);
+} Pattern;
+
+/**
+ * Returns the target of a jump instruction.
+ *
+ * @param code: The function's code
+ * @param pc: The index of the jump
+ * @return: The index of the target, or -1 if the instruction is no jump
+ */
+static int jump_target(const uint32_t * code, int pc) {
+    switch(OP(code[pc])) {
+        case OP_JMP:  return pc + 1 + ARG_SJ(code[pc]);
+        case OP_JMPT: return pc + 1 + ARG_SBX(code[pc]);
+        case OP_JMPF: return pc + 1 + ARG_SBX(code[pc]);
+        default:      return -1;
+    }
+}
+
+/**
+ * Returns the location of a register: its machine register if allocated,
+ * otherwise its slot in the register file.
+ *
+ * @param l: The lowering state
+ * @param r: The register
+ * @return: The operand
+ */
+static Operand loc(Lowering * l, int r) {
+    return l->map[r] != NO_REG ? reg_operand(l->map[r]) : mem_operand(l->file, r * (int32_t)sizeof(Value));
+}
+
+static void emit(Lowering * l, MachineOp op, Operand dst, Operand src) {
+    machine_emit(l->out, op, dst, src);
+}
+
+/**
+ * Emits a conditional jump with the probability that it is taken.
+ */
+static void emit_jcc(Lowering * l, Condition cc, int target, uint16_t likely) {
+    int index = machine_emit_cc(l->out, M_JCC, cc, label_operand(target));
+    l->out->code[index].likely = likely;
+}
+
+static bool uses_register(const Operand * operand, int reg) {
+    if(operand->kind == OPERAND_REG) return operand->reg == reg;
+    if(operand->kind == OPERAND_MEM) return operand->reg == reg || operand->index == reg;
+    return false;
+}
+
+/**
+ * Adds the weight of one use to the registers an instruction reads or
+ * writes. Immediates and flags in the B and C fields are skipped.
+ *
+ * @param weights: Weight of every register
+ * @param i: The instruction
+ * @param weight: Weight of the instruction
+ */
+static void count_uses(uint64_t * weights, uint32_t i, uint64_t weight) {
+    switch(OP(i)) {
+        case OP_JMP:
+            break;
+        case OP_LOADK: case OP_LOADI: case OP_JMPT: case OP_JMPF: case OP_CALL: case OP_RET:
+            weights[ARG_A(i)] += weight;
+            break;
+        case OP_MOVE: case OP_ADDI: case OP_NEG_I: case OP_NEG_F: case OP_NOT: case OP_I2F: case OP_F2I:
+        case OP_JEQ_I: case OP_JLT_I: case OP_JLE_I: case OP_JEQ_F: case OP_JLT_F: case OP_JLE_F:
+            weights[ARG_A(i)] += weight;
+            weights[ARG_B(i)] += weight;
+            break;
+        default:
+            weights[ARG_A(i)] += weight;
+            weights[ARG_B(i)] += weight;
+            weights[ARG_C(i)] += weight;
+            break;
+    }
+}
+
+/**
+ * Allocates the registers of one type with the highest use counts to the
+ * given machine registers.
+ *
+ * @param l: The lowering state
+ * @param weights: Weighted use count of every register
+ * @param type: The 'ValueType' to allocate
+ * @param machine: The machine registers
+ * @param count: Number of machine registers
+ */
+static void allocate_type(Lowering * l, const uint64_t * weights, int type, const int * machine, int count) {
+    for(int n = 0; n < count; n++) {
+        int best = -1;
+        for(int r = 0; r < l->function->register_count; r++) {
+            if(l->types[r] != type || l->map[r] != NO_REG || weights[r] == 0) continue;
+            if(best < 0 || weights[r] > weights[best]) best = r;
+        }
+        if(best < 0) break;
+        l->map[best] = (uint8_t)machine[n];
+    }
+}
+
+/**
+ * Allocates the registers with the highest use counts to machine
+ * registers. Each use weighs 8 to the power of its loop depth, where loops
+ * are found as the ranges spanned by backwards jumps. No SSE register
+ * survives a call, so floats are only allocated in leaf functions.
+ *
+ * @param l: The lowering state
+ */
+static void allocate_registers(Lowering * l) {
+    int length = (int)l->function->code_length;
+    int * depth = (int *)calloc(length + 1, sizeof(int));
+    uint64_t weights[MAX_REGISTERS] = { 0 };
+    assert(depth);
+
+    for(int pc = 0; pc < length; pc++) {
+        int target = jump_target(l->code, pc);
+        if(target >= 0 && target <= pc) {
+            for(int q = target; q <= pc; q++) depth[q]++;
+        }
+    }
+    for(int pc = 0; pc < length; pc++) {
+        int d = depth[pc] < 6 ? depth[pc] : 6;
+        count_uses(weights, l->code[pc], (uint64_t)1 << (3 * d));
+    }
+    free(depth);
+
+    memset(l->map, NO_REG, sizeof(l->map));
+    allocate_type(l, weights, TYPE_INT, allocatable, NATIVE_ALLOCATABLE);
+    if(l->leaf) allocate_type(l, weights, TYPE_FLOAT, float_allocatable, NATIVE_FLOAT_ALLOCATABLE);
+}
+
+/**
+ * Chooses the registers holding the virtual machine and the register file
+ * and collects the callee saved registers to preserve. A leaf function
+ * keeps its arguments in RDI and RSI, which are taken out of the scratch
+ * pool; other functions move them to RBX and R12, which survive calls.
+ *
+ * @param l: The lowering state
+ */
+static void assign_frame(Lowering * l) {
+    l->vm = l->leaf ? RDI : RBX;
+    l->file = l->leaf ? RSI : R12;
+    l->reserved = 0;
+    for(int s = 0; s < (int)(sizeof(scratch) / sizeof(scratch[0])); s++) {
+        if(scratch[s] == l->vm || scratch[s] == l->file) l->reserved |= 1u << s;
+    }
+
+    l->saved_count = 0;
+    for(int s = 0; s < SAVED_COUNT; s++) {
+        bool used = saved[s] == l->vm || saved[s] == l->file;
+        for(int r = 0; r < MAX_REGISTERS && !used; r++) used = l->map[r] == saved[s];
+        if(used) l->saved[l->saved_count++] = saved[s];
+    }
+}
+
+/**
+ * Returns the bytes a function that makes calls reserves below its saved
+ * registers: the slot of the frame offset, rounded so that the stack is
+ * 16 byte aligned at calls again after the return address and the pushes.
+ */
+static int32_t frame_size(const Lowering * l) {
+    return l->saved_count % 2 ? 16 : 8;
+}
+
+/**
+ * Emits the prologue: saves the callee saved registers in use and loads
+ * allocated parameters. Functions that make calls also align the stack
+ * and record the offset of the register file.
+ *
+ * @param l: The lowering state
+ */
+static void emit_prologue(Lowering * l) {
+    for(int s = 0; s < l->saved_count; s++) emit(l, M_PUSH, reg_operand(l->saved[s]), no_operand());
+    if(!l->leaf) {
+        emit(l, M_SUB, reg_operand(RSP), imm_operand(frame_size(l)));
+        emit(l, M_MOV, reg_operand(RBX), reg_operand(RDI));
+        emit(l, M_MOV, reg_operand(R12), reg_operand(RSI));
+        emit(l, M_MOV, reg_operand(RAX), reg_operand(R12));
+        emit(l, M_SUB, reg_operand(RAX), mem_operand(RBX, VM_STACK));
+        emit(l, M_MOV, FRAME_OFFSET, reg_operand(RAX));
+    }
+
+    for(int p = 0; p < l->function->param_count; p++) {
+        if(l->map[p] == NO_REG) continue;
+        MachineOp load = IS_XMM(l->map[p]) ? M_MOVSD : M_MOV;
+        emit(l, load, reg_operand(l->map[p]), mem_operand(l->file, p * (int32_t)sizeof(Value)));
+    }
+}
+
+/**
+ * Emits an epilogue returning the value in RAX. Every return gets its
+ * own copy so that no value has to live across a jump.
+ *
+ * @param l: The lowering state
+ */
+static void emit_epilogue(Lowering * l) {
+    if(!l->leaf) emit(l, M_ADD, reg_operand(RSP), imm_operand(frame_size(l)));
+    for(int s = l->saved_count - 1; s >= 0; s--) emit(l, M_POP, reg_operand(l->saved[s]), no_operand());
+    emit(l, M_RET, no_operand(), no_operand());
+}
+
+/**
+ * Lowers a float operation 'R[A] = R[B] op R[C]'.
+ */
+static void lower_float(Lowering * l, MachineOp op, int a, int b, int c) {
+    emit(l, M_MOVSD, reg_operand(XMM0), loc(l, b));
+    emit(l, op, reg_operand(XMM0), loc(l, c));
+    emit(l, M_MOVSD, loc(l, a), reg_operand(XMM0));
+}
+
+/**
+ * Stores the condition of the last compare as 0 or 1 into R[A].
+ */
+static void lower_set(Lowering * l, Condition cc, int a) {
+    machine_emit_cc(l->out, M_SETCC, cc, reg_operand(RAX));
+    emit(l, M_MOVZX, reg_operand(RAX), reg_operand(RAX));
+    emit(l, M_MOV, loc(l, a), reg_operand(RAX));
+}
+
+/**
+ * Compares two floats with 'ucomisd', which sets the flags like an
+ * unsigned compare and reports unordered operands as 'P', 'Z' and 'C'.
+ * Less-than is tested as 'y > x' so that NaN compares false.
+ */
+static void lower_ucomisd(Lowering * l, int x, int y) {
+    emit(l, M_MOVSD, reg_operand(XMM0), loc(l, x));
+    emit(l, M_UCOMISD, reg_operand(XMM0), loc(l, y));
+}
+
+/**
+ * Lowers a float equality test; equal operands must also be ordered.
+ */
+static void lower_float_equal(Lowering * l, bool equal, int a, int b, int c) {
+    lower_ucomisd(l, b, c);
+    machine_emit_cc(l->out, M_SETCC, equal ? CC_E : CC_NE, reg_operand(RAX));
+    emit(l, M_MOVZX, reg_operand(RAX), reg_operand(RAX));
+    machine_emit_cc(l->out, M_SETCC, equal ? CC_NP : CC_P, reg_operand(RCX));
+    emit(l, M_MOVZX, reg_operand(RCX), reg_operand(RCX));
+    emit(l, equal ? M_AND : M_OR, reg_operand(RAX), reg_operand(RCX));
+    emit(l, M_MOV, loc(l, a), reg_operand(RAX));
+}
+
+/**
+ * Lowers a conversion to 'int' that saturates like 'float_to_int()'.
+ * 'cvttsd2si' returns INT64_MIN for NaN and values out of range, the only
+ * result for which subtracting 1 overflows. Those are fixed up without
+ * branches: positive values become INT64_MIN - 1, i.e. INT64_MAX, and NaN
+ * is masked to 0. Scratch registers die at labels, so both paths store.
+ */
+static void lower_float_to_int(Lowering * l, int a, int b) {
+    int done = machine_new_label(l->out);
+    emit(l, M_CVTTSD2SI, reg_operand(RAX), loc(l, b));
+    emit(l, M_MOV, loc(l, a), reg_operand(RAX));
+    emit(l, M_CMP, reg_operand(RAX), imm_operand(1));
+    emit_jcc(l, CC_NO, done, LIKELY_SCALE);
+    emit(l, M_MOVSD, reg_operand(XMM0), loc(l, b));
+    emit(l, M_XORPD, reg_operand(XMM1), reg_operand(XMM1));
+    emit(l, M_UCOMISD, reg_operand(XMM0), reg_operand(XMM1));
+    machine_emit_cc(l->out, M_SETCC, CC_A, reg_operand(RCX));
+    emit(l, M_MOVZX, reg_operand(RCX), reg_operand(RCX));
+    machine_emit_cc(l->out, M_SETCC, CC_NP, reg_operand(RDX));
+    emit(l, M_MOVZX, reg_operand(RDX), reg_operand(RDX));
+    emit(l, M_SUB, reg_operand(RAX), reg_operand(RCX));
+    emit(l, M_NEG, reg_operand(RDX), no_operand());
+    emit(l, M_AND, reg_operand(RAX), reg_operand(RDX));
+    emit(l, M_MOV, loc(l, a), reg_operand(RAX));
+    emit(l, M_LABEL, label_operand(done), no_operand());
+}
+
+/**
+ * Lowers a division or remainder, checking for a zero divisor first. A
+ * divisor of -1 is handled apart, as 'idiv' faults on INT64_MIN / -1: the
+ * quotient is the negated dividend, wrapping around, and the remainder 0.
+ */
+static void lower_divide(Lowering * l, bool remainder, int a, int b, int c) {
+    int minus = machine_new_label(l->out), done = machine_new_label(l->out);
+    emit(l, M_MOV, reg_operand(RCX), loc(l, c));
+    emit(l, M_TEST, reg_operand(RCX), reg_operand(RCX));
+    emit_jcc(l, CC_E, l->divide, 0);
+    emit(l, M_CMP, reg_operand(RCX), imm_operand(-1));
+    emit_jcc(l, CC_E, minus, 0);
+    emit(l, M_MOV, reg_operand(RAX), loc(l, b));
+    emit(l, M_CQO, no_operand(), no_operand());
+    emit(l, M_IDIV, reg_operand(RCX), no_operand());
+    emit(l, M_MOV, loc(l, a), reg_operand(remainder ? RDX : RAX));
+    emit(l, M_JMP, label_operand(done), no_operand());
+
+    // Scratch registers die at labels, so the dividend is loaded again
+    emit(l, M_LABEL, label_operand(minus), no_operand());
+    if(remainder) {
+        emit(l, M_MOV, reg_operand(RAX), imm_operand(0));
+    } else {
+        emit(l, M_MOV, reg_operand(RAX), loc(l, b));
+        emit(l, M_NEG, reg_operand(RAX), no_operand());
+    }
+    emit(l, M_MOV, loc(l, a), reg_operand(RAX));
+    emit(l, M_LABEL, label_operand(done), no_operand());
+}
+
+/**
+ * Returns the registers an instruction reads.
+ *
+ * @param l: The lowering state
+ * @param i: The instruction
+ * @param regs: Receives the registers, at most 'MAX_REGISTERS'
+ * @return: The number of registers
+ */
+static int instruction_reads(const Lowering * l, uint32_t i, int * regs) {
+    switch(OP(i)) {
+        case OP_LOADK: case OP_LOADI: case OP_JMP:
+            return 0;
+        case OP_MOVE: case OP_ADDI: case OP_NEG_I: case OP_NEG_F: case OP_NOT: case OP_I2F: case OP_F2I:
+            regs[0] = ARG_B(i);
+            return 1;
+        case OP_JMPT: case OP_JMPF: case OP_RET:
+            regs[0] = ARG_A(i);
+            return 1;
+        case OP_JEQ_I: case OP_JLT_I: case OP_JLE_I: case OP_JEQ_F: case OP_JLT_F: case OP_JLE_F:
+            regs[0] = ARG_A(i);
+            regs[1] = ARG_B(i);
+            return 2;
+        case OP_CALL: {
+            int count = image_functions(l->image)[ARG_BX(i)].param_count;
+            for(int p = 0; p < count; p++) regs[p] = ARG_A(i) + p;
+            return count;
+        }
+        default:
+            regs[0] = ARG_B(i);
+            regs[1] = ARG_C(i);
+            return 2;
+    }
+}
+
+/**
+ * Returns the register an instruction writes.
+ *
+ * @param i: The instruction
+ * @return: The register, or -1 for jumps and returns
+ */
+static int instruction_writes(uint32_t i) {
+    switch(OP(i)) {
+        case OP_JMP: case OP_JMPT: case OP_JMPF: case OP_RET:
+        case OP_JEQ_I: case OP_JLT_I: case OP_JLE_I: case OP_JEQ_F: case OP_JLT_F: case OP_JLE_F:
+            return -1;
+        default:
+            return ARG_A(i);
+    }
+}
+
+/**
+ * Checks if an instruction computes an integer expression that can become
+ * an inner node of a tree.
+ */
+static bool is_expression(const Lowering * l, uint32_t i) {
+    switch(OP(i)) {
+        case OP_LOADK:
+            return image_constant_types(l->image)[ARG_BX(i)] == CONSTANT_INT;
+        case OP_MOVE:
+            return l->types[ARG_A(i)] == TYPE_INT;
+        case OP_LOADI: case OP_ADD_I: case OP_ADDI: case OP_SUB_I: case OP_MUL_I: case OP_NEG_I:
+        case OP_EQ_I: case OP_NE_I: case OP_LT_I: case OP_LE_I:
+            return true;
+        default:
+            return false;
+    }
+}
+
+/**
+ * Checks if an instruction can take a tree as its operand. Divisions,
+ * calls and float conversions use fixed registers and only take leaves.
+ */
+static bool takes_expression(const Lowering * l, uint32_t i) {
+    switch(OP(i)) {
+        case OP_JMPT: case OP_JMPF: case OP_JEQ_I: case OP_JLT_I: case OP_JLE_I:
+            return true;
+        case OP_RET:
+            return l->function->return_type == TYPE_INT;
+        default:
+            return is_expression(l, i);
+    }
+}
+
+/**
+ * Finds the expression trees of a function. An integer register written
+ * and read exactly once, by a later instruction of the same basic block,
+ * is a temporary: its defining instruction is folded into the tree of the
+ * reader, as long as none of its own operands change before the root of
+ * that tree is evaluated. Trees are cut at 'MAX_TREE_DEPTH' levels so that
+ * the scratch registers always suffice.
+ *
+ * @param l: The lowering state
+ */
+static void find_expressions(Lowering * l) {
+    int length = (int)l->function->code_length;
+    int writes[MAX_REGISTERS] = { 0 }, reads[MAX_REGISTERS] = { 0 };
+    int regs[MAX_REGISTERS];
+    bool * leader = (bool *)calloc(length + 1, sizeof(bool));
+    int * reader = (int *)malloc((length + 1) * sizeof(int));
+    int * root = (int *)malloc((length + 1) * sizeof(int));
+    int * depth = (int *)malloc((length + 1) * sizeof(int));
+    l->folded = (bool *)calloc(length + 1, sizeof(bool));
+    assert(leader && reader && root && depth && l->folded);
+
+    for(int r = 0; r < MAX_REGISTERS; r++) l->definition[r] = -1;
+    for(int pc = 0; pc < length; pc++) {
+        uint32_t i = l->code[pc];
+        int count = instruction_reads(l, i, regs);
+        for(int n = 0; n < count; n++) reads[regs[n]]++;
+        if(instruction_writes(i) >= 0) {
+            writes[instruction_writes(i)]++;
+            l->definition[instruction_writes(i)] = pc;
+        }
+
+        int target = jump_target(l->code, pc);
+        if(target >= 0 && target <= length) leader[target] = true;
+        if(target >= 0 || OP(i) == OP_RET) leader[pc + 1] = true;
+    }
+
+    // Backwards, so that the root of every reader is known
+    for(int pc = length - 1; pc >= 0; pc--) {
+        uint32_t i = l->code[pc];
+        int t = instruction_writes(i);
+        reader[pc] = root[pc] = -1;
+        if(!is_expression(l, i) || t < l->function->param_count || writes[t] != 1 || reads[t] != 1) continue;
+
+        int sources[2];
+        int source_count = instruction_reads(l, i, sources);
+        int q;
+        for(q = pc + 1; q < length && !leader[q]; q++) {
+            int count = instruction_reads(l, l->code[q], regs);
+            bool found = false;
+            for(int n = 0; n < count; n++) found |= regs[n] == t;
+            if(found) break;
+            for(int n = 0; n < source_count; n++) {
+                if(instruction_writes(l->code[q]) == sources[n]) q = length;
+            }
+        }
+        if(q >= length || leader[q] || !takes_expression(l, l->code[q])) continue;
+
+        int end = root[q] >= 0 ? root[q] : q;
+        bool stable = true;
+        for(int p = q; p < end; p++) {
+            for(int n = 0; n < source_count; n++) stable &= instruction_writes(l->code[p]) != sources[n];
+        }
+        if(!stable) continue;
+
+        reader[pc] = q;
+        root[pc] = end;
+        l->folded[pc] = true;
+    }
+
+    // Forwards, cutting the deepest subtrees of trees that grow too deep
+    for(int pc = 0; pc < length; pc++) {
+        depth[pc] = 1;
+        int count = instruction_reads(l, l->code[pc], regs);
+        for(int n = 0; n < count; n++) {
+            int d = l->definition[regs[n]];
+            if(d < 0 || !l->folded[d] || reader[d] != pc) continue;
+            if(depth[d] + 1 > MAX_TREE_DEPTH) l->folded[d] = false;
+            else if(depth[d] + 1 > depth[pc]) depth[pc] = depth[d] + 1;
+        }
+    }
+
+    free(depth);
+    free(root);
+    free(reader);
+    free(leader);
+}
+
+static Node * new_node(Lowering * l, int kind) {
+    assert(l->node_count < MAX_TREE_NODES);
+    Node * node = &l->nodes[l->node_count++];
+    memset(node, 0, sizeof(Node));
+    node->kind = (uint8_t)kind;
+    return node;
+}
+
+static Node * constant_node(Lowering * l, int64_t value) {
+    Node * node = new_node(l, NODE_CONST);
+    node->value = value;
+    return node;
+}
+
+static Node * build_tree(Lowering * l, int pc);
+
+/**
+ * Returns the tree computing the value of a register read at the root
+ * being built: the folded definition if there is one, otherwise a leaf.
+ */
+static Node * operand_tree(Lowering * l, int r) {
+    int d = l->definition[r];
+    if(d >= 0 && l->folded[d]) return build_tree(l, d);
+    Node * node = new_node(l, NODE_REG);
+    node->reg = r;
+    return node;
+}
+
+static Node * binary_node(Lowering * l, int kind, Node * left, Node * right) {
+    Node * node = new_node(l, kind);
+    node->kids[0] = left;
+    node->kids[1] = right;
+    return node;
+}
+
+/**
+ * Builds the tree of an expression instruction and its folded operands.
+ *
+ * @param l: The lowering state
+ * @param pc: Index of the instruction
+ * @return: The root node
+ */
+static Node * build_tree(Lowering * l, int pc) {
+    uint32_t i = l->code[pc];
+    Node * node;
+    switch(OP(i)) {
+        case OP_LOADK: return constant_node(l, image_constants(l->image)[ARG_BX(i)].i);
+        case OP_LOADI: return constant_node(l, ARG_SBX(i));
+        case OP_MOVE:  return operand_tree(l, ARG_B(i));
+        case OP_ADD_I: return binary_node(l, NODE_ADD, operand_tree(l, ARG_B(i)), operand_tree(l, ARG_C(i)));
+        case OP_ADDI:  return binary_node(l, NODE_ADD, operand_tree(l, ARG_B(i)), constant_node(l, ARG_SC(i)));
+        case OP_SUB_I: return binary_node(l, NODE_SUB, operand_tree(l, ARG_B(i)), operand_tree(l, ARG_C(i)));
+        case OP_MUL_I: return binary_node(l, NODE_MUL, operand_tree(l, ARG_B(i)), operand_tree(l, ARG_C(i)));
+        case OP_NEG_I: return binary_node(l, NODE_NEG, operand_tree(l, ARG_B(i)), NULL);
+        default:
+            node = binary_node(l, NODE_COMPARE, operand_tree(l, ARG_B(i)), operand_tree(l, ARG_C(i)));
+            node->cond = OP(i) == OP_EQ_I ? CC_E : OP(i) == OP_NE_I ? CC_NE : OP(i) == OP_LT_I ? CC_L : CC_LE;
+            return node;
+    }
+}
+
+static bool is_constant(const Node * node, int64_t value) {
+    return node->kind == NODE_CONST && node->value == value;
+}
+
+static bool fits_displacement(const Node * node) {
+    return node->kind == NODE_CONST && node->value >= INT32_MIN && node->value <= INT32_MAX;
+}
+
+static bool is_scale(const Node * node) {
+    return is_constant(node, 2) || is_constant(node, 4) || is_constant(node, 8);
+}
+
+/*
+ * Matchers of the address-forming patterns. They bind the operands of an
+ * 'lea' and try both orders of commutative operands.
+ */
+
+// x + y * s + c
+static bool match_scaled_displaced(const Node * node, Address * address) {
+    for(int k = 0; k < 2; k++) {
+        const Node * sum = node->kids[k], * c = node->kids[1 - k];
+        if(!fits_displacement(c) || sum->kind != NODE_ADD) continue;
+        for(int m = 0; m < 2; m++) {
+            const Node * x = sum->kids[m], * product = sum->kids[1 - m];
+            if(x->kind == NODE_CONST || product->kind != NODE_MUL) continue;
+            for(int n = 0; n < 2; n++) {
+                if(!is_scale(product->kids[1 - n]) || product->kids[n]->kind == NODE_CONST) continue;
+                *address = (Address){ x, product->kids[n], (int)product->kids[1 - n]->value, c->value };
+                return true;
+            }
+        }
+    }
+    return false;
+}
+
+// x + y * s
+static bool match_scaled(const Node * node, Address * address) {
+    for(int k = 0; k < 2; k++) {
+        const Node * x = node->kids[k], * product = node->kids[1 - k];
+        if(x->kind == NODE_CONST || product->kind != NODE_MUL) continue;
+        for(int n = 0; n < 2; n++) {
+            if(!is_scale(product->kids[1 - n]) || product->kids[n]->kind == NODE_CONST) continue;
+            *address = (Address){ x, product->kids[n], (int)product->kids[1 - n]->value, 0 };
+            return true;
+        }
+    }
+    return false;
+}
+
+// y * 2, y * 3, y * 5 and y * 9 as y + y * (s - 1)
+static bool match_multiple(const Node * node, Address * address) {
+    for(int k = 0; k < 2; k++) {
+        const Node * y = node->kids[k], * s = node->kids[1 - k];
+        if(y->kind == NODE_CONST) continue;
+        if(is_constant(s, 2) || is_constant(s, 3) || is_constant(s, 5) || is_constant(s, 9)) {
+            *address = (Address){ y, y, (int)s->value - 1, 0 };
+            return true;
+        }
+    }
+    return false;
+}
+
+// x + c and x - c
+static bool match_displaced(const Node * node, Address * address) {
+    for(int k = 0; k < 2; k++) {
+        const Node * x = node->kids[k], * c = node->kids[1 - k];
+        if(x->kind == NODE_CONST || !fits_displacement(c)) continue;
+        if(node->kind == NODE_SUB && (k != 0 || c->value == INT32_MIN)) continue;
+        *address = (Address){ x, NULL, 1, node->kind == NODE_SUB ? -c->value : c->value };
+        return true;
+    }
+    return false;
+}
+
+// x + y
+static bool match_indexed(const Node * node, Address * address) {
+    if(node->kids[0]->kind == NODE_CONST || node->kids[1]->kind == NODE_CONST) return false;
+    *address = (Address){ node->kids[0], node->kids[1], 1, 0 };
+    return true;
+}
+
+static bool match_any(const Node * node, Address * address) {
+    (void)node;
+    (void)address;
+    return true;
+}
+
+static int take_scratch(Lowering * l) {
+    for(int s = 0; s < (int)(sizeof(scratch) / sizeof(scratch[0])); s++) {
+        if((l->busy | l->reserved) & (1u << s)) continue;
+        l->busy |= 1u << s;
+        return scratch[s];
+    }
+    assert(!"out of scratch registers");
+    return RAX;
+}
+
+static void release(Lowering * l, Operand operand) {
+    for(int s = 0; s < (int)(sizeof(scratch) / sizeof(scratch[0])); s++) {
+        if(uses_register(&operand, scratch[s])) l->busy &= ~(1u << s);
+    }
+}
+
+static int select_scratch(Lowering * l, const Node * node);
+
+/**
+ * Selects code for a node whose value may be used in place: an allocated
+ * register, a register file slot, an immediate or a scratch register.
+ */
+static Operand select_operand(Lowering * l, const Node * node) {
+    if(node->kind == NODE_REG) return loc(l, node->reg);
+    if(fits_displacement(node)) return imm_operand(node->value);
+    return reg_operand(select_scratch(l, node));
+}
+
+/**
+ * Selects code for a node whose value must be in a register, which is
+ * not necessarily owned by the caller.
+ */
+static int select_register(Lowering * l, const Node * node) {
+    if(node->kind == NODE_REG && l->map[node->reg] != NO_REG) return l->map[node->reg];
+    return select_scratch(l, node);
+}
+
+static Operand in_register(Lowering * l, Operand operand) {
+    if(operand.kind == OPERAND_REG) return operand;
+    release(l, operand);
+    Operand reg = reg_operand(take_scratch(l));
+    emit(l, M_MOV, reg, operand);
+    return reg;
+}
+
+static int emit_lea(Lowering * l, const Node * node, const Address * address) {
+    (void)node;
+    int base = select_register(l, address->base);
+    int index = address->index == address->base ? base : address->index ? select_register(l, address->index) : NO_REG;
+    release(l, reg_operand(base));
+    if(index != NO_REG) release(l, reg_operand(index));
+
+    int d = take_scratch(l);
+    Operand source = index == NO_REG ? mem_operand(base, (int32_t)address->disp)
+                                     : index_operand(base, index, address->scale, (int32_t)address->disp);
+    emit(l, M_LEA, reg_operand(d), source);
+    return d;
+}
+
+static int emit_operation(Lowering * l, const Node * node, const Address * address) {
+    (void)address;
+    static const MachineOp ops[] = { [NODE_ADD] = M_ADD, [NODE_SUB] = M_SUB, [NODE_MUL] = M_IMUL };
+    const Node * left = node->kids[0], * right = node->kids[1];
+    if(node->kind != NODE_SUB && left->kind == NODE_REG && right->kind != NODE_REG && right->kind != NODE_CONST) {
+        left = node->kids[1];
+        right = node->kids[0];
+    }
+
+    int d = select_scratch(l, left);
+    Operand y = select_operand(l, right);
+    emit(l, ops[node->kind], reg_operand(d), y);
+    release(l, y);
+    return d;
+}
+
+static int emit_negate(Lowering * l, const Node * node, const Address * address) {
+    (void)address;
+    int d = select_scratch(l, node->kids[0]);
+    emit(l, M_NEG, reg_operand(d), no_operand());
+    return d;
+}
+
+/**
+ * Compares the two operands of a compare node, setting the flags.
+ */
+static void emit_cmp(Lowering * l, const Node * left, const Node * right) {
+    Operand x = select_operand(l, left);
+    if(x.kind == OPERAND_IMM) x = in_register(l, x);
+    Operand y = select_operand(l, right);
+    if(x.kind == OPERAND_MEM && y.kind == OPERAND_MEM) y = in_register(l, y);
+    emit(l, M_CMP, x, y);
+    release(l, x);
+    release(l, y);
+}
+
+static int emit_set(Lowering * l, const Node * node, const Address * address) {
+    (void)address;
+    emit_cmp(l, node->kids[0], node->kids[1]);
+    int d = take_scratch(l);
+    machine_emit_cc(l->out, M_SETCC, (Condition)node->cond, reg_operand(d));
+    emit(l, M_MOVZX, reg_operand(d), reg_operand(d));
+    return d;
+}
+
+static int emit_constant(Lowering * l, const Node * node, const Address * address) {
+    (void)address;
+    int d = take_scratch(l);
+    emit(l, M_MOV, reg_operand(d), imm_operand(node->value));
+    return d;
+}
+
+static int emit_copy(Lowering * l, const Node * node, const Address * address) {
+    (void)address;
+    int d = take_scratch(l);
+    emit(l, M_MOV, reg_operand(d), loc(l, node->reg));
+    return d;
+}
+
+/*
+ * The tiles, tried in order for the kind of the node at the root of the
+ * remaining tree: larger patterns first, so that the first match covers
+ * as many nodes as possible (maximal munch). The operands bound by a
+ * matcher are selected recursively.
+ */
+static const Pattern patterns[] = {
+    { NODE_ADD,     match_scaled_displaced, emit_lea },         // lea d, [x + y*s + c]
+    { NODE_ADD,     match_scaled,           emit_lea },         // lea d, [x + y*s]
+    { NODE_MUL,     match_multiple,         emit_lea },         // lea d, [y + y*(s-1)]
+    { NODE_ADD,     match_displaced,        emit_lea },         // lea d, [x + c]
+    { NODE_SUB,     match_displaced,        emit_lea },         // lea d, [x - c]
+    { NODE_ADD,     match_indexed,          emit_lea },         // lea d, [x + y]
+    { NODE_ADD,     match_any,              emit_operation },   // mov d, x; add d, y
+    { NODE_SUB,     match_any,              emit_operation },   // mov d, x; sub d, y
+    { NODE_MUL,     match_any,              emit_operation },   // mov d, x; imul d, y
+    { NODE_NEG,     match_any,              emit_negate },      // mov d, x; neg d
+    { NODE_COMPARE, match_any,              emit_set },         // cmp x, y; setcc d; movzx d, d
+    { NODE_CONST,   match_any,              emit_constant },    // mov d, c
+    { NODE_REG,     match_any,              emit_copy },        // mov d, x
+};
+
+/**
+ * Selects code for a node into a scratch register owned by the caller,
+ * using the first pattern matching the node.
+ *
+ * @param l: The lowering state
+ * @param node: The root of the tree
+ * @return: The scratch register holding the value
+ */
+static int select_scratch(Lowering * l, const Node * node) {
+    for(int p = 0; p < (int)(sizeof(patterns) / sizeof(patterns[0])); p++) {
+        Address address;
+        if(patterns[p].kind == node->kind && patterns[p].match(node, &address)) {
+            return patterns[p].emit(l, node, &address);
+        }
+    }
+    assert(!"no pattern matches");
+    return RAX;
+}
+
+/**
+ * Lowers the root of an expression tree: selects the tree and stores its
+ * value into the register the root writes.
+ *
+ * @param l: The lowering state
+ * @param pc: Index of the root instruction
+ */
+static void lower_tree(Lowering * l, int pc) {
+    l->node_count = 0;
+    Node * tree = build_tree(l, pc);
+    Operand value = select_operand(l, tree);
+    Operand target = loc(l, ARG_A(l->code[pc]));
+    if(target.kind == OPERAND_MEM && value.kind == OPERAND_MEM) value = in_register(l, value);
+    emit(l, M_MOV, target, value);
+    release(l, value);
+}
+
+/**
+ * Returns the probability that the jump of the instruction at 'pc' is
+ * taken, as counted by the profile. The counts of a running machine may be
+ * read while they change; a slightly stale probability is harmless.
+ *
+ * @param l: The lowering state
+ * @param pc: Index of the jump, or of the compare of a compare-and-branch
+ * @return: The probability in 1/'LIKELY_SCALE', or 'LIKELY_UNKNOWN'
+ */
+static uint16_t branch_likely(const Lowering * l, int pc) {
+    if(!l->profile) return LIKELY_UNKNOWN;
+    uint64_t count = l->profile->counts[pc], taken = l->profile->taken[pc];
+    if(count == 0) return LIKELY_UNKNOWN;
+    if(taken > count) taken = count;
+    return (uint16_t)((double)taken / (double)count * LIKELY_SCALE);
+}
+
+/**
+ * Lowers a conditional jump on an integer register. A compare folded into
+ * the jump sets the flags directly; other values are tested against 0.
+ *
+ * @param l: The lowering state
+ * @param r: The tested register
+ * @param jump_if_true: Jump if the value is not 0
+ * @param target: The bytecode target
+ * @param likely: Probability that the jump is taken
+ */
+static void lower_condition(Lowering * l, int r, bool jump_if_true, int target, uint16_t likely) {
+    l->node_count = 0;
+    Node * tree = operand_tree(l, r);
+    if(tree->kind == NODE_COMPARE) {
+        emit_cmp(l, tree->kids[0], tree->kids[1]);
+        Condition cc = (Condition)tree->cond;
+        emit_jcc(l, jump_if_true ? cc : NEGATE(cc), target, likely);
+        return;
+    }
+
+    Operand value = select_operand(l, tree);
+    if(value.kind == OPERAND_IMM) {
+        if((value.imm != 0) == jump_if_true) emit(l, M_JMP, label_operand(target), no_operand());
+        return;
+    }
+    if(value.kind == OPERAND_MEM) emit(l, M_CMP, value, imm_operand(0));
+    else emit(l, M_TEST, value, value);
+    release(l, value);
+    emit_jcc(l, jump_if_true ? CC_NE : CC_E, target, likely);
+}
+
+/**
+ * Lowers a compare-and-branch instruction: jumps to the target of the
+ * following 'JMP' if the comparison equals C. Unordered float operands
+ * are assumed to be rare.
+ */
+static void lower_branch(Lowering * l, uint32_t i, int target, uint16_t likely) {
+    int a = ARG_A(i), b = ARG_B(i);
+    bool expected = ARG_C(i) != 0;
+    Condition cc;
+
+    switch(OP(i)) {
+        case OP_JEQ_I: cc = CC_E; break;
+        case OP_JLT_I: cc = CC_L; break;
+        case OP_JLE_I: cc = CC_LE; break;
+        case OP_JLT_F: cc = CC_A; break;
+        case OP_JLE_F: cc = CC_AE; break;
+        default: {
+            // JEQ_F: equal requires ordered operands
+            lower_ucomisd(l, a, b);
+            if(expected) {
+                int skip = machine_new_label(l->out);
+                emit_jcc(l, CC_P, skip, 0);
+                emit_jcc(l, CC_E, target, likely);
+                emit(l, M_LABEL, label_operand(skip), no_operand());
+            } else {
+                emit_jcc(l, CC_P, target, 0);
+                emit_jcc(l, CC_NE, target, likely);
+            }
+            return;
+        }
+    }
+
+    if(OP(i) == OP_JLT_F || OP(i) == OP_JLE_F) {
+        lower_ucomisd(l, b, a);
+    } else {
+        l->node_count = 0;
+        Node * x = operand_tree(l, a);
+        emit_cmp(l, x, operand_tree(l, b));
+    }
+    emit_jcc(l, expected ? cc : NEGATE(cc), target, likely);
+}
+
+/**
+ * Lowers a call through 'vm_native_call()'. Allocated arguments are
+ * stored to the register file first, and the register file is reloaded
+ * afterwards since the stack may have moved.
+ */
+static void lower_call(Lowering * l, int a, int callee) {
+    const ImageFunction * target = &image_functions(l->image)[callee];
+    for(int p = 0; p < target->param_count; p++) {
+        if(l->map[a + p] == NO_REG) continue;
+        emit(l, M_MOV, mem_operand(R12, (a + p) * (int32_t)sizeof(Value)), reg_operand(l->map[a + p]));
+    }
+
+    emit(l, M_MOV, reg_operand(RDI), reg_operand(RBX));
+    emit(l, M_MOV, reg_operand(RSI), imm_operand(callee));
+    emit(l, M_LEA, reg_operand(RDX), mem_operand(R12, a * (int32_t)sizeof(Value)));
+    emit(l, M_MOV, reg_operand(RAX), imm_operand((int64_t)(intptr_t)&vm_native_call));
+    emit(l, M_CALL, reg_operand(RAX), no_operand());
+
+    emit(l, M_MOV, reg_operand(R12), mem_operand(RBX, VM_STACK));
+    emit(l, M_ADD, reg_operand(R12), FRAME_OFFSET);
+    emit(l, M_CMP, mem_operand(RBX, VM_ERROR), imm_operand(0));
+    emit_jcc(l, CC_NE, l->fail, 0);
+    emit(l, M_MOV, loc(l, a), reg_operand(RAX));
+}
+
+/**
+ * Lowers one instruction.
+ *
+ * @param l: The lowering state
+ * @param pc: Index of the instruction
+ * @return: 'false' if the opcode is invalid
+ */
+static bool lower_instruction(Lowering * l, int pc) {
+    const Value * constants = image_constants(l->image);
+    uint32_t i = l->code[pc];
+    int a = ARG_A(i), b = ARG_B(i), c = ARG_C(i);
+
+    if(l->folded[pc]) return true;
+    if(is_expression(l, i)) {
+        lower_tree(l, pc);
+        return true;
+    }
+
+    switch(OP(i)) {
+        case OP_MOVE:
+            if(l->types[a] == TYPE_FLOAT) {
+                emit(l, M_MOVSD, reg_operand(XMM0), loc(l, b));
+                emit(l, M_MOVSD, loc(l, a), reg_operand(XMM0));
+            } else {
+                emit(l, M_MOV, reg_operand(RAX), loc(l, b));
+                emit(l, M_MOV, loc(l, a), reg_operand(RAX));
+            }
+            break;
+        case OP_LOADK:
+            emit(l, M_MOV, reg_operand(RAX), imm_operand(constants[ARG_BX(i)].i));
+            emit(l, IS_XMM(l->map[a]) ? M_MOVQ : M_MOV, loc(l, a), reg_operand(RAX));
+            break;
+
+        case OP_DIV_I: lower_divide(l, false, a, b, c); break;
+        case OP_MOD_I: lower_divide(l, true, a, b, c); break;
+
+        case OP_ADD_F: lower_float(l, M_ADDSD, a, b, c); break;
+        case OP_SUB_F: lower_float(l, M_SUBSD, a, b, c); break;
+        case OP_MUL_F: lower_float(l, M_MULSD, a, b, c); break;
+        case OP_DIV_F: lower_float(l, M_DIVSD, a, b, c); break;
+        case OP_NEG_F:
+            emit(l, M_MOVSD, reg_operand(XMM0), loc(l, b));
+            emit(l, M_MOV, reg_operand(RAX), imm_operand(INT64_MIN));
+            emit(l, M_MOVQ, reg_operand(XMM1), reg_operand(RAX));
+            emit(l, M_XORPD, reg_operand(XMM0), reg_operand(XMM1));
+            emit(l, M_MOVSD, loc(l, a), reg_operand(XMM0));
+            break;
+
+        case OP_EQ_F: lower_float_equal(l, true, a, b, c); break;
+        case OP_NE_F: lower_float_equal(l, false, a, b, c); break;
+        case OP_LT_F: lower_ucomisd(l, c, b); lower_set(l, CC_A, a); break;
+        case OP_LE_F: lower_ucomisd(l, c, b); lower_set(l, CC_AE, a); break;
+        case OP_NOT:
+            emit(l, M_MOV, reg_operand(RAX), loc(l, b));
+            emit(l, M_TEST, reg_operand(RAX), reg_operand(RAX));
+            lower_set(l, CC_E, a);
+            break;
+
+        case OP_I2F:
+            emit(l, M_CVTSI2SD, reg_operand(XMM0), loc(l, b));
+            emit(l, M_MOVSD, loc(l, a), reg_operand(XMM0));
+            break;
+        case OP_F2I: lower_float_to_int(l, a, b); break;
+
+        case OP_JMP:
+            emit(l, M_JMP, label_operand(jump_target(l->code, pc)), no_operand());
+            break;
+        case OP_JMPT: case OP_JMPF:
+            lower_condition(l, a, OP(i) == OP_JMPT, jump_target(l->code, pc), branch_likely(l, pc));
+            break;
+
+        case OP_JEQ_I: case OP_JLT_I: case OP_JLE_I:
+        case OP_JEQ_F: case OP_JLT_F: case OP_JLE_F:
+            lower_branch(l, i, jump_target(l->code, pc + 1), branch_likely(l, pc));
+            break;
+
+        case OP_CALL: lower_call(l, a, ARG_BX(i)); break;
+        case OP_RET:
+            if(takes_expression(l, i)) {
+                l->node_count = 0;
+                Operand value = select_operand(l, operand_tree(l, a));
+                emit(l, M_MOV, reg_operand(RAX), value);
+                release(l, value);
+            } else {
+                emit(l, IS_XMM(l->map[a]) ? M_MOVQ : M_MOV, reg_operand(RAX), loc(l, a));
+            }
+            emit_epilogue(l);
+            break;
+
+        default:
+            return false;
+    }
+    return true;
+}
+
+/**
+ * Finds the counts of a function in a profile. Counts collected for the
+ * image are indexed like its functions; counts read from a file are
+ * looked up by name and only used if they belong to the same code.
+ *
+ * @param image: The linked image
+ * @param feedback: The profile, may be NULL
+ * @param function: Index of the function
+ * @return: The counts, or NULL if there are none
+ */
+static const FeedbackFunction * find_profile(const Image * image, const Feedback * feedback, int function) {
+    if(!feedback) return NULL;
+    if(feedback->counters) return function < feedback->function_count ? &feedback->functions[function] : NULL;
+
+    const ImageFunction * f = &image_functions(image)[function];
+    const char * name = image_string(image, f->name);
+    for(int i = 0; i < feedback->function_count; i++) {
+        const FeedbackFunction * profile = &feedback->functions[i];
+        if(profile->code_length == (int)f->code_length && strcmp(profile->name, name) == 0) {
+            const uint32_t * code = image_code(image) + f->code;
+            return profile->checksum == code_checksum(code, profile->code_length) ? profile : NULL;
+        }
+    }
+    return NULL;
+}
+
+/**
+ * Selects the machine instructions of a function, allocates its registers,
+ * places its blocks and runs the peephole optimizer. Labels 0 to
+ * 'code_length' belong to the bytecode instructions with the same index.
+ *
+ * @param image: The linked image
+ * @param feedback: Execution counts for block placement, may be NULL
+ * @param function: Index of the function
+ * @return: The machine function, or NULL if the bytecode is invalid
+ */
+MachineFunction * native_lower(const Image * image, const Feedback * feedback, int function) {
+    const ImageFunction * f = &image_functions(image)[function];
+    Lowering l;
+    l.image = image;
+    l.function = f;
+    l.code = image_code(image) + f->code;
+    l.types = (const uint8_t *)image_string(image, f->types);
+    l.profile = find_profile(image, feedback, function);
+    l.leaf = true;
+    for(uint32_t pc = 0; pc < f->code_length; pc++) {
+        if(OP(l.code[pc]) == OP_CALL) l.leaf = false;
+    }
+    l.out = init_machine_function(image_string(image, f->name));
+    l.busy = 0;
+    allocate_registers(&l);
+    assign_frame(&l);
+    find_expressions(&l);
+
+    int length = (int)f->code_length;
+    bool * targets = (bool *)calloc(length + 1, sizeof(bool));
+    assert(targets);
+    for(int pc = 0; pc < length; pc++) {
+        int target = jump_target(l.code, pc);
+        if(target >= 0 && target <= length) targets[target] = true;
+    }
+
+    l.out->label_count = length + 1;
+    l.fail = machine_new_label(l.out);
+    l.divide = machine_new_label(l.out);
+
+    emit_prologue(&l);
+    bool valid = true;
+    for(int pc = 0; pc < length && valid; pc++) {
+        if(targets[pc]) emit(&l, M_LABEL, label_operand(pc), no_operand());
+        valid = lower_instruction(&l, pc);
+
+        // The 'JMP' of a compare-and-branch only needs code if it is a target itself
+        if(OP(l.code[pc]) >= OP_JEQ_I && OP(l.code[pc]) <= OP_JLE_F && pc + 1 < length) {
+            pc++;
+            if(targets[pc]) {
+                emit(&l, M_LABEL, label_operand(pc), no_operand());
+                emit(&l, M_JMP, label_operand(jump_target(l.code, pc)), no_operand());
+            }
+        }
+    }
+    free(targets);
+    free(l.folded);
+
+    if(!valid) {
+        destroy_machine_function(l.out);
+        return NULL;
+    }
+
+    emit(&l, M_LABEL, label_operand(length), no_operand());
+    emit(&l, M_LABEL, label_operand(l.fail), no_operand());
+    emit(&l, M_MOV, reg_operand(RAX), imm_operand(0));
+    emit_epilogue(&l);
+
+    emit(&l, M_LABEL, label_operand(l.divide), no_operand());
+    emit(&l, M_MOV, reg_operand(RAX), imm_operand((int64_t)(intptr_t)division_by_zero));
+    emit(&l, M_MOV, mem_operand(l.vm, VM_ERROR), reg_operand(RAX));
+    emit(&l, M_MOV, reg_operand(RAX), imm_operand(0));
+    emit_epilogue(&l);
+
+    layout_blocks(l.out);
+    uint64_t kept = (1ull << l.vm) | (1ull << l.file);
+    peephole_optimize(l.out, SCRATCH & ~kept);
+    return l.out;
+}
+
+/**
+ * Compiles a function to native code. Matches 'TierCompiler'.
+ *
+ * @param context: The 'NativeContext'
+ * @param function: Index of the function
+ * @param size: Receives the size of the code in bytes
+ * @return: The entry point, or NULL if the function cannot be compiled
+ */
+void * native_compile(void * context, int function, size_t * size) {
+#if defined(__x86_64__)
+    const NativeContext * native = (const NativeContext *)context;
+    MachineFunction * lowered = native_lower(native->image, native->feedback, function);
+    if(!lowered) return NULL;
+
+    size_t length;
+    uint8_t * code = machine_encode(lowered, &length);
+    destroy_machine_function(lowered);
+
+    void * entry = mmap(NULL, length, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if(entry == MAP_FAILED) {
+        free(code);
+        return NULL;
+    }
+    memcpy(entry, code, length);
+    free(code);
+
+    if(mprotect(entry, length, PROT_READ | PROT_EXEC) != 0) {
+        munmap(entry, length);
+        return NULL;
+    }
+    *size = length;
+    return entry;
+#else
+    (void)context;
+    (void)function;
+    (void)size;
+    return NULL;
+#endif
+}
+
+/**
+ * Frees code returned by 'native_compile()'. Matches 'TierRelease'.
+ *
+ * @param context: The 'NativeContext', unused
+ * @param entry: The entry point
+ * @param size: The size of the code
+ */
+void native_release(void * context, void * entry, size_t size) {
+    (void)context;
+    munmap(entry, size);
+}
@@ -0,0 +1,25 @@
+#ifndef NATIVE_H
+#define NATIVE_H
+
+#include <stddef.h>
+#include "feedback.h"
+#include "image.h"
+#include "machine.h"
+
+#define NATIVE_ALLOCATABLE       4    // integer registers kept in machine registers
+#define NATIVE_FLOAT_ALLOCATABLE 14   // float registers kept in SSE registers by leaf functions
+
+/*
+ * Context of 'native_compile()'. The feedback may be the one a machine is
+ * collecting while it runs the image, or a profile read from a file.
+ */
+typedef struct {
+    const Image * image;
+    const Feedback * feedback;  // execution counts for block placement, may be NULL
+} NativeContext;
+
+MachineFunction * native_lower(const Image * image, const Feedback * feedback, int function);
+void * native_compile(void * context, int function, size_t * size);
+void native_release(void * context, void * entry, size_t size);
+
+#endif // NATIVE_H
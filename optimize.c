@@ -0,0 +1,859 @@
+/**
+ * This file contains the bytecode optimizer which rewrites the code of a
+ * function after generation to reduce the number of dispatches the virtual
+ * machine performs.
+ *
+ * The optimizer performs:
+ * - Quickening of small integer constants into 'LOADI' immediates
+ * - Folding of constant registers into 'ADDI', which covers adding a
+ *   constant and incrementing a local
+ * - Fusion of a comparison and the conditional jump testing its result
+ *   into a compare-and-branch superinstruction
+ * - Removal of instructions whose result is never used
+ *
+ * Given the execution counts of a previous run it also inlines hot call
+ * sites of small functions and unrolls hot innermost loops, which removes
+ * the most frequently executed calls, returns and back edges.
+ *
+ * The fused sequences are the most frequent opcode pairs in loops; the VM
+ * counts executed pairs when built with '-DVM_OPCODE_PAIRS', which is how
+ * new candidates should be chosen.
+ *
+ * @file    optimize.c
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include "optimize.h"
+#include "trace.h"
+#include "alloc.h"
+
+#define INLINE_MIN_CALLS        1000    // executions of a call site worth inlining
+#define INLINE_MAX_LENGTH       32      // instructions of a function that is inlined
+#define INLINE_MAX_GROWTH       256     // instructions a function may grow by inlining
+#define UNROLL_MIN_ITERATIONS   1000    // iterations of a loop worth unrolling
+#define UNROLL_MIN_TRIPS        4       // average iterations per entry of a loop
+#define UNROLL_MAX_LENGTH       16      // instructions in the body of an unrolled loop
+
+typedef struct {
+    uint64_t bits[MAX_REGISTERS / 64];
+} RegisterSet;
+
+static inline void set_add(RegisterSet * set, int r) {
+    set->bits[r >> 6] |= (uint64_t)1 << (r & 63);
+}
+
+static inline void set_remove(RegisterSet * set, int r) {
+    set->bits[r >> 6] &= ~((uint64_t)1 << (r & 63));
+}
+
+static inline bool set_contains(const RegisterSet * set, int r) {
+    return (set->bits[r >> 6] >> (r & 63)) & 1;
+}
+
+/**
+ * Returns the register written by an instruction.
+ *
+ * @param instruction: The instruction
+ * @return: The written register, or -1 if the instruction writes none
+ */
+static int instruction_def(uint32_t instruction) {
+    switch(OP(instruction)) {
+        case OP_JMP: case OP_JMPT: case OP_JMPF: case OP_RET:
+        case OP_JEQ_I: case OP_JLT_I: case OP_JLE_I:
+        case OP_JEQ_F: case OP_JLT_F: case OP_JLE_F:
+            return -1;
+        default:
+            return ARG_A(instruction);
+    }
+}
+
+/**
+ * Collects the registers read by an instruction.
+ *
+ * @param module: The module, needed for the arity of called functions
+ * @param instruction: The instruction
+ * @param uses: Receives the read registers
+ */
+static void instruction_uses(const Module * module, uint32_t instruction, RegisterSet * uses) {
+    memset(uses, 0, sizeof(RegisterSet));
+
+    switch(OP(instruction)) {
+        case OP_LOADK: case OP_LOADI: case OP_JMP:
+            break;
+        case OP_MOVE: case OP_ADDI: case OP_NEG_I: case OP_NEG_F:
+        case OP_NOT: case OP_I2F: case OP_F2I:
+            set_add(uses, ARG_B(instruction));
+            break;
+        case OP_JMPT: case OP_JMPF: case OP_RET:
+            set_add(uses, ARG_A(instruction));
+            break;
+        case OP_JEQ_I: case OP_JLT_I: case OP_JLE_I:
+        case OP_JEQ_F: case OP_JLT_F: case OP_JLE_F:
+            set_add(uses, ARG_A(instruction));
+            set_add(uses, ARG_B(instruction));
+            break;
+        case OP_CALL: {
+            const Function * callee = module->functions[ARG_BX(instruction)];
+            for(int r = 0; r < callee->param_count; r++) set_add(uses, ARG_A(instruction) + r);
+            break;
+        }
+        default:
+            set_add(uses, ARG_B(instruction));
+            set_add(uses, ARG_C(instruction));
+            break;
+    }
+}
+
+/**
+ * Returns the target of a jump instruction.
+ *
+ * @param code: The function's code
+ * @param pc: The index of the jump
+ * @return: The index of the target, or -1 if the instruction is no jump
+ */
+static int jump_target(const uint32_t * code, int pc) {
+    switch(OP(code[pc])) {
+        case OP_JMP:  return pc + 1 + ARG_SJ(code[pc]);
+        case OP_JMPT: return pc + 1 + ARG_SBX(code[pc]);
+        case OP_JMPF: return pc + 1 + ARG_SBX(code[pc]);
+        default:      return -1;
+    }
+}
+
+/**
+ * Computes the successors of an instruction in the control flow graph.
+ * Compare-and-branch instructions continue either with their 'JMP' or
+ * behind it.
+ *
+ * @param function: The function
+ * @param pc: The index of the instruction
+ * @param successors: Receives up to two successors
+ * @return: The number of successors
+ */
+static int instruction_successors(const Function * function, int pc, int successors[2]) {
+    uint32_t instruction = function->code[pc];
+    int count = 0;
+
+    switch(OP(instruction)) {
+        case OP_RET:
+            return 0;
+        case OP_JMP:
+            successors[count++] = jump_target(function->code, pc);
+            return count;
+        case OP_JMPT: case OP_JMPF:
+            successors[count++] = jump_target(function->code, pc);
+            break;
+        case OP_JEQ_I: case OP_JLT_I: case OP_JLE_I:
+        case OP_JEQ_F: case OP_JLT_F: case OP_JLE_F:
+            if(pc + 2 < function->code_length) successors[count++] = pc + 2;
+            break;
+        default:
+            break;
+    }
+    if(pc + 1 < function->code_length) successors[count++] = pc + 1;
+    return count;
+}
+
+/**
+ * Computes the registers live after every instruction by iterating the
+ * backwards data flow equations to a fixed point.
+ *
+ * @param module: The module containing the function
+ * @param function: The function
+ * @param live_in: Receives the registers live before every instruction
+ * @param live_out: Receives the registers live after every instruction
+ */
+static void compute_liveness(const Module * module, const Function * function,
+                             RegisterSet * live_in, RegisterSet * live_out) {
+    int length = function->code_length;
+    memset(live_in, 0, length * sizeof(RegisterSet));
+    memset(live_out, 0, length * sizeof(RegisterSet));
+
+    bool changed = true;
+    while(changed) {
+        changed = false;
+        for(int pc = length - 1; pc >= 0; pc--) {
+            int successors[2];
+            int count = instruction_successors(function, pc, successors);
+
+            RegisterSet out = { { 0 } };
+            for(int s = 0; s < count; s++) {
+                for(int w = 0; w < MAX_REGISTERS / 64; w++) out.bits[w] |= live_in[successors[s]].bits[w];
+            }
+
+            RegisterSet in = out;
+            int def = instruction_def(function->code[pc]);
+            if(def >= 0) set_remove(&in, def);
+            RegisterSet uses;
+            instruction_uses(module, function->code[pc], &uses);
+            for(int w = 0; w < MAX_REGISTERS / 64; w++) in.bits[w] |= uses.bits[w];
+
+            if(memcmp(&in, &live_in[pc], sizeof(RegisterSet)) != 0 ||
+               memcmp(&out, &live_out[pc], sizeof(RegisterSet)) != 0) {
+                live_in[pc] = in;
+                live_out[pc] = out;
+                changed = true;
+            }
+        }
+    }
+}
+
+/**
+ * Marks every instruction that is the target of a jump.
+ *
+ * @param function: The function
+ * @param targets: Receives one flag per instruction, plus one for the end
+ */
+static void find_jump_targets(const Function * function, bool * targets) {
+    memset(targets, 0, (function->code_length + 1) * sizeof(bool));
+    for(int pc = 0; pc < function->code_length; pc++) {
+        int target = jump_target(function->code, pc);
+        if(target >= 0) targets[target] = true;
+    }
+}
+
+/**
+ * Removes the marked instructions from a function and moves every jump to
+ * the new position of its target. Jumps to removed instructions continue
+ * with the next instruction that is kept.
+ *
+ * @param function: The function
+ * @param removed: One flag per instruction
+ */
+static void compact(Function * function, const bool * removed) {
+    int length = function->code_length;
+    int * map = (int *)accounted_malloc((length + 1) * sizeof(int));
+    assert(map);
+
+    int next = 0;
+    for(int pc = 0; pc < length; pc++) {
+        map[pc] = next;
+        if(!removed[pc]) next++;
+    }
+    map[length] = next;
+
+    uint32_t * code = function->code;
+    for(int pc = 0; pc < length; pc++) {
+        if(removed[pc]) continue;
+
+        int target = jump_target(code, pc);
+        int at = map[pc];
+        code[at] = code[pc];
+        if(target >= 0) function_patch_jump(function, at, map[target]);
+    }
+    function->code_length = next;
+    accounted_free(map);
+}
+
+/**
+ * Checks if an instruction only computes its result, so that it can be
+ * removed when the result is unused. Divisions may trap and calls may
+ * not terminate, so they are kept.
+ *
+ * @param instruction: The instruction
+ * @return: 'true' if the instruction has no side effects
+ */
+static bool is_pure(uint32_t instruction) {
+    switch(OP(instruction)) {
+        case OP_DIV_I: case OP_MOD_I: case OP_CALL:
+            return false;
+        default:
+            return instruction_def(instruction) >= 0;
+    }
+}
+
+/**
+ * Rewrites 'LOADK' of integer constants that fit into 16 bits as 'LOADI',
+ * saving the load from the constant pool.
+ *
+ * @param module: The module containing the function
+ * @param function: The function
+ */
+static void quicken_constants(const Module * module, Function * function) {
+    for(int pc = 0; pc < function->code_length; pc++) {
+        uint32_t instruction = function->code[pc];
+        if(OP(instruction) != OP_LOADK) continue;
+
+        const Constant * k = &module->constants[ARG_BX(instruction)];
+        if(k->type == CONSTANT_INT && k->value.i >= INT16_MIN && k->value.i <= INT16_MAX) {
+            function->code[pc] = ENCODE_ABX(OP_LOADI, ARG_A(instruction), (int)k->value.i);
+        }
+    }
+}
+
+/**
+ * Finds registers that hold the same small integer everywhere they are
+ * read: registers defined by exactly one 'LOADI' that is executed before
+ * every use.
+ *
+ * @param function: The function
+ * @param entry: Registers live on entry to the function
+ * @param known: Receives a flag per register
+ * @param values: Receives the value of every flagged register
+ */
+static void find_constant_registers(const Function * function, const RegisterSet * entry,
+                                    bool * known, int * values) {
+    int defs[MAX_REGISTERS] = { 0 };
+
+    memset(known, 0, MAX_REGISTERS * sizeof(bool));
+    for(int pc = 0; pc < function->code_length; pc++) {
+        uint32_t instruction = function->code[pc];
+        int def = instruction_def(instruction);
+        if(def < 0) continue;
+
+        defs[def]++;
+        if(OP(instruction) == OP_LOADI) {
+            known[def] = true;
+            values[def] = ARG_SBX(instruction);
+        }
+    }
+
+    for(int r = 0; r < function->register_count; r++) {
+        if(r < function->param_count || defs[r] != 1 || set_contains(entry, r)) known[r] = false;
+    }
+}
+
+/**
+ * Returns the small integer a register holds when the instruction at 'pc'
+ * reads it: a register holding a constant everywhere, or one loaded by
+ * the 'LOADI' right before, which is how temporaries hold the constant of
+ * 'i = i + 1'. Temporaries are reused, so the latter only holds if the
+ * instruction cannot be reached by a jump.
+ *
+ * @return: 'true' if the value is known
+ */
+static bool constant_at(const Function * function, int pc, int r, const bool * known, const int * values,
+                        const bool * targets, int * value) {
+    if(known[r]) {
+        *value = values[r];
+        return true;
+    }
+    uint32_t previous = pc > 0 ? function->code[pc - 1] : 0;
+    if(pc == 0 || targets[pc] || OP(previous) != OP_LOADI || ARG_A(previous) != r) return false;
+    *value = ARG_SBX(previous);
+    return true;
+}
+
+/**
+ * Folds integer additions and subtractions of a constant register that
+ * fits into a signed byte into 'ADDI'. A 'LOADI' left without readers is
+ * removed as dead code afterwards.
+ *
+ * @param function: The function
+ * @param known: Flags of registers holding a constant
+ * @param values: Values of those registers
+ * @param targets: Flags of instructions that are jump targets
+ */
+static void fold_immediates(Function * function, const bool * known, const int * values, const bool * targets) {
+    for(int pc = 0; pc < function->code_length; pc++) {
+        uint32_t instruction = function->code[pc];
+        int a = ARG_A(instruction), b = ARG_B(instruction), c = ARG_C(instruction);
+        int k;
+
+        if(OP(instruction) == OP_ADD_I) {
+            if(constant_at(function, pc, c, known, values, targets, &k) && k >= INT8_MIN && k <= INT8_MAX) {
+                function->code[pc] = ENCODE_ABC(OP_ADDI, a, b, (uint8_t)k);
+            } else if(constant_at(function, pc, b, known, values, targets, &k) && k >= INT8_MIN && k <= INT8_MAX) {
+                function->code[pc] = ENCODE_ABC(OP_ADDI, a, c, (uint8_t)k);
+            }
+        } else if(OP(instruction) == OP_SUB_I) {
+            if(constant_at(function, pc, c, known, values, targets, &k) && -k >= INT8_MIN && -k <= INT8_MAX) {
+                function->code[pc] = ENCODE_ABC(OP_ADDI, a, b, (uint8_t)-k);
+            }
+        }
+    }
+}
+
+/**
+ * Fuses a comparison followed by a conditional jump on its result into a
+ * compare-and-branch instruction, provided the result is not read again.
+ * The conditional jump becomes the 'JMP' that carries the offset, so the
+ * code keeps its length.
+ *
+ * @param function: The function
+ * @param live_out: Registers live after every instruction
+ * @param targets: Flags of instructions that are jump targets
+ */
+static void fuse_branches(Function * function, const RegisterSet * live_out, const bool * targets) {
+    for(int pc = 0; pc + 1 < function->code_length; pc++) {
+        uint32_t compare = function->code[pc];
+        uint32_t jump = function->code[pc + 1];
+        Opcode fused;
+        bool negate = false;
+
+        switch(OP(compare)) {
+            case OP_EQ_I: fused = OP_JEQ_I; break;
+            case OP_NE_I: fused = OP_JEQ_I; negate = true; break;
+            case OP_LT_I: fused = OP_JLT_I; break;
+            case OP_LE_I: fused = OP_JLE_I; break;
+            case OP_EQ_F: fused = OP_JEQ_F; break;
+            case OP_NE_F: fused = OP_JEQ_F; negate = true; break;
+            case OP_LT_F: fused = OP_JLT_F; break;
+            case OP_LE_F: fused = OP_JLE_F; break;
+            default: continue;
+        }
+
+        if(OP(jump) != OP_JMPT && OP(jump) != OP_JMPF) continue;
+        if(ARG_A(jump) != ARG_A(compare) || targets[pc + 1]) continue;
+        if(set_contains(&live_out[pc + 1], ARG_A(compare))) continue;
+
+        bool when = (OP(jump) == OP_JMPT) != negate;
+        function->code[pc] = ENCODE_ABC(fused, ARG_B(compare), ARG_C(compare), when);
+        function->code[pc + 1] = ENCODE_SJ(OP_JMP, ARG_SBX(jump));
+        pc++;
+    }
+}
+
+/**
+ * Removes instructions without side effects whose result is dead, and
+ * moves of a register onto itself, until no more can be removed.
+ *
+ * @param module: The module containing the function
+ * @param function: The function
+ */
+static void eliminate_dead_code(const Module * module, Function * function) {
+    while(function->code_length > 0) {
+        int length = function->code_length;
+        RegisterSet * live_in = (RegisterSet *)accounted_malloc(length * sizeof(RegisterSet));
+        RegisterSet * live_out = (RegisterSet *)accounted_malloc(length * sizeof(RegisterSet));
+        bool * removed = (bool *)accounted_calloc(length, sizeof(bool));
+        assert(live_in && live_out && removed);
+
+        compute_liveness(module, function, live_in, live_out);
+
+        bool any = false;
+        for(int pc = 0; pc < length; pc++) {
+            uint32_t instruction = function->code[pc];
+            bool self_move = OP(instruction) == OP_MOVE && ARG_A(instruction) == ARG_B(instruction);
+            if(self_move || (is_pure(instruction) && !set_contains(&live_out[pc], ARG_A(instruction)))) {
+                removed[pc] = true;
+                any = true;
+            }
+        }
+        if(any) compact(function, removed);
+
+        accounted_free(removed);
+        accounted_free(live_out);
+        accounted_free(live_in);
+        if(!any) break;
+    }
+}
+
+/**
+ * Optimizes the code of one function in place.
+ *
+ * @param module: The module containing the function
+ * @param function: The function to optimize
+ */
+void optimize_function(const Module * module, Function * function) {
+    int length = function->code_length;
+    if(length == 0) return;
+
+    trace_begin("optimize function", function->name);
+    trace_begin("quicken constants", NULL);
+    quicken_constants(module, function);
+    trace_end("quicken constants");
+
+    RegisterSet * live_in = (RegisterSet *)accounted_malloc(length * sizeof(RegisterSet));
+    RegisterSet * live_out = (RegisterSet *)accounted_malloc(length * sizeof(RegisterSet));
+    bool * targets = (bool *)accounted_malloc((length + 1) * sizeof(bool));
+    bool known[MAX_REGISTERS];
+    int values[MAX_REGISTERS];
+    assert(live_in && live_out && targets);
+
+    trace_begin("fold immediates", NULL);
+    compute_liveness(module, function, live_in, live_out);
+    find_jump_targets(function, targets);
+    find_constant_registers(function, &live_in[0], known, values);
+    fold_immediates(function, known, values, targets);
+    trace_end("fold immediates");
+
+    trace_begin("fuse branches", NULL);
+    compute_liveness(module, function, live_in, live_out);
+    fuse_branches(function, live_out, targets);
+    trace_end("fuse branches");
+
+    accounted_free(targets);
+    accounted_free(live_out);
+    accounted_free(live_in);
+
+    trace_begin("eliminate dead code", NULL);
+    eliminate_dead_code(module, function);
+    trace_end("eliminate dead code");
+    trace_end("optimize function");
+}
+
+/**
+ * Optimizes every function of a module, then drops constants that were
+ * turned into immediates from the pool.
+ *
+ * @param module: The module to optimize
+ */
+void optimize_module(Module * module) {
+    for(int i = 0; i < module->function_count; i++) {
+        optimize_function(module, module->functions[i]);
+    }
+    module_remove_unused_constants(module);
+}
+
+/*
+ * Execution counts of a function's current code. Profile guided passes
+ * move and duplicate instructions, so they carry the counts along.
+ */
+typedef struct {
+    uint64_t * counts;  // executions of every jump and call
+    uint64_t * taken;   // taken jumps
+    uint64_t calls;     // calls of the function
+} Counts;
+
+/*
+ * New code of a function under construction, with the target of every
+ * jump as an index into the new code.
+ */
+typedef struct {
+    uint32_t * code;
+    int * targets;      // -1 for instructions that do not jump
+    uint64_t * counts;
+    uint64_t * taken;
+    int length;
+} Rewrite;
+
+/**
+ * Allocates the new code of a function.
+ *
+ * @param rewrite: Receives the buffers
+ * @param length: Number of instructions of the new code
+ */
+static void init_rewrite(Rewrite * rewrite, int length) {
+    rewrite->code = (uint32_t *)accounted_malloc((length ? length : 1) * sizeof(uint32_t));
+    rewrite->targets = (int *)accounted_malloc((length ? length : 1) * sizeof(int));
+    rewrite->counts = (uint64_t *)accounted_calloc(length ? length : 1, sizeof(uint64_t));
+    rewrite->taken = (uint64_t *)accounted_calloc(length ? length : 1, sizeof(uint64_t));
+    assert(rewrite->code && rewrite->targets && rewrite->counts && rewrite->taken);
+    rewrite->length = length;
+}
+
+/**
+ * Stores one instruction of the new code.
+ *
+ * @param rewrite: The new code
+ * @param at: Index of the instruction
+ * @param instruction: The instruction, jump offsets are filled in later
+ * @param target: Index of the jump target in the new code, or -1
+ * @param count: Executions of the instruction
+ * @param taken: Taken jumps of the instruction
+ */
+static void rewrite_set(Rewrite * rewrite, int at, uint32_t instruction, int target, uint64_t count, uint64_t taken) {
+    rewrite->code[at] = instruction;
+    rewrite->targets[at] = target;
+    rewrite->counts[at] = count;
+    rewrite->taken[at] = taken;
+}
+
+/**
+ * Replaces the code and counts of a function with the new code and
+ * encodes the offsets of all jumps.
+ *
+ * @param function: The function
+ * @param counts: Counts of the function
+ * @param rewrite: The new code, whose buffers are taken over
+ */
+static void finish_rewrite(Function * function, Counts * counts, Rewrite * rewrite) {
+    accounted_free(function->code);
+    function->code = rewrite->code;
+    function->code_length = rewrite->length;
+    function->code_capacity = rewrite->length ? rewrite->length : 1;
+    for(int pc = 0; pc < rewrite->length; pc++) {
+        if(rewrite->targets[pc] >= 0) function_patch_jump(function, pc, rewrite->targets[pc]);
+    }
+
+    accounted_free(counts->counts);
+    accounted_free(counts->taken);
+    counts->counts = rewrite->counts;
+    counts->taken = rewrite->taken;
+    accounted_free(rewrite->targets);
+}
+
+/**
+ * Checks if an instruction is a compare-and-branch, whose 'JMP' must stay
+ * directly behind it.
+ *
+ * @param instruction: The instruction
+ * @return: 'true' for 'Jxx' instructions
+ */
+static bool is_compare_branch(uint32_t instruction) {
+    switch(OP(instruction)) {
+        case OP_JEQ_I: case OP_JLT_I: case OP_JLE_I:
+        case OP_JEQ_F: case OP_JLT_F: case OP_JLE_F:
+            return true;
+        default:
+            return false;
+    }
+}
+
+/**
+ * Moves every register operand of an instruction by a fixed offset.
+ *
+ * @param instruction: The instruction
+ * @param offset: Added to every register
+ * @return: The renamed instruction
+ */
+static uint32_t rename_registers(uint32_t instruction, int offset) {
+    uint32_t a = (uint32_t)offset << 8, b = (uint32_t)offset << 16, c = (uint32_t)offset << 24;
+
+    switch(OP(instruction)) {
+        case OP_JMP:
+            return instruction;
+        case OP_LOADK: case OP_LOADI: case OP_JMPT: case OP_JMPF:
+        case OP_CALL: case OP_RET:
+            return instruction + a;
+        case OP_MOVE: case OP_ADDI: case OP_NEG_I: case OP_NEG_F:
+        case OP_NOT: case OP_I2F: case OP_F2I:
+        case OP_JEQ_I: case OP_JLT_I: case OP_JLE_I:
+        case OP_JEQ_F: case OP_JLT_F: case OP_JLE_F:
+            return instruction + a + b;
+        default:
+            return instruction + a + b + c;
+    }
+}
+
+/**
+ * Replaces a call by the body of the callee. The callee's registers are
+ * appended to the caller's frame, the arguments are moved into its
+ * parameters and every return becomes a move into the call's result
+ * register and a jump behind the inlined body.
+ *
+ * @param caller: The calling function
+ * @param counts: Counts of the caller
+ * @param site: Index of the 'CALL'
+ * @param callee: The called function
+ * @param callee_counts: Counts of the callee
+ */
+static void inline_call(Function * caller, Counts * counts, int site,
+                        const Function * callee, const Counts * callee_counts) {
+    int result = ARG_A(caller->code[site]);
+    int base = caller->register_count;
+    for(int r = 0; r < callee->register_count; r++) function_add_register(caller, (ValueType)callee->types[r]);
+
+    double scale = callee_counts->calls ? (double)counts->counts[site] / callee_counts->calls : 0;
+    if(scale > 1) scale = 1;
+
+    int start = site + callee->param_count;
+    int * callee_map = (int *)accounted_malloc((callee->code_length + 1) * sizeof(int));
+    assert(callee_map);
+    int at = start;
+    for(int pc = 0; pc < callee->code_length; pc++) {
+        callee_map[pc] = at;
+        bool last = pc == callee->code_length - 1;
+        at += OP(callee->code[pc]) == OP_RET && !last ? 2 : 1;
+    }
+    int end = callee_map[callee->code_length] = at;
+    int growth = end - site - 1;
+
+    int length = caller->code_length;
+    int * caller_map = (int *)accounted_malloc((length + 1) * sizeof(int));
+    assert(caller_map);
+    for(int pc = 0; pc <= length; pc++) caller_map[pc] = pc <= site ? pc : pc + growth;
+
+    Rewrite rewrite;
+    init_rewrite(&rewrite, length + growth);
+    for(int pc = 0; pc < length; pc++) {
+        if(pc == site) continue;
+        int target = jump_target(caller->code, pc);
+        rewrite_set(&rewrite, caller_map[pc], caller->code[pc], target >= 0 ? caller_map[target] : -1,
+                    counts->counts[pc], counts->taken[pc]);
+    }
+
+    for(int p = 0; p < callee->param_count; p++) {
+        rewrite_set(&rewrite, site + p, ENCODE_ABC(OP_MOVE, base + p, result + p, 0), -1, 0, 0);
+    }
+    for(int pc = 0; pc < callee->code_length; pc++) {
+        uint32_t instruction = callee->code[pc];
+        uint64_t count = (uint64_t)(callee_counts->counts[pc] * scale);
+        uint64_t taken = (uint64_t)(callee_counts->taken[pc] * scale);
+        if(OP(instruction) == OP_RET) {
+            rewrite_set(&rewrite, callee_map[pc], ENCODE_ABC(OP_MOVE, result, base + ARG_A(instruction), 0), -1, 0, 0);
+            if(pc < callee->code_length - 1) {
+                rewrite_set(&rewrite, callee_map[pc] + 1, ENCODE_SJ(OP_JMP, 0), end, count, count);
+            }
+        } else {
+            int target = jump_target(callee->code, pc);
+            rewrite_set(&rewrite, callee_map[pc], rename_registers(instruction, base),
+                        target >= 0 ? callee_map[target] : -1, count, taken);
+        }
+    }
+
+    finish_rewrite(caller, counts, &rewrite);
+    accounted_free(caller_map);
+    accounted_free(callee_map);
+}
+
+/**
+ * Inlines the hot call sites of a function, including calls that became
+ * part of it by inlining, until its growth budget is spent.
+ *
+ * @param module: The module containing the function
+ * @param index: Index of the function
+ * @param counts: Counts of every function of the module
+ * @return: 'true' if the code changed
+ */
+static bool inline_hot_calls(Module * module, int index, Counts * counts) {
+    Function * function = module->functions[index];
+    int limit = function->code_length + INLINE_MAX_GROWTH;
+    bool changed = false;
+
+    for(int pc = 0; pc < function->code_length; pc++) {
+        uint32_t instruction = function->code[pc];
+        if(OP(instruction) != OP_CALL || counts[index].counts[pc] < INLINE_MIN_CALLS) continue;
+
+        int callee = ARG_BX(instruction);
+        const Function * target = module->functions[callee];
+        if(callee == index || target->code_length > INLINE_MAX_LENGTH) continue;
+        if(function->register_count + target->register_count > MAX_REGISTERS) continue;
+        if(function->code_length + target->code_length * 2 > limit) continue;
+        if(function->code_length + target->code_length * 2 > MAX_SBX) continue;
+
+        inline_call(function, &counts[index], pc, target, &counts[callee]);
+        changed = true;
+        pc--;
+    }
+    return changed;
+}
+
+/**
+ * Checks if the loop closed by the backwards 'JMP' at 'end' is worth
+ * unrolling and can be: an innermost loop with a small body, entered only
+ * through its header, whose header tests the exit condition and which runs
+ * many iterations per entry.
+ *
+ * @param function: The function
+ * @param counts: Counts of the function
+ * @param end: Index of the backwards jump
+ * @return: 'true' if the loop can be unrolled
+ */
+static bool can_unroll(const Function * function, const Counts * counts, int end) {
+    const uint32_t * code = function->code;
+    if(OP(code[end]) != OP_JMP || (end > 0 && is_compare_branch(code[end - 1]))) return false;
+
+    int header = jump_target(code, end);
+    int length = end - header;
+    if(length < 1 || length > UNROLL_MAX_LENGTH) return false;
+    if(header > 0 && is_compare_branch(code[header - 1])) return false;
+
+    uint32_t test = code[header];
+    if(!is_compare_branch(test) && OP(test) != OP_JMPT && OP(test) != OP_JMPF) return false;
+
+    uint64_t iterations = counts->taken[end];
+    if(iterations < UNROLL_MIN_ITERATIONS || counts->counts[header] <= iterations) return false;
+    if(iterations / (counts->counts[header] - iterations) < UNROLL_MIN_TRIPS) return false;
+
+    for(int pc = 0; pc < function->code_length; pc++) {
+        int target = jump_target(code, pc);
+        if(target < 0 || pc == end) continue;
+        bool inside = pc >= header && pc < end;
+        if(inside && target <= pc) return false;
+        if(!inside && target > header && target <= end) return false;
+    }
+    return true;
+}
+
+/**
+ * Unrolls a loop once: the body, including the exit test, is duplicated
+ * behind itself, so the backwards jump is taken half as often. Jumps of
+ * the first copy to the backwards jump continue with the second copy.
+ *
+ * @param function: The function
+ * @param counts: Counts of the function
+ * @param end: Index of the backwards jump
+ */
+static void unroll_loop(Function * function, Counts * counts, int end) {
+    const uint32_t * code = function->code;
+    int header = jump_target(code, end);
+    int length = end - header;
+
+    Rewrite rewrite;
+    init_rewrite(&rewrite, function->code_length + length);
+    for(int pc = 0; pc < function->code_length; pc++) {
+        int target = jump_target(code, pc);
+        int mapped = target < 0 ? -1 : target <= end ? target : target + length;
+        uint64_t count = counts->counts[pc], taken = counts->taken[pc];
+        bool body = pc >= header && pc < end;
+
+        if(pc == end) {
+            rewrite_set(&rewrite, end + length, code[pc], header, count / 2, taken / 2);
+        } else if(body) {
+            rewrite_set(&rewrite, pc, code[pc], mapped, count - count / 2, taken - taken / 2);
+            int copy = target < 0 ? -1 : target >= header && target <= end ? target + length : mapped;
+            rewrite_set(&rewrite, pc + length, code[pc], copy, count / 2, taken / 2);
+        } else {
+            rewrite_set(&rewrite, pc < end ? pc : pc + length, code[pc], mapped, count, taken);
+        }
+    }
+    finish_rewrite(function, counts, &rewrite);
+}
+
+/**
+ * Unrolls the hot innermost loops of a function. Loops are disjoint, so
+ * unrolling them from the last to the first does not move the ones still
+ * to be unrolled.
+ *
+ * @param function: The function
+ * @param counts: Counts of the function
+ * @return: 'true' if the code changed
+ */
+static bool unroll_hot_loops(Function * function, Counts * counts) {
+    bool changed = false;
+    for(int pc = function->code_length - 1; pc >= 0; pc--) {
+        if(function->code_length + UNROLL_MAX_LENGTH > MAX_SBX) break;
+        if(!can_unroll(function, counts, pc)) continue;
+
+        unroll_loop(function, counts, pc);
+        changed = true;
+    }
+    return changed;
+}
+
+/**
+ * Optimizes a module, then uses the execution counts of a previous run to
+ * inline hot calls and unroll hot loops. The counts must have been
+ * collected from a build without feedback, which produces the same code as
+ * 'optimize_module()'; functions whose code differs are only optimized
+ * without them.
+ *
+ * @param module: The module to optimize
+ * @param feedback: Execution counts of the module
+ */
+void optimize_module_with_feedback(Module * module, const Feedback * feedback) {
+    optimize_module(module);
+
+    Counts * counts = (Counts *)accounted_malloc((module->function_count ? module->function_count : 1) * sizeof(Counts));
+    assert(counts);
+    for(int i = 0; i < module->function_count; i++) {
+        const Function * function = module->functions[i];
+        const FeedbackFunction * profile = feedback_find(feedback, function);
+        counts[i].counts = (uint64_t *)accounted_calloc(function->code_length + 1, sizeof(uint64_t));
+        counts[i].taken = (uint64_t *)accounted_calloc(function->code_length + 1, sizeof(uint64_t));
+        assert(counts[i].counts && counts[i].taken);
+        counts[i].calls = 0;
+        if(profile) {
+            memcpy(counts[i].counts, profile->counts, function->code_length * sizeof(uint64_t));
+            memcpy(counts[i].taken, profile->taken, function->code_length * sizeof(uint64_t));
+            counts[i].calls = profile->calls;
+        }
+    }
+
+    for(int i = 0; i < module->function_count; i++) {
+        Function * function = module->functions[i];
+        bool changed = inline_hot_calls(module, i, counts);
+        changed |= unroll_hot_loops(function, &counts[i]);
+        if(changed) eliminate_dead_code(module, function);
+    }
+
+    for(int i = 0; i < module->function_count; i++) {
+        accounted_free(counts[i].counts);
+        accounted_free(counts[i].taken);
+    }
+    accounted_free(counts);
+}
@@ -0,0 +1,11 @@
+#ifndef OPTIMIZE_H
+#define OPTIMIZE_H
+
+#include "bytecode.h"
+#include "feedback.h"
+
+void optimize_function(const Module * module, Function * function);
+void optimize_module(Module * module);
+void optimize_module_with_feedback(Module * module, const Feedback * feedback);
+
+#endif // OPTIMIZE_H
@@ -0,0 +1,536 @@
+/**
+ * This file contains the recursive descent parser, which reads the tokens
+ * of one source file and builds the abstract syntax tree of its functions.
+ *
+ * Grammar:
+ *
+ *   program    := function*
+ *   function   := type IDENTIFIER '(' [type IDENTIFIER (',' type IDENTIFIER)*] ')' block
+ *   type       := 'int' | 'float'
+ *   block      := '{' statement* '}'
+ *   statement  := type IDENTIFIER ['=' expression] ';'
+ *               | IDENTIFIER '=' expression ';'
+ *               | 'if' '(' expression ')' block ['else' (block | if-statement)]
+ *               | 'while' '(' expression ')' block
+ *               | 'return' expression ';'
+ *               | expression ';'
+ *               | block
+ *   expression := binary operators by precedence, lowest first:
+ *                 '||', '&&', '==' '!=', '<' '<=' '>' '>=', '+' '-', '*' '/' '%'
+ *   unary      := ('-' | '!') unary | primary
+ *   primary    := NUMBER | IDENTIFIER | IDENTIFIER '(' [expression (',' expression)*] ')'
+ *               | '(' expression ')'
+ *
+ * After a syntax error the parser skips to the end of the statement and
+ * continues, so that one run reports as many errors as possible.
+ *
+ * Usage:
+ *  - Parse a file with 'parse()', passing a lexer and the messages to
+ *    report errors to
+ *  - Free the tree with 'destroy_program()'
+ *
+ * @file    parser.c
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include "parser.h"
+#include "trace.h"
+#include "alloc.h"
+
+#define TOKEN_BATCH 256         // tokens lexed ahead at a time
+
+typedef struct {
+    Lexer * lexer;
+    Token * current;            // next token to consume
+    Token * pending[TOKEN_BATCH];   // tokens lexed after 'current'
+    int pending_count;
+    int pending_next;           // next of 'pending' to consume
+    Diagnostics * diagnostics;
+} Parser;
+
+/*
+ * Binary operators by precedence, higher numbers binding tighter.
+ */
+static const struct {
+    const char * op;
+    int precedence;
+} binary_operators[] = {
+    { "||", 1 }, { "&&", 2 },
+    { "==", 3 }, { "!=", 3 },
+    { "<", 4 }, { "<=", 4 }, { ">", 4 }, { ">=", 4 },
+    { "+", 5 }, { "-", 5 },
+    { "*", 6 }, { "/", 6 }, { "%", 6 }
+};
+
+/**
+ * Allocates a syntax tree node.
+ *
+ * @param kind: The kind of node
+ * @param line: Line of the node in the source
+ * @param column: Column of the node
+ * @return: A pointer to the new 'AstNode' structure
+ */
+AstNode * new_node(AstKind kind, int line, int column) {
+    AstNode * node = (AstNode *)accounted_calloc(1, sizeof(AstNode));
+    assert(node);
+    node->kind = kind;
+    node->line = line;
+    node->column = column;
+    node->type = TYPE_INT;
+    node->symbol = -1;
+    return node;
+}
+
+/**
+ * Frees a syntax tree node and everything below it.
+ *
+ * @param node: A pointer to the node, may be NULL
+ */
+void destroy_node(AstNode * node) {
+    if(!node) return;
+    destroy_node(node->left);
+    destroy_node(node->right);
+    destroy_node(node->third);
+    for(int i = 0; i < node->child_count; i++) destroy_node(node->children[i]);
+    accounted_free(node->children);
+    accounted_free(node->text);
+    accounted_free(node);
+}
+
+/**
+ * Frees a program and all its functions.
+ *
+ * @param program: A pointer to the program
+ */
+void destroy_program(Program * program) {
+    for(int f = 0; f < program->function_count; f++) {
+        AstFunction * function = &program->functions[f];
+        accounted_free(function->name);
+        for(int p = 0; p < function->param_count; p++) destroy_node(function->params[p]);
+        accounted_free(function->params);
+        destroy_node(function->body);
+        accounted_free(function->slot_types);
+    }
+    accounted_free(program->functions);
+    accounted_free(program);
+}
+
+static void add_child(AstNode * node, AstNode * child) {
+    if(node->child_count == node->child_capacity) {
+        node->child_capacity = node->child_capacity ? node->child_capacity * 2 : 1;
+        node->children = (AstNode **)accounted_realloc(node->children, node->child_capacity * sizeof(AstNode *));
+        assert(node->children);
+    }
+    node->children[node->child_count++] = child;
+}
+
+/**
+ * Returns the next token of the file. Tokens are lexed in batches, so a
+ * trace shows lexing as a few slices rather than one per token.
+ */
+static Token * read_token(Parser * parser) {
+    if(parser->pending_next == parser->pending_count) {
+        trace_begin("lex", NULL);
+        Phase phase = alloc_phase(PHASE_LEX);
+        Token * token;
+        parser->pending_count = parser->pending_next = 0;
+        do {
+            token = get_next(parser->lexer);
+            parser->pending[parser->pending_count++] = token;
+        } while(token->type != END && parser->pending_count < TOKEN_BATCH);
+        alloc_phase(phase);
+        trace_end("lex");
+    }
+    return parser->pending[parser->pending_next++];
+}
+
+static void next_token(Parser * parser) {
+    destroy_token(parser->current);
+    parser->current = read_token(parser);
+}
+
+static bool check(const Parser * parser, TokenType type, const char * text) {
+    return parser->current->type == type && strcmp(parser->current->token, text) == 0;
+}
+
+static bool match(Parser * parser, TokenType type, const char * text) {
+    if(!check(parser, type, text)) return false;
+    next_token(parser);
+    return true;
+}
+
+static bool check_type(const Parser * parser) {
+    return check(parser, KEYWORD, "int") || check(parser, KEYWORD, "float");
+}
+
+/**
+ * Reports an error at the current token.
+ */
+static void error(Parser * parser, const char * message) {
+    const Token * token = parser->current;
+    if(token->type == END) diagnose(parser->diagnostics, token->line, token->column, "%s at end of file", message);
+    else diagnose(parser->diagnostics, token->line, token->column, "%s before '%s'", message, token->token);
+}
+
+/**
+ * Consumes an expected token or reports an error.
+ *
+ * @return: 'false' if the token is missing
+ */
+static bool expect(Parser * parser, TokenType type, const char * text) {
+    if(match(parser, type, text)) return true;
+    char message[64];
+    snprintf(message, sizeof(message), "expected '%s'", text);
+    error(parser, message);
+    return false;
+}
+
+/**
+ * Consumes an identifier and returns a copy of its name, or reports an
+ * error and returns NULL.
+ */
+static char * expect_identifier(Parser * parser) {
+    if(parser->current->type != IDENTIFIER) {
+        error(parser, "expected an identifier");
+        return NULL;
+    }
+    char * name = accounted_strdup(parser->current->token);
+    next_token(parser);
+    return name;
+}
+
+static ValueType parse_type(Parser * parser) {
+    ValueType type = check(parser, KEYWORD, "float") ? TYPE_FLOAT : TYPE_INT;
+    next_token(parser);
+    return type;
+}
+
+/**
+ * Skips tokens up to the end of the current statement after an error: past
+ * the next ';', or up to a '}' or the start of a statement.
+ */
+static void synchronize(Parser * parser) {
+    while(parser->current->type != END) {
+        if(match(parser, SEPARATOR, ";")) return;
+        if(check(parser, SEPARATOR, "}") || check(parser, SEPARATOR, "{")) return;
+        if(check(parser, KEYWORD, "if") || check(parser, KEYWORD, "while") || check(parser, KEYWORD, "return")) return;
+        next_token(parser);
+    }
+}
+
+static AstNode * parse_expression(Parser * parser, int precedence);
+
+/**
+ * Parses the arguments of a call after its '('.
+ *
+ * @return: 'false' on a syntax error
+ */
+static bool parse_arguments(Parser * parser, AstNode * call) {
+    if(match(parser, SEPARATOR, ")")) return true;
+    do {
+        AstNode * argument = parse_expression(parser, 1);
+        if(!argument) return false;
+        add_child(call, argument);
+    } while(match(parser, SEPARATOR, ","));
+    return expect(parser, SEPARATOR, ")");
+}
+
+/**
+ * Parses a literal, variable, call or parenthesized expression.
+ */
+static AstNode * parse_primary(Parser * parser) {
+    Token * token = parser->current;
+    int line = token->line, column = token->column;
+
+    if(token->type == NUMBER) {
+        AstNode * node = new_node(AST_NUMBER, line, column);
+        node->text = accounted_strdup(token->token);
+        next_token(parser);
+        return node;
+    }
+
+    if(token->type == IDENTIFIER) {
+        char * name = accounted_strdup(token->token);
+        next_token(parser);
+        if(!match(parser, SEPARATOR, "(")) {
+            AstNode * node = new_node(AST_VARIABLE, line, column);
+            node->text = name;
+            return node;
+        }
+
+        AstNode * call = new_node(AST_CALL, line, column);
+        call->text = name;
+        if(!parse_arguments(parser, call)) {
+            destroy_node(call);
+            return NULL;
+        }
+        return call;
+    }
+
+    if(match(parser, SEPARATOR, "(")) {
+        AstNode * inner = parse_expression(parser, 1);
+        if(inner && !expect(parser, SEPARATOR, ")")) {
+            destroy_node(inner);
+            return NULL;
+        }
+        return inner;
+    }
+
+    if(token->type == STRING) diagnose(parser->diagnostics, line, column, "string literals are not supported");
+    else error(parser, "expected an expression");
+    return NULL;
+}
+
+static AstNode * parse_unary(Parser * parser) {
+    if(check(parser, OPERATOR, "-") || check(parser, OPERATOR, "!")) {
+        AstNode * node = new_node(AST_UNARY, parser->current->line, parser->current->column);
+        node->text = accounted_strdup(parser->current->token);
+        next_token(parser);
+        node->left = parse_unary(parser);
+        if(!node->left) {
+            destroy_node(node);
+            return NULL;
+        }
+        return node;
+    }
+    return parse_primary(parser);
+}
+
+/**
+ * Returns the precedence of the current token as a binary operator.
+ *
+ * @return: The precedence, or 0 if the token is no binary operator
+ */
+static int current_precedence(const Parser * parser) {
+    if(parser->current->type != OPERATOR) return 0;
+    for(size_t i = 0; i < sizeof(binary_operators) / sizeof(binary_operators[0]); i++) {
+        if(strcmp(parser->current->token, binary_operators[i].op) == 0) return binary_operators[i].precedence;
+    }
+    return 0;
+}
+
+/**
+ * Parses an expression by precedence climbing; all binary operators are
+ * left associative.
+ *
+ * @param parser: The parser
+ * @param precedence: The lowest precedence of an operator to consume
+ * @return: The expression, or NULL after a syntax error
+ */
+static AstNode * parse_expression(Parser * parser, int precedence) {
+    AstNode * left = parse_unary(parser);
+    while(left) {
+        int current = current_precedence(parser);
+        if(current < precedence || current == 0) break;
+
+        AstNode * node = new_node(AST_BINARY, parser->current->line, parser->current->column);
+        node->text = accounted_strdup(parser->current->token);
+        next_token(parser);
+        node->left = left;
+        node->right = parse_expression(parser, current + 1);
+        if(!node->right) {
+            destroy_node(node);
+            return NULL;
+        }
+        left = node;
+    }
+    return left;
+}
+
+static AstNode * parse_statement(Parser * parser);
+
+/**
+ * Parses a block after checking for its '{'.
+ *
+ * @return: The block, or NULL if the '{' is missing
+ */
+static AstNode * parse_block(Parser * parser) {
+    AstNode * block = new_node(AST_BLOCK, parser->current->line, parser->current->column);
+    if(!expect(parser, SEPARATOR, "{")) {
+        destroy_node(block);
+        return NULL;
+    }
+
+    while(!check(parser, SEPARATOR, "}") && parser->current->type != END) {
+        AstNode * statement = parse_statement(parser);
+        if(statement) add_child(block, statement);
+        else synchronize(parser);
+    }
+    expect(parser, SEPARATOR, "}");
+    return block;
+}
+
+/**
+ * Parses the condition and body of an 'if' or 'while' after its keyword.
+ */
+static AstNode * parse_conditional(Parser * parser, AstKind kind, int line, int column) {
+    AstNode * node = new_node(kind, line, column);
+    if(!expect(parser, SEPARATOR, "(") || !(node->left = parse_expression(parser, 1))
+       || !expect(parser, SEPARATOR, ")") || !(node->right = parse_block(parser))) {
+        destroy_node(node);
+        return NULL;
+    }
+    return node;
+}
+
+static AstNode * parse_if(Parser * parser, int line, int column) {
+    AstNode * node = parse_conditional(parser, AST_IF, line, column);
+    if(!node || !check(parser, KEYWORD, "else")) return node;
+
+    next_token(parser);
+    if(check(parser, KEYWORD, "if")) {
+        int else_line = parser->current->line, else_column = parser->current->column;
+        next_token(parser);
+        node->third = parse_if(parser, else_line, else_column);
+    } else {
+        node->third = parse_block(parser);
+    }
+    if(!node->third) {
+        destroy_node(node);
+        return NULL;
+    }
+    return node;
+}
+
+/**
+ * Parses a statement.
+ *
+ * @return: The statement, or NULL after a syntax error
+ */
+static AstNode * parse_statement(Parser * parser) {
+    Token * token = parser->current;
+    int line = token->line, column = token->column;
+
+    if(check(parser, SEPARATOR, "{")) return parse_block(parser);
+
+    if(check_type(parser)) {
+        AstNode * node = new_node(AST_DECLARATION, line, column);
+        node->type = parse_type(parser);
+        node->text = expect_identifier(parser);
+        bool valid = node->text != NULL;
+        if(valid && match(parser, OPERATOR, "=")) valid = (node->left = parse_expression(parser, 1)) != NULL;
+        if(!valid || !expect(parser, SEPARATOR, ";")) {
+            destroy_node(node);
+            return NULL;
+        }
+        return node;
+    }
+
+    if(match(parser, KEYWORD, "if")) return parse_if(parser, line, column);
+    if(match(parser, KEYWORD, "while")) return parse_conditional(parser, AST_WHILE, line, column);
+
+    AstNode * node;
+    if(match(parser, KEYWORD, "return")) {
+        node = new_node(AST_RETURN, line, column);
+        node->left = parse_expression(parser, 1);
+    } else {
+        AstNode * expression = parse_expression(parser, 1);
+        if(expression && expression->kind == AST_VARIABLE && match(parser, OPERATOR, "=")) {
+            node = new_node(AST_ASSIGNMENT, line, column);
+            node->text = expression->text;
+            expression->text = NULL;
+            destroy_node(expression);
+            node->left = parse_expression(parser, 1);
+        } else {
+            node = new_node(AST_EXPRESSION, line, column);
+            node->left = expression;
+        }
+    }
+
+    if(!node->left || !expect(parser, SEPARATOR, ";")) {
+        destroy_node(node);
+        return NULL;
+    }
+    return node;
+}
+
+/**
+ * Parses one function definition into the program.
+ *
+ * @return: 'false' after a syntax error
+ */
+static bool parse_function(Parser * parser, Program * program) {
+    AstFunction function;
+    memset(&function, 0, sizeof(function));
+    function.line = parser->current->line;
+    function.column = parser->current->column;
+
+    if(!check_type(parser)) {
+        error(parser, "expected a function definition");
+        return false;
+    }
+    function.return_type = parse_type(parser);
+    function.name = expect_identifier(parser);
+    bool valid = function.name && expect(parser, SEPARATOR, "(");
+
+    if(valid && !match(parser, SEPARATOR, ")")) {
+        do {
+            if(!check_type(parser)) {
+                error(parser, "expected a parameter type");
+                valid = false;
+                break;
+            }
+            AstNode * param = new_node(AST_DECLARATION, parser->current->line, parser->current->column);
+            param->type = parse_type(parser);
+            param->text = expect_identifier(parser);
+            if(function.param_count == function.param_capacity) {
+                function.param_capacity = function.param_capacity ? function.param_capacity * 2 : 1;
+                function.params = (AstNode **)accounted_realloc(function.params, function.param_capacity * sizeof(AstNode *));
+                assert(function.params);
+            }
+            function.params[function.param_count++] = param;
+            if(!param->text) {
+                valid = false;
+                break;
+            }
+        } while(match(parser, SEPARATOR, ","));
+        valid = valid && expect(parser, SEPARATOR, ")");
+    }
+
+    if(valid) function.body = parse_block(parser);
+
+    if(program->function_count == program->function_capacity) {
+        program->function_capacity = program->function_capacity ? program->function_capacity * 2 : 16;
+        program->functions = (AstFunction *)accounted_realloc(program->functions,
+                                                              program->function_capacity * sizeof(AstFunction));
+        assert(program->functions);
+    }
+    program->functions[program->function_count++] = function;
+    return valid && function.body;
+}
+
+/**
+ * Parses a source file.
+ *
+ * @param lexer: The lexer reading the file
+ * @param diagnostics: Receives syntax errors
+ * @return: The program; check the error count before using it
+ */
+Program * parse(Lexer * lexer, Diagnostics * diagnostics) {
+    Program * program = (Program *)accounted_calloc(1, sizeof(Program));
+    assert(program);
+
+    Parser parser;
+    parser.lexer = lexer;
+    parser.diagnostics = diagnostics;
+    parser.pending_count = parser.pending_next = 0;
+    parser.current = read_token(&parser);
+
+    while(parser.current->type != END) {
+        if(parser.current->type == INVALID) {
+            error(&parser, "invalid character");
+            next_token(&parser);
+            continue;
+        }
+        if(!parse_function(&parser, program)) {
+            // Resume at the next function definition
+            while(parser.current->type != END && !check_type(&parser)) next_token(&parser);
+        }
+    }
+
+    destroy_token(parser.current);
+    while(parser.pending_next < parser.pending_count) destroy_token(parser.pending[parser.pending_next++]);
+    return program;
+}
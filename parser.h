@@ -0,0 +1,69 @@
+#ifndef PARSER_H
+#define PARSER_H
+
+#include <stdbool.h>
+#include "lexer.h"
+#include "bytecode.h"
+#include "diagnostic.h"
+
+typedef enum {
+    // Expressions
+    AST_NUMBER,         // literal, 'text' holds its digits
+    AST_VARIABLE,       // 'text' names the variable
+    AST_UNARY,          // 'text' is the operator, 'left' the operand
+    AST_BINARY,         // 'text' is the operator, 'left' and 'right' the operands
+    AST_CALL,           // 'text' names the function, 'children' are the arguments
+    AST_CONVERT,        // converts 'left' to 'type', inserted by semantic analysis
+
+    // Statements
+    AST_DECLARATION,    // declares 'text' of 'type', initialized to 'left' if not NULL
+    AST_ASSIGNMENT,     // assigns 'left' to the variable 'text'
+    AST_IF,             // runs 'right' if 'left' is not 0, otherwise 'third' if not NULL
+    AST_WHILE,          // runs 'right' as long as 'left' is not 0
+    AST_RETURN,         // returns 'left'
+    AST_EXPRESSION,     // evaluates 'left' for its side effects
+    AST_BLOCK           // runs 'children' in a scope of their own
+} AstKind;
+
+typedef struct AstNode {
+    AstKind kind;
+    int line;                   // position for error messages
+    int column;
+    int symbol;                 // variable slot or function index, set by semantic analysis
+    char * text;                // name, operator or literal
+    ValueType type;             // declared type, or the type of an expression after semantic analysis
+    struct AstNode * left;
+    struct AstNode * right;
+    struct AstNode * third;
+    struct AstNode ** children;
+    int child_count;
+    int child_capacity;
+} AstNode;
+
+typedef struct {
+    char * name;
+    ValueType return_type;
+    AstNode ** params;          // 'AST_DECLARATION' without initializer
+    int param_count;
+    int param_capacity;
+    AstNode * body;             // 'AST_BLOCK'
+    int line;
+    int column;
+
+    ValueType * slot_types;     // type of every variable slot, parameters first,
+    int slot_count;             // set by semantic analysis
+    int slot_capacity;
+} AstFunction;
+
+typedef struct {
+    AstFunction * functions;
+    int function_count;
+    int function_capacity;
+} Program;
+
+Program * parse(Lexer * lexer, Diagnostics * diagnostics);
+void destroy_program(Program * program);
+AstNode * new_node(AstKind kind, int line, int column);
+void destroy_node(AstNode * node);
+
+#endif // PARSER_H
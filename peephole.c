@@ -0,0 +1,471 @@
+/**
+ * This file contains the peephole optimizer of the native backend, which
+ * runs over machine instructions after registers have been allocated.
+ *
+ * Instruction selection lowers every bytecode instruction by a fixed
+ * template through scratch registers, so 'a = a + 1' on an allocated
+ * register first becomes a load into RAX, an add and a store back. The
+ * passes below look at a few neighbouring instructions at a time and
+ * rewrite such sequences until nothing changes any more:
+ *
+ *  - Moves through a dead scratch register are forwarded, self moves and
+ *    loads following a store to the same slot are removed
+ *  - Operations on a scratch copy are performed in place or renamed to
+ *    their final destination
+ *  - 'add 0', 'sub 0' and 'imul 1' are dropped
+ *  - 'mov d, x; add d, y' becomes 'lea d, [x + y]', and 'lea d, [d + y]'
+ *    becomes the shorter 'add d, y'
+ *  - The same forwarding applies to 'movsd' copies of float values held
+ *    in SSE registers
+ *  - 'setcc; movzx; test; jne' tests the original flags instead
+ *  - 'mov r, 0' becomes the shorter 'xor r, r' where the flags are dead
+ *
+ * Liveness is found by scanning forward to the next read or write. At
+ * labels and jumps the scan gives up and assumes the register is live,
+ * unless the caller declared it a scratch register which is never live
+ * at a label or jump target.
+ *
+ * Usage:
+ *  - Call 'peephole_optimize()' on a function with allocated registers
+ *
+ * @file    peephole.c
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include "peephole.h"
+
+static bool is_reg(const Operand * operand, int reg) {
+    return operand->kind == OPERAND_REG && operand->reg == reg;
+}
+
+static bool is_gpr(const Operand * operand) {
+    return operand->kind == OPERAND_REG && !IS_XMM(operand->reg);
+}
+
+static bool is_xmm(const Operand * operand) {
+    return operand->kind == OPERAND_REG && IS_XMM(operand->reg);
+}
+
+static bool uses(const Operand * operand, int reg) {
+    if(operand->kind == OPERAND_REG) return operand->reg == reg;
+    if(operand->kind == OPERAND_MEM) return operand->reg == reg || operand->index == reg;
+    return false;
+}
+
+static bool fits32(int64_t value) {
+    return value >= INT32_MIN && value <= INT32_MAX;
+}
+
+static void drop(MachineInstr * instr) {
+    instr->op = M_NOP;
+}
+
+/**
+ * Returns the index of the next instruction that is not a 'NOP'.
+ *
+ * @param function: The function
+ * @param i: Index of the current instruction
+ * @return: The index, or the length of the function
+ */
+static int next(const MachineFunction * function, int i) {
+    for(i++; i < function->length && function->code[i].op == M_NOP; i++);
+    return i;
+}
+
+/**
+ * Checks if the value of a register is not read after an instruction.
+ * 'SETCC' only replaces the low byte and keeps the register alive. A
+ * scratch register is dead where a conditional jump lands, so only the
+ * path falling through is followed.
+ *
+ * @param function: The function
+ * @param i: Index of the instruction
+ * @param reg: The register
+ * @param scratch: Registers never live across labels and jumps
+ * @return: 'true' if the register is overwritten before it is read
+ */
+static bool register_dead(const MachineFunction * function, int i, int reg, uint64_t scratch) {
+    bool local = (scratch >> reg) & 1;
+    for(int j = i + 1; j < function->length; j++) {
+        const MachineInstr * instr = &function->code[j];
+        if(machine_reads(instr, reg)) return false;
+        if(instr->op == M_SETCC && is_reg(&instr->dst, reg)) continue;
+        if(machine_writes(instr, reg)) return true;
+        if(instr->op == M_JCC && local) continue;
+        if(instr->op == M_LABEL || instr->op == M_JMP || instr->op == M_JCC || instr->op == M_RET) return local;
+    }
+    return local;
+}
+
+/**
+ * Checks if the flags set by an instruction are never tested. Flags never
+ * live across labels and unconditional jumps.
+ *
+ * @param function: The function
+ * @param i: Index of the instruction
+ * @return: 'true' if the flags are dead
+ */
+static bool flags_dead(const MachineFunction * function, int i) {
+    for(int j = i + 1; j < function->length; j++) {
+        const MachineInstr * instr = &function->code[j];
+        if(machine_reads_flags(instr)) return false;
+        if(machine_writes_flags(instr)) return true;
+        if(instr->op == M_LABEL || instr->op == M_JMP || instr->op == M_RET) return true;
+    }
+    return true;
+}
+
+/**
+ * Checks if an instruction is a two operand integer operation that can
+ * write a register directly.
+ */
+static bool is_operation(int op) {
+    switch(op) {
+        case M_ADD: case M_SUB: case M_AND: case M_OR: case M_XOR: case M_IMUL: case M_NEG:
+            return true;
+        default:
+            return false;
+    }
+}
+
+/**
+ * Checks if an instruction is a scalar float operation on an SSE register.
+ */
+static bool is_float_operation(int op) {
+    return op == M_ADDSD || op == M_SUBSD || op == M_MULSD || op == M_DIVSD;
+}
+
+/**
+ * Checks if an operation can also update a memory destination with the
+ * given source.
+ */
+static bool operates_on_memory(int op, const Operand * src) {
+    if(op == M_IMUL) return false;
+    return src->kind == OPERAND_NONE || is_gpr(src) || (src->kind == OPERAND_IMM && fits32(src->imm));
+}
+
+/**
+ * Checks if an instruction only computes a value into its destination
+ * register, without side effects or flags, so that it can be deleted when
+ * the value is dead.
+ */
+static bool is_definition(const MachineInstr * instr) {
+    switch(instr->op) {
+        case M_MOV: case M_LEA: case M_MOVZX: case M_SETCC: case M_MOVSD:
+        case M_CVTSI2SD: case M_CVTTSD2SI: case M_MOVQ:
+            return instr->dst.kind == OPERAND_REG;
+        default:
+            return false;
+    }
+}
+
+/**
+ * Performs 'mov s, x; op s, y; mov d, s' on the final destination instead
+ * of the scratch copy s.
+ *
+ * @param function: The function
+ * @param i: Index of the 'mov'
+ * @param j: Index of the operation
+ * @param scratch: Registers never live across labels and jumps
+ * @return: 'true' if the code changed
+ */
+static bool forward_operation(MachineFunction * function, int i, int j, uint64_t scratch) {
+    MachineInstr * a = &function->code[i], * b = &function->code[j];
+    int s = a->dst.reg;
+    if(!is_operation(b->op) || !is_reg(&b->dst, s) || uses(&b->src, s)) return false;
+    int k = next(function, j);
+    if(k >= function->length) return false;
+    MachineInstr * c = &function->code[k];
+    if(c->op != M_MOV || !is_reg(&c->src, s) || !register_dead(function, k, s, scratch)) return false;
+
+    // mov s, x; op s, y; mov x, s => op x, y
+    if(operands_equal(&a->src, &c->dst)) {
+        if(c->dst.kind == OPERAND_MEM && !operates_on_memory(b->op, &b->src)) return false;
+        if(c->dst.kind != OPERAND_MEM && !is_gpr(&c->dst)) return false;
+        c->op = b->op;
+        c->src = b->src;
+        drop(a);
+        drop(b);
+        return true;
+    }
+
+    // mov s, x; op s, y; mov d, s => mov d, x; op d, y
+    if(is_gpr(&c->dst) && c->dst.reg != s && !uses(&b->src, c->dst.reg)) {
+        a->dst = c->dst;
+        b->dst = c->dst;
+        drop(c);
+        return true;
+    }
+    return false;
+}
+
+/**
+ * Forwards 'mov s, x' into a following use of the scratch copy s:
+ * another move, an operation whose result is moved on, or a compare.
+ *
+ * @param function: The function
+ * @param i: Index of the 'mov'
+ * @param scratch: Registers never live across labels and jumps
+ * @return: 'true' if the code changed
+ */
+static bool forward_move(MachineFunction * function, int i, uint64_t scratch) {
+    MachineInstr * a = &function->code[i];
+    int s = a->dst.reg;
+    int j = next(function, i);
+    if(j >= function->length) return false;
+    MachineInstr * b = &function->code[j];
+
+    // mov s, x; mov y, s => mov y, x
+    if(b->op == M_MOV && is_reg(&b->src, s) && register_dead(function, j, s, scratch)) {
+        if(a->src.kind == OPERAND_MEM && b->dst.kind == OPERAND_MEM) return false;
+        if(a->src.kind == OPERAND_IMM && b->dst.kind == OPERAND_MEM && !fits32(a->src.imm)) return false;
+        b->src = a->src;
+        drop(a);
+        return true;
+    }
+
+    // mov s, x; cmp s, y => cmp x, y
+    if(b->op == M_CMP && is_reg(&b->dst, s) && !uses(&b->src, s) && a->src.kind != OPERAND_IMM
+       && !(a->src.kind == OPERAND_MEM && b->src.kind == OPERAND_MEM) && register_dead(function, j, s, scratch)) {
+        b->dst = a->src;
+        drop(a);
+        return true;
+    }
+
+    // mov s, x; test s, s => test x, x
+    if(b->op == M_TEST && is_reg(&b->dst, s) && is_reg(&b->src, s) && is_gpr(&a->src)
+       && register_dead(function, j, s, scratch)) {
+        b->dst = b->src = a->src;
+        drop(a);
+        return true;
+    }
+
+    if(forward_operation(function, i, j, scratch)) return true;
+
+    // mov d, x; add d, y => lea d, [x + y]
+    if(b->op == M_ADD && is_reg(&b->dst, s) && is_gpr(&a->src) && a->src.reg != s && flags_dead(function, j)) {
+        if(is_gpr(&b->src) && b->src.reg != RSP) {
+            a->op = M_LEA;
+            a->src = index_operand(a->src.reg, b->src.reg == s ? a->src.reg : b->src.reg, 1, 0);
+            drop(b);
+            return true;
+        }
+        if(b->src.kind == OPERAND_IMM && fits32(b->src.imm)) {
+            a->op = M_LEA;
+            a->src = mem_operand(a->src.reg, (int32_t)b->src.imm);
+            drop(b);
+            return true;
+        }
+    }
+
+    return false;
+}
+
+/**
+ * Forwards 'movsd s, x' of a float in an SSE register into a following
+ * use of the copy s, like 'forward_move()' does for integers. SSE
+ * operations only write registers, so results always stay in one.
+ *
+ * @param function: The function
+ * @param i: Index of the 'movsd'
+ * @param scratch: Registers never live across labels and jumps
+ * @return: 'true' if the code changed
+ */
+static bool forward_float_move(MachineFunction * function, int i, uint64_t scratch) {
+    MachineInstr * a = &function->code[i];
+    int s = a->dst.reg;
+    int j = next(function, i);
+    if(j >= function->length) return false;
+    MachineInstr * b = &function->code[j];
+
+    // movsd s, x; movsd y, s => movsd y, x
+    if(b->op == M_MOVSD && is_reg(&b->src, s) && !(a->src.kind == OPERAND_MEM && b->dst.kind == OPERAND_MEM)
+       && register_dead(function, j, s, scratch)) {
+        b->src = a->src;
+        drop(a);
+        return true;
+    }
+
+    // movsd s, x; ucomisd s, y => ucomisd x, y
+    if(b->op == M_UCOMISD && is_reg(&b->dst, s) && !uses(&b->src, s) && is_xmm(&a->src)
+       && register_dead(function, j, s, scratch)) {
+        b->dst = a->src;
+        drop(a);
+        return true;
+    }
+
+    if(!is_float_operation(b->op) || !is_reg(&b->dst, s) || uses(&b->src, s)) return false;
+    int k = next(function, j);
+    if(k >= function->length) return false;
+    MachineInstr * c = &function->code[k];
+    if(c->op != M_MOVSD || !is_reg(&c->src, s) || !is_xmm(&c->dst) || !register_dead(function, k, s, scratch)) {
+        return false;
+    }
+
+    // movsd s, x; op s, y; movsd x, s => op x, y
+    if(operands_equal(&a->src, &c->dst)) {
+        c->op = b->op;
+        c->src = b->src;
+        drop(a);
+        drop(b);
+        return true;
+    }
+
+    // movsd s, x; op s, y; movsd d, s => movsd d, x; op d, y
+    if(c->dst.reg != s && !uses(&b->src, c->dst.reg)) {
+        a->dst = c->dst;
+        b->dst = c->dst;
+        drop(c);
+        return true;
+    }
+    return false;
+}
+
+/**
+ * Replaces 'test q, q; je/jne' by a jump on the flags of the compare that
+ * produced q with 'setcc' and 'movzx', possibly copied by moves in between.
+ *
+ * @param function: The function
+ * @param i: Index of the 'test'
+ * @return: 'true' if the code changed
+ */
+static bool fuse_branch(MachineFunction * function, int i) {
+    MachineInstr * test = &function->code[i];
+    int q = test->dst.reg;
+    int j = next(function, i);
+    if(j >= function->length) return false;
+    MachineInstr * jump = &function->code[j];
+    if(jump->op != M_JCC || (jump->cond != CC_E && jump->cond != CC_NE)) return false;
+
+    int p = i - 1;
+    while(p >= 0 && (function->code[p].op == M_NOP
+                     || (function->code[p].op == M_MOV && is_reg(&function->code[p].src, q)
+                         && !uses(&function->code[p].dst, q)))) p--;
+    if(p < 0 || function->code[p].op != M_MOVZX || !is_reg(&function->code[p].dst, q)) return false;
+
+    int byte = function->code[p].src.reg;
+    do p--; while(p >= 0 && function->code[p].op == M_NOP);
+    if(p < 0 || function->code[p].op != M_SETCC || !is_reg(&function->code[p].dst, byte)) return false;
+
+    Condition cc = (Condition)function->code[p].cond;
+    jump->cond = (uint8_t)(jump->cond == CC_NE ? cc : NEGATE(cc));
+    drop(test);
+    return true;
+}
+
+/**
+ * Runs one pass of all rewrites over a function.
+ *
+ * @param function: The function
+ * @param scratch: Registers never live across labels and jumps
+ * @return: 'true' if the code changed
+ */
+static bool peephole_pass(MachineFunction * function, uint64_t scratch) {
+    bool changed = false;
+    for(int i = 0; i < function->length; i++) {
+        MachineInstr * instr = &function->code[i];
+        if(instr->op == M_NOP) continue;
+
+        if((instr->op == M_MOV || instr->op == M_MOVSD) && instr->src.kind == OPERAND_REG
+           && is_reg(&instr->dst, instr->src.reg)) {
+            drop(instr);
+            changed = true;
+            continue;
+        }
+
+        if(is_definition(instr) && register_dead(function, i, instr->dst.reg, scratch)) {
+            drop(instr);
+            changed = true;
+            continue;
+        }
+
+        // mov m, r; mov r2, m => mov m, r; mov r2, r
+        if(instr->op == M_MOV && instr->dst.kind == OPERAND_MEM && is_gpr(&instr->src)) {
+            int j = next(function, i);
+            MachineInstr * load = j < function->length ? &function->code[j] : NULL;
+            if(load && load->op == M_MOV && is_gpr(&load->dst) && operands_equal(&load->src, &instr->dst)) {
+                if(load->dst.reg == instr->src.reg) drop(load);
+                else load->src = instr->src;
+                changed = true;
+                continue;
+            }
+        }
+
+        if(instr->op == M_MOV && is_gpr(&instr->dst) && forward_move(function, i, scratch)) {
+            changed = true;
+            continue;
+        }
+
+        if(instr->op == M_MOVSD && is_xmm(&instr->dst) && forward_float_move(function, i, scratch)) {
+            changed = true;
+            continue;
+        }
+
+        // movzx s, r8; mov d, s => movzx d, r8 (also for lea and cvttsd2si)
+        if((instr->op == M_MOVZX || instr->op == M_LEA || instr->op == M_CVTTSD2SI) && is_gpr(&instr->dst)) {
+            int j = next(function, i);
+            MachineInstr * move = j < function->length ? &function->code[j] : NULL;
+            int s = instr->dst.reg;
+            if(move && move->op == M_MOV && is_reg(&move->src, s) && is_gpr(&move->dst) && move->dst.reg != s
+               && register_dead(function, j, s, scratch)) {
+                instr->dst = move->dst;
+                drop(move);
+                changed = true;
+                continue;
+            }
+        }
+
+        // lea d, [d + y] => add d, y where the flags are dead, which is shorter
+        if(instr->op == M_LEA && instr->src.reg == instr->dst.reg && flags_dead(function, i)) {
+            const Operand * address = &instr->src;
+            if(address->index == NO_REG) {
+                instr->op = M_ADD;
+                instr->src = imm_operand(address->disp);
+                changed = true;
+                continue;
+            }
+            if(address->scale == 1 && address->disp == 0) {
+                instr->op = M_ADD;
+                instr->src = reg_operand(address->index);
+                changed = true;
+                continue;
+            }
+        }
+
+        bool identity = instr->src.kind == OPERAND_IMM
+            && (((instr->op == M_ADD || instr->op == M_SUB || instr->op == M_OR || instr->op == M_XOR) && instr->src.imm == 0)
+                || (instr->op == M_IMUL && instr->src.imm == 1));
+        if(identity && flags_dead(function, i)) {
+            drop(instr);
+            changed = true;
+            continue;
+        }
+
+        if(instr->op == M_TEST && is_gpr(&instr->dst) && is_reg(&instr->src, instr->dst.reg) && fuse_branch(function, i)) {
+            changed = true;
+            continue;
+        }
+
+        if(instr->op == M_MOV && is_gpr(&instr->dst) && instr->src.kind == OPERAND_IMM && instr->src.imm == 0
+           && flags_dead(function, i)) {
+            instr->op = M_XOR;
+            instr->src = instr->dst;
+            changed = true;
+        }
+    }
+    machine_remove_nops(function);
+    return changed;
+}
+
+/**
+ * Optimizes a machine function with allocated registers in place until no
+ * rewrite applies any more.
+ *
+ * @param function: The function
+ * @param scratch: Bit mask of the registers which never hold a value
+ * across labels and jumps
+ */
+void peephole_optimize(MachineFunction * function, uint64_t scratch) {
+    while(peephole_pass(function, scratch));
+}
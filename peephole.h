@@ -0,0 +1,9 @@
+#ifndef PEEPHOLE_H
+#define PEEPHOLE_H
+
+#include <stdint.h>
+#include "machine.h"
+
+void peephole_optimize(MachineFunction * function, uint64_t scratch);
+
+#endif // PEEPHOLE_H
@@ -0,0 +1,231 @@
+/**
+ * This file makes native code generated at run time visible to the Linux
+ * 'perf' tool.
+ *
+ * Without help 'perf' only sees anonymous executable memory and reports
+ * samples in compiled functions as raw addresses. Two formats fix this:
+ *
+ *  - The perf map, '/tmp/perf-<pid>.map', one "start size name" line per
+ *    function. 'perf report' reads it directly.
+ *  - The jitdump file, 'jit-<pid>.dump', which also carries a copy of the
+ *    code and timestamps. 'perf inject --jit' turns it into one ELF file
+ *    per function, so 'perf annotate' can disassemble compiled code. The
+ *    file is mapped executable once so that 'perf record' notices it;
+ *    record with '-k mono' so the timestamps match.
+ *
+ * Usage:
+ *  - Create the writer with 'init_perf_map()' for a linked image
+ *  - Install 'perf_map_listener()' on the image's tier with
+ *    'tier_set_listener()', or call 'perf_map_add()' for other code
+ *  - Free resources with 'destroy_perf_map()'
+ *
+ * @file    perfmap.c
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include "perfmap.h"
+
+#define JITDUMP_MAGIC       0x4A695444  // "JiTD"
+#define JITDUMP_VERSION     1
+#define JIT_CODE_LOAD       0
+
+#if defined(__x86_64__)
+#define JITDUMP_MACHINE     62          // EM_X86_64
+#elif defined(__aarch64__)
+#define JITDUMP_MACHINE     183         // EM_AARCH64
+#elif defined(__i386__)
+#define JITDUMP_MACHINE     3           // EM_386
+#else
+#define JITDUMP_MACHINE     0
+#endif
+
+typedef struct {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t size;              // size of this header
+    uint32_t machine;           // ELF machine of the generated code
+    uint32_t pad;
+    uint32_t pid;
+    uint64_t timestamp;
+    uint64_t flags;
+} JitdumpHeader;
+
+typedef struct {
+    uint32_t id;                // 'JIT_CODE_LOAD'
+    uint32_t size;              // size of the record including name and code
+    uint64_t timestamp;
+    uint32_t pid;
+    uint32_t tid;
+    uint64_t vma;               // address the code is executed at
+    uint64_t code_address;      // address of the copy below, same as 'vma'
+    uint64_t code_size;
+    uint64_t code_index;        // unique per record
+} JitdumpCodeLoad;              // followed by the name and the code
+
+/**
+ * Reads the clock used for jitdump timestamps, which must be the one
+ * 'perf record -k mono' samples with.
+ *
+ * @return: Nanoseconds since an arbitrary point
+ */
+static uint64_t timestamp(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000000u + (uint64_t)now.tv_nsec;
+}
+
+/**
+ * Creates the jitdump file, writes its header and maps the header
+ * executable so that perf records where the file is.
+ *
+ * @param perf: A pointer to the writer
+ * @param directory: Directory of the file
+ * @return: 'true' on success
+ */
+static bool open_jitdump(PerfMap * perf, const char * directory) {
+    char filename[4096];
+    snprintf(filename, sizeof(filename), "%s/jit-%d.dump", directory, (int)getpid());
+    perf->dump = fopen(filename, "w+b");
+    if(!perf->dump) return false;
+
+    JitdumpHeader header = {
+        .magic = JITDUMP_MAGIC,
+        .version = JITDUMP_VERSION,
+        .size = sizeof(JitdumpHeader),
+        .machine = JITDUMP_MACHINE,
+        .pid = (uint32_t)getpid(),
+        .timestamp = timestamp(),
+    };
+    fwrite(&header, sizeof(header), 1, perf->dump);
+    fflush(perf->dump);
+
+    perf->marker_size = (size_t)sysconf(_SC_PAGESIZE);
+    perf->marker = mmap(NULL, perf->marker_size, PROT_READ | PROT_EXEC, MAP_PRIVATE, fileno(perf->dump), 0);
+    if(perf->marker == MAP_FAILED) {
+        perf->marker = NULL;
+        fclose(perf->dump);
+        perf->dump = NULL;
+        return false;
+    }
+
+    return true;
+}
+
+/**
+ * Initializes the writer. Files that cannot be created are skipped, so a
+ * failure never stops the program; check the 'map' and 'dump' fields to
+ * see what is written.
+ *
+ * @param image: Image whose functions are compiled, may be NULL if only
+ *               'perf_map_add()' is used
+ * @param flags: 'PERF_MAP', 'PERF_JITDUMP' or both
+ * @param dump_directory: Directory of the jitdump file, NULL for the
+ *                        current directory
+ * @return: A pointer to the new 'PerfMap' structure
+ */
+PerfMap * init_perf_map(const Image * image, int flags, const char * dump_directory) {
+    PerfMap * perf = (PerfMap *)malloc(sizeof(PerfMap));
+    assert(perf);
+
+    perf->image = image;
+    perf->flags = flags;
+    perf->map = NULL;
+    perf->dump = NULL;
+    perf->marker = NULL;
+    perf->marker_size = 0;
+    perf->code_index = 0;
+    pthread_mutex_init(&perf->lock, NULL);
+
+    if(flags & PERF_MAP) {
+        char filename[256];
+        snprintf(filename, sizeof(filename), PERF_MAP_DIRECTORY "/perf-%d.map", (int)getpid());
+        perf->map = fopen(filename, "a");
+    }
+    if(flags & PERF_JITDUMP) {
+        open_jitdump(perf, dump_directory ? dump_directory : ".");
+    }
+
+    return perf;
+}
+
+/**
+ * Destroys the writer. The files are kept, perf reads them after the
+ * program exited.
+ *
+ * @param perf: A pointer to the writer
+ */
+void destroy_perf_map(PerfMap * perf) {
+    if(perf->map) fclose(perf->map);
+    if(perf->marker) munmap(perf->marker, perf->marker_size);
+    if(perf->dump) fclose(perf->dump);
+    pthread_mutex_destroy(&perf->lock);
+    free(perf);
+}
+
+/**
+ * Records native code. Entries are flushed immediately so that they are
+ * complete even if the program is killed while it is being profiled.
+ *
+ * @param perf: A pointer to the writer
+ * @param code: First byte of the code
+ * @param size: Size of the code in bytes
+ * @param name: Symbol shown by perf
+ */
+void perf_map_add(PerfMap * perf, const void * code, size_t size, const char * name) {
+    pthread_mutex_lock(&perf->lock);
+
+    if(perf->map) {
+        fprintf(perf->map, "%lx %zx %s\n", (unsigned long)(uintptr_t)code, size, name);
+        fflush(perf->map);
+    }
+
+    if(perf->dump) {
+        size_t name_size = strlen(name) + 1;
+        JitdumpCodeLoad record = {
+            .id = JIT_CODE_LOAD,
+            .size = (uint32_t)(sizeof(JitdumpCodeLoad) + name_size + size),
+            .timestamp = timestamp(),
+            .pid = (uint32_t)getpid(),
+            .tid = (uint32_t)syscall(SYS_gettid),
+            .vma = (uint64_t)(uintptr_t)code,
+            .code_address = (uint64_t)(uintptr_t)code,
+            .code_size = size,
+            .code_index = perf->code_index++,
+        };
+        fwrite(&record, sizeof(record), 1, perf->dump);
+        fwrite(name, 1, name_size, perf->dump);
+        fwrite(code, 1, size, perf->dump);
+        fflush(perf->dump);
+    }
+
+    pthread_mutex_unlock(&perf->lock);
+}
+
+/**
+ * Tier listener recording each compiled function of the writer's image
+ * under its Sloth name.
+ *
+ * @param context: A pointer to the writer
+ * @param function: Index of the compiled function
+ * @param entry: Entry point of its native code
+ * @param size: Size of the code in bytes
+ */
+void perf_map_listener(void * context, int function, const void * entry, size_t size) {
+    PerfMap * perf = (PerfMap *)context;
+
+    char name[256];
+    if(perf->image && function >= 0 && (uint32_t)function < perf->image->function_count) {
+        const ImageFunction * f = &image_functions(perf->image)[function];
+        snprintf(name, sizeof(name), "sloth::%s", image_string(perf->image, f->name));
+    } else {
+        snprintf(name, sizeof(name), "sloth::function%d", function);
+    }
+    perf_map_add(perf, entry, size, name);
+}
@@ -0,0 +1,31 @@
+#ifndef PERFMAP_H
+#define PERFMAP_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <pthread.h>
+#include "image.h"
+
+#define PERF_MAP_DIRECTORY  "/tmp"  // where perf looks for 'perf-<pid>.map'
+
+#define PERF_MAP            0x1     // write '/tmp/perf-<pid>.map'
+#define PERF_JITDUMP        0x2     // write 'jit-<pid>.dump' for 'perf inject --jit'
+
+typedef struct {
+    const Image * image;        // resolves function names
+    int flags;                  // 'PERF_MAP' and 'PERF_JITDUMP'
+    FILE * map;                 // symbol map, NULL if not written
+    FILE * dump;                // jitdump file, NULL if not written
+    void * marker;              // mapping announcing the jitdump file to perf
+    size_t marker_size;
+    uint64_t code_index;        // number of code load records written
+    pthread_mutex_t lock;       // serializes writes from several compiler threads
+} PerfMap;
+
+PerfMap * init_perf_map(const Image * image, int flags, const char * dump_directory);
+void destroy_perf_map(PerfMap * perf);
+void perf_map_add(PerfMap * perf, const void * code, size_t size, const char * name);
+void perf_map_listener(void * context, int function, const void * entry, size_t size);
+
+#endif // PERFMAP_H
@@ -0,0 +1,385 @@
+/**
+ * This file contains the sampling profiler for programs running on the
+ * virtual machine.
+ *
+ * A CPU time timer of the profiled thread raises 'SIGPROF' at a fixed
+ * frequency. The signal handler copies the machine's current function,
+ * its position and the chain of calling functions into a preallocated
+ * buffer; it takes no locks and allocates nothing, and the interpreter
+ * only publishes its position on calls, returns and loop back edges, so
+ * profiling needs no instrumentation of the program and costs almost
+ * nothing while the timer is not armed.
+ *
+ * Positions are resolved to the entry, last call site or innermost loop
+ * header reached, which is exactly what is needed to tell which loop of a
+ * function is hot.
+ *
+ * The 'SIGPROF' handler belongs to the whole process, so only one profiler
+ * may be running at a time; starting a second one fails until the first
+ * is stopped.
+ *
+ * Usage:
+ *  - Create a profiler for a machine with 'init_profiler()'
+ *  - Sample the calling thread between 'profiler_start()' and
+ *    'profiler_stop()'
+ *  - Print hot functions and loops with 'profiler_report()' or folded
+ *    stacks for flame graphs with 'profiler_write_folded()'
+ *  - Free resources with 'destroy_profiler()'
+ *
+ * @file    profiler.c
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <unistd.h>
+#include "profiler.h"
+
+#ifndef sigev_notify_thread_id
+#define sigev_notify_thread_id _sigev_un._tid   // not exported by older C libraries
+#endif
+
+static _Atomic(Profiler *) active_profiler = NULL;   // profiler owning the 'SIGPROF' handler
+
+/**
+ * Signal handler recording one sample. Runs on the profiled thread, so the
+ * machine is interrupted between two of its own instructions; only the
+ * frame array may be in an inconsistent state, while it is being moved.
+ *
+ * @param signal: The signal number
+ * @param info: Carries the profiler as the timer's value
+ * @param context: Unused
+ */
+static void on_sample(int signal, siginfo_t * info, void * context) {
+    (void)signal;
+    (void)context;
+    if(info->si_code != SI_TIMER || !info->si_value.sival_ptr) return;
+
+    Profiler * profiler = (Profiler *)info->si_value.sival_ptr;
+    if(profiler != atomic_load_explicit(&active_profiler, memory_order_relaxed)) return;
+    const Vm * vm = profiler->vm;
+    int function = vm->current_function;
+    uint32_t function_count = vm->image->function_count;
+    if(function < 0 || (uint32_t)function >= function_count) return;
+
+    uint32_t count = atomic_load_explicit(&profiler->count, memory_order_relaxed);
+    if(count >= profiler->capacity) {
+        atomic_fetch_add_explicit(&profiler->dropped, 1, memory_order_relaxed);
+        return;
+    }
+
+    const ImageFunction * entry = &image_functions(vm->image)[function];
+    uint32_t pc = vm->current_pc - entry->code;
+    Sample * sample = &profiler->samples[count];
+    sample->function = function;
+    sample->pc = pc < entry->code_length ? pc : 0;
+    sample->depth = 0;
+
+    if(!vm->frames_moving) {
+        const CallFrame * frames = vm->frames;
+        for(int k = vm->frame_count - 1; k >= 0 && sample->depth < PROFILER_MAX_DEPTH; k--) {
+            if(frames[k].function < 0 || (uint32_t)frames[k].function >= function_count) break;
+            sample->stack[sample->depth++] = frames[k].function;
+        }
+    }
+
+    atomic_store_explicit(&profiler->count, count + 1, memory_order_release);
+}
+
+/**
+ * Initializes a profiler for the given machine.
+ *
+ * @param vm: The machine to sample
+ * @param frequency: Samples per second of CPU time, 0 for the default
+ * @param capacity: Samples to keep, 0 for the default
+ * @return: A pointer to the new 'Profiler' structure
+ */
+Profiler * init_profiler(Vm * vm, int frequency, uint32_t capacity) {
+    Profiler * profiler = (Profiler *)calloc(1, sizeof(Profiler));
+    assert(profiler);
+
+    profiler->vm = vm;
+    profiler->frequency = frequency > 0 ? frequency : PROFILER_FREQUENCY;
+    profiler->capacity = capacity > 0 ? capacity : PROFILER_CAPACITY;
+    profiler->samples = (Sample *)malloc(profiler->capacity * sizeof(Sample));
+    assert(profiler->samples);
+    atomic_init(&profiler->count, 0);
+    atomic_init(&profiler->dropped, 0);
+    profiler->running = false;
+    return profiler;
+}
+
+/**
+ * Destroys the profiler, stopping it first if it is running.
+ *
+ * @param profiler: A pointer to the profiler
+ */
+void destroy_profiler(Profiler * profiler) {
+    if(profiler->running) profiler_stop(profiler);
+    free(profiler->samples);
+    free(profiler);
+}
+
+/**
+ * Starts sampling the calling thread, which must be the thread running the
+ * profiled machine. Fails while another profiler is running.
+ *
+ * @param profiler: A pointer to the profiler
+ * @return: 'true' if the timer was armed, 'false' otherwise
+ */
+bool profiler_start(Profiler * profiler) {
+    if(profiler->running) return true;
+
+    Profiler * none = NULL;
+    if(!atomic_compare_exchange_strong(&active_profiler, &none, profiler)) return false;
+
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    action.sa_sigaction = on_sample;
+    action.sa_flags = SA_SIGINFO | SA_RESTART;
+    sigemptyset(&action.sa_mask);
+    if(sigaction(SIGPROF, &action, &profiler->previous) != 0) {
+        atomic_store(&active_profiler, NULL);
+        return false;
+    }
+
+    struct sigevent event;
+    memset(&event, 0, sizeof(event));
+    event.sigev_notify = SIGEV_THREAD_ID;
+    event.sigev_signo = SIGPROF;
+    event.sigev_value.sival_ptr = profiler;
+    event.sigev_notify_thread_id = gettid();
+    if(timer_create(CLOCK_THREAD_CPUTIME_ID, &event, &profiler->timer) != 0) {
+        sigaction(SIGPROF, &profiler->previous, NULL);
+        atomic_store(&active_profiler, NULL);
+        return false;
+    }
+
+    struct itimerspec interval;
+    interval.it_interval.tv_sec = 0;
+    interval.it_interval.tv_nsec = 1000000000L / profiler->frequency;
+    interval.it_value = interval.it_interval;
+    if(timer_settime(profiler->timer, 0, &interval, NULL) != 0) {
+        timer_delete(profiler->timer);
+        sigaction(SIGPROF, &profiler->previous, NULL);
+        atomic_store(&active_profiler, NULL);
+        return false;
+    }
+
+    profiler->running = true;
+    return true;
+}
+
+/**
+ * Stops sampling. Signals already raised by the timer are consumed before
+ * the previous handler is restored.
+ *
+ * @param profiler: A pointer to the profiler
+ */
+void profiler_stop(Profiler * profiler) {
+    if(!profiler->running) return;
+
+    sigset_t set, saved;
+    sigemptyset(&set);
+    sigaddset(&set, SIGPROF);
+    pthread_sigmask(SIG_BLOCK, &set, &saved);
+    timer_delete(profiler->timer);
+
+    struct timespec now = { 0, 0 };
+    while(sigtimedwait(&set, NULL, &now) == SIGPROF) {
+    }
+
+    sigaction(SIGPROF, &profiler->previous, NULL);
+    pthread_sigmask(SIG_SETMASK, &saved, NULL);
+    profiler->running = false;
+    atomic_store(&active_profiler, NULL);
+}
+
+/**
+ * Checks that a sample only names functions of the image, so that a
+ * sample recorded from a machine in an unexpected state is skipped rather
+ * than read out of bounds.
+ *
+ * @param sample: A pointer to the sample
+ * @param function_count: Number of functions in the image
+ * @return: True if every function of the sample is in the image
+ */
+static bool sample_valid(const Sample * sample, uint32_t function_count) {
+    if(sample->function >= function_count || sample->depth > PROFILER_MAX_DEPTH) return false;
+    for(uint32_t d = 0; d < sample->depth; d++) {
+        if(sample->stack[d] >= function_count) return false;
+    }
+    return true;
+}
+
+/**
+ * Orders two samples by their call stacks, outermost function first.
+ *
+ * @param a: A pointer to the first sample pointer
+ * @param b: A pointer to the second sample pointer
+ * @return: Negative, zero or positive like 'strcmp()'
+ */
+static int compare_stacks(const void * a, const void * b) {
+    const Sample * x = *(const Sample * const *)a;
+    const Sample * y = *(const Sample * const *)b;
+    uint32_t length = (x->depth < y->depth ? x->depth : y->depth) + 1;
+
+    for(uint32_t k = 0; k < length; k++) {
+        uint32_t fx = k < x->depth ? x->stack[x->depth - 1 - k] : x->function;
+        uint32_t fy = k < y->depth ? y->stack[y->depth - 1 - k] : y->function;
+        if(fx != fy) return fx < fy ? -1 : 1;
+    }
+    return (int)x->depth - (int)y->depth;
+}
+
+typedef struct {
+    uint64_t position;  // function << 32 | offset
+    uint32_t samples;   // samples taken at the position
+} Position;
+
+/**
+ * Orders packed positions ascending.
+ *
+ * @param a: A pointer to the first position
+ * @param b: A pointer to the second position
+ * @return: Negative, zero or positive like 'strcmp()'
+ */
+static int compare_positions(const void * a, const void * b) {
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+    return x < y ? -1 : x > y;
+}
+
+/**
+ * Orders positions by descending sample count.
+ *
+ * @param a: A pointer to the first 'Position'
+ * @param b: A pointer to the second 'Position'
+ * @return: Negative, zero or positive like 'strcmp()'
+ */
+static int compare_hot_positions(const void * a, const void * b) {
+    const Position * x = (const Position *)a, * y = (const Position *)b;
+    return x->samples < y->samples ? 1 : x->samples > y->samples ? -1 : 0;
+}
+
+/**
+ * Prints the functions taking most samples, by self and total time, and
+ * the loops inside them taking most samples.
+ *
+ * @param profiler: A pointer to the stopped profiler
+ * @param out: The output stream
+ * @param limit: Maximum number of functions and loops to print
+ */
+void profiler_report(const Profiler * profiler, FILE * out, int limit) {
+    const Image * image = profiler->vm->image;
+    const ImageFunction * functions = image_functions(image);
+    uint32_t count = atomic_load(&profiler->count);
+    uint32_t function_count = image->function_count;
+
+    fprintf(out, "%u samples at %d Hz, %u dropped\n", count, profiler->frequency, atomic_load(&profiler->dropped));
+    if(count == 0) return;
+
+    uint32_t * self = (uint32_t *)calloc(function_count, sizeof(uint32_t));
+    uint32_t * total = (uint32_t *)calloc(function_count, sizeof(uint32_t));
+    uint32_t * seen = (uint32_t *)calloc(function_count, sizeof(uint32_t));
+    uint64_t * positions = (uint64_t *)malloc(count * sizeof(uint64_t));
+    assert(self && total && seen && positions);
+
+    uint32_t valid = 0;
+    for(uint32_t n = 0; n < count; n++) {
+        const Sample * sample = &profiler->samples[n];
+        if(!sample_valid(sample, function_count)) continue;
+        self[sample->function]++;
+        total[sample->function]++;
+        seen[sample->function] = n + 1;
+        for(uint32_t d = 0; d < sample->depth; d++) {
+            uint32_t caller = sample->stack[d];
+            if(seen[caller] != n + 1) {
+                seen[caller] = n + 1;
+                total[caller]++;
+            }
+        }
+        positions[valid++] = (uint64_t)sample->function << 32 | sample->pc;
+    }
+    count = valid;
+
+    fprintf(out, "\nHot functions:\n   self%%  total%%   samples  function\n");
+    for(int printed = 0; printed < limit; printed++) {
+        int best = -1;
+        for(uint32_t f = 0; f < function_count; f++) {
+            if(self[f] && (best < 0 || self[f] > self[best])) best = f;
+        }
+        if(best < 0) break;
+
+        fprintf(out, "  %5.1f%%  %5.1f%%  %8u  %s\n", 100.0 * self[best] / count, 100.0 * total[best] / count,
+                self[best], image_string(image, functions[best].name));
+        self[best] = 0;
+    }
+
+    qsort(positions, count, sizeof(uint64_t), compare_positions);
+    Position * loops = (Position *)malloc(count * sizeof(Position));
+    assert(loops);
+    uint32_t loop_count = 0;
+    for(uint32_t n = 0; n < count; ) {
+        uint32_t run = n;
+        while(run < count && positions[run] == positions[n]) run++;
+        if((uint32_t)positions[n] != 0) {
+            loops[loop_count].position = positions[n];
+            loops[loop_count].samples = run - n;
+            loop_count++;
+        }
+        n = run;
+    }
+    qsort(loops, loop_count, sizeof(Position), compare_hot_positions);
+
+    fprintf(out, "\nHot loops and call sites:\n   self%%   samples  function @ pc\n");
+    for(uint32_t n = 0; n < loop_count && (int)n < limit; n++) {
+        uint32_t function = loops[n].position >> 32;
+        fprintf(out, "  %5.1f%%  %8u  %s @ %u\n", 100.0 * loops[n].samples / count, loops[n].samples,
+                image_string(image, functions[function].name), (uint32_t)loops[n].position);
+    }
+
+    free(loops);
+    free(positions);
+    free(seen);
+    free(total);
+    free(self);
+}
+
+/**
+ * Writes the samples as folded stacks, one line per distinct stack with
+ * the outermost function first, as consumed by 'flamegraph.pl' and
+ * similar tools.
+ *
+ * @param profiler: A pointer to the stopped profiler
+ * @param out: The output stream
+ */
+void profiler_write_folded(const Profiler * profiler, FILE * out) {
+    const Image * image = profiler->vm->image;
+    const ImageFunction * functions = image_functions(image);
+    uint32_t count = atomic_load(&profiler->count);
+    if(count == 0) return;
+
+    const Sample ** sorted = (const Sample **)malloc(count * sizeof(Sample *));
+    assert(sorted);
+    uint32_t valid = 0;
+    for(uint32_t n = 0; n < count; n++) {
+        if(sample_valid(&profiler->samples[n], image->function_count)) sorted[valid++] = &profiler->samples[n];
+    }
+    count = valid;
+    qsort(sorted, count, sizeof(Sample *), compare_stacks);
+
+    for(uint32_t n = 0; n < count; ) {
+        uint32_t run = n;
+        while(run < count && compare_stacks(&sorted[run], &sorted[n]) == 0) run++;
+
+        const Sample * sample = sorted[n];
+        for(uint32_t d = sample->depth; d > 0; d--) {
+            fprintf(out, "%s;", image_string(image, functions[sample->stack[d - 1]].name));
+        }
+        fprintf(out, "%s %u\n", image_string(image, functions[sample->function].name), run - n);
+        n = run;
+    }
+
+    free(sorted);
+}
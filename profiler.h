@@ -0,0 +1,42 @@
+#ifndef PROFILER_H
+#define PROFILER_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+#include <signal.h>
+#include <time.h>
+#include "vm.h"
+
+#define PROFILER_FREQUENCY  997     // samples per second of CPU time
+#define PROFILER_CAPACITY   65536   // samples kept before new ones are dropped
+#define PROFILER_MAX_DEPTH  16      // callers recorded per sample
+
+typedef struct {
+    uint32_t function;                      // running function
+    uint32_t pc;                            // code offset within the function
+    uint32_t depth;                         // callers in 'stack'
+    uint32_t stack[PROFILER_MAX_DEPTH];     // callers, innermost first
+} Sample;
+
+typedef struct {
+    Vm * vm;                        // machine being sampled
+    Sample * samples;               // sample buffer
+    uint32_t capacity;              // size of the buffer
+    _Atomic uint32_t count;         // samples recorded
+    _Atomic uint32_t dropped;       // samples lost because the buffer was full
+    int frequency;                  // samples per second
+    timer_t timer;                  // CPU time timer of the sampled thread
+    bool running;                   // the timer is armed
+    struct sigaction previous;      // handler replaced by the profiler
+} Profiler;
+
+Profiler * init_profiler(Vm * vm, int frequency, uint32_t capacity);
+void destroy_profiler(Profiler * profiler);
+bool profiler_start(Profiler * profiler);
+void profiler_stop(Profiler * profiler);
+void profiler_report(const Profiler * profiler, FILE * out, int limit);
+void profiler_write_folded(const Profiler * profiler, FILE * out);
+
+#endif // PROFILER_H
@@ -0,0 +1,207 @@
+/**
+ * This file contains the run mode of the compiler, which loads a compiled
+ * image, calls one of its functions with arguments from the command line
+ * and prints the result.
+ *
+ *   sloth --run [--native[=all]] [--profile[=FILE]] [--profile-generate=FILE]
+ *               IMAGE FUNCTION [ARG...]
+ *
+ * Without '--native' the program is only interpreted. With '--native' the
+ * tier compiles functions to native code (see native.c) in the background
+ * once they are hot, as an embedding application would, and with
+ * '--native=all' every function is compiled before the program starts, so
+ * native code runs from the first call.
+ *
+ * With '--profile' the run is sampled by the profiler (see profiler.c) and
+ * the hot functions and loops are printed after the result, on standard
+ * error; '--profile=FILE' writes folded stacks for flame graphs to FILE
+ * instead.
+ *
+ * With '--profile-generate' the machine counts executed jumps and calls
+ * (see feedback.c) and adds them to the profile in FILE, creating it if
+ * it does not exist yet, so that the program can be compiled again with
+ * 'sloth --profile-use=FILE'. The counts also guide the placement of
+ * blocks of functions compiled to native code during the run.
+ *
+ * Arguments are read by the types of the function's parameters. A
+ * function flagged with 'FUNCTION_RESULT_PARAM' has a hidden result
+ * parameter (see codegen.c) and is called with exactly the arguments of
+ * its source parameters.
+ *
+ * Usage:
+ *  - Run an image with 'run_program()'
+ *  - Create a machine running an image in a given mode with
+ *    'init_run_vm()'
+ *  - The exit status is 1 if the program stopped with a run-time error
+ *
+ * @file    run.c
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <unistd.h>
+#include "run.h"
+#include "profiler.h"
+
+static void usage(void) {
+    fprintf(stderr, "usage: sloth --run [--native[=all]] [--profile[=FILE]] [--profile-generate=FILE]\n"
+                    "                   IMAGE FUNCTION [ARG...]\n");
+}
+
+/**
+ * Initializes a virtual machine running an image in the given mode. For
+ * 'RUN_NATIVE' every function has been compiled, or rejected by the
+ * native compiler, when this returns.
+ *
+ * @param image: The image to run
+ * @param mode: How functions are executed
+ * @param feedback: Receives the execution counts of the machine, may be NULL
+ * @param context: Filled with the context of the native compiler, must
+ *                 outlive the machine; may be NULL for 'RUN_INTERPRETED'
+ * @return: A pointer to the new 'Vm' structure
+ */
+Vm * init_run_vm(const Image * image, RunMode mode, Feedback * feedback, NativeContext * context) {
+    Vm * vm = init_vm(image);
+    vm->feedback = feedback;
+    if(mode == RUN_INTERPRETED) return vm;
+
+    context->image = image;
+    context->feedback = feedback;
+    vm_set_compiler(vm, native_compile, native_release, context);
+    if(mode == RUN_NATIVE) {
+        for(uint32_t f = 0; f < image->function_count; f++) tier_request(vm->tier, f);
+        tier_wait(vm->tier);
+    }
+    return vm;
+}
+
+/**
+ * Reads one argument by the type of the parameter receiving it.
+ *
+ * @param text: The argument as given on the command line
+ * @param type: The 'ValueType' of the parameter
+ * @param value: Receives the value
+ * @return: 'true' if the whole text is a number of that type
+ */
+static bool read_argument(const char * text, ValueType type, Value * value) {
+    char * end;
+    if(type == TYPE_FLOAT) value->f = strtod(text, &end);
+    else value->i = strtoll(text, &end, 10);
+    return *text != '\0' && *end == '\0';
+}
+
+/**
+ * Adds execution counts to a profile file, which is created if it does
+ * not exist yet. Counts of functions that are not in the image or whose
+ * code changed are dropped.
+ *
+ * @param feedback: The counts of the run
+ * @param filename: Path of the profile
+ * @return: 'true' if the profile was written
+ */
+static bool write_profile(Feedback * feedback, const char * filename) {
+    if(access(filename, F_OK) == 0) {
+        Feedback * previous = read_feedback(filename);
+        if(!previous) return false;
+        feedback_merge(feedback, previous);
+        destroy_feedback(previous);
+    }
+    return write_feedback(feedback, filename);
+}
+
+/**
+ * Runs a function of an image.
+ *
+ * @param argc: Number of arguments, without the program name and '--run'
+ * @param argv: The arguments
+ * @return: The exit status of the process
+ */
+int run_program(int argc, char ** argv) {
+    RunMode mode = RUN_INTERPRETED;
+    bool profile = false;
+    const char * folded = NULL;
+    const char * generate = NULL;
+    int i = 0;
+    for(; i < argc && strncmp(argv[i], "--", 2) == 0; i++) {
+        if(strcmp(argv[i], "--native") == 0) mode = RUN_TIERED;
+        else if(strcmp(argv[i], "--native=all") == 0) mode = RUN_NATIVE;
+        else if(strcmp(argv[i], "--profile") == 0) profile = true;
+        else if(strncmp(argv[i], "--profile=", 10) == 0 && argv[i][10]) profile = true, folded = argv[i] + 10;
+        else if(strncmp(argv[i], "--profile-generate=", 19) == 0 && argv[i][19]) generate = argv[i] + 19;
+        else return usage(), 1;
+    }
+    if(argc - i < 2) return usage(), 1;
+    const char * filename = argv[i];
+    const char * name = argv[i + 1];
+    char ** args = argv + i + 2;
+    int arg_count = argc - i - 2;
+
+    Image * image = map_image(filename);
+    if(!image) {
+        fprintf(stderr, "sloth: cannot load the image '%s'\n", filename);
+        return 1;
+    }
+    int function = image_find_function(image, name);
+    if(function < 0) {
+        fprintf(stderr, "sloth: '%s' has no function '%s'\n", filename, name);
+        destroy_image(image);
+        return 1;
+    }
+
+    // The hidden result parameter is left unset, as callers leave it
+    const ImageFunction * target = &image_functions(image)[function];
+    const uint8_t * types = (const uint8_t *)image_string(image, target->types);
+    int first = target->flags & FUNCTION_RESULT_PARAM ? 1 : 0;
+    if(arg_count + first != target->param_count) {
+        fprintf(stderr, "sloth: '%s' takes %d argument%s\n", name, target->param_count - first,
+                target->param_count - first == 1 ? "" : "s");
+        destroy_image(image);
+        return 1;
+    }
+
+    Value * values = (Value *)calloc(target->param_count + 1, sizeof(Value));
+    assert(values);
+    for(int p = 0; p < arg_count; p++) {
+        if(!read_argument(args[p], (ValueType)types[first + p], &values[first + p])) {
+            fprintf(stderr, "sloth: '%s' is not %s\n", args[p], types[first + p] == TYPE_FLOAT ? "a float" : "an integer");
+            free(values);
+            destroy_image(image);
+            return 1;
+        }
+    }
+
+    NativeContext context;
+    Feedback * feedback = generate ? init_feedback(image) : NULL;
+    Vm * vm = init_run_vm(image, mode, feedback, &context);
+    Profiler * profiler = profile ? init_profiler(vm, 0, 0) : NULL;
+    if(profiler && !profiler_start(profiler)) fprintf(stderr, "sloth: cannot start the profiler\n");
+    Value result;
+    bool ok = vm_run(vm, function, values, &result);
+    if(profiler) profiler_stop(profiler);
+    if(!ok) fprintf(stderr, "sloth: %s: %s\n", name, vm->error);
+    else if(target->return_type == TYPE_FLOAT) printf("%.17g\n", result.f);
+    else printf("%lld\n", (long long)result.i);
+    fflush(stdout);
+
+    if(profiler && folded) {
+        FILE * out = fopen(folded, "w");
+        if(out) profiler_write_folded(profiler, out);
+        if(!out || fclose(out) != 0) {
+            fprintf(stderr, "sloth: cannot write '%s'\n", folded);
+            ok = false;
+        }
+    } else if(profiler) {
+        profiler_report(profiler, stderr, RUN_PROFILE_LIMIT);
+    }
+    if(profiler) destroy_profiler(profiler);
+    if(feedback && !write_profile(feedback, generate)) {
+        fprintf(stderr, "sloth: cannot write '%s'\n", generate);
+        ok = false;
+    }
+    destroy_vm(vm);
+    if(feedback) destroy_feedback(feedback);
+    free(values);
+    destroy_image(image);
+    return ok ? 0 : 1;
+}
@@ -0,0 +1,19 @@
+#ifndef RUN_H
+#define RUN_H
+
+#include "image.h"
+#include "native.h"
+#include "vm.h"
+
+#define RUN_PROFILE_LIMIT   10  // hot functions and loops printed by '--profile'
+
+typedef enum {
+    RUN_INTERPRETED,    // interpret every function
+    RUN_TIERED,         // compile functions to native code once they are hot
+    RUN_NATIVE          // compile every function to native code before running
+} RunMode;
+
+Vm * init_run_vm(const Image * image, RunMode mode, Feedback * feedback, NativeContext * context);
+int run_program(int argc, char ** argv);
+
+#endif // RUN_H
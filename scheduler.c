@@ -0,0 +1,197 @@
+/**
+ * This file contains the scheduler which runs many independent programs
+ * concurrently on a fixed pool of worker threads.
+ *
+ * Each job names a linked image and a function to run. Workers execute
+ * jobs on virtual machines of their own, so no two programs ever share
+ * registers, stacks or errors, while the images themselves (and,
+ * optionally, the tier holding their native code) are shared read-only by
+ * all workers. A worker keeps its machine as long as consecutive jobs run
+ * the same image, so the register stack it has grown is reused.
+ *
+ * Usage:
+ *  - Start the workers with 'init_scheduler()'
+ *  - Queue jobs with 'scheduler_submit()'
+ *  - Block until they finished with 'scheduler_wait()'
+ *  - Stop the workers with 'destroy_scheduler()'
+ *
+ * @file    scheduler.c
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <unistd.h>
+#include "scheduler.h"
+#include "vm.h"
+
+/**
+ * Runs one job on the worker's machine, replacing the machine if the job
+ * runs a different image or tier than the previous one.
+ *
+ * @param vm: The worker's machine, may be NULL
+ * @param job: The job to run
+ * @return: The machine to keep for the next job
+ */
+static Vm * run_job(Vm * vm, Job * job) {
+    bool reusable = vm && vm->image == job->image
+        && (job->tier ? vm->tier == job->tier : vm->owns_tier);
+    if(!reusable) {
+        if(vm) destroy_vm(vm);
+        vm = job->tier ? init_vm_shared(job->image, job->tier) : init_vm(job->image);
+    }
+
+    job->ok = vm_run(vm, job->function, job->args, &job->result);
+    job->error = vm->error;
+    if(job->done) job->done(job);
+    return vm;
+}
+
+/**
+ * Body of a worker thread. Takes batches of jobs off the queue so that the
+ * lock is not contended once per job when jobs are small, but never more
+ * than its share of the queue, so that a short queue still spreads over
+ * all workers.
+ *
+ * @param arg: A pointer to the scheduler
+ * @return: NULL
+ */
+static void * worker_thread(void * arg) {
+    Scheduler * scheduler = (Scheduler *)arg;
+    Vm * vm = NULL;
+
+    pthread_mutex_lock(&scheduler->lock);
+    while(true) {
+        while(!scheduler->head && !scheduler->stopping) {
+            pthread_cond_wait(&scheduler->wake, &scheduler->lock);
+        }
+        if(!scheduler->head) break;
+
+        int share = scheduler->queued / scheduler->worker_count;
+        if(share > SCHEDULER_BATCH) share = SCHEDULER_BATCH;
+        Job * batch = scheduler->head;
+        Job * last = batch;
+        int count = 1;
+        while(count < share && last->next) {
+            last = last->next;
+            count++;
+        }
+        scheduler->head = last->next;
+        if(!scheduler->head) scheduler->tail = NULL;
+        last->next = NULL;
+        scheduler->queued -= count;
+        pthread_mutex_unlock(&scheduler->lock);
+
+        for(Job * job = batch; job; ) {
+            Job * next = job->next;
+            vm = run_job(vm, job);
+            job = next;
+        }
+
+        pthread_mutex_lock(&scheduler->lock);
+        scheduler->pending -= count;
+        if(scheduler->pending == 0) pthread_cond_broadcast(&scheduler->idle);
+    }
+    pthread_mutex_unlock(&scheduler->lock);
+
+    if(vm) destroy_vm(vm);
+    return NULL;
+}
+
+/**
+ * Initializes a scheduler and starts its workers.
+ *
+ * @param worker_count: Number of worker threads, 0 for one per online core
+ * @return: A pointer to the new 'Scheduler' structure
+ */
+Scheduler * init_scheduler(int worker_count) {
+    Scheduler * scheduler = (Scheduler *)malloc(sizeof(Scheduler));
+    assert(scheduler);
+
+    if(worker_count <= 0) worker_count = (int)sysconf(_SC_NPROCESSORS_ONLN);
+    if(worker_count <= 0) worker_count = 1;
+
+    scheduler->head = NULL;
+    scheduler->tail = NULL;
+    scheduler->queued = 0;
+    scheduler->pending = 0;
+    scheduler->stopping = false;
+    pthread_mutex_init(&scheduler->lock, NULL);
+    pthread_cond_init(&scheduler->wake, NULL);
+    pthread_cond_init(&scheduler->idle, NULL);
+
+    scheduler->workers = (pthread_t *)malloc(worker_count * sizeof(pthread_t));
+    assert(scheduler->workers);
+    scheduler->worker_count = worker_count;
+    for(int i = 0; i < worker_count; i++) {
+        int error = pthread_create(&scheduler->workers[i], NULL, worker_thread, scheduler);
+        assert(error == 0);
+        (void)error;
+    }
+
+    return scheduler;
+}
+
+/**
+ * Destroys the scheduler. Jobs still queued are run before the workers
+ * stop.
+ *
+ * @param scheduler: A pointer to the scheduler
+ */
+void destroy_scheduler(Scheduler * scheduler) {
+    pthread_mutex_lock(&scheduler->lock);
+    scheduler->stopping = true;
+    pthread_cond_broadcast(&scheduler->wake);
+    pthread_mutex_unlock(&scheduler->lock);
+
+    for(int i = 0; i < scheduler->worker_count; i++) {
+        pthread_join(scheduler->workers[i], NULL);
+    }
+
+    pthread_cond_destroy(&scheduler->idle);
+    pthread_cond_destroy(&scheduler->wake);
+    pthread_mutex_destroy(&scheduler->lock);
+    free(scheduler->workers);
+    free(scheduler);
+}
+
+/**
+ * Queues jobs for execution. The jobs must stay valid until they are
+ * finished, which is signalled by their 'done' callback or by
+ * 'scheduler_wait()' returning.
+ *
+ * @param scheduler: A pointer to the scheduler
+ * @param jobs: An array of jobs
+ * @param count: Number of jobs in the array
+ */
+void scheduler_submit(Scheduler * scheduler, Job * jobs, int count) {
+    if(count <= 0) return;
+
+    for(int i = 0; i < count; i++) {
+        jobs[i].next = i + 1 < count ? &jobs[i + 1] : NULL;
+        jobs[i].ok = false;
+        jobs[i].error = NULL;
+    }
+
+    pthread_mutex_lock(&scheduler->lock);
+    if(scheduler->tail) scheduler->tail->next = &jobs[0];
+    else scheduler->head = &jobs[0];
+    scheduler->tail = &jobs[count - 1];
+    scheduler->queued += count;
+    scheduler->pending += count;
+    pthread_cond_broadcast(&scheduler->wake);
+    pthread_mutex_unlock(&scheduler->lock);
+}
+
+/**
+ * Blocks until every submitted job has finished.
+ *
+ * @param scheduler: A pointer to the scheduler
+ */
+void scheduler_wait(Scheduler * scheduler) {
+    pthread_mutex_lock(&scheduler->lock);
+    while(scheduler->pending > 0) {
+        pthread_cond_wait(&scheduler->idle, &scheduler->lock);
+    }
+    pthread_mutex_unlock(&scheduler->lock);
+}
@@ -0,0 +1,44 @@
+#ifndef SCHEDULER_H
+#define SCHEDULER_H
+
+#include <stdbool.h>
+#include <pthread.h>
+#include "image.h"
+#include "tier.h"
+
+#define SCHEDULER_BATCH 16  // jobs a worker takes from the queue at once at most
+
+typedef struct Job Job;
+
+struct Job {
+    const Image * image;        // program to run, shared read-only
+    Tier * tier;                // shared tier of the image, NULL for a private one
+    int function;               // index of the function to run
+    const Value * args;         // arguments, owned by the submitter
+    Value result;               // returned value
+    bool ok;                    // 'false' if the program failed
+    const char * error;         // run-time error message, NULL if none
+    void (*done)(Job * job);    // called on the worker when finished, may be NULL
+    void * user;                // free for use by the submitter
+    Job * next;                 // link in the scheduler's queue
+};
+
+typedef struct {
+    pthread_t * workers;        // worker threads
+    int worker_count;           // number of workers
+    Job * head;                 // next job to run
+    Job * tail;                 // last queued job
+    int queued;                 // jobs queued
+    int pending;                // jobs queued or running
+    pthread_mutex_t lock;       // guards the queue
+    pthread_cond_t wake;        // signals workers
+    pthread_cond_t idle;        // signals 'scheduler_wait()'
+    bool stopping;              // set by 'destroy_scheduler()'
+} Scheduler;
+
+Scheduler * init_scheduler(int worker_count);
+void destroy_scheduler(Scheduler * scheduler);
+void scheduler_submit(Scheduler * scheduler, Job * jobs, int count);
+void scheduler_wait(Scheduler * scheduler);
+
+#endif // SCHEDULER_H
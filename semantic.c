@@ -0,0 +1,332 @@
+/**
+ * This file contains the semantic analysis, which resolves the names of a
+ * parsed program and checks and completes its types before code
+ * generation.
+ *
+ * The analysis:
+ * - Resolves every variable to a slot of its function, parameters first,
+ *   and every call to the index of the called function
+ * - Types every expression: arithmetic on an 'int' and a 'float' yields a
+ *   'float', comparisons yield an 'int', and '%', '!', '&&', '||' and
+ *   conditions require 'int' operands
+ * - Inserts 'AST_CONVERT' nodes wherever a value is assigned, passed or
+ *   returned as a different type, so that code generation never has to
+ *   reason about conversions
+ * - Reports undefined and redefined names and calls with the wrong
+ *   number of arguments
+ *
+ * Usage:
+ *  - Analyze a parsed program with 'analyze()'
+ *
+ * @file    semantic.c
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <errno.h>
+#include "semantic.h"
+#include "alloc.h"
+
+typedef struct {
+    const char * name;
+    int slot;
+    int depth;          // nesting of the block that declared the variable
+} Symbol;
+
+typedef struct {
+    Program * program;
+    AstFunction * function;     // function being analyzed
+    Diagnostics * diagnostics;
+    Symbol * symbols;           // visible variables, innermost last
+    int symbol_count;
+    int symbol_capacity;
+    int depth;
+    int * functions;            // open addressing table of function indices + 1, 0 if free
+    int function_mask;          // size of 'functions' - 1, a power of two minus one
+} Analyzer;
+
+static const char * type_name(ValueType type) {
+    return type == TYPE_FLOAT ? "float" : "int";
+}
+
+static uint64_t hash_name(const char * name) {
+    uint64_t hash = 14695981039346656037ull;  // FNV-1a
+    for(const char * c = name; *c; c++) hash = (hash ^ (uint8_t)*c) * 1099511628211ull;
+    return hash;
+}
+
+/**
+ * Finds the slot of a function name in the analyzer's function table.
+ *
+ * @return: The slot holding the first function of that name, or the free
+ *          slot where it belongs
+ */
+static int function_slot(const Analyzer * analyzer, const char * name) {
+    int slot = (int)(hash_name(name) & analyzer->function_mask);
+    while(analyzer->functions[slot]) {
+        if(strcmp(analyzer->program->functions[analyzer->functions[slot] - 1].name, name) == 0) break;
+        slot = (slot + 1) & analyzer->function_mask;
+    }
+    return slot;
+}
+
+static int find_function(const Analyzer * analyzer, const char * name) {
+    return analyzer->functions[function_slot(analyzer, name)] - 1;
+}
+
+/**
+ * Finds the innermost visible variable of a name.
+ *
+ * @return: Its index in the symbol list, or -1
+ */
+static int find_symbol(const Analyzer * analyzer, const char * name) {
+    for(int s = analyzer->symbol_count - 1; s >= 0; s--) {
+        if(strcmp(analyzer->symbols[s].name, name) == 0) return s;
+    }
+    return -1;
+}
+
+/**
+ * Declares a variable in the current block and gives it a new slot.
+ *
+ * @param analyzer: The analyzer
+ * @param node: The 'AST_DECLARATION' node, receives the slot
+ */
+static void declare(Analyzer * analyzer, AstNode * node) {
+    int existing = find_symbol(analyzer, node->text);
+    if(existing >= 0 && analyzer->symbols[existing].depth == analyzer->depth) {
+        diagnose(analyzer->diagnostics, node->line, node->column, "redeclaration of '%s'", node->text);
+    }
+
+    AstFunction * function = analyzer->function;
+    if(function->slot_count == function->slot_capacity) {
+        function->slot_capacity = function->slot_capacity ? function->slot_capacity * 2 : 16;
+        function->slot_types = (ValueType *)accounted_realloc(function->slot_types, function->slot_capacity * sizeof(ValueType));
+        assert(function->slot_types);
+    }
+    function->slot_types[function->slot_count] = node->type;
+    node->symbol = function->slot_count++;
+
+    if(analyzer->symbol_count == analyzer->symbol_capacity) {
+        analyzer->symbol_capacity = analyzer->symbol_capacity ? analyzer->symbol_capacity * 2 : 16;
+        analyzer->symbols = (Symbol *)accounted_realloc(analyzer->symbols, analyzer->symbol_capacity * sizeof(Symbol));
+        assert(analyzer->symbols);
+    }
+    analyzer->symbols[analyzer->symbol_count++] = (Symbol){ node->text, node->symbol, analyzer->depth };
+}
+
+/**
+ * Wraps an expression in a conversion to the given type if it has another.
+ *
+ * @param node: The expression
+ * @param type: The required type
+ * @return: The expression or the conversion wrapping it
+ */
+static AstNode * convert(AstNode * node, ValueType type) {
+    if(node->type == type) return node;
+    AstNode * conversion = new_node(AST_CONVERT, node->line, node->column);
+    conversion->type = type;
+    conversion->left = node;
+    return conversion;
+}
+
+static void require_int(Analyzer * analyzer, const AstNode * node, const char * what) {
+    if(node->type != TYPE_INT) {
+        diagnose(analyzer->diagnostics, node->line, node->column, "%s requires an 'int', not a '%s'", what, type_name(node->type));
+    }
+}
+
+static void analyze_expression(Analyzer * analyzer, AstNode * node);
+
+static void analyze_call(Analyzer * analyzer, AstNode * node) {
+    node->symbol = find_function(analyzer, node->text);
+    for(int i = 0; i < node->child_count; i++) analyze_expression(analyzer, node->children[i]);
+
+    if(node->symbol < 0) {
+        diagnose(analyzer->diagnostics, node->line, node->column, "call to undefined function '%s'", node->text);
+        return;
+    }
+
+    const AstFunction * callee = &analyzer->program->functions[node->symbol];
+    node->type = callee->return_type;
+    if(node->child_count != callee->param_count) {
+        diagnose(analyzer->diagnostics, node->line, node->column, "'%s' takes %d argument%s, not %d",
+                 node->text, callee->param_count, callee->param_count == 1 ? "" : "s", node->child_count);
+        return;
+    }
+    for(int i = 0; i < node->child_count; i++) node->children[i] = convert(node->children[i], callee->params[i]->type);
+}
+
+static void analyze_binary(Analyzer * analyzer, AstNode * node) {
+    const char * op = node->text;
+    analyze_expression(analyzer, node->left);
+    analyze_expression(analyzer, node->right);
+
+    if(strcmp(op, "&&") == 0 || strcmp(op, "||") == 0 || strcmp(op, "%") == 0) {
+        char what[32];
+        snprintf(what, sizeof(what), "operator '%s'", op);
+        require_int(analyzer, node->left, what);
+        require_int(analyzer, node->right, what);
+        node->type = TYPE_INT;
+        return;
+    }
+
+    // Arithmetic and comparisons operate on the common type of the operands
+    ValueType common = node->left->type == TYPE_FLOAT || node->right->type == TYPE_FLOAT ? TYPE_FLOAT : TYPE_INT;
+    node->left = convert(node->left, common);
+    node->right = convert(node->right, common);
+
+    bool arithmetic = strcmp(op, "+") == 0 || strcmp(op, "-") == 0 || strcmp(op, "*") == 0 || strcmp(op, "/") == 0;
+    node->type = arithmetic ? common : TYPE_INT;
+}
+
+/**
+ * Resolves and types an expression.
+ *
+ * @param analyzer: The analyzer
+ * @param node: The expression, receives its type
+ */
+static void analyze_expression(Analyzer * analyzer, AstNode * node) {
+    switch(node->kind) {
+        case AST_NUMBER:
+            node->type = strpbrk(node->text, ".eE") ? TYPE_FLOAT : TYPE_INT;
+            if(node->type == TYPE_INT) {
+                errno = 0;
+                strtoll(node->text, NULL, 10);
+                if(errno == ERANGE) {
+                    diagnose(analyzer->diagnostics, node->line, node->column, "integer literal '%s' is out of range",
+                             node->text);
+                }
+            }
+            break;
+        case AST_VARIABLE: {
+            int s = find_symbol(analyzer, node->text);
+            if(s < 0) {
+                diagnose(analyzer->diagnostics, node->line, node->column, "undefined variable '%s'", node->text);
+                break;
+            }
+            node->symbol = analyzer->symbols[s].slot;
+            node->type = analyzer->function->slot_types[node->symbol];
+            break;
+        }
+        case AST_UNARY:
+            analyze_expression(analyzer, node->left);
+            if(strcmp(node->text, "!") == 0) require_int(analyzer, node->left, "operator '!'");
+            node->type = node->left->type;
+            break;
+        case AST_BINARY:
+            analyze_binary(analyzer, node);
+            break;
+        case AST_CALL:
+            analyze_call(analyzer, node);
+            break;
+        default:
+            assert(false);
+    }
+}
+
+static void analyze_statement(Analyzer * analyzer, AstNode * node);
+
+static void analyze_block(Analyzer * analyzer, AstNode * block) {
+    int visible = analyzer->symbol_count;
+    analyzer->depth++;
+    for(int i = 0; i < block->child_count; i++) analyze_statement(analyzer, block->children[i]);
+    analyzer->depth--;
+    analyzer->symbol_count = visible;
+}
+
+/**
+ * Resolves and checks a statement.
+ *
+ * @param analyzer: The analyzer
+ * @param node: The statement
+ */
+static void analyze_statement(Analyzer * analyzer, AstNode * node) {
+    switch(node->kind) {
+        case AST_DECLARATION:
+            // The initializer cannot see the variable it initializes
+            if(node->left) {
+                analyze_expression(analyzer, node->left);
+                node->left = convert(node->left, node->type);
+            }
+            declare(analyzer, node);
+            break;
+        case AST_ASSIGNMENT: {
+            analyze_expression(analyzer, node->left);
+            int s = find_symbol(analyzer, node->text);
+            if(s < 0) {
+                diagnose(analyzer->diagnostics, node->line, node->column, "assignment to undefined variable '%s'", node->text);
+                break;
+            }
+            node->symbol = analyzer->symbols[s].slot;
+            node->left = convert(node->left, analyzer->function->slot_types[node->symbol]);
+            break;
+        }
+        case AST_IF:
+        case AST_WHILE:
+            analyze_expression(analyzer, node->left);
+            require_int(analyzer, node->left, "a condition");
+            analyze_block(analyzer, node->right);
+            if(node->third && node->third->kind == AST_IF) analyze_statement(analyzer, node->third);
+            else if(node->third) analyze_block(analyzer, node->third);
+            break;
+        case AST_RETURN:
+            analyze_expression(analyzer, node->left);
+            node->left = convert(node->left, analyzer->function->return_type);
+            break;
+        case AST_EXPRESSION:
+            analyze_expression(analyzer, node->left);
+            break;
+        case AST_BLOCK:
+            analyze_block(analyzer, node);
+            break;
+        default:
+            assert(false);
+    }
+}
+
+/**
+ * Analyzes a parsed program, completing its tree for code generation.
+ *
+ * @param program: The program, which must have parsed without errors
+ * @param diagnostics: Receives the errors
+ * @return: 'true' if the program is valid
+ */
+bool analyze(Program * program, Diagnostics * diagnostics) {
+    int errors = diagnostics->errors;
+    Analyzer analyzer;
+    memset(&analyzer, 0, sizeof(analyzer));
+    analyzer.program = program;
+    analyzer.diagnostics = diagnostics;
+
+    // Functions may call each other regardless of the order of definition,
+    // so all of them are entered into a table kept at most half full
+    int size = 16;
+    while(size < 2 * program->function_count) size *= 2;
+    analyzer.functions = (int *)accounted_calloc(size, sizeof(int));
+    assert(analyzer.functions);
+    analyzer.function_mask = size - 1;
+    for(int f = 0; f < program->function_count; f++) {
+        const AstFunction * function = &program->functions[f];
+        int slot = function_slot(&analyzer, function->name);
+        if(analyzer.functions[slot]) {
+            diagnose(diagnostics, function->line, function->column, "redefinition of function '%s'", function->name);
+        } else {
+            analyzer.functions[slot] = f + 1;
+        }
+    }
+
+    for(int f = 0; f < program->function_count; f++) {
+        AstFunction * function = &program->functions[f];
+        analyzer.function = function;
+        analyzer.symbol_count = 0;
+        analyzer.depth = 0;
+        for(int p = 0; p < function->param_count; p++) declare(&analyzer, function->params[p]);
+        analyze_block(&analyzer, function->body);
+    }
+
+    accounted_free(analyzer.symbols);
+    accounted_free(analyzer.functions);
+    return diagnostics->errors == errors;
+}
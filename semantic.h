@@ -0,0 +1,10 @@
+#ifndef SEMANTIC_H
+#define SEMANTIC_H
+
+#include <stdbool.h>
+#include "parser.h"
+#include "diagnostic.h"
+
+bool analyze(Program * program, Diagnostics * diagnostics);
+
+#endif // SEMANTIC_H
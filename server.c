@@ -0,0 +1,529 @@
+/**
+ * This file contains the compile server, a long-lived compiler process
+ * that serves compile requests from thin clients over a Unix domain
+ * socket. A build running thousands of compiles then pays for starting
+ * the compiler once, and the server keeps the result of every unit it
+ * compiled in a unit cache (see driver.c), so units whose sources did not
+ * change since an earlier request are not compiled again.
+ *
+ * A client sends the command line of an ordinary compile together with
+ * its working directory and source files as open file descriptors
+ * (SCM_RIGHTS). The server reads the sources directly and writes the images
+ * into the client's directory, so neither sources nor images are copied
+ * through the socket, and it streams back the messages of every unit in
+ * order, followed by the exit status. Every connection is served by a
+ * thread of its own, so the requests of a parallel build are compiled
+ * concurrently.
+ *
+ * Protocol, all integers 32-bit in host byte order:
+ *
+ *   request:  count, then 'count' strings with the arguments; a string
+ *             with one byte per source file, 1 if the file is passed open;
+ *             then the descriptors of the working directory and the open
+ *             files, at most 'SERVER_DESCRIPTOR_BATCH' per message, each
+ *             message carrying one byte
+ *   response: strings with the messages of one unit each, an empty
+ *             string, then the exit status
+ *   string:   length, then 'length' bytes
+ *
+ * A trace (see trace.c) of a server covers every request it served from
+ * start to shutdown, so it is requested when the server is started rather
+ * than by a client.
+ *
+ * When the process runs out of descriptors, the server closes a spare one
+ * it keeps for the purpose, accepts and immediately closes the waiting
+ * connection and reopens the spare, so clients fail instead of waiting,
+ * and it pauses briefly after any failed 'accept()' rather than spinning
+ * on a connection it cannot take.
+ *
+ * Usage:
+ *  - Start the server with 'run_server()', which returns once the
+ *    process receives SIGINT or SIGTERM
+ *  - Compile through the server with 'run_client()'
+ *
+ * @file    server.c
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <time.h>
+#include <assert.h>
+#include <signal.h>
+#include <pthread.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/stat.h>
+#include "server.h"
+#include "driver.h"
+#include "trace.h"
+
+typedef struct {
+    UnitCache * cache;          // results shared by all requests
+    int clients;                // connections being served, guarded by 'lock'
+    pthread_mutex_t lock;
+    pthread_cond_t idle;        // signaled when the last connection closes
+} Server;
+
+typedef struct {
+    Server * server;
+    int fd;                     // the client's connection
+} Connection;
+
+static volatile sig_atomic_t stopping;
+
+static void on_stop(int signal) {
+    (void)signal;
+    stopping = 1;
+}
+
+static bool send_all(int fd, const void * data, size_t length) {
+    const char * bytes = (const char *)data;
+    while(length > 0) {
+        ssize_t sent = send(fd, bytes, length, MSG_NOSIGNAL);
+        if(sent < 0) {
+            if(errno == EINTR) continue;
+            return false;
+        }
+        bytes += sent;
+        length -= (size_t)sent;
+    }
+    return true;
+}
+
+static bool receive_all(int fd, void * data, size_t length) {
+    char * bytes = (char *)data;
+    while(length > 0) {
+        ssize_t received = recv(fd, bytes, length, 0);
+        if(received < 0 && errno == EINTR) continue;
+        if(received <= 0) return false;
+        bytes += received;
+        length -= (size_t)received;
+    }
+    return true;
+}
+
+static bool send_string(int fd, const char * string, size_t length) {
+    uint32_t header = (uint32_t)length;
+    return send_all(fd, &header, sizeof(header)) && send_all(fd, string, length);
+}
+
+/**
+ * Receives a string.
+ *
+ * @param fd: The connection
+ * @param length: Receives the length of the string
+ * @param limit: The longest string accepted
+ * @return: The string with a terminating 0 added, NULL if the connection
+ *          failed or the string is longer than 'limit'
+ */
+static char * receive_string(int fd, uint32_t * length, uint32_t limit) {
+    if(!receive_all(fd, length, sizeof(*length)) || *length > limit) return NULL;
+    char * string = (char *)malloc(*length + 1);
+    assert(string);
+    if(!receive_all(fd, string, *length)) {
+        free(string);
+        return NULL;
+    }
+    string[*length] = '\0';
+    return string;
+}
+
+/**
+ * Passes file descriptors to the other end of the connection.
+ *
+ * @param fd: The connection
+ * @param descriptors: The descriptors, which stay open
+ * @param count: Number of descriptors
+ * @return: 'false' if the connection failed
+ */
+static bool send_descriptors(int fd, const int * descriptors, int count) {
+    for(int sent = 0, batch; sent < count; sent += batch) {
+        batch = count - sent < SERVER_DESCRIPTOR_BATCH ? count - sent : SERVER_DESCRIPTOR_BATCH;
+        union {
+            struct cmsghdr header;
+            char buffer[CMSG_SPACE(SERVER_DESCRIPTOR_BATCH * sizeof(int))];
+        } control;
+        memset(&control, 0, sizeof(control));
+
+        char byte = 0;
+        struct iovec data = { &byte, 1 };
+        struct msghdr message;
+        memset(&message, 0, sizeof(message));
+        message.msg_iov = &data;
+        message.msg_iovlen = 1;
+        message.msg_control = control.buffer;
+        message.msg_controllen = CMSG_SPACE(batch * sizeof(int));
+
+        struct cmsghdr * header = CMSG_FIRSTHDR(&message);
+        header->cmsg_level = SOL_SOCKET;
+        header->cmsg_type = SCM_RIGHTS;
+        header->cmsg_len = CMSG_LEN(batch * sizeof(int));
+        memcpy(CMSG_DATA(header), descriptors + sent, batch * sizeof(int));
+
+        ssize_t result;
+        do {
+            result = sendmsg(fd, &message, MSG_NOSIGNAL);
+        } while(result < 0 && errno == EINTR);
+        if(result != 1) return false;
+    }
+    return true;
+}
+
+/**
+ * Receives file descriptors passed by 'send_descriptors()'.
+ *
+ * @param fd: The connection
+ * @param descriptors: Receives the descriptors
+ * @param count: Number of descriptors expected
+ * @return: 'false' if the connection failed or passed other descriptors,
+ *          in which case all received ones are closed
+ */
+static bool receive_descriptors(int fd, int * descriptors, int count) {
+    int received = 0;
+    while(received < count) {
+        int batch = count - received < SERVER_DESCRIPTOR_BATCH ? count - received : SERVER_DESCRIPTOR_BATCH;
+        union {
+            struct cmsghdr header;
+            char buffer[CMSG_SPACE(SERVER_DESCRIPTOR_BATCH * sizeof(int))];
+        } control;
+
+        char byte;
+        struct iovec data = { &byte, 1 };
+        struct msghdr message;
+        memset(&message, 0, sizeof(message));
+        message.msg_iov = &data;
+        message.msg_iovlen = 1;
+        message.msg_control = control.buffer;
+        message.msg_controllen = sizeof(control.buffer);
+
+        ssize_t result;
+        do {
+            result = recvmsg(fd, &message, MSG_CMSG_CLOEXEC);
+        } while(result < 0 && errno == EINTR);
+
+        struct cmsghdr * header = result == 1 ? CMSG_FIRSTHDR(&message) : NULL;
+        int passed = 0;
+        if(header && header->cmsg_level == SOL_SOCKET && header->cmsg_type == SCM_RIGHTS) {
+            passed = (int)((header->cmsg_len - CMSG_LEN(0)) / sizeof(int));
+            if(passed > batch) passed = batch;
+            memcpy(descriptors + received, CMSG_DATA(header), passed * sizeof(int));
+            received += passed;
+        }
+        if(passed != batch || (message.msg_flags & MSG_CTRUNC)) {
+            for(int i = 0; i < received; i++) close(descriptors[i]);
+            return false;
+        }
+    }
+    return true;
+}
+
+static bool init_address(struct sockaddr_un * address, const char * socket_path) {
+    memset(address, 0, sizeof(*address));
+    address->sun_family = AF_UNIX;
+    if(strlen(socket_path) >= sizeof(address->sun_path)) return false;
+    strcpy(address->sun_path, socket_path);
+    return true;
+}
+
+static void send_report(const Unit * unit, void * context) {
+    int fd = *(const int *)context;
+    if(unit->diagnostics.length > 0) send_string(fd, unit->diagnostics.text, unit->diagnostics.length);
+}
+
+/**
+ * Counts a connection as closed, waking the shutdown once none is left.
+ *
+ * @param server: A pointer to the server
+ */
+static void release_client(Server * server) {
+    pthread_mutex_lock(&server->lock);
+    if(--server->clients == 0) pthread_cond_signal(&server->idle);
+    pthread_mutex_unlock(&server->lock);
+}
+
+/**
+ * Serves one request of a client and closes the connection.
+ *
+ * @param arg: A pointer to the 'Connection', freed when done
+ * @return: NULL
+ */
+static void * connection_thread(void * arg) {
+    Connection * connection = (Connection *)arg;
+    Server * server = connection->server;
+    int fd = connection->fd;
+    free(connection);
+
+    uint32_t count = 0;
+    char ** strings = NULL;
+    int received = 0;
+    bool valid = receive_all(fd, &count, sizeof(count)) && count <= SERVER_MAX_ARGUMENTS;
+    if(valid) {
+        strings = (char **)calloc(count, sizeof(char *));
+        assert(strings);
+        for(uint32_t length; received < (int)count; received++) {
+            if(!(strings[received] = receive_string(fd, &length, SERVER_MAX_STRING))) {
+                valid = false;
+                break;
+            }
+        }
+    }
+
+    DriverOptions options;
+    bool parsed = valid && init_driver_options(&options, (int)count, strings) && !options.profile_use;
+    if(valid && !parsed) {
+        const char * usage = "usage: sloth [-j N] [-O0] file...\n";
+        uint32_t status = 1;
+        send_string(fd, usage, strlen(usage));
+        send_string(fd, "", 0);
+        send_all(fd, &status, sizeof(status));
+    }
+
+    // The working directory and the sources the client opened
+    uint32_t length = 0;
+    char * opened = parsed ? receive_string(fd, &length, SERVER_MAX_STRING) : NULL;
+    int * descriptors = NULL;
+    int descriptor_count = 1;
+    bool complete = opened && length == (uint32_t)options.file_count;
+    if(complete) {
+        for(uint32_t i = 0; i < length; i++) descriptor_count += opened[i] ? 1 : 0;
+        descriptors = (int *)malloc(descriptor_count * sizeof(int));
+        assert(descriptors);
+        complete = receive_descriptors(fd, descriptors, descriptor_count);
+    }
+
+    // Images are written relative to the working directory, which must be one
+    struct stat directory;
+    if(complete && (fstat(descriptors[0], &directory) != 0 || !S_ISDIR(directory.st_mode))) {
+        const char * message = "sloth: the working directory was not passed\n";
+        uint32_t status = 1;
+        send_string(fd, message, strlen(message));
+        send_string(fd, "", 0);
+        send_all(fd, &status, sizeof(status));
+        for(int i = 0; i < descriptor_count; i++) close(descriptors[i]);
+        complete = false;
+    }
+
+    if(complete) {
+        options.directory = descriptors[0];
+        options.sources = (int *)malloc(options.file_count * sizeof(int));
+        assert(options.sources);
+        for(int i = 0, next = 1; i < options.file_count; i++) options.sources[i] = opened[i] ? descriptors[next++] : -1;
+
+        trace_thread_name("connection");
+        trace_begin("request", NULL);
+        uint32_t status = compile_files(&options, server->cache, send_report, &fd) ? 0 : 1;
+        trace_end("request");
+        send_string(fd, "", 0);
+        send_all(fd, &status, sizeof(status));
+
+        for(int i = 0; i < descriptor_count; i++) close(descriptors[i]);
+        free(options.sources);
+    }
+    if(valid) destroy_driver_options(&options);
+    free(descriptors);
+    free(opened);
+
+    for(int i = 0; i < received; i++) free(strings[i]);
+    free(strings);
+    close(fd);
+
+    release_client(server);
+    return NULL;
+}
+
+/**
+ * Runs the compile server until SIGINT or SIGTERM.
+ *
+ * @param socket_path: Path of the Unix domain socket to listen on
+ * @param trace: File to write a trace of all requests to, NULL if none
+ * @return: The exit status of the process
+ */
+int run_server(const char * socket_path, const char * trace) {
+    struct sockaddr_un address;
+    if(!init_address(&address, socket_path)) {
+        fprintf(stderr, "sloth: socket path '%s' is too long\n", socket_path);
+        return 1;
+    }
+
+    int listener = socket(AF_UNIX, SOCK_STREAM, 0);
+    if(listener < 0) {
+        perror("sloth: socket");
+        return 1;
+    }
+
+    // A socket left behind by a server that did not shut down is replaced,
+    // one with a server still listening is not
+    if(connect(listener, (struct sockaddr *)&address, sizeof(address)) == 0) {
+        fprintf(stderr, "sloth: a server is already listening on '%s'\n", socket_path);
+        close(listener);
+        return 1;
+    }
+    close(listener);
+    unlink(socket_path);
+
+    listener = socket(AF_UNIX, SOCK_STREAM, 0);
+    if(listener < 0 || bind(listener, (struct sockaddr *)&address, sizeof(address)) != 0
+       || listen(listener, SOMAXCONN) != 0) {
+        perror("sloth: cannot listen");
+        if(listener >= 0) close(listener);
+        return 1;
+    }
+
+    // Without SA_RESTART the signals interrupt 'accept()'
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = on_stop;
+    sigemptyset(&action.sa_mask);
+    sigaction(SIGINT, &action, NULL);
+    sigaction(SIGTERM, &action, NULL);
+
+    if(trace) trace_start(trace);
+    Server server;
+    server.cache = init_unit_cache();
+    server.clients = 0;
+    pthread_mutex_init(&server.lock, NULL);
+    pthread_cond_init(&server.idle, NULL);
+
+    sigset_t signals, saved;
+    sigemptyset(&signals);
+    sigaddset(&signals, SIGINT);
+    sigaddset(&signals, SIGTERM);
+
+    int spare = open("/dev/null", O_RDONLY | O_CLOEXEC);
+    const struct timespec backoff = { 0, SERVER_ACCEPT_BACKOFF };
+    while(!stopping) {
+        int fd = accept(listener, NULL, NULL);
+        if(fd < 0) {
+            if(errno == EINTR || errno == ECONNABORTED) continue;
+            if((errno == EMFILE || errno == ENFILE) && spare >= 0) {
+                close(spare);
+                int refused = accept(listener, NULL, NULL);
+                if(refused >= 0) close(refused);
+                spare = open("/dev/null", O_RDONLY | O_CLOEXEC);
+            }
+            nanosleep(&backoff, NULL);
+            continue;
+        }
+
+        Connection * connection = (Connection *)malloc(sizeof(Connection));
+        assert(connection);
+        connection->server = &server;
+        connection->fd = fd;
+        pthread_mutex_lock(&server.lock);
+        server.clients++;
+        pthread_mutex_unlock(&server.lock);
+
+        // The signals must reach this thread, so the connection threads and
+        // the workers they start block them
+        pthread_sigmask(SIG_BLOCK, &signals, &saved);
+        pthread_t thread;
+        if(pthread_create(&thread, NULL, connection_thread, connection) == 0) {
+            pthread_detach(thread);
+        } else {
+            close(fd);
+            free(connection);
+            release_client(&server);
+        }
+        pthread_sigmask(SIG_SETMASK, &saved, NULL);
+    }
+
+    if(spare >= 0) close(spare);
+    close(listener);
+    unlink(socket_path);
+
+    pthread_mutex_lock(&server.lock);
+    while(server.clients > 0) pthread_cond_wait(&server.idle, &server.lock);
+    pthread_mutex_unlock(&server.lock);
+    pthread_cond_destroy(&server.idle);
+    pthread_mutex_destroy(&server.lock);
+    destroy_unit_cache(server.cache);
+    if(trace && !trace_stop()) {
+        fprintf(stderr, "sloth: cannot write '%s'\n", trace);
+        return 1;
+    }
+    return 0;
+}
+
+/**
+ * Compiles through a running compile server, printing its messages.
+ *
+ * @param socket_path: Path of the server's socket
+ * @param argc: Number of arguments, without the program name
+ * @param argv: The compiler's command line
+ * @return: The exit status of the compile
+ */
+int run_client(const char * socket_path, int argc, char ** argv) {
+    struct sockaddr_un address;
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if(fd < 0 || !init_address(&address, socket_path)
+       || connect(fd, (struct sockaddr *)&address, sizeof(address)) != 0) {
+        fprintf(stderr, "sloth: cannot connect to a server on '%s'\n", socket_path);
+        if(fd >= 0) close(fd);
+        return 1;
+    }
+
+    DriverOptions options;
+    if(!init_driver_options(&options, argc, argv)) {
+        destroy_driver_options(&options);
+        close(fd);
+        fprintf(stderr, "usage: sloth --connect SOCKET [-j N] [-O0] file...\n");
+        return 1;
+    }
+    if(options.trace || options.mem_stats || options.profile_use) {
+        destroy_driver_options(&options);
+        close(fd);
+        fprintf(stderr, options.trace ? "sloth: a server is traced with --server SOCKET --trace=FILE\n"
+                        : options.mem_stats ? "sloth: --mem-stats is not available through a server\n"
+                        : "sloth: --profile-use is not available through a server\n");
+        return 1;
+    }
+
+    // Sources that cannot be opened here are left to the server, which
+    // then reports them in order with all other messages. A pipe is opened
+    // without waiting for a writer, and the server refuses it.
+    int * descriptors = (int *)malloc((options.file_count + 1) * sizeof(int));
+    char * opened = (char *)malloc(options.file_count + 1);
+    assert(descriptors && opened);
+    int descriptor_count = 0;
+    descriptors[descriptor_count++] = open(".", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    for(int i = 0; i < options.file_count; i++) {
+        int source = i < SERVER_MAX_SOURCES ? open(options.files[i], O_RDONLY | O_NONBLOCK | O_CLOEXEC) : -1;
+        opened[i] = source >= 0;
+        if(source >= 0) descriptors[descriptor_count++] = source;
+    }
+
+    uint32_t count = (uint32_t)argc;
+    bool ok = descriptors[0] >= 0 && send_all(fd, &count, sizeof(count));
+    for(int i = 0; ok && i < argc; i++) ok = send_string(fd, argv[i], strlen(argv[i]));
+    ok = ok && send_string(fd, opened, options.file_count) && send_descriptors(fd, descriptors, descriptor_count);
+
+    for(int i = 0; i < descriptor_count; i++) {
+        if(descriptors[i] >= 0) close(descriptors[i]);
+    }
+    free(descriptors);
+    free(opened);
+    destroy_driver_options(&options);
+
+    uint32_t status = 1;
+    bool answered = false;
+    while(ok) {
+        uint32_t length;
+        char * messages = receive_string(fd, &length, UINT32_MAX - 1);
+        if(!messages) break;
+        if(length == 0) answered = receive_all(fd, &status, sizeof(status));
+        else fwrite(messages, 1, length, stderr);
+        free(messages);
+        if(length == 0) break;
+    }
+    close(fd);
+
+    if(!answered) {
+        fprintf(stderr, "sloth: lost the connection to the server on '%s'\n", socket_path);
+        return 1;
+    }
+    return (int)status;
+}
@@ -0,0 +1,13 @@
+#ifndef SERVER_H
+#define SERVER_H
+
+#define SERVER_MAX_ARGUMENTS    65536       // arguments of one request
+#define SERVER_MAX_STRING       (1 << 20)   // bytes of one argument
+#define SERVER_MAX_SOURCES      256         // sources of one request passed open, the rest by name
+#define SERVER_DESCRIPTOR_BATCH 64          // descriptors passed in one message
+#define SERVER_ACCEPT_BACKOFF   10000000    // nanoseconds to wait after 'accept()' failed
+
+int run_server(const char * socket_path, const char * trace);
+int run_client(const char * socket_path, int argc, char ** argv);
+
+#endif // SERVER_H
@@ -0,0 +1,147 @@
+#ifndef TEST_H
+#define TEST_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "lexer.h"
+#include "parser.h"
+#include "semantic.h"
+#include "codegen.h"
+#include "optimize.h"
+#include "image.h"
+#include "vm.h"
+
+/*
+ * Helpers shared by the tests. Every test is a program of its own that
+ * runs its checks, prints the ones failing and exits with status 1 if any
+ * did. Sources are written to files in a temporary directory, as the
+ * compiler reads them.
+ */
+
+static int test_failures = 0;
+static char test_directory[] = "/tmp/sloth-test-XXXXXX";
+
+#define CHECK(condition) do { \
+    if(!(condition)) { \
+        fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #condition); \
+        test_failures++; \
+    } \
+} while(0)
+
+#define CHECK_INT(actual, expected) do { \
+    long long actual_value = (long long)(actual), expected_value = (long long)(expected); \
+    if(actual_value != expected_value) { \
+        fprintf(stderr, "%s:%d: %s is %lld, expected %lld\n", __FILE__, __LINE__, #actual, \
+                actual_value, expected_value); \
+        test_failures++; \
+    } \
+} while(0)
+
+/**
+ * Creates the temporary directory the test's files are written to.
+ */
+static inline void test_start(void) {
+    if(!mkdtemp(test_directory)) {
+        perror("mkdtemp");
+        exit(1);
+    }
+}
+
+/**
+ * Removes the test's files and returns the exit status of the test.
+ */
+static inline int test_finish(void) {
+    char command[sizeof(test_directory) + 16];
+    snprintf(command, sizeof(command), "rm -rf %s", test_directory);
+    if(system(command) != 0) fprintf(stderr, "cannot remove %s\n", test_directory);
+    if(test_failures > 0) fprintf(stderr, "%d checks failed\n", test_failures);
+    return test_failures > 0 ? 1 : 0;
+}
+
+/**
+ * Writes a file into the test's directory.
+ *
+ * @param name: The file name
+ * @param text: The contents
+ * @return: The path of the file, to be freed by the caller
+ */
+static inline char * test_write_file(const char * name, const char * text) {
+    char * path = (char *)malloc(strlen(test_directory) + strlen(name) + 2);
+    sprintf(path, "%s/%s", test_directory, name);
+    FILE * file = fopen(path, "w");
+    if(!file) {
+        perror(path);
+        exit(1);
+    }
+    fputs(text, file);
+    fclose(file);
+    return path;
+}
+
+/**
+ * Compiles a source text into a module, collecting the messages, which
+ * name the file 'source.sloth'.
+ *
+ * @param source: The source text
+ * @param diagnostics: Receives the messages, to be destroyed by the caller
+ * @return: The module, or NULL after errors
+ */
+static inline Module * test_generate(const char * source, Diagnostics * diagnostics) {
+    init_diagnostics(diagnostics, "source.sloth");
+    char * path = test_write_file("source.sloth", source);
+    Lexer * lexer = init(path);
+    free(path);
+    if(!lexer) {
+        diagnose(diagnostics, 0, 0, "cannot read file");
+        return NULL;
+    }
+    Program * program = parse(lexer, diagnostics);
+    destroy_lexer(lexer);
+    Module * module = NULL;
+    if(diagnostics->errors == 0 && analyze(program, diagnostics)) module = generate(program, diagnostics);
+    destroy_program(program);
+    return module;
+}
+
+/**
+ * Compiles a source text into a module, failing the test on errors.
+ *
+ * @param source: The source text
+ * @param optimize: Run the bytecode optimizer
+ * @return: The module, or NULL if it did not compile
+ */
+static inline Module * test_compile(const char * source, bool optimize) {
+    Diagnostics diagnostics;
+    Module * module = test_generate(source, &diagnostics);
+    if(diagnostics.length > 0) fwrite(diagnostics.text, 1, diagnostics.length, stderr);
+    CHECK(diagnostics.errors == 0);
+    destroy_diagnostics(&diagnostics);
+
+    if(module && optimize) optimize_module(module);
+    return module;
+}
+
+/**
+ * Runs a function of an image taking and returning integers in a fresh
+ * machine, failing the test on run-time errors.
+ */
+static inline int64_t test_run(const Image * image, const char * name, const int64_t * args, int arg_count) {
+    int function = image_find_function(image, name);
+    CHECK(function >= 0);
+    if(function < 0) return 0;
+
+    Value values[8];
+    for(int i = 0; i < arg_count && i < 8; i++) values[i].i = args[i];
+    Vm * vm = init_vm(image);
+    Value result = { .i = 0 };
+    if(!vm_run(vm, function, values, &result)) {
+        fprintf(stderr, "%s: %s\n", name, vm->error);
+        test_failures++;
+    }
+    destroy_vm(vm);
+    return result.i;
+}
+
+#endif // TEST_H
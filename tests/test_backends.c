@@ -0,0 +1,143 @@
+/**
+ * Tests that the C and LLVM backends emit functions with the parameters of
+ * the source, without the hidden result parameter of the bytecode, that
+ * the emitted files compile (the C one without warnings), and that the
+ * functions return what the interpreter returns. The LLVM check needs
+ * 'llc' and is skipped without it.
+ *
+ * @file    test_backends.c
+ */
+#include "test.h"
+#include "cgen.h"
+#include "llvmgen.h"
+
+static const char * source =
+    "int fib(int n) {\n"
+    "    if(n < 2) { return n; }\n"
+    "    return fib(n - 1) + fib(n - 2);\n"
+    "}\n"
+    "float fsum(int n) {\n"
+    "    float s = 0.0;\n"
+    "    int i = 0;\n"
+    "    while(i < n) { s = s + i * 0.5; i = i + 1; }\n"
+    "    return s;\n"
+    "}\n"
+    "float scaled(int a, float b) { return a * b; }\n"
+    "int mixed(int a, float b) { return a + b; }\n"
+    "float twice(int n) { return fsum(n) + scaled(n, 0.25); }\n";
+
+/*
+ * Calls the emitted functions with the parameters of the source and
+ * prints their results as the test prints the interpreter's.
+ */
+static const char * harness =
+    "#include <stdio.h>\n"
+    "#include <stdint.h>\n"
+    "int64_t sloth_fib(int64_t n);\n"
+    "double sloth_fsum(int64_t n);\n"
+    "double sloth_scaled(int64_t a, double b);\n"
+    "int64_t sloth_mixed(int64_t a, double b);\n"
+    "double sloth_twice(int64_t n);\n"
+    "int main(void) {\n"
+    "    printf(\"%lld %.17g %.17g %lld %.17g\\n\", (long long)sloth_fib(20), sloth_fsum(10),\n"
+    "           sloth_scaled(3, 2.5), (long long)sloth_mixed(3, 2.5), sloth_twice(10));\n"
+    "    return 0;\n"
+    "}\n";
+
+/**
+ * Runs a function of the image in the interpreter.
+ */
+static Value interpret(const Image * image, const char * name, Value a, Value b) {
+    int function = image_find_function(image, name);
+    CHECK(function >= 0);
+    Value args[3] = { a, b, { .i = 0 } };
+    const ImageFunction * entry = &image_functions(image)[function];
+    if(entry->flags & FUNCTION_RESULT_PARAM) args[0] = (Value){ .i = 0 }, args[1] = a, args[2] = b;
+    Value result = { .i = 0 };
+    Vm * vm = init_vm(image);
+    CHECK(vm_run(vm, function, args, &result));
+    destroy_vm(vm);
+    return result;
+}
+
+/**
+ * Runs a shell command and returns the first line it printed, or an empty
+ * string.
+ */
+static void run_command(const char * command, char * line, size_t size) {
+    FILE * out = popen(command, "r");
+    CHECK(out != NULL);
+    line[0] = '\0';
+    if(!out) return;
+    if(fgets(line, (int)size, out)) line[strcspn(line, "\n")] = '\0';
+    CHECK(pclose(out) == 0);
+}
+
+static void check_c(const Module * module, const char * expected) {
+    char generated[sizeof(test_directory) + 32], command[1024], line[256];
+    snprintf(generated, sizeof(generated), "%s/generated.c", test_directory);
+    FILE * out = fopen(generated, "w");
+    CHECK(out != NULL);
+    if(!out) return;
+    CHECK(cgen_module(out, module));
+    fclose(out);
+    char * main_file = test_write_file("main.c", harness);
+
+    snprintf(command, sizeof(command), "cc -std=c11 -O1 -Wall -Wextra -Werror -o %s/c.out %s %s -lm 2>&1 && %s/c.out",
+             test_directory, generated, main_file, test_directory);
+    run_command(command, line, sizeof(line));
+    if(strcmp(line, expected) != 0) {
+        fprintf(stderr, "the C backend printed '%s', expected '%s'\n", line, expected);
+        test_failures++;
+    }
+    free(main_file);
+}
+
+static void check_llvm(const Module * module, const char * expected) {
+    if(system("command -v llc >/dev/null 2>&1") != 0) return;
+    char generated[sizeof(test_directory) + 32], command[2048], line[256];
+    snprintf(generated, sizeof(generated), "%s/generated.ll", test_directory);
+    FILE * out = fopen(generated, "w");
+    CHECK(out != NULL);
+    if(!out) return;
+    CHECK(llvmgen_module(out, module));
+    fclose(out);
+    char * main_file = test_write_file("main.c", harness);
+
+    // LLVM 14 needs '-opaque-pointers', later versions have them by default
+    snprintf(command, sizeof(command),
+             "(llc -O1 -filetype=obj -relocation-model=pic -opaque-pointers -o %s/ll.o %s 2>/dev/null"
+             " || llc -O1 -filetype=obj -relocation-model=pic -o %s/ll.o %s 2>&1)"
+             " && cc -o %s/ll.out %s %s/ll.o -lm 2>&1 && %s/ll.out",
+             test_directory, generated, test_directory, generated, test_directory, main_file, test_directory,
+             test_directory);
+    run_command(command, line, sizeof(line));
+    if(strcmp(line, expected) != 0) {
+        fprintf(stderr, "the LLVM backend printed '%s', expected '%s'\n", line, expected);
+        test_failures++;
+    }
+    free(main_file);
+}
+
+int main(void) {
+    test_start();
+    Module * module = test_compile(source, true);
+    CHECK(module != NULL);
+    if(!module) return test_finish();
+    Image * image = link_module(module);
+
+    Value none = { .i = 0 };
+    char expected[256];
+    snprintf(expected, sizeof(expected), "%lld %.17g %.17g %lld %.17g",
+             (long long)interpret(image, "fib", (Value){ .i = 20 }, none).i,
+             interpret(image, "fsum", (Value){ .i = 10 }, none).f,
+             interpret(image, "scaled", (Value){ .i = 3 }, (Value){ .f = 2.5 }).f,
+             (long long)interpret(image, "mixed", (Value){ .i = 3 }, (Value){ .f = 2.5 }).i,
+             interpret(image, "twice", (Value){ .i = 10 }, none).f);
+    check_c(module, expected);
+    check_llvm(module, expected);
+
+    destroy_image(image);
+    destroy_module(module);
+    return test_finish();
+}
@@ -0,0 +1,68 @@
+/**
+ * Tests that programs exceeding the limits of the bytecode or of its
+ * integers are reported as errors rather than aborting the compiler or
+ * changing their values.
+ *
+ * @file    test_codegen.c
+ */
+#include "test.h"
+
+#define TEXT_SIZE (8 << 20)
+
+static void check_too_many_constants(void) {
+    char * text = (char *)malloc(TEXT_SIZE);
+    size_t length = 0;
+    length += sprintf(text + length, "int f() {\n    int x = 0;\n");
+    for(int i = 0; i <= MAX_BX + 1; i++) length += sprintf(text + length, "    x = %d;\n", 1000000 + i);
+    length += sprintf(text + length, "    return x;\n}\nint g() { return 1000000; }\n");
+
+    Diagnostics diagnostics;
+    Module * module = test_generate(text, &diagnostics);
+    CHECK(module == NULL);
+    CHECK_INT(diagnostics.errors, 1);
+    CHECK(diagnostics.text && strstr(diagnostics.text, "source.sloth:1:1: error: function 'f' uses too many constants\n"));
+    destroy_diagnostics(&diagnostics);
+    free(text);
+}
+
+static void check_too_many_functions(void) {
+    char * text = (char *)malloc(TEXT_SIZE);
+    size_t length = 0;
+    for(int i = 0; i <= MAX_BX + 1; i++) length += sprintf(text + length, "int f%d() { return %d; }\n", i, i % 100);
+
+    Diagnostics diagnostics;
+    Module * module = test_generate(text, &diagnostics);
+    CHECK(module == NULL);
+    CHECK_INT(diagnostics.errors, 1);
+    CHECK(diagnostics.text && strstr(diagnostics.text, "source.sloth:65537:1: error: too many functions"));
+    destroy_diagnostics(&diagnostics);
+    free(text);
+}
+
+static void check_literal_range(void) {
+    Diagnostics diagnostics;
+    Module * module = test_generate("int f() {\n    return 99999999999999999999;\n}\n", &diagnostics);
+    CHECK(module == NULL);
+    CHECK_INT(diagnostics.errors, 1);
+    CHECK(diagnostics.text
+          && strstr(diagnostics.text, "source.sloth:2:12: error: integer literal '99999999999999999999' is out of range"));
+    destroy_diagnostics(&diagnostics);
+
+    // The largest integer still compiles
+    module = test_compile("int f() { return 9223372036854775807; }\n", false);
+    CHECK(module != NULL);
+    if(module) {
+        Image * image = link_module(module);
+        CHECK_INT(test_run(image, "f", NULL, 0), INT64_MAX);
+        destroy_image(image);
+        destroy_module(module);
+    }
+}
+
+int main(void) {
+    test_start();
+    check_too_many_constants();
+    check_too_many_functions();
+    check_literal_range();
+    return test_finish();
+}
@@ -0,0 +1,189 @@
+/**
+ * Tests that the driver reports the messages of every unit in the order of
+ * the command line, the same for any number of workers and whether or not
+ * results come from the unit cache, and that '--emit' writes C source and
+ * LLVM IR in place of the image. The unit cache is checked to follow the
+ * contents of a source rather than its timestamps and not to keep errors
+ * from writing the image.
+ *
+ * @file    test_driver.c
+ */
+#include <utime.h>
+#include <sys/stat.h>
+#include "test.h"
+#include "driver.h"
+
+#define UNITS 12
+
+typedef struct {
+    char text[1 << 16];
+    size_t length;
+    int reported;
+    const char * order[UNITS];
+} Report;
+
+static void collect(const Unit * unit, void * context) {
+    Report * report = (Report *)context;
+    if(report->reported < UNITS) report->order[report->reported] = unit->filename;
+    report->reported++;
+    if(unit->diagnostics.length > 0 && report->length + unit->diagnostics.length < sizeof(report->text)) {
+        memcpy(report->text + report->length, unit->diagnostics.text, unit->diagnostics.length);
+        report->length += unit->diagnostics.length;
+    }
+}
+
+static const char * sources[] = {
+    "int f(int x) { return x + 1; }\n",
+    "int f(int x) {\n    return y + 1;\n}\nint g(float a) { return a % 2; }\n",
+    "int f(int x) {\n    return x +;\n}\n",
+};
+
+static bool compile(char ** files, int jobs, UnitCache * cache, Report * report) {
+    char arguments[UNITS + 2][16];
+    char * argv[UNITS + 2];
+    int argc = 0;
+    snprintf(arguments[0], sizeof(arguments[0]), "-j%d", jobs);
+    argv[argc++] = arguments[0];
+    for(int i = 0; i < UNITS; i++) argv[argc++] = files[i];
+
+    DriverOptions options;
+    CHECK(init_driver_options(&options, argc, argv));
+    memset(report, 0, sizeof(*report));
+    bool ok = compile_files(&options, cache, collect, report);
+    destroy_driver_options(&options);
+    return ok;
+}
+
+/**
+ * Compiles the first unit with '--emit=' the given kind and checks that
+ * the output names its function.
+ */
+static void check_emit(char * file, const char * kind, const char * extension, const char * function) {
+    char emit[32];
+    snprintf(emit, sizeof(emit), "--emit=%s", kind);
+    char * argv[] = { emit, file };
+    DriverOptions options;
+    CHECK(init_driver_options(&options, 2, argv));
+    Report report;
+    memset(&report, 0, sizeof(report));
+    CHECK(compile_files(&options, NULL, collect, &report));
+    destroy_driver_options(&options);
+
+    char output[sizeof(test_directory) + 32];
+    snprintf(output, sizeof(output), "%s/unit00%s", test_directory, extension);
+    FILE * in = fopen(output, "r");
+    CHECK(in != NULL);
+    if(!in) return;
+    static char text[1 << 16];
+    size_t length = fread(text, 1, sizeof(text) - 1, in);
+    text[length] = '\0';
+    fclose(in);
+    CHECK(strstr(text, function) != NULL);
+}
+
+/**
+ * Compiles one file through a cache and returns its messages.
+ */
+static void compile_cached(char * file, UnitCache * cache, Report * report) {
+    char * argv[] = { file };
+    DriverOptions options;
+    CHECK(init_driver_options(&options, 1, argv));
+    memset(report, 0, sizeof(*report));
+    compile_files(&options, cache, collect, report);
+    destroy_driver_options(&options);
+    report->text[report->length] = '\0';
+}
+
+static void check_cache_keys(void) {
+    UnitCache * cache = init_unit_cache();
+    static Report report;
+
+    // Same size and modification time, different contents
+    char * file = test_write_file("keyed.sloth", "int f(int x) { return x + 1; }\n");
+    struct stat before;
+    CHECK(stat(file, &before) == 0);
+    compile_cached(file, cache, &report);
+    CHECK_INT(report.length, 0);
+    free(test_write_file("keyed.sloth", "int f(int x) { return y + 1; }\n"));
+    struct utimbuf times = { before.st_atime, before.st_mtime };
+    CHECK(utime(file, &times) == 0);
+    compile_cached(file, cache, &report);
+    CHECK(strstr(report.text, "keyed.sloth:1:") != NULL);
+
+    // An image that cannot be written is reported again, not from the cache
+    char image[sizeof(test_directory) + 32];
+    snprintf(image, sizeof(image), "%s/keyed.slbc", test_directory);
+    free(test_write_file("keyed.sloth", "int f(int x) { return x + 2; }\n"));
+    unlink(image);
+    CHECK(mkdir(image, 0700) == 0);
+    compile_cached(file, cache, &report);
+    CHECK(strstr(report.text, "cannot write") != NULL);
+    CHECK(rmdir(image) == 0);
+    compile_cached(file, cache, &report);
+    CHECK_INT(report.length, 0);
+
+    destroy_unit_cache(cache);
+    free(file);
+}
+
+int main(void) {
+    test_start();
+    char * files[UNITS];
+    for(int i = 0; i < UNITS; i++) {
+        char name[32];
+        snprintf(name, sizeof(name), "unit%02d.sloth", i);
+        files[i] = test_write_file(name, sources[i % 3]);
+    }
+    // A missing file is reported in its place too
+    char * missing = files[UNITS - 1];
+    files[UNITS - 1] = (char *)malloc(strlen(missing) + 16);
+    sprintf(files[UNITS - 1], "%s.missing", missing);
+    free(missing);
+
+    static Report sequential, parallel, cached;
+    CHECK(!compile(files, 1, NULL, &sequential));
+    CHECK_INT(sequential.reported, UNITS);
+    for(int i = 0; i < UNITS; i++) CHECK(sequential.order[i] == files[i]);
+
+    // Messages of a unit are contiguous, name their file and follow the command line
+    const char * text = sequential.text;
+    int last = -1;
+    while(text < sequential.text + sequential.length) {
+        int unit = -1;
+        for(int i = 0; i < UNITS; i++) {
+            if(strncmp(text, files[i], strlen(files[i])) == 0 && text[strlen(files[i])] == ':') unit = i;
+        }
+        CHECK(unit >= last);
+        CHECK(unit % 3 != 0 || unit == UNITS - 1);
+        last = unit;
+        const char * end = memchr(text, '\n', sequential.text + sequential.length - text);
+        if(!end) break;
+        text = end + 1;
+    }
+    CHECK_INT(last, UNITS - 1);
+
+    CHECK(!compile(files, 8, NULL, &parallel));
+    CHECK_INT(parallel.length, sequential.length);
+    CHECK(memcmp(parallel.text, sequential.text, sequential.length) == 0);
+
+    UnitCache * cache = init_unit_cache();
+    for(int run = 0; run < 2; run++) {
+        CHECK(!compile(files, 4, cache, &cached));
+        CHECK_INT(cached.length, sequential.length);
+        CHECK(memcmp(cached.text, sequential.text, sequential.length) == 0);
+    }
+    destroy_unit_cache(cache);
+
+    char image[sizeof(test_directory) + 32];
+    snprintf(image, sizeof(image), "%s/unit00.slbc", test_directory);
+    Image * mapped = map_image(image);
+    CHECK(mapped != NULL);
+    if(mapped) destroy_image(mapped);
+
+    check_cache_keys();
+    check_emit(files[0], "c", ".c", "sloth_f(");
+    check_emit(files[0], "llvm", ".ll", "@sloth_f(");
+
+    for(int i = 0; i < UNITS; i++) free(files[i]);
+    return test_finish();
+}
@@ -0,0 +1,79 @@
+/**
+ * Tests that a profile collected with 'sloth --run --profile-generate'
+ * accumulates the counts of several runs and that compiling with
+ * 'sloth --profile-use' changes the code of hot functions but not what
+ * they return.
+ *
+ * @file    test_feedback.c
+ */
+#include "test.h"
+
+static const char * source =
+    "int square(int x) { return x * x; }\n"
+    "int sum(int n) {\n"
+    "    int total = 0;\n"
+    "    int i = 0;\n"
+    "    while(i < n) { total = total + square(i); i = i + 1; }\n"
+    "    return total;\n"
+    "}\n";
+
+static int run_command(const char * command) {
+    int status = system(command);
+    if(status != 0) fprintf(stderr, "'%s' failed\n", command);
+    return status;
+}
+
+int main(void) {
+    test_start();
+    const char * sloth = getenv("SLOTH");
+    if(!sloth) return test_finish();
+
+    char * path = test_write_file("sum.sloth", source);
+    char image[sizeof(test_directory) + 32], baseline[sizeof(test_directory) + 32];
+    char profile[sizeof(test_directory) + 32], command[1024];
+    snprintf(image, sizeof(image), "%s/sum.slbc", test_directory);
+    snprintf(baseline, sizeof(baseline), "%s/plain.slbc", test_directory);
+    snprintf(profile, sizeof(profile), "%s/sum.profile", test_directory);
+
+    snprintf(command, sizeof(command), "%s %s", sloth, path);
+    CHECK(run_command(command) == 0);
+    // Kept under another name, as the next compile rewrites the mapped file
+    CHECK(rename(image, baseline) == 0);
+    Image * plain = map_image(baseline);
+    CHECK(plain != NULL);
+
+    for(int run = 0; run < 2; run++) {
+        snprintf(command, sizeof(command), "%s --run --profile-generate=%s %s sum 1000 >/dev/null",
+                 sloth, profile, baseline);
+        CHECK(run_command(command) == 0);
+    }
+    Feedback * feedback = read_feedback(profile);
+    CHECK(feedback != NULL);
+    if(feedback) {
+        for(int f = 0; f < feedback->function_count; f++) {
+            if(strcmp(feedback->functions[f].name, "square") == 0) CHECK_INT(feedback->functions[f].calls, 2000);
+            if(strcmp(feedback->functions[f].name, "sum") == 0) CHECK_INT(feedback->functions[f].calls, 2);
+        }
+        destroy_feedback(feedback);
+    }
+
+    snprintf(command, sizeof(command), "%s --profile-use=%s %s", sloth, profile, path);
+    CHECK(run_command(command) == 0);
+    Image * optimized = map_image(image);
+    CHECK(optimized != NULL);
+    if(plain && optimized) {
+        CHECK(plain->size != optimized->size || memcmp(plain, optimized, plain->size) != 0);
+        for(int64_t n = 0; n < 2000; n += 37) {
+            CHECK_INT(test_run(optimized, "sum", &n, 1), test_run(plain, "sum", &n, 1));
+        }
+    }
+
+    // A profile that cannot be read stops the compile
+    snprintf(command, sizeof(command), "%s --profile-use=%s.missing %s 2>/dev/null", sloth, profile, path);
+    CHECK(system(command) != 0);
+
+    if(optimized) destroy_image(optimized);
+    if(plain) destroy_image(plain);
+    free(path);
+    return test_finish();
+}
@@ -0,0 +1,166 @@
+/**
+ * Tests that an image written to a file maps back unchanged and runs the
+ * same as the image it was written from, that rewriting the file leaves
+ * images mapped from it unchanged, and that files whose functions or code
+ * reach outside the image, the frame or the function are rejected.
+ *
+ * @file    test_image.c
+ */
+#include <dirent.h>
+#include "test.h"
+
+static const char * source =
+    "int fib(int n) {\n"
+    "    if(n < 2) { return n; }\n"
+    "    return fib(n - 1) + fib(n - 2);\n"
+    "}\n"
+    "int sum(int n) {\n"
+    "    int s = 0;\n"
+    "    int i = 0;\n"
+    "    while(i <= n) { s = s + i; i = i + 1; }\n"
+    "    return s;\n"
+    "}\n"
+    "float half(int x) { return x / 2.0; }\n"
+    "int main() { return fib(20) + sum(100); }\n";
+
+static void check_round_trip(bool optimize) {
+    Module * module = test_compile(source, optimize);
+    CHECK(module != NULL);
+    if(!module) return;
+    Image * image = link_module(module);
+    destroy_module(module);
+
+    char path[sizeof(test_directory) + 16];
+    snprintf(path, sizeof(path), "%s/out.slbc", test_directory);
+    CHECK(write_image(image, path));
+    Image * mapped = map_image(path);
+    CHECK(mapped != NULL);
+    if(mapped) {
+        CHECK_INT(mapped->size, image->size);
+        CHECK(memcmp(mapped, image, image->size) == 0);
+        CHECK_INT(mapped->function_count, 4);
+        CHECK(image_find_function(mapped, "half") == image_find_function(image, "half"));
+        CHECK(image_find_function(mapped, "missing") < 0);
+
+        int64_t n = 20;
+        CHECK_INT(test_run(mapped, "fib", &n, 1), 6765);
+        n = 100;
+        CHECK_INT(test_run(mapped, "sum", &n, 1), 5050);
+        CHECK_INT(test_run(mapped, "main", NULL, 0), 6765 + 5050);
+        CHECK_INT(test_run(image, "main", NULL, 0), 6765 + 5050);
+
+        // The file is replaced, not rewritten in place under the mapping
+        Module * other = test_compile("int main() { return 1; }\n", optimize);
+        Image * replacement = other ? link_module(other) : NULL;
+        if(other) destroy_module(other);
+        CHECK(replacement && write_image(replacement, path));
+        CHECK(memcmp(mapped, image, image->size) == 0);
+        CHECK_INT(test_run(mapped, "main", NULL, 0), 6765 + 5050);
+        Image * remapped = map_image(path);
+        CHECK(remapped != NULL);
+        if(remapped) {
+            CHECK_INT(test_run(remapped, "main", NULL, 0), 1);
+            destroy_image(remapped);
+        }
+        if(replacement) destroy_image(replacement);
+        destroy_image(mapped);
+    }
+    destroy_image(image);
+
+    // No temporary file is left behind
+    DIR * directory = opendir(test_directory);
+    CHECK(directory != NULL);
+    for(struct dirent * entry; directory && (entry = readdir(directory)) != NULL; ) {
+        CHECK(strstr(entry->d_name, ".tmp") == NULL);
+    }
+    if(directory) closedir(directory);
+
+    // A truncated file is rejected rather than mapped
+    FILE * file = fopen(path, "r+");
+    CHECK(file != NULL);
+    if(file) {
+        CHECK(ftruncate(fileno(file), 16) == 0);
+        fclose(file);
+        CHECK(map_image(path) == NULL);
+    }
+}
+
+/**
+ * Writes a copy of an image with one change and checks that it is not
+ * mapped.
+ *
+ * @param image: The valid image
+ * @param change: Changes the copy
+ * @param what: Names the change in the failure message
+ */
+static void check_rejected(const Image * image, void (*change)(Image * copy), const char * what) {
+    Image * copy = (Image *)malloc(image->size);
+    memcpy(copy, image, image->size);
+    change(copy);
+    char path[sizeof(test_directory) + 16];
+    snprintf(path, sizeof(path), "%s/bad.slbc", test_directory);
+    CHECK(write_image(copy, path));
+    Image * mapped = map_image(path);
+    if(mapped) {
+        fprintf(stderr, "an image with %s was mapped\n", what);
+        test_failures++;
+        destroy_image(mapped);
+    }
+    free(copy);
+}
+
+static ImageFunction * fib_entry(Image * image) {
+    return (ImageFunction *)image_functions(image) + image_find_function(image, "fib");
+}
+
+static uint32_t * fib_code(Image * image) {
+    return (uint32_t *)image_code(image) + fib_entry(image)->code;
+}
+
+static void code_outside(Image * image) { fib_entry(image)->code = 0x7fffffff; }
+static void code_too_long(Image * image) { fib_entry(image)->code_length = image->code_length + 1; }
+static void name_outside(Image * image) { fib_entry(image)->name = image->strings_size; }
+static void types_outside(Image * image) { fib_entry(image)->types = image->strings_size; }
+static void one_register(Image * image) { fib_entry(image)->register_count = 1; }
+static void params_over_registers(Image * image) {
+    fib_entry(image)->param_count = fib_entry(image)->register_count + 1;
+}
+
+/**
+ * Replace the first instruction of 'fib' by an invalid one.
+ */
+static void bad_register(Image * image) { fib_code(image)[0] = ENCODE_ABC(OP_MOVE, 0, 200, 0); }
+static void bad_constant(Image * image) { fib_code(image)[0] = ENCODE_ABX(OP_LOADK, 0, image->constant_count); }
+static void bad_callee(Image * image) { fib_code(image)[0] = ENCODE_ABX(OP_CALL, 0, image->function_count); }
+static void jump_before(Image * image) { fib_code(image)[0] = ENCODE_SJ(OP_JMP, -2); }
+static void jump_after(Image * image) { fib_code(image)[0] = ENCODE_SJ(OP_JMP, fib_entry(image)->code_length); }
+
+static void check_validation(void) {
+    Module * module = test_compile(source, false);
+    CHECK(module != NULL);
+    if(!module) return;
+    Image * image = link_module(module);
+    destroy_module(module);
+    CHECK(fib_entry(image)->register_count > 1);
+
+    check_rejected(image, code_outside, "code outside the code section");
+    check_rejected(image, code_too_long, "code longer than the code section");
+    check_rejected(image, name_outside, "a name outside the strings");
+    check_rejected(image, types_outside, "register types outside the strings");
+    check_rejected(image, one_register, "too few registers for its code");
+    check_rejected(image, params_over_registers, "more parameters than registers");
+    check_rejected(image, bad_register, "a register outside the frame");
+    check_rejected(image, bad_constant, "a constant outside the pool");
+    check_rejected(image, bad_callee, "a call of a missing function");
+    check_rejected(image, jump_before, "a jump before its function");
+    check_rejected(image, jump_after, "a jump after its function");
+    destroy_image(image);
+}
+
+int main(void) {
+    test_start();
+    check_round_trip(false);
+    check_round_trip(true);
+    check_validation();
+    return test_finish();
+}
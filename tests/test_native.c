@@ -0,0 +1,162 @@
+/**
+ * Tests that functions compiled to native code return what the interpreter
+ * returns, at the edges of the integer and float ranges too, both through
+ * the API and through 'sloth --run --native=all'.
+ *
+ * @file    test_native.c
+ */
+#include <stdint.h>
+#include <math.h>
+#include "test.h"
+#include "run.h"
+
+static const char * source =
+    "int fib(int n) {\n"
+    "    if(n < 2) { return n; }\n"
+    "    return fib(n - 1) + fib(n - 2);\n"
+    "}\n"
+    "int sum(int n) {\n"
+    "    int total = 0;\n"
+    "    int i = 0;\n"
+    "    while(i < n) { total = total + i * i; i = i + 1; }\n"
+    "    return total;\n"
+    "}\n"
+    "int add(int a, int b) { return a + b; }\n"
+    "int mul(int a, int b) { return a * b; }\n"
+    "int div(int a, int b) { return a / b; }\n"
+    "int mod(int a, int b) { return a % b; }\n"
+    "int truncate(int a, float x) { return x; }\n"
+    "float scale(float x, float y) { return x * y + 0.5; }\n"
+    "float half(int x) { return x / 2.0; }\n"
+    "int mixed(int a, float b) { return a + b; }\n";
+
+static const int64_t ints[] = { 0, 1, -1, 2, -7, 7, 1000003, INT64_MAX, INT64_MIN, INT64_MIN + 1 };
+static const double floats[] = { 0.0, -0.0, 2.9, -2.9, 1e300, -1e300, INFINITY, -INFINITY, NAN, 9223372036854775807.0 };
+
+#define INT_COUNT   (int)(sizeof(ints) / sizeof(ints[0]))
+#define FLOAT_COUNT (int)(sizeof(floats) / sizeof(floats[0]))
+
+/**
+ * Calls a function on both machines and checks they agree, including on
+ * run-time errors.
+ */
+static void compare(Vm * interpreted, Vm * native, const char * name, Value a, Value b) {
+    int function = image_find_function(interpreted->image, name);
+    CHECK(function >= 0);
+    if(function < 0) return;
+
+    Value args[2] = { a, b };
+    Value expected = { .i = 0 }, actual = { .i = 0 };
+    bool expected_ok = vm_run(interpreted, function, args, &expected);
+    bool actual_ok = vm_run(native, function, args, &actual);
+    CHECK(expected_ok == actual_ok);
+    if(!expected_ok || !actual_ok) return;
+    if(expected.i != actual.i) {
+        fprintf(stderr, "%s(%lld, %lld): interpreted %lld, native %lld\n", name, (long long)a.i, (long long)b.i,
+                (long long)expected.i, (long long)actual.i);
+        test_failures++;
+    }
+}
+
+static void check_native(bool optimize) {
+    Module * module = test_compile(source, optimize);
+    CHECK(module != NULL);
+    if(!module) return;
+    Image * image = link_module(module);
+    destroy_module(module);
+
+    NativeContext context;
+    Vm * interpreted = init_run_vm(image, RUN_INTERPRETED, NULL, NULL);
+    Vm * native = init_run_vm(image, RUN_NATIVE, NULL, &context);
+#if defined(__x86_64__)
+    for(uint32_t f = 0; f < image->function_count; f++) {
+        CHECK_INT(atomic_load(&native->tier->functions[f].state), TIER_NATIVE);
+    }
+#endif
+
+    const char * binary[] = { "add", "mul", "div", "mod" };
+    for(int k = 0; k < 4; k++) {
+        for(int x = 0; x < INT_COUNT; x++) {
+            for(int y = 0; y < INT_COUNT; y++) {
+                compare(interpreted, native, binary[k], (Value){ .i = ints[x] }, (Value){ .i = ints[y] });
+            }
+        }
+    }
+    for(int x = 0; x < FLOAT_COUNT; x++) {
+        compare(interpreted, native, "truncate", (Value){ .i = 0 }, (Value){ .f = floats[x] });
+        for(int y = 0; y < FLOAT_COUNT; y++) {
+            compare(interpreted, native, "scale", (Value){ .f = floats[x] }, (Value){ .f = floats[y] });
+        }
+    }
+    for(int n = 0; n < 25; n++) {
+        compare(interpreted, native, "fib", (Value){ .i = n }, (Value){ .i = 0 });
+        compare(interpreted, native, "sum", (Value){ .i = n * 1000 }, (Value){ .i = 0 });
+    }
+
+    destroy_vm(native);
+    destroy_vm(interpreted);
+    destroy_image(image);
+}
+
+/**
+ * Runs a function through 'sloth --run' and returns the first line it
+ * printed, or an empty string.
+ */
+static void run_sloth(const char * sloth, const char * arguments, char * line, size_t size) {
+    char command[512];
+    snprintf(command, sizeof(command), "%s --run %s 2>&1", sloth, arguments);
+    FILE * out = popen(command, "r");
+    CHECK(out != NULL);
+    line[0] = '\0';
+    if(!out) return;
+    if(fgets(line, (int)size, out)) line[strcspn(line, "\n")] = '\0';
+    pclose(out);
+}
+
+static void check_command(const char * sloth) {
+    Module * module = test_compile(source, true);
+    CHECK(module != NULL);
+    if(!module) return;
+    Image * image = link_module(module);
+    destroy_module(module);
+    char filename[sizeof(test_directory) + 32];
+    snprintf(filename, sizeof(filename), "%s/native.slbc", test_directory);
+    CHECK(write_image(image, filename));
+    destroy_image(image);
+
+    static const char * runs[][2] = {
+        { "fib 25", "75025" },
+        { "div -9223372036854775808 -1", "-9223372036854775808" },
+        { "mod -9223372036854775808 -1", "0" },
+        { "truncate 0 1e300", "9223372036854775807" },
+        { "truncate 0 -inf", "-9223372036854775808" },
+        { "truncate 0 nan", "0" },
+        { "scale 3 0.5", "2" },
+        { "div 1 0", "sloth: div: division by zero" },
+        { "half 5", "2.5" },
+        { "half", "sloth: 'half' takes 1 argument" },
+        { "mixed 5 0.5", "5" },
+        { "mixed 5", "sloth: 'mixed' takes 2 arguments" },
+    };
+    const char * modes[] = { "", "--native", "--native=all" };
+    for(int m = 0; m < 3; m++) {
+        for(size_t k = 0; k < sizeof(runs) / sizeof(runs[0]); k++) {
+            char arguments[256], line[256];
+            snprintf(arguments, sizeof(arguments), "%s %s %s", modes[m], filename, runs[k][0]);
+            run_sloth(sloth, arguments, line, sizeof(line));
+            if(strcmp(line, runs[k][1]) != 0) {
+                fprintf(stderr, "sloth --run %s printed '%s', expected '%s'\n", arguments, line, runs[k][1]);
+                test_failures++;
+            }
+        }
+    }
+}
+
+int main(void) {
+    test_start();
+    check_native(false);
+    check_native(true);
+    const char * sloth = getenv("SLOTH");
+    if(sloth) check_command(sloth);
+    return test_finish();
+}
@@ -0,0 +1,108 @@
+/**
+ * Tests that the optimizer folds constants into immediates and fuses
+ * branches where it may, leaves code reached by jumps alone, and keeps
+ * the results of every function.
+ *
+ * @file    test_optimize.c
+ */
+#include "test.h"
+
+static const char * source =
+    "int fib(int n) {\n"
+    "    if(n < 2) { return n; }\n"
+    "    return fib(n - 1) + fib(n - 2);\n"
+    "}\n"
+    "int sum(int n) {\n"
+    "    int s = 0;\n"
+    "    int i = 0;\n"
+    "    while(i <= n) { s = s + i; i = i + 1; }\n"
+    "    return s;\n"
+    "}\n"
+    "int down(int n) {\n"
+    "    int steps = 0;\n"
+    "    while(n > 0) { n = n - 3; steps = steps + 1; }\n"
+    "    return steps;\n"
+    "}\n";
+
+static int count(const Function * function, Opcode op) {
+    int n = 0;
+    for(int pc = 0; pc < function->code_length; pc++) n += OP(function->code[pc]) == op;
+    return n;
+}
+
+static const Function * find(const Module * module, const char * name) {
+    return module->functions[module_find_function(module, name)];
+}
+
+static void check_folds(void) {
+    Module * module = test_compile(source, true);
+    CHECK(module != NULL);
+    if(!module) return;
+
+    // 'i = i + 1' and 'n - 1' load their constant into a reused temporary
+    const Function * sum = find(module, "sum");
+    CHECK_INT(count(sum, OP_ADDI), 1);
+    CHECK_INT(count(sum, OP_ADD_I), 1);
+    CHECK_INT(count(sum, OP_JLE_I), 1);
+    const Function * fib = find(module, "fib");
+    CHECK_INT(count(fib, OP_ADDI), 2);
+    CHECK_INT(count(fib, OP_SUB_I), 0);
+    const Function * down = find(module, "down");
+    CHECK_INT(count(down, OP_ADDI), 2);
+    CHECK_INT(count(down, OP_SUB_I), 0);
+    CHECK_INT(count(down, OP_LOADI), 3);
+
+    Image * image = link_module(module);
+    destroy_module(module);
+    module = test_compile(source, false);
+    Image * plain = link_module(module);
+    destroy_module(module);
+    for(int64_t n = -1; n < 12; n++) {
+        CHECK_INT(test_run(image, "fib", &n, 1), test_run(plain, "fib", &n, 1));
+        CHECK_INT(test_run(image, "sum", &n, 1), test_run(plain, "sum", &n, 1));
+        CHECK_INT(test_run(image, "down", &n, 1), test_run(plain, "down", &n, 1));
+    }
+    destroy_image(plain);
+    destroy_image(image);
+}
+
+/*
+ * A 'LOADI' right before an addition does not tell the value of the
+ * register if the addition is a jump target:
+ *
+ *   0  LOADI 1 5
+ *   1  JMPF  0 -> 3
+ *   2  LOADI 1 7
+ *   3  ADD_I 2 0 1
+ *   4  RET   2
+ */
+static void check_jump_target(void) {
+    Module * module = init_module();
+    int index = module_add_function(module, "f", TYPE_INT);
+    Function * function = module->functions[index];
+    int p = function_add_param(function, TYPE_INT);
+    int t = function_add_register(function, TYPE_INT), r = function_add_register(function, TYPE_INT);
+    function_emit(function, ENCODE_ABX(OP_LOADI, t, 5));
+    int jump = function_emit(function, ENCODE_ABX(OP_JMPF, p, 0));
+    function_emit(function, ENCODE_ABX(OP_LOADI, t, 7));
+    function_patch_jump(function, jump, function->code_length);
+    function_emit(function, ENCODE_ABC(OP_ADD_I, r, p, t));
+    function_emit(function, ENCODE_ABC(OP_RET, r, 0, 0));
+
+    optimize_module(module);
+    CHECK_INT(count(function, OP_ADDI), 0);
+    Image * image = link_module(module);
+    destroy_module(module);
+    int64_t n = 0;
+    CHECK_INT(test_run(image, "f", &n, 1), 5);
+    n = 1;
+    CHECK_INT(test_run(image, "f", &n, 1), 8);
+    destroy_image(image);
+}
+
+int main(void) {
+    test_start();
+    check_folds();
+    check_jump_target();
+    return test_finish();
+}
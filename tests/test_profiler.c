@@ -0,0 +1,80 @@
+/**
+ * Tests that the profiler samples a running program, names its hot
+ * function in the report and folded stacks, and that only one profiler can
+ * own the process' 'SIGPROF' handler at a time. 'sloth --run --profile'
+ * is checked to write the folded stacks of a run.
+ *
+ * @file    test_profiler.c
+ */
+#include "test.h"
+#include "profiler.h"
+
+static const char * source =
+    "int fib(int n) {\n"
+    "    if(n < 2) { return n; }\n"
+    "    return fib(n - 1) + fib(n - 2);\n"
+    "}\n";
+
+int main(void) {
+    test_start();
+    Module * module = test_compile(source, true);
+    CHECK(module != NULL);
+    if(!module) return test_finish();
+    Image * image = link_module(module);
+    destroy_module(module);
+
+    Vm * vm = init_vm(image);
+    Vm * other_vm = init_vm(image);
+    Profiler * profiler = init_profiler(vm, 1000, 0);
+    Profiler * other = init_profiler(other_vm, 1000, 0);
+
+    CHECK(profiler_start(profiler));
+    CHECK(!profiler_start(other));
+
+    Value args[1] = { { .i = 30 } };
+    Value result;
+    CHECK(vm_run(vm, image_find_function(image, "fib"), args, &result));
+    CHECK_INT(result.i, 832040);
+    profiler_stop(profiler);
+    CHECK(atomic_load(&profiler->count) > 0);
+
+    // The handler is free again once the first profiler stopped
+    CHECK(profiler_start(other));
+    profiler_stop(other);
+
+    char * text = NULL;
+    size_t length = 0;
+    FILE * out = open_memstream(&text, &length);
+    profiler_report(profiler, out, 5);
+    profiler_write_folded(profiler, out);
+    fclose(out);
+    CHECK(strstr(text, "fib") != NULL);
+    CHECK(strstr(text, "fib;fib") != NULL);
+    free(text);
+
+    destroy_profiler(other);
+    destroy_profiler(profiler);
+    destroy_vm(other_vm);
+    destroy_vm(vm);
+
+    const char * sloth = getenv("SLOTH");
+    if(sloth) {
+        char filename[sizeof(test_directory) + 32], folded[sizeof(test_directory) + 32], command[512];
+        snprintf(filename, sizeof(filename), "%s/fib.slbc", test_directory);
+        snprintf(folded, sizeof(folded), "%s/fib.folded", test_directory);
+        CHECK(write_image(image, filename));
+        snprintf(command, sizeof(command), "%s --run --profile=%s %s fib 30 >/dev/null", sloth, folded, filename);
+        CHECK(system(command) == 0);
+
+        FILE * in = fopen(folded, "r");
+        CHECK(in != NULL);
+        char line[4096] = "";
+        if(in) {
+            CHECK(fgets(line, sizeof(line), in) != NULL);
+            fclose(in);
+        }
+        CHECK(strncmp(line, "fib", 3) == 0);
+    }
+    destroy_image(image);
+    return test_finish();
+}
@@ -0,0 +1,65 @@
+/**
+ * Tests that the scheduler runs every job with the right result and that
+ * a queue of a few independent jobs spreads over more than one worker.
+ *
+ * @file    test_scheduler.c
+ */
+#include <pthread.h>
+#include "test.h"
+#include "scheduler.h"
+
+#define JOB_COUNT       16
+#define WORKER_COUNT    8
+
+static const char * source =
+    "int fib(int n) {\n"
+    "    if(n < 2) { return n; }\n"
+    "    return fib(n - 1) + fib(n - 2);\n"
+    "}\n";
+
+/**
+ * Records the worker that ran a job.
+ */
+static void record_worker(Job * job) {
+    *(pthread_t *)job->user = pthread_self();
+}
+
+int main(void) {
+    test_start();
+    Module * module = test_compile(source, true);
+    CHECK(module != NULL);
+    if(!module) return test_finish();
+    Image * image = link_module(module);
+    destroy_module(module);
+    int fib = image_find_function(image, "fib");
+    CHECK(fib >= 0);
+
+    Scheduler * scheduler = init_scheduler(WORKER_COUNT);
+    Job jobs[JOB_COUNT];
+    Value args[JOB_COUNT];
+    pthread_t workers[JOB_COUNT];
+    for(int run = 0; run < 3; run++) {
+        for(int j = 0; j < JOB_COUNT; j++) {
+            args[j].i = 20 + j % 4;
+            jobs[j] = (Job){ .image = image, .function = fib, .args = &args[j], .done = record_worker,
+                             .user = &workers[j] };
+        }
+        scheduler_submit(scheduler, jobs, JOB_COUNT);
+        scheduler_wait(scheduler);
+
+        static const int64_t expected[4] = { 6765, 10946, 17711, 28657 };
+        int distinct = 0;
+        for(int j = 0; j < JOB_COUNT; j++) {
+            CHECK(jobs[j].ok);
+            CHECK_INT(jobs[j].result.i, expected[j % 4]);
+            bool seen = false;
+            for(int k = 0; k < j && !seen; k++) seen = pthread_equal(workers[k], workers[j]);
+            if(!seen) distinct++;
+        }
+        CHECK(distinct > 1);
+    }
+
+    destroy_scheduler(scheduler);
+    destroy_image(image);
+    return test_finish();
+}
@@ -0,0 +1,117 @@
+/**
+ * Tests that compiling through a compile server prints the same messages
+ * as compiling in process, and that the server refuses sources that are
+ * not regular files instead of blocking on them. A server out of file
+ * descriptors refuses connections without spinning and still shuts down.
+ *
+ * @file    test_server.c
+ */
+#include <limits.h>
+#include <signal.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <sys/resource.h>
+#include "test.h"
+
+/**
+ * Runs a command and returns everything it printed.
+ */
+static char * capture(const char * command) {
+    FILE * out = popen(command, "r");
+    CHECK(out != NULL);
+    if(!out) return strdup("");
+    static char text[1 << 16];
+    size_t length = fread(text, 1, sizeof(text) - 1, out);
+    text[length] = '\0';
+    pclose(out);
+    return strdup(text);
+}
+
+/**
+ * Starts a server on a socket in the test's directory and waits until it
+ * listens.
+ *
+ * @param descriptors: Limit of open descriptors of the server, 0 for none
+ */
+static pid_t start_server(const char * sloth, const char * socket_path, int descriptors) {
+    unlink(socket_path);
+    pid_t pid = fork();
+    if(pid == 0) {
+        struct rlimit limit = { descriptors, descriptors };
+        if(descriptors > 0) setrlimit(RLIMIT_NOFILE, &limit);
+        execl(sloth, sloth, "--server", socket_path, (char *)NULL);
+        _exit(127);
+    }
+    CHECK(pid > 0);
+    struct stat st;
+    for(int wait = 0; wait < 500 && stat(socket_path, &st) != 0; wait++) usleep(10000);
+    CHECK(stat(socket_path, &st) == 0);
+    return pid;
+}
+
+int main(void) {
+    test_start();
+    // The commands run in the test's directory
+    char * sloth = getenv("SLOTH") ? realpath(getenv("SLOTH"), NULL) : NULL;
+    if(!sloth) return test_finish();
+
+    char * valid = test_write_file("valid.sloth", "int f(int x) { return x + 1; }\n");
+    char * invalid = test_write_file("invalid.sloth", "int f(int x) {\n    return y;\n}\n");
+    char fifo[sizeof(test_directory) + 32], socket_path[sizeof(test_directory) + 32], command[1024];
+    snprintf(fifo, sizeof(fifo), "%s/fifo.sloth", test_directory);
+    snprintf(socket_path, sizeof(socket_path), "%s/server.sock", test_directory);
+    CHECK(mkfifo(fifo, 0600) == 0);
+
+    // The files are named relative to the directory, as a build would
+    snprintf(command, sizeof(command), "cd %s && timeout 10 %s valid.sloth fifo.sloth invalid.sloth 2>&1; echo status $?",
+             test_directory, sloth);
+    char * local = capture(command);
+    CHECK(strstr(local, "fifo.sloth: error: not a regular file") != NULL);
+    CHECK(strstr(local, "status 1") != NULL);
+
+    pid_t server = start_server(sloth, socket_path, 0);
+    snprintf(command, sizeof(command),
+             "cd %s && timeout 10 %s --connect %s valid.sloth fifo.sloth invalid.sloth 2>&1; echo status $?",
+             test_directory, sloth, socket_path);
+    for(int run = 0; run < 2; run++) {
+        char * remote = capture(command);
+        if(strcmp(remote, local) != 0) {
+            fprintf(stderr, "through the server:\n%s\nin process:\n%s\n", remote, local);
+            test_failures++;
+        }
+        free(remote);
+    }
+
+    if(server > 0) {
+        kill(server, SIGTERM);
+        int status;
+        CHECK(waitpid(server, &status, 0) == server);
+        CHECK(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+    }
+
+    // Standard streams, listener and spare leave no descriptor for clients
+    server = start_server(sloth, socket_path, 5);
+    snprintf(command, sizeof(command), "cd %s && timeout 10 %s --connect %s valid.sloth 2>&1; echo status $?",
+             test_directory, sloth, socket_path);
+    for(int run = 0; run < 2; run++) {
+        char * refused = capture(command);
+        CHECK(strstr(refused, "status 1") != NULL);
+        free(refused);
+    }
+    usleep(500000);
+    if(server > 0) {
+        kill(server, SIGTERM);
+        int status;
+        struct rusage usage;
+        CHECK(wait4(server, &status, 0, &usage) == server);
+        CHECK(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+        double seconds = usage.ru_utime.tv_sec + usage.ru_stime.tv_sec
+                         + (usage.ru_utime.tv_usec + usage.ru_stime.tv_usec) / 1e6;
+        CHECK(seconds < 0.2);
+    }
+    free(local);
+    free(invalid);
+    free(valid);
+    free(sloth);
+    return test_finish();
+}
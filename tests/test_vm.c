@@ -0,0 +1,70 @@
+/**
+ * Tests the integer arithmetic of the interpreter at the edges of the
+ * range, where it wraps around instead of being undefined, and the
+ * conversion of floats out of range, which saturates.
+ *
+ * @file    test_vm.c
+ */
+#include <stdint.h>
+#include <math.h>
+#include "test.h"
+
+static const char * source =
+    "int add(int a, int b) { return a + b; }\n"
+    "int sub(int a, int b) { return a - b; }\n"
+    "int mul(int a, int b) { return a * b; }\n"
+    "int div(int a, int b) { return a / b; }\n"
+    "int mod(int a, int b) { return a % b; }\n"
+    "int neg(int a) { return -a; }\n"
+    "int inc(int a) { return a + 1; }\n"
+    "int truncate(int a, float x) { return x; }\n";
+
+static int64_t call(const Image * image, const char * name, int64_t a, int64_t b) {
+    int64_t args[2] = { a, b };
+    return test_run(image, name, args, 2);
+}
+
+static void check_arithmetic(bool optimize) {
+    Module * module = test_compile(source, optimize);
+    CHECK(module != NULL);
+    if(!module) return;
+    Image * image = link_module(module);
+    destroy_module(module);
+
+    CHECK_INT(call(image, "add", INT64_MAX, 1), INT64_MIN);
+    CHECK_INT(call(image, "sub", INT64_MIN, 1), INT64_MAX);
+    CHECK_INT(call(image, "mul", INT64_MIN, -1), INT64_MIN);
+    CHECK_INT(call(image, "mul", INT64_MAX, 2), -2);
+    CHECK_INT(call(image, "div", INT64_MIN, -1), INT64_MIN);
+    CHECK_INT(call(image, "div", 7, -1), -7);
+    CHECK_INT(call(image, "div", -7, 2), -3);
+    CHECK_INT(call(image, "mod", INT64_MIN, -1), 0);
+    CHECK_INT(call(image, "mod", -7, 2), -1);
+    CHECK_INT(call(image, "neg", INT64_MIN, 0), INT64_MIN);
+    CHECK_INT(call(image, "inc", INT64_MAX, 0), INT64_MIN);
+
+    double floats[] = { 2.9, -2.9, 1e300, -1e300, INFINITY, -INFINITY, NAN, 9223372036854775807.0 };
+    int64_t ints[] = { 2, -2, INT64_MAX, INT64_MIN, INT64_MAX, INT64_MIN, 0, INT64_MAX };
+    for(int k = 0; k < 8; k++) {
+        int64_t args[2];
+        memcpy(&args[1], &floats[k], sizeof(double));
+        args[0] = 0;
+        CHECK_INT(test_run(image, "truncate", args, 2), ints[k]);
+    }
+
+    // Division by zero stops the machine with an error
+    Vm * vm = init_vm(image);
+    Value args[2] = { { .i = 1 }, { .i = 0 } };
+    Value result;
+    CHECK(!vm_run(vm, image_find_function(image, "div"), args, &result));
+    CHECK(vm->error && strcmp(vm->error, "division by zero") == 0);
+    destroy_vm(vm);
+    destroy_image(image);
+}
+
+int main(void) {
+    test_start();
+    check_arithmetic(false);
+    check_arithmetic(true);
+    return test_finish();
+}
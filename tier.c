@@ -0,0 +1,197 @@
+/**
+ * This file contains the tiering controller which decides when a function
+ * leaves the bytecode interpreter and is handed to the optimizing compiler.
+ *
+ * Every function starts interpreted. The interpreter counts calls and taken
+ * back edges per function; once either counter crosses its threshold the
+ * function is queued for a background compiler thread, and the interpreter
+ * keeps running it until native code is installed. The thread is only
+ * spawned on the first request, so short-running programs never pay for
+ * compilation at all.
+ *
+ * Usage:
+ *  - Create the controller with 'init_tier()' for every loaded module
+ *  - Call 'tier_call()' on function entry and 'tier_back_edge()' on loops
+ *  - Use 'tier_wait()' to block until all queued compilations finished
+ *  - Free resources with 'destroy_tier()'
+ *
+ * @file    tier.c
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include "tier.h"
+
+/**
+ * Body of the background compiler thread. Pops queued functions, compiles
+ * them without holding the lock and publishes the entry point.
+ *
+ * @param arg: A pointer to the tier
+ * @return: NULL
+ */
+static void * compiler_thread(void * arg) {
+    Tier * tier = (Tier *)arg;
+
+    pthread_mutex_lock(&tier->lock);
+    while(true) {
+        while(tier->count == 0 && !tier->stopping) {
+            pthread_cond_wait(&tier->wake, &tier->lock);
+        }
+        if(tier->stopping) break;
+
+        int function = tier->queue[tier->head];
+        tier->head = (tier->head + 1) % tier->function_count;
+        tier->count--;
+        pthread_mutex_unlock(&tier->lock);
+
+        TierFunction * f = &tier->functions[function];
+        size_t size = 0;
+        void * entry = tier->compile(tier->context, function, &size);
+        if(entry) {
+            f->size = size;
+            atomic_store_explicit(&f->entry, entry, memory_order_release);
+            atomic_store(&f->state, TIER_NATIVE);
+            if(tier->listener) tier->listener(tier->listener_context, function, entry, size);
+        } else {
+            atomic_store(&f->state, TIER_FAILED);
+        }
+
+        pthread_mutex_lock(&tier->lock);
+        if(--tier->busy == 0) pthread_cond_broadcast(&tier->idle);
+    }
+    pthread_mutex_unlock(&tier->lock);
+    return NULL;
+}
+
+/**
+ * Initializes the tiering controller for a module with the given number of
+ * functions. Without a compiler every function stays interpreted.
+ *
+ * @param function_count: Number of functions in the module
+ * @param compile: The optimizing compiler, or NULL
+ * @param release: Frees code returned by 'compile', or NULL
+ * @param context: Passed through to 'compile' and 'release'
+ * @return: A pointer to the new 'Tier' structure
+ */
+Tier * init_tier(int function_count, TierCompiler compile, TierRelease release, void * context) {
+    Tier * tier = (Tier *)malloc(sizeof(Tier));
+    assert(tier);
+
+    tier->functions = (TierFunction *)calloc(function_count ? function_count : 1, sizeof(TierFunction));
+    assert(tier->functions);
+    tier->function_count = function_count;
+    tier->call_threshold = TIER_CALL_THRESHOLD;
+    tier->back_edge_threshold = TIER_BACK_EDGE_THRESHOLD;
+
+    tier->compile = compile;
+    tier->release = release;
+    tier->context = context;
+    tier->listener = NULL;
+    tier->listener_context = NULL;
+
+    tier->queue = (int *)malloc((function_count ? function_count : 1) * sizeof(int));
+    assert(tier->queue);
+    tier->head = 0;
+    tier->count = 0;
+    tier->busy = 0;
+    pthread_mutex_init(&tier->lock, NULL);
+    pthread_cond_init(&tier->wake, NULL);
+    pthread_cond_init(&tier->idle, NULL);
+    tier->started = false;
+    tier->stopping = false;
+
+    return tier;
+}
+
+/**
+ * Destroys the tiering controller. Stops the compiler thread, dropping any
+ * functions still queued, and releases all installed native code.
+ *
+ * @param tier: A pointer to the tier
+ */
+void destroy_tier(Tier * tier) {
+    pthread_mutex_lock(&tier->lock);
+    tier->stopping = true;
+    pthread_cond_signal(&tier->wake);
+    pthread_mutex_unlock(&tier->lock);
+    if(tier->started) pthread_join(tier->thread, NULL);
+
+    for(int i = 0; i < tier->function_count; i++) {
+        void * entry = atomic_load(&tier->functions[i].entry);
+        if(entry && tier->release) {
+            tier->release(tier->context, entry, tier->functions[i].size);
+        }
+    }
+
+    pthread_cond_destroy(&tier->idle);
+    pthread_cond_destroy(&tier->wake);
+    pthread_mutex_destroy(&tier->lock);
+    free(tier->queue);
+    free(tier->functions);
+    free(tier);
+}
+
+/**
+ * Queues a function for compilation. Called by the interpreter when one of
+ * the counters crosses its threshold; the function keeps running
+ * interpreted until the compiler installs its native entry point. Requests
+ * for functions that are already queued, compiled or rejected are ignored.
+ *
+ * @param tier: A pointer to the tier
+ * @param function: Index of the hot function
+ */
+void tier_request(Tier * tier, int function) {
+    TierFunction * f = &tier->functions[function];
+    atomic_store_explicit(&f->calls, 0, memory_order_relaxed);
+    atomic_store_explicit(&f->back_edges, 0, memory_order_relaxed);
+
+    int expected = TIER_INTERPRETED;
+    if(!tier->compile) {
+        atomic_store(&f->state, TIER_FAILED);
+        return;
+    }
+    if(!atomic_compare_exchange_strong(&f->state, &expected, TIER_QUEUED)) return;
+
+    pthread_mutex_lock(&tier->lock);
+    if(!tier->started) {
+        tier->started = pthread_create(&tier->thread, NULL, compiler_thread, tier) == 0;
+        if(!tier->started) {
+            pthread_mutex_unlock(&tier->lock);
+            atomic_store(&f->state, TIER_FAILED);
+            return;
+        }
+    }
+
+    tier->queue[(tier->head + tier->count) % tier->function_count] = function;
+    tier->count++;
+    tier->busy++;
+    pthread_cond_signal(&tier->wake);
+    pthread_mutex_unlock(&tier->lock);
+}
+
+/**
+ * Blocks until every queued function has been compiled or rejected.
+ *
+ * @param tier: A pointer to the tier
+ */
+void tier_wait(Tier * tier) {
+    pthread_mutex_lock(&tier->lock);
+    while(tier->busy > 0) {
+        pthread_cond_wait(&tier->idle, &tier->lock);
+    }
+    pthread_mutex_unlock(&tier->lock);
+}
+
+/**
+ * Sets the function notified whenever native code is installed. Must be
+ * called before the first function is queued.
+ *
+ * @param tier: A pointer to the tier
+ * @param listener: The function to notify, or NULL
+ * @param context: Passed through to 'listener'
+ */
+void tier_set_listener(Tier * tier, TierListener listener, void * context) {
+    tier->listener = listener;
+    tier->listener_context = context;
+}
@@ -0,0 +1,117 @@
+#ifndef TIER_H
+#define TIER_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include <pthread.h>
+
+#define TIER_CALL_THRESHOLD      1000   // calls before a function is compiled
+#define TIER_BACK_EDGE_THRESHOLD 20000  // loop back edges before a function is compiled
+
+typedef enum {
+    TIER_INTERPRETED, // running in the bytecode interpreter
+    TIER_QUEUED,      // waiting for or being compiled by the background thread
+    TIER_NATIVE,      // native code has been installed
+    TIER_FAILED       // the compiler rejected the function, stays interpreted
+} TierState;
+
+/*
+ * A tier may be shared by several virtual machines running the same image
+ * on different threads. The counters are then updated with relaxed loads
+ * and stores rather than atomic increments: an occasionally lost count
+ * only delays tiering up, while a locked instruction on every call would
+ * make the cores fight over the cache line.
+ */
+typedef struct {
+    _Atomic uint32_t calls;         // calls counted by the interpreter
+    _Atomic uint32_t back_edges;    // backwards jumps counted by the interpreter
+    _Atomic int state;              // current 'TierState' of the function
+    void * _Atomic entry;           // native entry point, NULL until compiled
+    size_t size;                    // size of the native code in bytes
+} TierFunction;
+
+/**
+ * Compiles one function to native code on the background thread. Returns
+ * the entry point and stores the code size, or returns NULL if the function
+ * cannot be compiled.
+ */
+typedef void * (*TierCompiler)(void * context, int function, size_t * size);
+
+/**
+ * Releases native code previously returned by a 'TierCompiler'.
+ */
+typedef void (*TierRelease)(void * context, void * entry, size_t size);
+
+/**
+ * Notified on the compiler thread after native code has been installed,
+ * e.g. to tell profilers where the code of a function lives.
+ */
+typedef void (*TierListener)(void * context, int function, const void * entry, size_t size);
+
+typedef struct {
+    TierFunction * functions;       // one entry per function of the module
+    int function_count;             // number of functions
+    uint32_t call_threshold;        // calls before tiering up
+    uint32_t back_edge_threshold;   // back edges before tiering up
+
+    TierCompiler compile;           // optimizing compiler, may be NULL
+    TierRelease release;            // frees compiled code, may be NULL
+    void * context;                 // passed to 'compile' and 'release'
+    TierListener listener;          // called after installation, may be NULL
+    void * listener_context;        // passed to 'listener'
+
+    int * queue;                    // ring buffer of functions to compile
+    int head;                       // next function to compile
+    int count;                      // functions in the queue
+    int busy;                       // functions queued or being compiled
+    pthread_mutex_t lock;           // guards the queue
+    pthread_cond_t wake;            // signals the compiler thread
+    pthread_cond_t idle;            // signals 'tier_wait()'
+    pthread_t thread;               // background compiler thread
+    bool started;                   // the thread is only spawned on demand
+    bool stopping;                  // set by 'destroy_tier()'
+} Tier;
+
+Tier * init_tier(int function_count, TierCompiler compile, TierRelease release, void * context);
+void destroy_tier(Tier * tier);
+void tier_request(Tier * tier, int function);
+void tier_wait(Tier * tier);
+void tier_set_listener(Tier * tier, TierListener listener, void * context);
+
+/**
+ * Counts a call to the given function. Returns the native entry point if
+ * the function has been compiled, otherwise NULL and the caller keeps
+ * interpreting.
+ *
+ * @param tier: A pointer to the tier
+ * @param function: Index of the called function
+ * @return: The native entry point or NULL
+ */
+static inline void * tier_call(Tier * tier, int function) {
+    TierFunction * f = &tier->functions[function];
+    void * entry = atomic_load_explicit(&f->entry, memory_order_acquire);
+    if(entry) return entry;
+
+    uint32_t calls = atomic_load_explicit(&f->calls, memory_order_relaxed) + 1;
+    atomic_store_explicit(&f->calls, calls, memory_order_relaxed);
+    if(calls >= tier->call_threshold) tier_request(tier, function);
+    return NULL;
+}
+
+/**
+ * Counts a backwards jump taken inside the given function, so that a
+ * function running one long loop is compiled even if it is only called once.
+ *
+ * @param tier: A pointer to the tier
+ * @param function: Index of the function containing the loop
+ */
+static inline void tier_back_edge(Tier * tier, int function) {
+    TierFunction * f = &tier->functions[function];
+    uint32_t back_edges = atomic_load_explicit(&f->back_edges, memory_order_relaxed) + 1;
+    atomic_store_explicit(&f->back_edges, back_edges, memory_order_relaxed);
+    if(back_edges >= tier->back_edge_threshold) tier_request(tier, function);
+}
+
+#endif // TIER_H
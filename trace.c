@@ -0,0 +1,232 @@
+/**
+ * This file records a timeline of the compiler's phases in the Chrome
+ * trace event format, which Perfetto (ui.perfetto.dev) and
+ * chrome://tracing display as one track per thread. With units compiled
+ * concurrently the timeline shows which unit is on the critical path and
+ * when workers sit idle.
+ *
+ * Every thread records its events into a buffer of its own, so recording
+ * takes no lock; the buffers are written out as JSON when the trace
+ * stops, through a 'Writer' so that traces of large builds are written
+ * quickly. While no trace is recorded, 'trace_begin()' and 'trace_end()'
+ * cost one test of a global flag.
+ *
+ * Usage:
+ *  - Start recording with 'trace_start()'
+ *  - Name threads with 'trace_thread_name()'
+ *  - Mark phases with 'trace_begin()' and 'trace_end()'
+ *  - Write the file with 'trace_stop()', after all recording threads
+ *    finished
+ *
+ * @file    trace.c
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include "trace.h"
+#include "writer.h"
+
+typedef struct TraceBuffer {
+    int thread;                 // track of the thread in the trace
+    char * name;                // name of the thread, NULL if none
+    TraceEvent * events;
+    int event_count;
+    int event_capacity;
+    struct TraceBuffer * next;  // next buffer of the trace
+} TraceBuffer;
+
+bool tracing = false;
+
+static struct {
+    char * filename;
+    struct timespec start;
+    TraceBuffer * buffers;      // buffers of all threads that recorded
+    int thread_count;
+    pthread_mutex_t lock;       // guards 'buffers' and 'thread_count'
+} trace = { NULL, { 0, 0 }, NULL, 0, PTHREAD_MUTEX_INITIALIZER };
+
+// Buffer of the calling thread; stale after 'trace_stop()', hence the generation
+static __thread TraceBuffer * thread_buffer;
+static __thread int thread_generation;
+static int generation;
+
+/**
+ * Starts recording a trace.
+ *
+ * @param filename: The file to write when the trace stops
+ * @return: 'false' if a trace is already being recorded
+ */
+bool trace_start(const char * filename) {
+    if(tracing) return false;
+    trace.filename = strdup(filename);
+    trace.buffers = NULL;
+    trace.thread_count = 0;
+    generation++;
+    clock_gettime(CLOCK_MONOTONIC, &trace.start);
+    tracing = true;
+    return true;
+}
+
+static TraceBuffer * current_buffer(void) {
+    if(thread_buffer && thread_generation == generation) return thread_buffer;
+
+    TraceBuffer * buffer = (TraceBuffer *)calloc(1, sizeof(TraceBuffer));
+    assert(buffer);
+    pthread_mutex_lock(&trace.lock);
+    buffer->thread = ++trace.thread_count;
+    buffer->next = trace.buffers;
+    trace.buffers = buffer;
+    pthread_mutex_unlock(&trace.lock);
+
+    thread_buffer = buffer;
+    thread_generation = generation;
+    return buffer;
+}
+
+/**
+ * Names the calling thread's track in the trace.
+ *
+ * @param name: The name, copied
+ */
+void trace_thread_name(const char * name) {
+    if(!tracing) return;
+    TraceBuffer * buffer = current_buffer();
+    free(buffer->name);
+    buffer->name = strdup(name);
+}
+
+/**
+ * Records an event on the calling thread; see 'trace_begin()' and
+ * 'trace_end()'.
+ *
+ * @param name: Name of the phase
+ * @param detail: The file or function the phase works on, may be NULL
+ * @param begin: 'true' for the beginning of the phase
+ */
+void trace_event(const char * name, const char * detail, bool begin) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    TraceBuffer * buffer = current_buffer();
+
+    if(buffer->event_count == buffer->event_capacity) {
+        buffer->event_capacity += TRACE_CHUNK;
+        buffer->events = (TraceEvent *)realloc(buffer->events, buffer->event_capacity * sizeof(TraceEvent));
+        assert(buffer->events);
+    }
+    TraceEvent * event = &buffer->events[buffer->event_count++];
+    event->name = name;
+    event->detail = detail ? strdup(detail) : NULL;
+    event->begin = begin;
+    event->time = (uint64_t)(now.tv_sec - trace.start.tv_sec) * 1000000000u + now.tv_nsec - trace.start.tv_nsec;
+}
+
+/**
+ * Appends a JSON string literal.
+ */
+static void write_json_string(Writer * writer, const char * string) {
+    writer_char(writer, '"');
+    for(const char * c = string; *c; c++) {
+        if(*c == '"' || *c == '\\') {
+            writer_char(writer, '\\');
+            writer_char(writer, *c);
+        } else if((unsigned char)*c < 0x20) {
+            static const char hex[] = "0123456789abcdef";
+            writer_string(writer, "\\u00");
+            writer_char(writer, hex[(unsigned char)*c >> 4]);
+            writer_char(writer, hex[*c & 0xf]);
+        } else {
+            writer_char(writer, *c);
+        }
+    }
+    writer_char(writer, '"');
+}
+
+/**
+ * Appends a time in microseconds with three decimals, the unit of the
+ * trace format.
+ */
+static void write_microseconds(Writer * writer, uint64_t nanoseconds) {
+    writer_int(writer, (int64_t)(nanoseconds / 1000));
+    writer_char(writer, '.');
+    int fraction = (int)(nanoseconds % 1000);
+    writer_char(writer, (char)('0' + fraction / 100));
+    writer_char(writer, (char)('0' + fraction / 10 % 10));
+    writer_char(writer, (char)('0' + fraction % 10));
+}
+
+static void write_event_header(Writer * writer, const char * name, char phase, int thread) {
+    writer_string(writer, "{\"name\":");
+    write_json_string(writer, name);
+    writer_string(writer, ",\"ph\":\"");
+    writer_char(writer, phase);
+    writer_string(writer, "\",\"pid\":1,\"tid\":");
+    writer_int(writer, thread);
+}
+
+/**
+ * Stops recording and writes the trace. Threads must not record while it
+ * stops.
+ *
+ * @return: 'false' if the file could not be written
+ */
+bool trace_stop(void) {
+    if(!tracing) return true;
+    tracing = false;
+
+    int fd = open(trace.filename, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666);
+    Writer * writer = fd >= 0 ? init_writer(fd) : NULL;
+    if(writer) writer_string(writer, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n");
+
+    bool first = true;
+    TraceBuffer * buffer = trace.buffers;
+    while(buffer) {
+        if(writer && buffer->name) {
+            if(!first) writer_string(writer, ",\n");
+            first = false;
+            write_event_header(writer, "thread_name", 'M', buffer->thread);
+            writer_string(writer, ",\"args\":{\"name\":");
+            write_json_string(writer, buffer->name);
+            writer_string(writer, "}}");
+        }
+
+        for(int i = 0; i < buffer->event_count; i++) {
+            TraceEvent * event = &buffer->events[i];
+            if(writer) {
+                if(!first) writer_string(writer, ",\n");
+                first = false;
+                write_event_header(writer, event->name, event->begin ? 'B' : 'E', buffer->thread);
+                writer_string(writer, ",\"ts\":");
+                write_microseconds(writer, event->time);
+                if(event->detail) {
+                    writer_string(writer, ",\"args\":{\"detail\":");
+                    write_json_string(writer, event->detail);
+                    writer_char(writer, '}');
+                }
+                writer_char(writer, '}');
+            }
+            free(event->detail);
+        }
+
+        TraceBuffer * next = buffer->next;
+        free(buffer->events);
+        free(buffer->name);
+        free(buffer);
+        buffer = next;
+    }
+    trace.buffers = NULL;
+
+    bool ok = writer != NULL;
+    if(writer) {
+        writer_string(writer, "\n]}\n");
+        ok = destroy_writer(writer);
+    }
+    if(fd >= 0 && close(fd) != 0) ok = false;
+    free(trace.filename);
+    trace.filename = NULL;
+    return ok;
+}
@@ -0,0 +1,47 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#define TRACE_CHUNK 4096    // events a thread records per allocation
+
+/*
+ * One begin or end of a phase. 'name' is a string literal; 'detail' (the
+ * file or function the phase works on) is copied.
+ */
+typedef struct {
+    const char * name;
+    char * detail;          // NULL if none
+    uint64_t time;          // nanoseconds since the trace started
+    bool begin;             // 'B' event, otherwise 'E'
+} TraceEvent;
+
+extern bool tracing;        // set while a trace is recorded
+
+bool trace_start(const char * filename);
+bool trace_stop(void);
+void trace_thread_name(const char * name);
+void trace_event(const char * name, const char * detail, bool begin);
+
+/**
+ * Records the beginning of a phase on the calling thread, if a trace is
+ * being recorded.
+ *
+ * @param name: Name of the phase, a string literal
+ * @param detail: The file or function the phase works on, may be NULL
+ */
+static inline void trace_begin(const char * name, const char * detail) {
+    if(tracing) trace_event(name, detail, true);
+}
+
+/**
+ * Records the end of the phase begun last on the calling thread.
+ *
+ * @param name: Name of the phase, as passed to 'trace_begin()'
+ */
+static inline void trace_end(const char * name) {
+    if(tracing) trace_event(name, NULL, false);
+}
+
+#endif // TRACE_H
@@ -0,0 +1,533 @@
+/**
+ * This file contains the virtual machine which executes linked bytecode
+ * images, either produced by 'link_module()' or mapped from a file.
+ *
+ * The machine is register based: every instruction names its operands as
+ * registers of the current frame, so 'a = b + c' is a single 'ADD_I'
+ * instead of three pushes and a pop. Dispatch uses computed gotos where the
+ * compiler supports them, jumping straight from the end of one handler to
+ * the next, which gives every handler its own indirect branch and lets the
+ * branch predictor learn opcode sequences.
+ *
+ * All frames live on one contiguous register stack owned by the machine;
+ * calls bump the stack top and returns pop it, so calling a function never
+ * allocates once the stack has grown to the program's maximum depth.
+ *
+ * Every call and taken back edge is counted by the tiering controller;
+ * functions it has compiled run natively instead of being interpreted.
+ * When 'vm->feedback' is set, the machine also counts every executed jump
+ * and call for profile guided optimization.
+ *
+ * Usage:
+ *  - Create a machine for a linked or mapped image with 'init_vm()'
+ *  - Execute a function with 'vm_run()'
+ *  - Free resources with 'destroy_vm()'
+ *
+ * @file    vm.c
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <stdatomic.h>
+#include "vm.h"
+
+#if defined(__GNUC__) || defined(__clang__)
+#define COMPUTED_GOTO 1
+#endif
+
+/**
+ * Initializes a virtual machine for the given image. The image is not
+ * copied and must outlive the machine.
+ *
+ * @param image: The linked module to execute
+ * @return: A pointer to the new 'Vm' structure
+ */
+Vm * init_vm(const Image * image) {
+    Vm * vm = init_vm_shared(image, init_tier(image->function_count, NULL, NULL, NULL));
+    vm->owns_tier = true;
+    return vm;
+}
+
+/**
+ * Initializes a virtual machine that shares the tier, and with it the
+ * counters and native code, of other machines running the same image.
+ * Machines never share mutable state otherwise, so each one may run on its
+ * own thread. The image and the tier must outlive the machine.
+ *
+ * @param image: The linked module to execute
+ * @param tier: The tier of the image
+ * @return: A pointer to the new 'Vm' structure
+ */
+Vm * init_vm_shared(const Image * image, Tier * tier) {
+    Vm * vm = (Vm *)malloc(sizeof(Vm));
+    assert(vm);
+
+    vm->image = image;
+    vm->tier = tier;
+    vm->owns_tier = false;
+    vm->error = NULL;
+    vm->depth = 0;
+    vm->feedback = NULL;
+
+    vm->stack_size = VM_STACK_SIZE;
+    vm->stack = (Value *)malloc(vm->stack_size * sizeof(Value));
+    assert(vm->stack);
+    vm->top = 0;
+
+    vm->frame_capacity = VM_FRAME_COUNT;
+    vm->frames = (CallFrame *)malloc(vm->frame_capacity * sizeof(CallFrame));
+    assert(vm->frames);
+    vm->frame_count = 0;
+    vm->frames_moving = false;
+    vm->current_function = -1;
+    vm->current_pc = 0;
+#ifdef VM_OPCODE_PAIRS
+    memset(vm->pairs, 0, sizeof(vm->pairs));
+    vm->previous = OP_RET;
+#endif
+    return vm;
+}
+
+/**
+ * Destroys the given virtual machine and frees all resources associated
+ * with it.
+ *
+ * @param vm: A pointer to the virtual machine
+ */
+void destroy_vm(Vm * vm) {
+    if(vm->owns_tier) destroy_tier(vm->tier);
+    free(vm->frames);
+    free(vm->stack);
+    free(vm);
+}
+
+/**
+ * Installs the optimizing compiler used for hot functions. Must be called
+ * before the first 'vm_run()' on any machine sharing the tier.
+ *
+ * @param vm: A pointer to the virtual machine
+ * @param compile: Compiles a function to a 'NativeFunction'
+ * @param release: Frees compiled code, may be NULL
+ * @param context: Passed through to 'compile' and 'release'
+ */
+void vm_set_compiler(Vm * vm, TierCompiler compile, TierRelease release, void * context) {
+    vm->tier->compile = compile;
+    vm->tier->release = release;
+    vm->tier->context = context;
+}
+
+/**
+ * Grows the register stack so that it holds at least the given number of
+ * registers. Moves the stack, so pointers into it must be recomputed from
+ * frame offsets afterwards.
+ *
+ * @param vm: A pointer to the virtual machine
+ * @param needed: Number of registers required
+ */
+static void grow_stack(Vm * vm, size_t needed) {
+    size_t size = vm->stack_size;
+    while(size < needed) size *= 2;
+
+    vm->stack = (Value *)realloc(vm->stack, size * sizeof(Value));
+    assert(vm->stack);
+    vm->stack_size = size;
+}
+
+/**
+ * Saves the state of a caller before the interpreter enters a callee. The
+ * profiler's signal handler may interrupt at any point, so the frame is
+ * only counted once it is filled in, and the frames are flagged while they
+ * move; the fences keep the compiler from reordering across either store.
+ *
+ * @param vm: A pointer to the virtual machine
+ * @param pc: Where the caller continues
+ * @param base: Offset of the caller's registers on the stack
+ * @param function: Index of the caller
+ * @param result: Caller's register receiving the returned value
+ */
+static void push_frame(Vm * vm, const uint32_t * pc, size_t base, int function, int result) {
+    int count = vm->frame_count;
+    if(count == vm->frame_capacity) {
+        vm->frames_moving = true;
+        atomic_signal_fence(memory_order_seq_cst);
+        vm->frame_capacity *= 2;
+        vm->frames = (CallFrame *)realloc(vm->frames, vm->frame_capacity * sizeof(CallFrame));
+        assert(vm->frames);
+        atomic_signal_fence(memory_order_seq_cst);
+        vm->frames_moving = false;
+    }
+
+    CallFrame * frame = &vm->frames[count];
+    frame->pc = pc;
+    frame->base = base;
+    frame->function = function;
+    frame->result = result;
+    atomic_signal_fence(memory_order_release);
+    vm->frame_count = count + 1;
+}
+
+/**
+ * Interprets a function whose register file has been reserved at the top
+ * of the stack. Interpreted calls do not recurse: the caller's state is
+ * pushed as a 'CallFrame' and the callee's registers are bumped on the
+ * stack directly behind the caller's, so a call costs no allocation.
+ *
+ * @param vm: A pointer to the virtual machine
+ * @param index: Index of the function
+ * @param base: Offset of the function's first register on the stack
+ * @param result: Receives the returned value
+ * @return: 'true' on success, 'false' on a run-time error
+ */
+static bool execute(Vm * vm, int index, size_t base, Value * result) {
+    const Image * image = vm->image;
+    const ImageFunction * functions = image_functions(image);
+    const Value * constants = image_constants(image);
+    const uint32_t * code = image_code(image);
+    const uint32_t * pc = code + functions[index].code;
+    Value * R = vm->stack + base;
+    int entry = vm->frame_count;
+    int depth = vm->depth;
+    size_t top = vm->top;
+    uint64_t * counts = vm->feedback ? vm->feedback->counters : NULL;
+    uint64_t * taken = counts ? counts + image->code_length : NULL;
+    uint32_t i;
+
+#ifdef VM_OPCODE_PAIRS
+#define COUNT_PAIR() (vm->pairs[vm->previous][OP(i)]++, vm->previous = OP(i))
+#else
+#define COUNT_PAIR() ((void)0)
+#endif
+
+#ifdef COMPUTED_GOTO
+    static const void * const labels[] = {
+#define OPCODE_LABEL(name, format) &&do_##name,
+        OPCODE_LIST(OPCODE_LABEL)
+#undef OPCODE_LABEL
+    };
+#define DISPATCH()  do { i = *pc++; COUNT_PAIR(); goto *labels[OP(i)]; } while(0)
+#define CASE(name)  do_##name
+#else
+#define DISPATCH()  goto dispatch
+#define CASE(name)  case OP_##name
+#endif
+
+#define A  ARG_A(i)
+#define B  ARG_B(i)
+#define C  ARG_C(i)
+
+    /*
+     * Taken backwards jumps are loop iterations; count them so that a long
+     * loop in a function called once still reaches the optimizing tier, and
+     * publish the loop header for the sampling profiler.
+     */
+#define JUMP(offset) do {                                   \
+        int o_ = (offset);                                  \
+        pc += o_;                                           \
+        if(o_ < 0) {                                        \
+            tier_back_edge(vm->tier, index);                \
+            vm->current_pc = (uint32_t)(pc - code);         \
+        }                                                   \
+    } while(0)
+
+    /*
+     * Counts the execution of the jump or call just dispatched, which is
+     * the instruction before 'pc', and whether it jumped.
+     */
+#define COUNT(jumped) do {                                  \
+        if(counts) {                                        \
+            size_t at_ = (size_t)(pc - 1 - code);           \
+            counts[at_]++;                                  \
+            taken[at_] += (jumped);                         \
+        }                                                   \
+    } while(0)
+
+    /*
+     * Compare-and-branch superinstructions: 'pc' points at the 'JMP' that
+     * follows, whose offset is relative to the instruction after it.
+     */
+#define BRANCH(condition) do {                              \
+        bool jumped_ = (condition) == C;                    \
+        COUNT(jumped_);                                     \
+        if(jumped_) JUMP(ARG_SJ(*pc) + 1);                  \
+        else pc++;                                          \
+        DISPATCH();                                         \
+    } while(0)
+
+#ifdef COMPUTED_GOTO
+    DISPATCH();
+#else
+dispatch:
+    i = *pc++;
+    COUNT_PAIR();
+    switch(OP(i)) {
+#endif
+
+    CASE(MOVE):  R[A] = R[B]; DISPATCH();
+    CASE(LOADK): R[A] = constants[ARG_BX(i)]; DISPATCH();
+    CASE(LOADI): R[A].i = ARG_SBX(i); DISPATCH();
+
+    // Integers wrap around on overflow, computed unsigned where C leaves it undefined
+    CASE(ADD_I): R[A].i = (int64_t)((uint64_t)R[B].i + (uint64_t)R[C].i); DISPATCH();
+    CASE(ADDI):  R[A].i = (int64_t)((uint64_t)R[B].i + (uint64_t)(int64_t)ARG_SC(i)); DISPATCH();
+    CASE(SUB_I): R[A].i = (int64_t)((uint64_t)R[B].i - (uint64_t)R[C].i); DISPATCH();
+    CASE(MUL_I): R[A].i = (int64_t)((uint64_t)R[B].i * (uint64_t)R[C].i); DISPATCH();
+    CASE(DIV_I):
+        if(R[C].i == 0) goto division_by_zero;
+        R[A].i = R[C].i == -1 ? (int64_t)(0 - (uint64_t)R[B].i) : R[B].i / R[C].i;
+        DISPATCH();
+    CASE(MOD_I):
+        if(R[C].i == 0) goto division_by_zero;
+        R[A].i = R[C].i == -1 ? 0 : R[B].i % R[C].i;
+        DISPATCH();
+    CASE(NEG_I): R[A].i = (int64_t)(0 - (uint64_t)R[B].i); DISPATCH();
+
+    CASE(ADD_F): R[A].f = R[B].f + R[C].f; DISPATCH();
+    CASE(SUB_F): R[A].f = R[B].f - R[C].f; DISPATCH();
+    CASE(MUL_F): R[A].f = R[B].f * R[C].f; DISPATCH();
+    CASE(DIV_F): R[A].f = R[B].f / R[C].f; DISPATCH();
+    CASE(NEG_F): R[A].f = -R[B].f; DISPATCH();
+
+    CASE(EQ_I): R[A].i = R[B].i == R[C].i; DISPATCH();
+    CASE(NE_I): R[A].i = R[B].i != R[C].i; DISPATCH();
+    CASE(LT_I): R[A].i = R[B].i < R[C].i; DISPATCH();
+    CASE(LE_I): R[A].i = R[B].i <= R[C].i; DISPATCH();
+    CASE(EQ_F): R[A].i = R[B].f == R[C].f; DISPATCH();
+    CASE(NE_F): R[A].i = R[B].f != R[C].f; DISPATCH();
+    CASE(LT_F): R[A].i = R[B].f < R[C].f; DISPATCH();
+    CASE(LE_F): R[A].i = R[B].f <= R[C].f; DISPATCH();
+    CASE(NOT):  R[A].i = !R[B].i; DISPATCH();
+
+    CASE(I2F): R[A].f = (double)R[B].i; DISPATCH();
+    CASE(F2I): R[A].i = float_to_int(R[B].f); DISPATCH();
+
+    CASE(JMP):  COUNT(1); JUMP(ARG_SJ(i)); DISPATCH();
+    CASE(JMPT): COUNT(R[A].i != 0); if(R[A].i) JUMP(ARG_SBX(i)); DISPATCH();
+    CASE(JMPF): COUNT(R[A].i == 0); if(!R[A].i) JUMP(ARG_SBX(i)); DISPATCH();
+
+    CASE(JEQ_I): BRANCH(R[A].i == R[B].i);
+    CASE(JLT_I): BRANCH(R[A].i < R[B].i);
+    CASE(JLE_I): BRANCH(R[A].i <= R[B].i);
+    CASE(JEQ_F): BRANCH(R[A].f == R[B].f);
+    CASE(JLT_F): BRANCH(R[A].f < R[B].f);
+    CASE(JLE_F): BRANCH(R[A].f <= R[B].f);
+
+    CASE(CALL): {
+        int callee = ARG_BX(i);
+        const ImageFunction * target = &functions[callee];
+        if(vm->depth >= VM_MAX_DEPTH) goto stack_overflow;
+        COUNT(1);
+
+        size_t callee_base = vm->top;
+        if(callee_base + target->register_count > vm->stack_size) {
+            grow_stack(vm, callee_base + target->register_count);
+            R = vm->stack + base;
+        }
+        Value * arguments = vm->stack + callee_base;
+        for(int p = 0; p < target->param_count; p++) arguments[p] = R[A + p];
+
+        vm->depth++;
+        vm->top = callee_base + target->register_count;
+
+        push_frame(vm, pc, base, index, A);
+        vm->current_function = callee;
+        vm->current_pc = target->code;
+
+        NativeFunction native = (NativeFunction)tier_call(vm->tier, callee);
+        if(native) {
+            Value value = native(vm, arguments);
+            vm->frame_count--;
+            vm->depth--;
+            vm->top = callee_base;
+            if(vm->error) goto unwind;
+
+            vm->current_function = index;
+            vm->current_pc = (uint32_t)(pc - code);
+            R = vm->stack + base;
+            R[A] = value;
+            DISPATCH();
+        }
+
+        if(counts) vm->feedback->functions[callee].calls++;
+        index = callee;
+        base = callee_base;
+        R = vm->stack + base;
+        pc = code + target->code;
+        DISPATCH();
+    }
+
+    CASE(RET): {
+        Value value = R[A];
+        vm->top = base;
+        int count = vm->frame_count;
+        if(count == entry) {
+            *result = value;
+            return true;
+        }
+
+        CallFrame * frame = &vm->frames[count - 1];
+        vm->frame_count = count - 1;
+        vm->depth--;
+        pc = frame->pc;
+        base = frame->base;
+        index = frame->function;
+        vm->current_function = index;
+        vm->current_pc = (uint32_t)(pc - code);
+        R = vm->stack + base;
+        R[frame->result] = value;
+        DISPATCH();
+    }
+
+#ifndef COMPUTED_GOTO
+    default:
+        break;
+    }
+    vm->error = "invalid opcode";
+    goto unwind;
+#endif
+
+division_by_zero:
+    vm->error = "division by zero";
+    goto unwind;
+
+stack_overflow:
+    vm->error = "stack overflow";
+
+unwind:
+    vm->frame_count = entry;
+    vm->top = top;
+    vm->depth = depth;
+    return false;
+
+#undef BRANCH
+#undef COUNT
+#undef JUMP
+#undef A
+#undef B
+#undef C
+#undef CASE
+#undef DISPATCH
+#undef COUNT_PAIR
+}
+
+/**
+ * Runs a function of the image to completion.
+ *
+ * @param vm: A pointer to the virtual machine
+ * @param function: Index of the function to run
+ * @param args: The arguments, one per parameter
+ * @param result: Receives the returned value
+ * @return: 'true' on success, 'false' on a run-time error described by
+ * 'vm->error'
+ */
+bool vm_run(Vm * vm, int function, const Value * args, Value * result) {
+    const ImageFunction * target = &image_functions(vm->image)[function];
+    if(target->register_count > vm->stack_size) grow_stack(vm, target->register_count);
+    for(int p = 0; p < target->param_count; p++) vm->stack[p] = args[p];
+
+    vm->error = NULL;
+    vm->depth = 1;
+    vm->frame_count = 0;
+    vm->top = target->register_count;
+    vm->current_pc = target->code;
+    vm->current_function = function;
+
+    bool ok;
+    NativeFunction native = (NativeFunction)tier_call(vm->tier, function);
+    if(native) {
+        *result = native(vm, vm->stack);
+        ok = vm->error == NULL;
+    } else {
+        if(vm->feedback) vm->feedback->functions[function].calls++;
+        ok = execute(vm, function, 0, result);
+    }
+
+    vm->current_function = -1;
+    vm->depth = 0;
+    vm->top = 0;
+    return ok;
+}
+
+/**
+ * Calls a function from native code. The callee's register file is
+ * reserved at the top of the stack and the callee runs natively if it has
+ * been compiled, otherwise in the interpreter. The stack may move, so the
+ * caller must reload pointers into it afterwards.
+ *
+ * @param vm: A pointer to the virtual machine
+ * @param function: Index of the called function
+ * @param args: The arguments in the caller's register file
+ * @return: The returned value, or 0 with 'vm->error' set on a run-time error
+ */
+Value vm_native_call(Vm * vm, int function, const Value * args) {
+    const ImageFunction * target = &image_functions(vm->image)[function];
+    Value result = { .i = 0 };
+    if(vm->depth >= VM_MAX_DEPTH) {
+        vm->error = "stack overflow";
+        return result;
+    }
+
+    size_t base = vm->top;
+    if(base + target->register_count > vm->stack_size) {
+        size_t offset = (size_t)(args - vm->stack);
+        grow_stack(vm, base + target->register_count);
+        args = vm->stack + offset;
+    }
+    Value * registers = vm->stack + base;
+    for(int p = 0; p < target->param_count; p++) registers[p] = args[p];
+
+    int caller = vm->current_function;
+    vm->depth++;
+    vm->top = base + target->register_count;
+    vm->current_function = function;
+
+    NativeFunction native = (NativeFunction)tier_call(vm->tier, function);
+    if(native) {
+        result = native(vm, registers);
+    } else {
+        if(vm->feedback) vm->feedback->functions[function].calls++;
+        execute(vm, function, base, &result);
+    }
+
+    vm->current_function = caller;
+    vm->depth--;
+    vm->top = base;
+    return result;
+}
+
+#ifdef VM_OPCODE_PAIRS
+/**
+ * Prints the most frequently executed pairs of consecutive opcodes. Build
+ * with '-DVM_OPCODE_PAIRS' and run representative programs to find the
+ * sequences worth fusing into superinstructions.
+ *
+ * @param vm: A pointer to the virtual machine
+ * @param out: The output stream
+ * @param limit: Number of pairs to print
+ */
+void vm_print_opcode_pairs(const Vm * vm, FILE * out, int limit) {
+    uint64_t total = 0;
+    for(int a = 0; a < OPCODE_COUNT; a++) {
+        for(int b = 0; b < OPCODE_COUNT; b++) total += vm->pairs[a][b];
+    }
+
+    bool printed[OPCODE_COUNT][OPCODE_COUNT] = { { false } };
+    for(int n = 0; n < limit; n++) {
+        int best_a = -1, best_b = -1;
+        for(int a = 0; a < OPCODE_COUNT; a++) {
+            for(int b = 0; b < OPCODE_COUNT; b++) {
+                if(printed[a][b] || vm->pairs[a][b] == 0) continue;
+                if(best_a < 0 || vm->pairs[a][b] > vm->pairs[best_a][best_b]) {
+                    best_a = a;
+                    best_b = b;
+                }
+            }
+        }
+        if(best_a < 0) break;
+
+        printed[best_a][best_b] = true;
+        fprintf(out, "%-6s %-6s %12llu  %5.1f%%\n", opcode_name(best_a), opcode_name(best_b),
+                (unsigned long long)vm->pairs[best_a][best_b], 100.0 * vm->pairs[best_a][best_b] / total);
+    }
+}
+#endif
@@ -0,0 +1,71 @@
+#ifndef VM_H
+#define VM_H
+
+#include <stdbool.h>
+#include <signal.h>
+#include "bytecode.h"
+#include "image.h"
+#include "tier.h"
+#include "feedback.h"
+
+#define VM_MAX_DEPTH    10000  // maximum call depth before a stack overflow
+#define VM_STACK_SIZE   1024   // initial size of the register stack
+#define VM_FRAME_COUNT  64     // initial number of call frames
+
+typedef struct Vm Vm;
+
+/**
+ * Signature of code installed by the optimizing tier. Receives the callee's
+ * register file with the arguments in the first registers and returns the
+ * result. Run-time errors are reported through 'vm->error'.
+ */
+typedef Value (*NativeFunction)(Vm * vm, Value * registers);
+
+typedef struct {
+    const uint32_t * pc;    // where the caller continues
+    size_t base;            // offset of the caller's registers on the stack
+    int function;           // index of the caller
+    int result;             // caller's register receiving the returned value
+} CallFrame;
+
+struct Vm {
+    const Image * image;    // linked module being executed
+    Tier * tier;            // call and back-edge counters, native code
+    bool owns_tier;         // the tier is destroyed with the machine
+    const char * error;     // run-time error message, NULL if none
+    int depth;              // current call depth
+    Feedback * feedback;    // execution counts for the optimizer, NULL if not collected
+
+    Value * stack;          // registers of all active frames
+    size_t stack_size;      // allocated registers
+    size_t top;             // first register not used by any frame
+    CallFrame * frames;     // suspended interpreted callers
+    int frame_capacity;     // allocated frames
+
+    /*
+     * Read by the sampling profiler from a signal handler: the running
+     * function, the code offset of its entry, last call or last loop
+     * header, whichever was reached last, and the frames of its callers.
+     * A frame is only counted in 'frame_count' once it is complete.
+     */
+    volatile sig_atomic_t frame_count;      // used frames
+    volatile sig_atomic_t current_function; // -1 while not running
+    volatile uint32_t current_pc;           // offset in the image's code section
+    volatile sig_atomic_t frames_moving;    // 'frames' is being reallocated
+#ifdef VM_OPCODE_PAIRS
+    uint64_t pairs[OPCODE_COUNT][OPCODE_COUNT]; // executed opcode pairs
+    Opcode previous;                            // last executed opcode
+#endif
+};
+
+Vm * init_vm(const Image * image);
+Vm * init_vm_shared(const Image * image, Tier * tier);
+void destroy_vm(Vm * vm);
+void vm_set_compiler(Vm * vm, TierCompiler compile, TierRelease release, void * context);
+bool vm_run(Vm * vm, int function, const Value * args, Value * result);
+Value vm_native_call(Vm * vm, int function, const Value * args);
+#ifdef VM_OPCODE_PAIRS
+void vm_print_opcode_pairs(const Vm * vm, FILE * out, int limit);
+#endif
+
+#endif // VM_H
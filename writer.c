@@ -0,0 +1,152 @@
+/**
+ * This file contains a buffered text writer for large generated outputs
+ * such as assembly listings. Formatting through 'fprintf' parses the
+ * format string and locks the stream on every call, which costs more than
+ * producing the text itself; the writer instead copies strings and
+ * converts integers by hand into a buffer of 'WRITER_BUFFER_SIZE' bytes
+ * and hands it to the kernel in one piece, so writing even very large
+ * files is bound by the I/O rather than the formatting.
+ *
+ * Usage:
+ *  - Create a writer for a file descriptor with 'init_writer()'
+ *  - Append text with 'writer_string()', 'writer_char()' and 'writer_int()'
+ *  - Use 'destroy_writer()' to flush the rest and free the buffer; it
+ *    reports whether every write succeeded
+ *
+ * @file    writer.c
+ */
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <assert.h>
+#include <unistd.h>
+#include <sys/uio.h>
+#include "writer.h"
+
+/**
+ * Initializes a writer.
+ *
+ * @param fd: The file descriptor to write to, which stays open
+ * @return: A pointer to the new 'Writer' structure
+ */
+Writer * init_writer(int fd) {
+    Writer * writer = (Writer *)malloc(sizeof(Writer));
+    assert(writer);
+    writer->buffer = (char *)malloc(WRITER_BUFFER_SIZE);
+    assert(writer->buffer);
+    writer->fd = fd;
+    writer->length = 0;
+    writer->failed = false;
+    return writer;
+}
+
+/**
+ * Flushes and frees a writer.
+ *
+ * @param writer: A pointer to the writer
+ * @return: 'false' if any write failed
+ */
+bool destroy_writer(Writer * writer) {
+    bool ok = writer_flush(writer);
+    free(writer->buffer);
+    free(writer);
+    return ok;
+}
+
+/**
+ * Writes a list of pieces completely, continuing after partial writes and
+ * interrupted calls.
+ *
+ * @param fd: The file descriptor
+ * @param pieces: The pieces, consumed in place
+ * @param count: Number of pieces
+ * @return: 'false' if a write failed
+ */
+static bool write_all(int fd, struct iovec * pieces, int count) {
+    while(count > 0) {
+        ssize_t written = writev(fd, pieces, count);
+        if(written < 0) {
+            if(errno == EINTR) continue;
+            return false;
+        }
+
+        size_t rest = (size_t)written;
+        while(count > 0 && rest >= pieces->iov_len) {
+            rest -= pieces->iov_len;
+            pieces++;
+            count--;
+        }
+        if(count > 0) {
+            pieces->iov_base = (char *)pieces->iov_base + rest;
+            pieces->iov_len -= rest;
+        }
+    }
+    return true;
+}
+
+/**
+ * Writes the buffered text.
+ *
+ * @param writer: A pointer to the writer
+ * @return: 'false' if this or an earlier write failed
+ */
+bool writer_flush(Writer * writer) {
+    if(writer->length > 0 && !writer->failed) {
+        struct iovec piece = { writer->buffer, writer->length };
+        writer->failed = !write_all(writer->fd, &piece, 1);
+    }
+    writer->length = 0;
+    return !writer->failed;
+}
+
+/**
+ * Appends bytes. Data that does not fit goes out together with the
+ * buffered text in a single 'writev'.
+ *
+ * @param writer: A pointer to the writer
+ * @param data: The bytes
+ * @param length: Number of bytes
+ */
+void writer_bytes(Writer * writer, const char * data, size_t length) {
+    if(writer->length + length <= WRITER_BUFFER_SIZE) {
+        memcpy(writer->buffer + writer->length, data, length);
+        writer->length += length;
+        return;
+    }
+
+    if(!writer->failed) {
+        struct iovec pieces[2] = { { writer->buffer, writer->length }, { (void *)data, length } };
+        writer->failed = !write_all(writer->fd, pieces, 2);
+    }
+    writer->length = 0;
+}
+
+/**
+ * Appends a string.
+ *
+ * @param writer: A pointer to the writer
+ * @param string: The string
+ */
+void writer_string(Writer * writer, const char * string) {
+    writer_bytes(writer, string, strlen(string));
+}
+
+/**
+ * Appends a signed integer in decimal.
+ *
+ * @param writer: A pointer to the writer
+ * @param value: The integer
+ */
+void writer_int(Writer * writer, int64_t value) {
+    char digits[20];
+    int count = 0;
+    // Negating INT64_MIN overflows, so the magnitude is taken as unsigned
+    uint64_t magnitude = value < 0 ? 0 - (uint64_t)value : (uint64_t)value;
+    do {
+        digits[sizeof(digits) - 1 - count++] = (char)('0' + magnitude % 10);
+        magnitude /= 10;
+    } while(magnitude);
+
+    if(value < 0) writer_char(writer, '-');
+    writer_bytes(writer, digits + sizeof(digits) - count, (size_t)count);
+}
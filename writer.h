@@ -0,0 +1,40 @@
+#ifndef WRITER_H
+#define WRITER_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+#define WRITER_BUFFER_SIZE (1 << 20)   // bytes collected before a write
+
+/*
+ * Buffered text output to a file descriptor. Everything is formatted into
+ * one buffer allocated up front, which goes out with a single 'write' when
+ * it is full; no call allocates or parses a format string.
+ */
+typedef struct {
+    int fd;                     // destination
+    size_t length;              // bytes in the buffer
+    bool failed;                // a write failed; later output is dropped
+    char * buffer;              // 'WRITER_BUFFER_SIZE' bytes
+} Writer;
+
+Writer * init_writer(int fd);
+bool destroy_writer(Writer * writer);
+bool writer_flush(Writer * writer);
+void writer_bytes(Writer * writer, const char * data, size_t length);
+void writer_string(Writer * writer, const char * string);
+void writer_int(Writer * writer, int64_t value);
+
+/**
+ * Appends one character.
+ *
+ * @param writer: A pointer to the writer
+ * @param c: The character
+ */
+static inline void writer_char(Writer * writer, char c) {
+    if(writer->length == WRITER_BUFFER_SIZE) writer_flush(writer);
+    writer->buffer[writer->length++] = c;
+}
+
+#endif // WRITER_H